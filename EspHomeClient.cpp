@@ -1,5 +1,27 @@
 #include "EspHomeClient.h"
 
+#if ESPHOMECLIENT_LOG_LEVEL >= ESPHOMECLIENT_LOG_LEVEL_ERROR
+#define ESPHOMECLIENT_LOG_ERROR(...) writeLog(__VA_ARGS__)
+#else
+#define ESPHOMECLIENT_LOG_ERROR(...) do {} while (0)
+#endif
+
+#if ESPHOMECLIENT_LOG_LEVEL >= ESPHOMECLIENT_LOG_LEVEL_INFO
+#define ESPHOMECLIENT_LOG_INFO(...) writeLog(__VA_ARGS__)
+#else
+#define ESPHOMECLIENT_LOG_INFO(...) do {} while (0)
+#endif
+
+#if ESPHOMECLIENT_LOG_LEVEL >= ESPHOMECLIENT_LOG_LEVEL_DEBUG
+#define ESPHOMECLIENT_LOG_DEBUG(...) writeLog(__VA_ARGS__)
+#else
+#define ESPHOMECLIENT_LOG_DEBUG(...) do {} while (0)
+#endif
+
+// Topic prefixes indexed by TopicType
+static const char *topic_type_names[] = {"cmnd", "stat", "tele"};
+static const char *short_topic_type_names[] = {"c", "s", "t"};
+
 // Wifi and MQTT handling
 EspHomeClient::EspHomeClient(
   const char* wifi_ssid,
@@ -16,14 +38,31 @@ EspHomeClient::EspHomeClient(
     const char *mqtt_username,
     const char *mqtt_password,
     const char *mqtt_client_name,
-    const short mqtt_port) : wifi_ssid_(wifi_ssid),
+    const short mqtt_port) : EspHomeClient(wifi_ssid, wifi_password, mqtt_broker, mqtt_username, mqtt_password, mqtt_client_name, mqtt_port,
+                                           NULL, 0, NULL, 0, NULL, 0) {}
+
+EspHomeClient::EspHomeClient(
+    const char *wifi_ssid,
+    const char *wifi_password,
+    const char *mqtt_broker,
+    const char *mqtt_username,
+    const char *mqtt_password,
+    const char *mqtt_client_name,
+    const short mqtt_port,
+    EspHomeClientSubscriptionRecord *subscriptions,
+    uint16_t subscription_capacity,
+    char *subscription_topics,
+    uint16_t subscription_topic_size,
+    EspHomeClientTopicTrieNode *topic_trie_nodes,
+    uint16_t topic_trie_capacity) : wifi_ssid_(wifi_ssid),
                              wifi_password_(wifi_password),
                              mqtt_broker_(mqtt_broker),
                              mqtt_username_(mqtt_username),
                              mqtt_password_(mqtt_password),
                              mqtt_client_name_(mqtt_client_name),
                              mqtt_port_(mqtt_port),
-                             mqtt_client_(mqtt_broker, mqtt_port, wifi_client_)
+                             mqtt_transport_(wifi_client_),
+                             mqtt_client_(mqtt_broker, mqtt_port, mqtt_transport_)
 {
   // WiFi connection
   handle_wifi_ = (wifi_ssid_ != NULL);
@@ -32,23 +71,122 @@ EspHomeClient::EspHomeClient(
   next_wifi_connection_attempt_millis_ = 500;
   last_wifi_connection_attempt_millis_ = 0;
   wifi_reconnection_attempt_delay_ = 60 * 1000;
+  failed_wifi_connection_attempt_count_ = 0;
+  wifi_reconnect_policy_ = ReconnectPolicy::wifiDefault();
+  wifi_fast_connect_ = false;
+  wifi_fast_connecting_ = false;
+  wifi_static_ip_configured_ = false;
+  wifi_fast_connect_timeout_ = 5000;
+  memset(&wifi_connection_stats_, 0, sizeof(wifi_connection_stats_));
 
   // MQTT client
   mqtt_connected_ = false;
   next_mqtt_connection_attempt_millis_ = 0;
-  mqtt_reconnection_attempt_delay_ = 15 * 1000; // 15 seconds of waiting between each mqtt reconnection attempts by default
+  mqtt_reconnect_policy_ = ReconnectPolicy::mqttDefault();
   mqtt_last_will_topic_ = 0;
   mqtt_last_will_message_ = 0;
   mqtt_last_will_retain_ = false;
   mqtt_clean_session_ = true;
   mqtt_client_.setCallback([this](char *topic, byte *payload, unsigned int length) { this->mqttMessageReceivedCallback(topic, payload, length); });
   failed_mqtt_connection_attempt_count_ = 0;
+  mqtt_keep_alive_ = MQTT_KEEPALIVE;
+  mqtt_stream_keep_alive_ = false;
+  mqtt_stream_packet_count_ = 0;
+  mqtt_stream_ping_millis_ = 0;
+  mqtt_connection_phase_ = MQTT_PHASE_IDLE;
+  mqtt_connection_attempt_millis_ = 0;
+  mqtt_connect_packet_millis_ = 0;
+  mqtt_connection_timeout_ = MQTT_SOCKET_TIMEOUT * 1000;
+  mqtt_connection_time_budget_ = 100;
+  mqtt_step_timeout_ = mqtt_connection_time_budget_;
+  mqtt_blocking_connect_timeout_ = 5000;
+  mqtt_connect_packet_length_ = 0;
+  mqtt_connect_ahead_ = true;
+  mqtt_broker_ip_resolved_ = false;
+
+  // Subscriptions
+  subscriptions_ = subscriptions;
+  subscription_count_ = 0;
+  subscription_capacity_ = subscription_capacity;
+  subscription_topics_ = subscription_topics;
+  subscription_topic_size_ = subscription_topic_size;
+  topic_trie_ = topic_trie_nodes;
+  topic_trie_size_ = 0;
+  topic_trie_capacity_ = topic_trie_capacity;
+  subscription_storage_fixed_ = (subscriptions != NULL);
+  topic_trie_dispatching_ = false;
+  topic_trie_dirty_ = false;
+  deferred_subscriptions_ = NULL;
+  mqtt_packet_id_ = 0;
+  inflight_retry_timeout_ = 5000;
+  inflight_resend_ = false;
+  inflight_processing_ = false;
+  stream_offset_ = 0;
+  stream_length_ = 0;
+  rebuildTopicTrie();
+
+  // Topics
+  compact_topics_ = false;
+  buildTopicPrefixes(topic_prefixes_, mqtt_client_name_);
+  devices_ = NULL;
+  topic_device_ = NULL;
+  topic_buffer_size_ = mqtt_client_.getBufferSize();
+  topic_buffer_ = new char[topic_buffer_size_];
+  expanded_topic_ = NULL;
+  expanded_topic_size_ = 0;
+  telemetry_channels_ = NULL;
+  broker_list_.add(mqtt_broker_, mqtt_port_);
+  broker_failback_ = false;
+  network_client_ = &wifi_client_;
+#ifdef ESP8266
+  tls_client_ = NULL;
+  tls_session_ = NULL;
+#endif
+  memset(&transport_stats_, 0, sizeof(transport_stats_));
+  command_queue_budget_micros_ = 10000;
+  publish_queue_drain_budget_ = 1024;
+  publish_queue_default_ttl_ = 0;
 
   // other
   connection_established_callback_ = onConnectionEstablished;
   enable_serial_logs_ = false;
   drastic_reset_on_connection_failures_ = false;
   connection_established_count_ = 0;
+  ESPHOMECLIENT_STAT(resetStats());
+}
+
+EspHomeClient::~EspHomeClient()
+{
+  delete[] topic_buffer_;
+  delete[] expanded_topic_;
+#ifdef ESP8266
+  delete tls_client_;
+  delete tls_session_;
+#endif
+
+  while (devices_ != NULL)
+  {
+    EspHomeClientDevice *next = devices_->next_;
+    delete devices_;
+    devices_ = next;
+  }
+
+  while (telemetry_channels_ != NULL)
+  {
+    EspHomeClientTelemetry *next = telemetry_channels_->next_;
+    delete telemetry_channels_;
+    telemetry_channels_ = next;
+  }
+
+  cancelDeferredSubscription(NULL);
+
+  if (!subscription_storage_fixed_)
+  {
+    for (uint16_t i = 0; i < subscription_count_; i++)
+      delete[] subscriptions_[i].topic;
+    delete[] subscriptions_;
+    delete[] topic_trie_;
+  }
 }
 
 // ##### Configuration ####
@@ -63,6 +201,71 @@ void EspHomeClient::enableMQTTPersistence()
   mqtt_clean_session_ = false;
 }
 
+void EspHomeClient::enableCompactTopics(const char *short_name)
+{
+  if (short_name == NULL)
+    short_name = mqtt_client_name_;
+
+  compact_topics_ = true;
+  buildTopicPrefixes(topic_prefixes_, short_name);
+  for (EspHomeClientDevice *device = devices_; device != NULL; device = device->next_)
+    buildTopicPrefixes(device->topic_prefixes_, device->name_);
+}
+
+bool EspHomeClient::addTopicAlias(const char *topic, const char *alias)
+{
+  if (!topic_aliases_.add(topic, alias))
+  {
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Alias [%s] of [%s] rejected\n", alias, topic);
+    return false;
+  }
+
+  return true;
+}
+
+bool EspHomeClient::addBroker(const char *mqtt_broker, const short mqtt_port)
+{
+  return broker_list_.add(mqtt_broker, mqtt_port);
+}
+
+void EspHomeClient::setBrokerSelection(const unsigned long margin_millis, const unsigned long failback_interval_millis)
+{
+  broker_list_.setPreferenceMargin(margin_millis);
+  broker_list_.setFailbackInterval(failback_interval_millis);
+}
+
+void EspHomeClient::setNetworkClient(Client &client)
+{
+  network_client_ = &client;
+  mqtt_transport_.setClient(client);
+}
+
+#ifdef ESP8266
+void EspHomeClient::enableTLS(const uint8_t fingerprint[20])
+{
+  createTLSClient();
+  tls_client_->setFingerprint(fingerprint);
+}
+
+void EspHomeClient::enableTLS(const BearSSL::X509List *trust_anchors)
+{
+  createTLSClient();
+  tls_client_->setTrustAnchors(trust_anchors);
+}
+
+void EspHomeClient::createTLSClient()
+{
+  if (tls_client_ == NULL)
+  {
+    tls_client_ = new BearSSL::WiFiClientSecure();
+    tls_session_ = new BearSSL::Session();
+    tls_client_->setSession(tls_session_);
+  }
+
+  setNetworkClient(*tls_client_);
+}
+#endif
+
 void EspHomeClient::enableLastWillMessage(const char* topic, const char* message, const bool retain)
 {
   mqtt_last_will_topic_ = (char*)topic;
@@ -70,12 +273,63 @@ void EspHomeClient::enableLastWillMessage(const char* topic, const char* message
   mqtt_last_will_retain_ = retain;
 }
 
+void EspHomeClient::enableWifiFastConnect(const unsigned int timeout_millis)
+{
+  wifi_fast_connect_ = true;
+  wifi_fast_connect_timeout_ = timeout_millis;
+
+  if (wifi_cache_.load(wifi_ssid_))
+    ESPHOMECLIENT_LOG_INFO("WiFi: Cached access point found, channel %d\n", wifi_cache_.data().channel);
+}
+
+void EspHomeClient::enableDeepSleepCycle(const uint64_t sleep_micros, const unsigned long command_wait_millis, const unsigned long max_awake_millis)
+{
+  duty_cycle_.begin(sleep_micros, command_wait_millis, max_awake_millis);
+  duty_cycle_.loadStats();
+
+  if (!wifi_fast_connect_)
+    enableWifiFastConnect();
+}
+
+bool EspHomeClient::enablePublishQueue(const size_t capacity_bytes, const PublishQueueOverflowPolicy overflow_policy, const unsigned long default_ttl_millis)
+{
+  publish_queue_default_ttl_ = default_ttl_millis;
+  return publish_queue_.begin(capacity_bytes, overflow_policy);
+}
+
+bool EspHomeClient::enableCommandQueue(const uint16_t slot_count, const uint16_t slot_size, const PublishQueueOverflowPolicy overflow_policy)
+{
+  return command_queue_.begin(slot_count, slot_size, overflow_policy);
+}
+
+bool EspHomeClient::enableQoS1Publish(const uint8_t window_size, const size_t capacity_bytes, const unsigned long retry_timeout_millis)
+{
+  inflight_retry_timeout_ = retry_timeout_millis;
+  return inflight_window_.begin(window_size, capacity_bytes);
+}
+
 // ##### Main Loop ####
 
 void EspHomeClient::loop()
 {
+  ESPHOMECLIENT_STAT(LoopStatsRecorder loop_stats_recorder(this));
+
+#if ESPHOMECLIENT_LOG_LEVEL > ESPHOMECLIENT_LOG_LEVEL_NONE
+  // Write the pending log lines, as much as Serial accepts without blocking
+  log_sink_.drain(Serial);
+#endif
+
+  // End of the duty cycle
+  if (duty_cycle_.isEnabled() && duty_cycle_.update(millis(), isConnected(), !publish_queue_.isEmpty() || !command_queue_.isEmpty() || !inflight_window_.isEmpty() || hasPendingTelemetry()))
+  {
+    enterDeepSleep();
+    return;
+  }
+
   // WIFI handling
+  ESPHOMECLIENT_STAT(unsigned long wifi_start_micros = micros());
   bool wifi_state_changed_ = handleWifi();
+  ESPHOMECLIENT_STAT(stats_.handle_wifi_micros += micros() - wifi_start_micros);
 
   // If there is a change in the wifi connection state, don't handle the mqtt connection state right away.
   // We will wait at least one lopp() call. This prevent the library from doing too much thing in the same loop() call.
@@ -83,9 +337,31 @@ void EspHomeClient::loop()
     return;
 
   // MQTT Handling
+  ESPHOMECLIENT_STAT(unsigned long mqtt_start_micros = micros());
   bool mqtt_state_changed_ = handleMQTT();
+  ESPHOMECLIENT_STAT(stats_.handle_mqtt_micros += micros() - mqtt_start_micros);
   if (mqtt_state_changed_)
     return;
+
+  // Dispatch the queued commands
+  if (!command_queue_.isEmpty())
+    processCommandQueue();
+
+  // Send the messages published while disconnected
+  if (isConnected() && !publish_queue_.isEmpty())
+    processPublishQueue();
+
+  // Acknowledge and retransmit the QoS 1 messages
+  if (isConnected() && !inflight_window_.isEmpty())
+    processInflightWindow();
+
+  // Publish the changed telemetry values, all the due channels at once
+  if (isConnected() && telemetry_channels_ != NULL)
+    processTelemetry();
+
+  // Scheduled tasks, after the connection has been serviced
+  if (!scheduler_.isEmpty())
+    scheduler_.tick(millis());
 }
 
 // ##### Public Functions ####
@@ -95,482 +371,2164 @@ bool EspHomeClient::setMaxPacketSize(const uint16_t size)
 
   bool success = mqtt_client_.setBufferSize(size);
 
-  if(!success && enable_serial_logs_)
-    Serial.println("MQTT! failed to set the max packet size.");
+  if (!success)
+    ESPHOMECLIENT_LOG_ERROR("MQTT! failed to set the max packet size.\n");
+
+  if (success && size != topic_buffer_size_)
+  {
+    delete[] topic_buffer_;
+    topic_buffer_size_ = size;
+    topic_buffer_ = new char[topic_buffer_size_];
+  }
 
   return success;
 }
 
 bool EspHomeClient::publish(TopicType type, const String &topic, const String &payload, bool retain)
 {
+  return publish(type, topic.c_str(), (const uint8_t *)payload.c_str(), payload.length(), retain);
+}
+
+bool EspHomeClient::publish(TopicType type, const char *topic, const char *payload, bool retain)
+{
+  return publish(type, topic, (const uint8_t *)payload, strlen(payload), retain);
+}
+
+bool EspHomeClient::publish(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain, unsigned long ttl_millis)
+{
+  // Queue the message while disconnected, or behind the already queued ones to keep the publishing order
+  if (publish_queue_.isEnabled() && (!isConnected() || !publish_queue_.isEmpty()))
+  {
+    const char *full_topic = buildFullTopic(type, topic);
+    if (full_topic == NULL)
+      return false;
+
+    bool queued = publish_queue_.push(full_topic, payload, length, retain, ttl_millis > 0 ? ttl_millis : publish_queue_default_ttl_);
+
+    if (queued)
+      ESPHOMECLIENT_LOG_DEBUG("MQTT: Queued [%s] %.*s\n", full_topic, (int)length, (const char *)payload);
+    else
+      ESPHOMECLIENT_LOG_ERROR("MQTT! publish queue full, message dropped.\n");
+
+    return queued;
+  }
+
   // Do not try to publish if MQTT is not connected.
   if (!isConnected())
   {
-    if (enable_serial_logs_)
-      Serial.println("MQTT! Trying to publish when disconnected, skipping.");
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Trying to publish when disconnected, skipping.\n");
 
     return false;
   }
 
   // Build full topic
-  String full_topic = buildFullTopic(type, topic);
+  const char *full_topic = buildFullTopic(type, topic);
+  if (full_topic == NULL)
+    return false;
 
-  bool success = mqtt_client_.publish(full_topic.c_str(), payload.c_str(), retain);
+  bool success = mqtt_client_.publish(full_topic, payload, length, retain);
 
-  if (enable_serial_logs_)
-  {
-    if (success)
-      Serial.printf("MQTT << [%s] %s\n", full_topic.c_str(), payload.c_str());
-    else
-      Serial.println("MQTT! publish failed, is the message too long ? (see setMaxPacketSize())"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
-  }
+  ESPHOMECLIENT_STAT(if (success) { stats_.messages_out++; stats_.bytes_out += strlen(full_topic) + length; });
+
+  if (success)
+    ESPHOMECLIENT_LOG_DEBUG("MQTT << [%s] %.*s\n", full_topic, (int)length, (const char *)payload);
+  else
+    ESPHOMECLIENT_LOG_ERROR("MQTT! publish failed, is the message too long ? (see setMaxPacketSize())\n"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
 
   return success;
 }
 
-bool EspHomeClient::subscribe(const String &topic, MessageReceivedCallback message_received_callback, uint8_t qos)
+bool EspHomeClient::beginPublish(TopicType type, const char *topic, size_t length, bool retain)
 {
-  // Do not try to subscribe if MQTT is not connected.
+  // Do not try to publish if MQTT is not connected.
   if (!isConnected())
   {
-    if (enable_serial_logs_)
-      Serial.println("MQTT! Trying to subscribe when disconnected, skipping.");
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Trying to publish when disconnected, skipping.\n");
 
     return false;
   }
 
   // Build full topic
-  String full_topic = buildFullTopic(CMND, topic);
-
-  bool success = mqtt_client_.subscribe(full_topic.c_str(), qos);
+  const char *full_topic = buildFullTopic(type, topic);
+  if (full_topic == NULL)
+    return false;
 
-  if (success)
+  // Only the header goes through the PubSubClient buffer, the payload is written straight to the connection
+  if (!mqtt_client_.beginPublish(full_topic, length, retain))
   {
-    // Add the record to the subscription list only if it does not exists.
-    bool found = false;
-    for (byte i = 0; i < topic_subscription_list_.size() && !found; i++)
-      found = topic_subscription_list_[i].topic.equals(full_topic);
+    ESPHOMECLIENT_LOG_ERROR("MQTT! publish failed, is the message too long ? (see setMaxPacketSize())\n");
 
-    if (!found)
-      topic_subscription_list_.push_back({full_topic, message_received_callback, NULL});
+    return false;
   }
 
-  if (enable_serial_logs_)
-  {
-    if (success)
-      Serial.printf("MQTT: Subscribed to [%s]\n", full_topic.c_str());
-    else
-      Serial.println("MQTT! subscribe failed");
-  }
+  ESPHOMECLIENT_LOG_DEBUG("MQTT << [%s] %u bytes streamed\n", full_topic, (unsigned int)length);
+  ESPHOMECLIENT_STAT(stats_.messages_out++; stats_.bytes_out += strlen(full_topic) + length);
 
-  return success;
+  return true;
 }
 
-bool EspHomeClient::subscribe(const String &topic, MessageReceivedCallbackWithTopic message_received_callback, uint8_t qos)
+size_t EspHomeClient::write(const uint8_t *data, size_t length)
 {
-  if (subscribe(topic, (MessageReceivedCallback)NULL, qos))
-  {
-    topic_subscription_list_[topic_subscription_list_.size() - 1].callback_with_topic = message_received_callback;
-    return true;
-  }
-  return false;
+  return mqtt_client_.write(data, length);
 }
 
-bool EspHomeClient::unsubscribe(const String &topic)
+size_t EspHomeClient::write(uint8_t data)
 {
-  // Do not try to unsubscribe if MQTT is not connected.
-  if (!isConnected())
+  return mqtt_client_.write(data);
+}
+
+bool EspHomeClient::endPublish()
+{
+  return mqtt_client_.endPublish() == 1;
+}
+
+uint16_t EspHomeClient::publishQoS1(TopicType type, const char *topic, const char *payload, bool retain)
+{
+  return publishQoS1(type, topic, (const uint8_t *)payload, strlen(payload), retain);
+}
+
+uint16_t EspHomeClient::publishQoS1(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain)
+{
+  if (!inflight_window_.isEnabled())
   {
-    if (enable_serial_logs_)
-      Serial.println("MQTT! Trying to unsubscribe when disconnected, skipping.");
+    ESPHOMECLIENT_LOG_ERROR("MQTT! QoS 1 publish without enableQoS1Publish(), skipping.\n");
 
-    return false;
+    return 0;
   }
 
   // Build full topic
-  String full_topic = buildFullTopic(CMND, topic);
+  const char *full_topic = buildFullTopic(type, topic);
+  if (full_topic == NULL)
+    return 0;
 
-  for (int i = 0; i < topic_subscription_list_.size(); i++)
+  uint16_t packet_id = nextPacketId();
+  if (!inflight_window_.push(packet_id, full_topic, payload, length, retain))
   {
-    if (topic_subscription_list_[i].topic.equals(full_topic))
-    {
-      if (mqtt_client_.unsubscribe(full_topic.c_str()))
-      {
-        topic_subscription_list_.erase(topic_subscription_list_.begin() + i);
-        i--;
+    ESPHOMECLIENT_LOG_DEBUG("MQTT! QoS 1 window full, [%s] not published\n", full_topic);
 
-        if (enable_serial_logs_)
-          Serial.printf("MQTT: Unsubscribed from %s\n", full_topic.c_str());
-      }
-      else
-      {
-        if (enable_serial_logs_)
-          Serial.println("MQTT! unsubscribe failed");
-
-        return false;
-      }
-    }
+    return 0;
   }
 
-  return true;
+  // Sent right away when connected, or by the window walk in progress
+  if (isConnected() && !inflight_processing_)
+    processInflightWindow();
+
+  return packet_id;
 }
 
-void EspHomeClient::setKeepAlive(uint16_t keep_alive_seconds)
+bool EspHomeClient::subscribe(const String &topic, MessageReceivedCallback message_received_callback, uint8_t qos)
 {
-  mqtt_client_.setKeepAlive(keep_alive_seconds);
+  return subscribe(topic, [message_received_callback](const char *, const uint8_t *payload, size_t length) {
+    message_received_callback(payloadToString(payload, length));
+  }, qos);
 }
 
-// ##### Private Function ####
+bool EspHomeClient::subscribe(const String &topic, MessageReceivedCallbackWithTopic message_received_callback, uint8_t qos)
+{
+  return subscribe(topic, [message_received_callback](const char *topic, const uint8_t *payload, size_t length) {
+    message_received_callback(String(topic), payloadToString(payload, length));
+  }, qos);
+}
 
-bool EspHomeClient::handleWifi()
+bool EspHomeClient::subscribe(const String &topic, MessageReceivedViewCallback message_received_callback, uint8_t qos)
 {
-  // When it's the first call, reset the wifi radio and schedule the wifi connection
-  static bool first_loop_call = true;
-  if (handle_wifi_ && first_loop_call)
-  {
-    WiFi.disconnect(true);
-    next_wifi_connection_attempt_millis_ = millis() + 500;
-    first_loop_call = false;
-    return true;
-  }
+  return addSubscription(topic.c_str(), message_received_callback, MessageReceivedViewCallbackRef(), NULL, qos);
+}
 
-  // Get the current connextion status
-  bool is_wifi_connected = (WiFi.status() == WL_CONNECTED);
+bool EspHomeClient::subscribeRef(const char *topic, MessageReceivedViewCallbackRef message_received_callback, uint8_t qos)
+{
+  if (!message_received_callback)
+    return false;
 
-  /***** Detect ans handle the current WiFi handling state *****/
+  // Stored in the record as is, a std::function wrapping it may allocate
+  return addSubscription(topic, NULL, message_received_callback, NULL, qos);
+}
 
-  // Connection established
-  if (is_wifi_connected && !wifi_connected_)
-  {
-    onWiFiConnectionEstablished();
-    connecting_to_wifi_ = false;
+bool EspHomeClient::subscribeStream(const String &topic, MessageStreamCallback message_stream_callback, uint8_t qos)
+{
+  // The incoming topics can be as long as the packet size
+  mqtt_transport_.enableStreaming(this, topic_buffer_size_);
 
-    // At least 500 miliseconds of waiting before an mqtt connection attempt.
-    // Some people have reported instabilities when trying to connect to
-    // the mqtt broker right after being connected to wifi.
-    // This delay prevent these instabilities.
-    next_mqtt_connection_attempt_millis_ = millis() + 500;
-  }
+  return addSubscription(topic.c_str(), NULL, MessageReceivedViewCallbackRef(), message_stream_callback, qos);
+}
 
-  // Connection in progress
-  else if (connecting_to_wifi_)
-  {
-    if (WiFi.status() == WL_CONNECT_FAILED || millis() - last_wifi_connection_attempt_millis_ >= wifi_reconnection_attempt_delay_)
-    {
-      if (enable_serial_logs_)
-        Serial.printf("WiFi! Connection attempt failed, delay expired. (%fs). \n", millis() / 1000.0);
+bool EspHomeClient::subscribeFrame(const String &topic, EspHomeClientFrameDecoder &frame_decoder, FrameReceivedCallback frame_received_callback, uint8_t qos)
+{
+  EspHomeClientFrameDecoder *decoder = &frame_decoder;
 
-      WiFi.disconnect(true);
+  // Each streamed piece is decoded into the pixel buffer right away, the callback only runs for complete frames
+  return subscribeStream(topic, [decoder, frame_received_callback](const char *, const uint8_t *data, size_t length, size_t offset, size_t total_length) {
+    if (offset == 0)
+      decoder->reset();
+    decoder->decode(data, length);
 
-      next_wifi_connection_attempt_millis_ = millis() + 500;
-      connecting_to_wifi_ = false;
-    }
-  }
+    if (offset + length == total_length && decoder->finish() && frame_received_callback)
+      frame_received_callback();
+  }, qos);
+}
 
-  // Connection lost
-  else if (!is_wifi_connected && wifi_connected_)
-  {
-    onWiFiConnectionLost();
+bool EspHomeClient::subscribeCommand(const String &topic, EspHomeClientCommandFields &fields, CommandReceivedCallback command_received_callback, uint8_t qos)
+{
+  EspHomeClientCommandFields *command_fields = &fields;
 
-    if (handle_wifi_)
-      next_wifi_connection_attempt_millis_ = millis() + 500;
-  }
+  // Malformed commands never reach the callback
+  return subscribe(topic, [this, command_fields, command_received_callback](const char *topic, const uint8_t *payload, size_t length) {
+    uint32_t fields_present;
+    if (command_fields->parse(payload, length, fields_present))
+      command_received_callback(fields_present);
+    else
+      ESPHOMECLIENT_LOG_ERROR("MQTT! Malformed command on [%s]\n", topic);
+  }, qos);
+}
 
-  // Disconnected since at least one loop() call
-  // Then, if we handle the wifi reconnection process and the waiting delay has expired, we connect to wifi
-  else if (handle_wifi_ && next_wifi_connection_attempt_millis_ > 0 && millis() >= next_wifi_connection_attempt_millis_)
-  {
-    connectToWifi();
-    next_wifi_connection_attempt_millis_ = 0;
-    connecting_to_wifi_ = true;
-    last_wifi_connection_attempt_millis_ = millis();
-  }
+bool EspHomeClient::unsubscribe(const String &topic)
+{
+  // Build full topic
+  const char *full_topic = buildFullTopic(CMND, topic.c_str());
+  if (full_topic == NULL)
+    return false;
 
-  /**** Detect and return if there was a change in the WiFi state ****/
+  cancelDeferredSubscription(full_topic);
 
-  if (is_wifi_connected != wifi_connected_)
-  {
-    wifi_connected_ = is_wifi_connected;
+  int record = findSubscription(full_topic);
+  if (record < 0)
     return true;
-  }
-  else
+
+  // While disconnected the subscription is only forgotten. A persistent session may still deliver its
+  // messages, they are dropped for lack of a matching subscription.
+  if (isConnected() && !subscriptions_[record].pending && !sendUnsubscribePacket(subscriptions_[record].topic))
+  {
+    ESPHOMECLIENT_LOG_ERROR("MQTT! unsubscribe failed\n");
+
     return false;
-}
+  }
 
-bool EspHomeClient::handleMQTT()
-{
-  // PubSubClient main lopp() call
-  mqtt_client_.loop();
+  removeSubscription(record);
 
-  // Get the current connextion status
-  bool is_mqtt_connected = (isWifiConnected() && mqtt_client_.connected());
+  ESPHOMECLIENT_LOG_INFO("MQTT: Unsubscribed from %s\n", full_topic);
 
-  /***** Detect ans handle the current MQTT handling state *****/
+  return true;
+}
 
-  // Connection established
-  if (is_mqtt_connected && !mqtt_connected_)
+bool EspHomeClient::coalesceCommands(const String &topic, bool coalesce)
+{
+  const char *full_topic = buildFullTopic(CMND, topic.c_str());
+  if (full_topic == NULL)
+    return false;
+
+  int record = findSubscription(full_topic);
+  if (record >= 0)
   {
-    mqtt_connected_ = true;
-    onMQTTConnectionEstablished();
+    subscriptions_[record].coalesce = coalesce;
+    return true;
+  }
+
+  // Subscribed by a callback of the message being dispatched
+  for (EspHomeClientDeferredSubscription *deferred = deferred_subscriptions_; deferred != NULL; deferred = deferred->next)
+  {
+    if (strcmp(deferred->record.topic, full_topic) == 0)
+    {
+      deferred->record.coalesce = coalesce;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void EspHomeClient::setKeepAlive(uint16_t keep_alive_seconds)
+{
+  mqtt_keep_alive_ = keep_alive_seconds;
+  if (!mqtt_stream_keep_alive_)
+    mqtt_client_.setKeepAlive(keep_alive_seconds);
+}
+
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+void EspHomeClient::resetStats()
+{
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.loop_min_micros = (unsigned long)-1;
+  stats_.min_free_heap = ESP.getFreeHeap();
+}
+
+bool EspHomeClient::publishStats()
+{
+  char failed_attempts[ESPHOMECLIENT_STATS_HISTORY_LENGTH * 4 + 1];
+  size_t position = 0;
+  for (byte i = 0; i < ESPHOMECLIENT_STATS_HISTORY_LENGTH; i++)
+    position += snprintf(failed_attempts + position, sizeof(failed_attempts) - position, i == 0 ? "%u" : ",%u", stats_.failed_mqtt_connection_attempts[i]);
+
+  char json[384];
+  snprintf(json, sizeof(json),
+           "{\"loops\":%lu,\"loop_us\":{\"min\":%lu,\"max\":%lu,\"mean\":%lu},\"wifi_us\":%llu,\"mqtt_us\":%llu,"
+           "\"msg_in\":%lu,\"msg_out\":%lu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"at_buffer_limit\":%lu,"
+           "\"wifi_connections\":%u,\"mqtt_connections\":%u,\"failed_attempts\":[%s],"
+           "\"callback_us\":%llu,\"slowest_callback\":{\"us\":%lu,\"topic\":\"%s\"},\"min_free_heap\":%u}",
+           stats_.loop_count, stats_.loop_count > 0 ? stats_.loop_min_micros : 0, stats_.loop_max_micros,
+           stats_.loop_count > 0 ? (unsigned long)(stats_.loop_total_micros / stats_.loop_count) : 0,
+           stats_.handle_wifi_micros, stats_.handle_mqtt_micros,
+           stats_.messages_in, stats_.messages_out, stats_.bytes_in, stats_.bytes_out, stats_.messages_at_buffer_limit,
+           stats_.wifi_connections, stats_.mqtt_connections, failed_attempts,
+           stats_.callback_micros, stats_.slowest_callback_micros, stats_.slowest_callback_topic, (unsigned int)stats_.min_free_heap);
+
+  return publish(TELE, "stats", json);
+}
+#endif
+
+// ##### Private Function ####
+
+#if ESPHOMECLIENT_LOG_LEVEL > ESPHOMECLIENT_LOG_LEVEL_NONE
+void EspHomeClient::writeLog(const char *format, ...)
+{
+  if (!enable_serial_logs_)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  log_sink_.vprintf(format, args);
+  va_end(args);
+}
+#endif
+
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+void EspHomeClient::recordLoopDuration(unsigned long duration_micros)
+{
+  stats_.loop_count++;
+  stats_.loop_total_micros += duration_micros;
+  if (duration_micros < stats_.loop_min_micros)
+    stats_.loop_min_micros = duration_micros;
+  if (duration_micros > stats_.loop_max_micros)
+    stats_.loop_max_micros = duration_micros;
+
+  uint32_t free_heap = ESP.getFreeHeap();
+  if (free_heap < stats_.min_free_heap)
+    stats_.min_free_heap = free_heap;
+}
+#endif
+
+// Send queued messages until the per loop() byte budget is spent, at least one
+void EspHomeClient::processPublishQueue()
+{
+  size_t sent_bytes = 0;
+
+  while (!publish_queue_.isEmpty())
+  {
+    EspHomeClientPublishQueue::EntryHeader header;
+    publish_queue_.front(header);
+
+    // Each message is checked as it comes to the head, the ones behind a message without time to live included
+    if (EspHomeClientPublishQueue::isExpired(header, millis()))
+    {
+      publish_queue_.dropFront();
+      continue;
+    }
+
+    // The buffer may have been shrunk by setMaxPacketSize() since the message was queued
+    if (header.topic_length >= topic_buffer_size_)
+    {
+      publish_queue_.pop(false);
+      continue;
+    }
+    publish_queue_.frontTopic(topic_buffer_);
+
+    const uint8_t *first, *second;
+    size_t first_length, second_length;
+    publish_queue_.frontPayload(first, first_length, second, second_length);
+
+    // The payload is written straight from the queue
+    if (!mqtt_client_.beginPublish(topic_buffer_, header.payload_length, header.retain))
+      break;
+    mqtt_client_.write(first, first_length);
+    if (second_length > 0)
+      mqtt_client_.write(second, second_length);
+    mqtt_client_.endPublish();
+
+    ESPHOMECLIENT_LOG_DEBUG("MQTT << [%s] (queued for %lums)\n", topic_buffer_, millis() - header.enqueued_millis);
+
+    publish_queue_.pop(true);
+    sent_bytes += header.topic_length + header.payload_length;
+    ESPHOMECLIENT_STAT(stats_.messages_out++; stats_.bytes_out += header.topic_length + header.payload_length);
+
+    if (sent_bytes >= publish_queue_drain_budget_)
+      break;
+  }
+}
+
+EspHomeClientDevice &EspHomeClient::device(const char *name)
+{
+  EspHomeClientDevice **device = &devices_;
+  for (; *device != NULL; device = &(*device)->next_)
+  {
+    if (strcmp((*device)->name_, name) == 0)
+      return **device;
+  }
+
+  *device = new EspHomeClientDevice(*this, name);
+  buildTopicPrefixes((*device)->topic_prefixes_, (*device)->name_);
+  return **device;
+}
+
+EspHomeClientTelemetry &EspHomeClient::telemetry(const char *topic, TopicType type)
+{
+  EspHomeClientTelemetry **channel = &telemetry_channels_;
+  for (; *channel != NULL; channel = &(*channel)->next_)
+  {
+    if ((*channel)->type_ == type && strcmp((*channel)->topic_, topic) == 0)
+      return **channel;
+  }
+
+  *channel = new EspHomeClientTelemetry(topic, type);
+  return **channel;
+}
+
+TelemetryStats EspHomeClient::getTelemetryStats() const
+{
+  TelemetryStats total = {0, 0, 0, 0};
+  for (EspHomeClientTelemetry *channel = telemetry_channels_; channel != NULL; channel = channel->next_)
+  {
+    total.updates += channel->stats_.updates;
+    total.sent += channel->stats_.sent;
+    total.suppressed += channel->stats_.suppressed;
+    total.heartbeats += channel->stats_.heartbeats;
+  }
+
+  return total;
+}
+
+void EspHomeClient::processTelemetry()
+{
+  unsigned long now = millis();
+  for (EspHomeClientTelemetry *channel = telemetry_channels_; channel != NULL; channel = channel->next_)
+  {
+    // A value failing to be published stays due, it is tried again in the next loop() call
+    const char *value = channel->due(now);
+    if (value != NULL && publish((TopicType)channel->type_, channel->topic_, (const uint8_t *)value, strlen(value), channel->retain_))
+      channel->markSent(now);
+  }
+}
+
+bool EspHomeClient::hasPendingTelemetry() const
+{
+  for (EspHomeClientTelemetry *channel = telemetry_channels_; channel != NULL; channel = channel->next_)
+  {
+    if (channel->pending_)
+      return true;
+  }
+
+  return false;
+}
+
+// Complete the acknowledged QoS 1 messages, send the new ones and retransmit the ones whose PUBACK is late
+void EspHomeClient::processInflightWindow()
+{
+  inflight_processing_ = true;
+
+  uint16_t packet_id;
+  while (mqtt_transport_.takeAcknowledgement(packet_id))
+  {
+    if (inflight_window_.acknowledge(packet_id) && publish_completed_callback_)
+      publish_completed_callback_(packet_id, true);
+  }
+
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < inflight_window_.count(); i++)
+  {
+    EspHomeClientInflightWindow::Slot &slot = inflight_window_.slot(i);
+    if (slot.done)
+      continue;
+
+    if (slot.send_count > 0 && !inflight_resend_)
+    {
+      if (now - slot.sent_millis < inflight_retry_timeout_)
+        continue;
+
+      if (slot.retransmissions == ESPHOMECLIENT_QOS1_MAX_RETRANSMISSIONS)
+      {
+        ESPHOMECLIENT_LOG_ERROR("MQTT! QoS 1 message %u not acknowledged, dropped\n", slot.packet_id);
+
+        inflight_window_.drop(slot);
+        if (publish_completed_callback_)
+          publish_completed_callback_(slot.packet_id, false);
+        continue;
+      }
+      slot.retransmissions++;
+    }
+
+    const uint8_t *first, *second;
+    size_t first_length, second_length;
+    inflight_window_.packet(slot, first, first_length, second, second_length);
+    if (mqtt_transport_.writeDirect(first, first_length) != first_length ||
+        (second_length > 0 && mqtt_transport_.writeDirect(second, second_length) != second_length))
+      break; // The connection is broken, the window is sent again after the reconnection
+
+    ESPHOMECLIENT_LOG_DEBUG("MQTT << QoS 1 message %u%s\n", slot.packet_id, slot.send_count > 0 ? " (DUP)" : "");
+    ESPHOMECLIENT_STAT(stats_.messages_out++; stats_.bytes_out += slot.length);
+
+    inflight_window_.markSent(slot, now);
+  }
+
+  inflight_resend_ = false;
+  inflight_processing_ = false;
+  inflight_window_.release();
+}
+
+// Identifier of the next QoS 1 PUBLISH, SUBSCRIBE or UNSUBSCRIBE packet. All of them are sent by EspHomeClient itself,
+// PubSubClient is never asked to send one. The identifiers still held by the QoS 1 window are skipped.
+uint16_t EspHomeClient::nextPacketId()
+{
+  do
+    mqtt_packet_id_ = (mqtt_packet_id_ == 0xFFFF ? 1 : mqtt_packet_id_ + 1);
+  while (inflight_window_.contains(mqtt_packet_id_));
+
+  return mqtt_packet_id_;
+}
+
+// Close the connections and deep sleep until the next duty cycle
+void EspHomeClient::enterDeepSleep()
+{
+  unsigned long awake_millis = millis();
+  duty_cycle_.saveStats(awake_millis);
+
+  uint64_t sleep_micros = duty_cycle_.sleepMicros();
+#ifdef ESP8266
+  // Longer sleeps overflow the RTC timer, the maximum depends on the calibration of the chip (about 3.5 hours)
+  if (sleep_micros > ESP.deepSleepMax())
+    sleep_micros = ESP.deepSleepMax();
+#endif
+
+  ESPHOMECLIENT_LOG_INFO("Sleep: Awake for %lums%s, sleeping for %lus\n", awake_millis,
+                         duty_cycle_.timedOut() ? " (timeout)" : "",
+                         (unsigned long)(sleep_micros / 1000000));
+
+  if (before_sleep_callback_)
+    before_sleep_callback_();
+
+  // A clean disconnection, the broker does not publish the last will
+  if (mqtt_client_.connected())
+    mqtt_client_.disconnect();
+  WiFi.disconnect(true);
+
+#if ESPHOMECLIENT_LOG_LEVEL > ESPHOMECLIENT_LOG_LEVEL_NONE
+  unsigned long drain_start_millis = millis();
+  while (!log_sink_.isEmpty() && millis() - drain_start_millis < 100)
+  {
+    log_sink_.drain(Serial);
+    yield();
+  }
+  Serial.flush();
+#endif
+
+#ifdef ESP8266
+  ESP.deepSleep(sleep_micros);
+#else
+  // ESP.deepSleep() takes 32 bits on ESP32, it would wrap after 71 minutes
+  esp_deep_sleep(sleep_micros);
+#endif
+}
+
+bool EspHomeClient::handleWifi()
+{
+  // When it's the first call, reset the wifi radio and schedule the wifi connection
+  static bool first_loop_call = true;
+  if (handle_wifi_ && first_loop_call)
+  {
+    WiFi.disconnect(true);
+    // No need to wait when the connection is set up from the cache
+    next_wifi_connection_attempt_millis_ = millis() + (wifi_fast_connect_ && wifi_cache_.isValid() ? 1 : 500);
+    first_loop_call = false;
+    return true;
+  }
+
+  // Get the current connextion status
+  bool is_wifi_connected = (WiFi.status() == WL_CONNECTED);
+
+  /***** Detect ans handle the current WiFi handling state *****/
+
+  // Connection established
+  if (is_wifi_connected && !wifi_connected_)
+  {
+    onWiFiConnectionEstablished();
+    connecting_to_wifi_ = false;
+    wifi_fast_connecting_ = false;
+    failed_wifi_connection_attempt_count_ = 0;
+
+    // At least 500 miliseconds of waiting before an mqtt connection attempt.
+    // Some people have reported instabilities when trying to connect to
+    // the mqtt broker right after being connected to wifi.
+    // This delay prevent these instabilities.
+    next_mqtt_connection_attempt_millis_ = millis() + 500;
+  }
+
+  // Connection in progress
+  else if (connecting_to_wifi_)
+  {
+    unsigned long timeout = (wifi_fast_connecting_ ? wifi_fast_connect_timeout_ : wifi_reconnection_attempt_delay_);
+    if (WiFi.status() == WL_CONNECT_FAILED || millis() - last_wifi_connection_attempt_millis_ >= timeout)
+    {
+      ESPHOMECLIENT_LOG_ERROR("WiFi! Connection attempt failed, delay expired. (%lums). \n", millis());
+
+      WiFi.disconnect(true);
+
+      // The access point or the lease changed, the next attempt scans and requests an address
+      if (wifi_fast_connecting_)
+      {
+        ESPHOMECLIENT_LOG_INFO("WiFi: Fast connection failed, falling back to a full connection\n");
+
+        wifi_connection_stats_.fast_connection_failures++;
+        wifi_cache_.invalidate();
+        wifi_fast_connecting_ = false;
+      }
+
+      failed_wifi_connection_attempt_count_++;
+      scheduleWifiConnectionAttempt();
+      connecting_to_wifi_ = false;
+    }
+  }
+
+  // Connection lost
+  else if (!is_wifi_connected && wifi_connected_)
+  {
+    onWiFiConnectionLost();
+
+    if (handle_wifi_)
+      scheduleWifiConnectionAttempt();
+  }
+
+  // Disconnected since at least one loop() call
+  // Then, if we handle the wifi reconnection process and the waiting delay has expired, we connect to wifi
+  else if (handle_wifi_ && next_wifi_connection_attempt_millis_ > 0 && millis() >= next_wifi_connection_attempt_millis_)
+  {
+    connectToWifi();
+    next_wifi_connection_attempt_millis_ = 0;
+    connecting_to_wifi_ = true;
+    last_wifi_connection_attempt_millis_ = millis();
+  }
+
+  /**** Detect and return if there was a change in the WiFi state ****/
+
+  if (is_wifi_connected != wifi_connected_)
+  {
+    wifi_connected_ = is_wifi_connected;
+    return true;
+  }
+  else
+    return false;
+}
+
+bool EspHomeClient::handleMQTT()
+{
+  // Hand the payload of the message being streamed, if any, before PubSubClient reads the next packets
+  mqtt_transport_.processIncomingStream();
+  keepStreamAlive();
+
+  // Leave the fallback broker from time to time, to find out whether the preferred one is back
+  if (mqtt_connected_ && broker_list_.failbackDue(millis()))
+  {
+    ESPHOMECLIENT_LOG_INFO("MQTT: Failing back to broker \"%s\"\n", broker_list_.broker(0).host);
+    broker_failback_ = true;
+    mqtt_client_.disconnect();
+  }
+
+  // PubSubClient main lopp() call
+  mqtt_client_.loop();
+
+  // PubSubClient reads one packet per call. With the command queue, the messages already received are all read so
+  // that a burst is coalesced and dispatched within the budget
+  for (uint16_t i = 0; command_queue_.isEnabled() && !command_queue_.isFull() && mqtt_transport_.available() > 0 && i < command_queue_.slotCount(); i++)
+    mqtt_client_.loop();
+
+  // Get the current connextion status
+  bool is_mqtt_connected = (isWifiConnected() && mqtt_client_.connected());
+
+  /***** Detect ans handle the current MQTT handling state *****/
+
+  // Connection established
+  if (is_mqtt_connected && !mqtt_connected_)
+  {
+    mqtt_connected_ = true;
+    onMQTTConnectionEstablished();
   }
 
   // Connection lost
   else if (!is_mqtt_connected && mqtt_connected_)
   {
-    onMQTTConnectionLost();
-    next_mqtt_connection_attempt_millis_ = millis() + mqtt_reconnection_attempt_delay_;
+    restoreKeepAlive();
+    broker_list_.disconnected();
+    onMQTTConnectionLost();
+    scheduleMqttConnectionAttempt();
+  }
+
+  // WiFi lost while connecting to the MQTT broker
+  else if (!isWifiConnected() && mqtt_connection_phase_ != MQTT_PHASE_IDLE)
+  {
+    abortMqttConnection("WiFi connection lost");
+  }
+
+  // It's time to connect to the MQTT broker, or a connection is in progress
+  else if (isWifiConnected() && (mqtt_connection_phase_ != MQTT_PHASE_IDLE || (next_mqtt_connection_attempt_millis_ > 0 && millis() >= next_mqtt_connection_attempt_millis_)))
+  {
+    next_mqtt_connection_attempt_millis_ = 0;
+
+    // Advance the connection to the MQTT broker by one phase
+    if (connectToMqttBroker())
+    {
+      if (mqtt_connection_phase_ == MQTT_PHASE_IDLE)
+      {
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+        memmove(stats_.failed_mqtt_connection_attempts + 1, stats_.failed_mqtt_connection_attempts, ESPHOMECLIENT_STATS_HISTORY_LENGTH - 1);
+        stats_.failed_mqtt_connection_attempts[0] = min(failed_mqtt_connection_attempt_count_, 255u);
+#endif
+        failed_mqtt_connection_attempt_count_ = 0;
+      }
+    }
+    else
+    {
+      // Connection failed, plan another connection attempt
+      mqtt_client_.disconnect();
+      broker_list_.failed(millis());
+      failed_mqtt_connection_attempt_count_++;
+      scheduleMqttConnectionAttempt();
+
+      ESPHOMECLIENT_LOG_ERROR("MQTT!: Failed MQTT connection count: %u \n", failed_mqtt_connection_attempt_count_);
+
+      // When there is too many failed attempt, sometimes it help to reset the WiFi connection or to restart the board.
+      if (failed_mqtt_connection_attempt_count_ == mqtt_reconnect_policy_.reset_wifi_after_failures)
+      {
+        ESPHOMECLIENT_LOG_ERROR("MQTT!: Can't connect to broker after too many attempt, resetting WiFi ...\n");
+
+        WiFi.disconnect(true);
+        next_wifi_connection_attempt_millis_ = millis() + wifi_reconnect_policy_.delayMillis(0);
+
+        if (!drastic_reset_on_connection_failures_)
+          failed_mqtt_connection_attempt_count_ = 0;
+      }
+      else if (drastic_reset_on_connection_failures_ && failed_mqtt_connection_attempt_count_ == mqtt_reconnect_policy_.reset_board_after_failures)
+      {
+        ESPHOMECLIENT_LOG_ERROR("MQTT!: Can't connect to broker after too many attempt, resetting board ...\n");
+
+#ifdef ESP8266
+        ESP.reset();
+#else
+        ESP.restart();
+#endif
+      }
+    }
+  }
+
+  /**** Detect and return if there was a change in the MQTT state ****/
+  if (mqtt_connected_ != is_mqtt_connected)
+  {
+    mqtt_connected_ = is_mqtt_connected;
+    return true;
+  }
+  else
+    return false;
+}
+
+// Initiate a Wifi connection (non-blocking)
+void EspHomeClient::connectToWifi()
+{
+  WiFi.mode(WIFI_STA);
+#ifdef ESP32
+  WiFi.setHostname(mqtt_client_name_);
+#else
+  WiFi.hostname(mqtt_client_name_);
+#endif
+
+  wifi_fast_connecting_ = (wifi_fast_connect_ && wifi_cache_.isValid());
+  if (wifi_fast_connecting_)
+  {
+    // Static configuration from the last DHCP lease, on the last access point
+    const EspHomeClientWifiCache::Data &cache = wifi_cache_.data();
+    WiFi.config(IPAddress(cache.local_ip), IPAddress(cache.gateway_ip), IPAddress(cache.subnet_mask), IPAddress(cache.dns_ip));
+    wifi_static_ip_configured_ = true;
+    WiFi.begin(wifi_ssid_, wifi_password_, cache.channel, cache.bssid);
+
+    ESPHOMECLIENT_LOG_INFO("WiFi: Connecting to %s on channel %d with ip %s ... (%lums) \n", wifi_ssid_, cache.channel, IPAddress(cache.local_ip).toString().c_str(), millis());
+    return;
+  }
+
+  // Back to DHCP after a failed fast connection
+  if (wifi_static_ip_configured_)
+  {
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+    wifi_static_ip_configured_ = false;
+  }
+  WiFi.begin(wifi_ssid_, wifi_password_);
+
+  ESPHOMECLIENT_LOG_INFO("WiFi: Connecting to %s ... (%lums) \n", wifi_ssid_, millis());
+}
+
+void EspHomeClient::scheduleWifiConnectionAttempt()
+{
+  unsigned long delay_millis = wifi_reconnect_policy_.delayMillis(failed_wifi_connection_attempt_count_);
+  next_wifi_connection_attempt_millis_ = millis() + delay_millis;
+
+  ESPHOMECLIENT_LOG_INFO("WiFi: Retrying to connect in %lums.\n", delay_millis);
+}
+
+/**
+ * Advance the connection to the MQTT broker by one phase (non-blocking).
+ * Steps that have to wait for the network (DNS lookup, TCP connection) block for at most mqtt_connection_time_budget_ at
+ * first, then twice as long at each try up to mqtt_blocking_connect_timeout_. The exceptions are the steps that cannot be
+ * split, see connectNetworkClient(), and the DNS lookup on ESP32 which has no timeout argument: it blocks until answered,
+ * or until the DNS timeout of the core when the server does not answer.
+ *
+ * @return false when the connection attempt failed, true while it is in progress or once it succeeded
+ */
+bool EspHomeClient::connectToMqttBroker()
+{
+  switch (mqtt_connection_phase_)
+  {
+  case MQTT_PHASE_IDLE:
+    if (broker_list_.count() > 1)
+    {
+      const BrokerStatus &broker = broker_list_.select(millis(), broker_failback_);
+      broker_failback_ = false;
+      if (broker.host != mqtt_broker_ || broker.port != mqtt_port_)
+      {
+        mqtt_broker_ = broker.host;
+        mqtt_port_ = broker.port;
+        mqtt_broker_ip_resolved_ = false;
+      }
+    }
+
+    ESPHOMECLIENT_LOG_INFO("MQTT: Connecting to broker \"%s\" with client name \"%s\" ... (%lums)\n", mqtt_broker_, mqtt_client_name_, millis());
+
+    mqtt_connection_attempt_millis_ = millis();
+    mqtt_step_timeout_ = mqtt_connection_time_budget_;
+    mqtt_connection_phase_ = MQTT_PHASE_RESOLVING;
+    return true;
+
+  case MQTT_PHASE_RESOLVING:
+    // The address is kept for the next attempts until a TCP connection to it fails, which limits the blocking lookups on ESP32
+    if (!mqtt_broker_ip_resolved_)
+    {
+      if (mqtt_broker_ip_.fromString(mqtt_broker_))
+        mqtt_broker_ip_resolved_ = true;
+      else
+#ifdef ESP8266
+        mqtt_broker_ip_resolved_ = (WiFi.hostByName(mqtt_broker_, mqtt_broker_ip_, mqtt_step_timeout_) == 1);
+#else
+        mqtt_broker_ip_resolved_ = (WiFi.hostByName(mqtt_broker_, mqtt_broker_ip_) == 1);
+#endif
+    }
+
+    if (mqtt_broker_ip_resolved_)
+    {
+      mqtt_step_timeout_ = mqtt_connection_time_budget_;
+      mqtt_connection_phase_ = MQTT_PHASE_TCP_CONNECTING;
+    }
+    else if (millis() - mqtt_connection_attempt_millis_ >= mqtt_connection_timeout_)
+      return abortMqttConnection("DNS lookup failed");
+    else
+      extendStepTimeout();
+
+    return true;
+
+  case MQTT_PHASE_TCP_CONNECTING:
+  {
+    bool tcp_connected = connectNetworkClient();
+
+    if (tcp_connected)
+      mqtt_connection_phase_ = MQTT_PHASE_SENDING_CONNECT;
+    else if (millis() - mqtt_connection_attempt_millis_ >= mqtt_connection_timeout_)
+    {
+      mqtt_broker_ip_resolved_ = false;
+      return abortMqttConnection("TCP connection failed");
+    }
+    else
+      extendStepTimeout();
+
+    return true;
+  }
+
+  case MQTT_PHASE_SENDING_CONNECT:
+    // PubSubClient did not write the CONNECT packet expected on an earlier connection. It is left to send its own and to
+    // wait for the CONNACK, which blocks loop() for up to mqtt_blocking_connect_timeout_
+    if (!mqtt_connect_ahead_)
+    {
+      mqtt_connect_packet_millis_ = millis();
+      mqtt_transport_.expectConnack();
+      mqtt_client_.setSocketTimeout(max(1u, (mqtt_blocking_connect_timeout_ + 999) / 1000));
+      bool success = mqtt_client_.connect(mqtt_client_name_, mqtt_username_, mqtt_password_, mqtt_last_will_topic_, 0, mqtt_last_will_retain_, mqtt_last_will_message_, mqtt_clean_session_);
+      mqtt_client_.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+      if (!success)
+        return abortMqttConnection(mqttStateName(mqtt_client_.state()));
+
+      mqtt_connection_phase_ = MQTT_PHASE_IDLE;
+      broker_list_.connected(millis(), millis() - mqtt_connect_packet_millis_);
+
+      ESPHOMECLIENT_LOG_INFO("MQTT: Connected to broker (%lums) \n", millis());
+
+      return true;
+    }
+
+    mqtt_connect_packet_length_ = buildConnectPacket((uint8_t *)topic_buffer_, topic_buffer_size_);
+    if (mqtt_connect_packet_length_ == 0)
+      return abortMqttConnection("CONNECT packet too long, see setMaxPacketSize()");
+
+    if (mqtt_transport_.writeDirect((uint8_t *)topic_buffer_, mqtt_connect_packet_length_) != mqtt_connect_packet_length_)
+      return abortMqttConnection("unable to send the CONNECT packet");
+
+    mqtt_connect_packet_millis_ = millis();
+    mqtt_connection_phase_ = MQTT_PHASE_AWAITING_CONNACK;
+    return true;
+
+  case MQTT_PHASE_AWAITING_CONNACK:
+    // CONNACK is 4 bytes long
+    if (mqtt_transport_.available() >= 4)
+    {
+      // Let PubSubClient read the CONNACK. The TCP connection being already open, PubSubClient 2.8 only writes a CONNECT
+      // packet, identical to the one already sent, before reading. The transport drops it after checking that it is.
+      // The scratch buffer may have been used since the packet was sent, it is encoded again.
+      buildConnectPacket((uint8_t *)topic_buffer_, topic_buffer_size_);
+      mqtt_transport_.skipOutgoingPacket((uint8_t *)topic_buffer_, mqtt_connect_packet_length_);
+      mqtt_transport_.expectConnack();
+      bool success = mqtt_client_.connect(mqtt_client_name_, mqtt_username_, mqtt_password_, mqtt_last_will_topic_, 0, mqtt_last_will_retain_, mqtt_last_will_message_, mqtt_clean_session_);
+
+      // Another PubSubClient version: the broker may not have been given the options PubSubClient knows of, the
+      // connection is dropped and the next ones are left to PubSubClient
+      if (!mqtt_transport_.stopSkippingOutgoingPacket())
+      {
+        mqtt_connect_ahead_ = false;
+        return abortMqttConnection("PubSubClient sent an unexpected CONNECT packet, falling back to its blocking connection");
+      }
+
+      if (!success)
+        return abortMqttConnection(mqttStateName(mqtt_client_.state()));
+
+      mqtt_connection_phase_ = MQTT_PHASE_IDLE;
+      broker_list_.connected(millis(), millis() - mqtt_connect_packet_millis_);
+
+      ESPHOMECLIENT_LOG_INFO("MQTT: Connected to broker (%lums) \n", millis());
+
+      return true;
+    }
+
+    if (!mqtt_transport_.connected())
+      return abortMqttConnection("connection closed by the broker");
+    if (millis() - mqtt_connect_packet_millis_ >= mqtt_connection_timeout_)
+      return abortMqttConnection("MQTT_CONNECTION_TIMEOUT");
+
+    return true;
+  }
+
+  return true;
+}
+
+// A lookup or a connection try cannot be resumed in the next loop() call, it starts over. A broker whose round trip is
+// longer than the budget is reached once the tries are long enough.
+void EspHomeClient::extendStepTimeout()
+{
+  unsigned long limit = max(mqtt_blocking_connect_timeout_, mqtt_connection_time_budget_);
+  // A duty cycle sleeps on time
+  if (duty_cycle_.isEnabled())
+    limit = max((unsigned long)mqtt_connection_time_budget_, min(limit, duty_cycle_.awakeMillisLeft(millis())));
+
+  mqtt_step_timeout_ = min((unsigned long)mqtt_step_timeout_ * 2, limit);
+}
+
+// Plan the next connection attempt according to the reconnect policy and the number of failed attempts
+void EspHomeClient::scheduleMqttConnectionAttempt()
+{
+  unsigned long delay_millis = mqtt_reconnect_policy_.delayMillis(failed_mqtt_connection_attempt_count_);
+  next_mqtt_connection_attempt_millis_ = millis() + delay_millis;
+
+  ESPHOMECLIENT_LOG_INFO("MQTT: Retrying to connect in %lums.\n", delay_millis);
+}
+
+// Close the connection being set up and return false
+bool EspHomeClient::abortMqttConnection(const char *reason)
+{
+  ESPHOMECLIENT_LOG_ERROR("MQTT! unable to connect (%lums), reason: %s\n", millis(), reason);
+
+  mqtt_transport_.stop();
+  mqtt_connection_phase_ = MQTT_PHASE_IDLE;
+  return false;
+}
+
+const char *EspHomeClient::mqttStateName(int state)
+{
+  switch (state)
+  {
+  case -4:
+    return "MQTT_CONNECTION_TIMEOUT";
+  case -3:
+    return "MQTT_CONNECTION_LOST";
+  case -2:
+    return "MQTT_CONNECT_FAILED";
+  case -1:
+    return "MQTT_DISCONNECTED";
+  case 1:
+    return "MQTT_CONNECT_BAD_PROTOCOL";
+  case 2:
+    return "MQTT_CONNECT_BAD_CLIENT_ID";
+  case 3:
+    return "MQTT_CONNECT_UNAVAILABLE";
+  case 4:
+    return "MQTT_CONNECT_BAD_CREDENTIALS";
+  case 5:
+    return "MQTT_CONNECT_UNAUTHORIZED";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+static size_t writeMqttString(uint8_t *buffer, size_t position, const char *str)
+{
+  size_t length = strlen(str);
+  buffer[position++] = length >> 8;
+  buffer[position++] = length & 0xFF;
+  memcpy(buffer + position, str, length);
+  return position + length;
+}
+
+// Open the connection to the broker and record how long it took
+bool EspHomeClient::connectNetworkClient()
+{
+  unsigned long start_millis = millis();
+  bool connected;
+
+  if (network_client_ == &wifi_client_)
+  {
+#ifdef ESP8266
+    wifi_client_.setTimeout(mqtt_step_timeout_);
+    connected = (wifi_client_.connect(mqtt_broker_ip_, mqtt_port_) == 1);
+#else
+    connected = (wifi_client_.connect(mqtt_broker_ip_, mqtt_port_, mqtt_step_timeout_) == 1);
+#endif
+  }
+  else
+  {
+    // Neither the TLS handshake nor the connection of an arbitrary Client can be split across loop() calls, they block
+    // for up to mqtt_blocking_connect_timeout_. Clients that ignore the Stream timeout bound themselves, e.g. with
+    // WiFiClientSecure::setHandshakeTimeout() on ESP32
+    network_client_->setTimeout(mqtt_blocking_connect_timeout_);
+    // By name, TLS clients need it for SNI and the certificate check. It was just resolved, so it is cached
+    connected = (network_client_->connect(mqtt_broker_, mqtt_port_) == 1);
+  }
+
+  unsigned long duration = millis() - start_millis;
+  if (!connected)
+  {
+    transport_stats_.failed_connections++;
+    return false;
+  }
+
+  if (transport_stats_.connections == 0)
+  {
+    transport_stats_.first_connect_millis = duration;
+    transport_stats_.min_connect_millis = duration;
+  }
+  transport_stats_.connections++;
+  transport_stats_.last_connect_millis = duration;
+  transport_stats_.min_connect_millis = min(transport_stats_.min_connect_millis, duration);
+  transport_stats_.max_connect_millis = max(transport_stats_.max_connect_millis, duration);
+  ESPHOMECLIENT_LOG_INFO("MQTT: Connection to the broker opened in %lums\n", duration);
+  return true;
+}
+
+/**
+ * Encode the CONNECT packet exactly like PubSubClient::connect() does
+ *
+ * @return the length of the packet, 0 when it does not fit in the buffer
+ */
+size_t EspHomeClient::buildConnectPacket(uint8_t *buffer, size_t size)
+{
+#if MQTT_VERSION == MQTT_VERSION_3_1
+  const char protocol_name[] = "MQIsdp";
+#else
+  const char protocol_name[] = "MQTT";
+#endif
+
+  // Remaining length
+  size_t remaining_length = 2 + strlen(protocol_name) + 4 + 2 + strlen(mqtt_client_name_);
+  if (mqtt_last_will_topic_)
+    remaining_length += 2 + strlen(mqtt_last_will_topic_) + 2 + strlen(mqtt_last_will_message_);
+  if (mqtt_username_)
+  {
+    remaining_length += 2 + strlen(mqtt_username_);
+    if (mqtt_password_)
+      remaining_length += 2 + strlen(mqtt_password_);
+  }
+
+  // Same limit as PubSubClient, which keeps room for the largest fixed header
+  if (MQTT_MAX_HEADER_SIZE + remaining_length > size)
+    return 0;
+
+  // Fixed header
+  size_t position = 0;
+  buffer[position++] = 0x10; // CONNECT
+  size_t length = remaining_length;
+  do
+  {
+    uint8_t digit = length % 128;
+    length /= 128;
+    if (length > 0)
+      digit |= 0x80;
+    buffer[position++] = digit;
+  } while (length > 0);
+
+  // Variable header
+  position = writeMqttString(buffer, position, protocol_name);
+  buffer[position++] = MQTT_VERSION;
+
+  uint8_t flags = 0;
+  if (mqtt_last_will_topic_)
+    flags |= 0x04 | (mqtt_last_will_retain_ ? 0x20 : 0);
+  if (mqtt_clean_session_)
+    flags |= 0x02;
+  if (mqtt_username_)
+  {
+    flags |= 0x80;
+    if (mqtt_password_)
+      flags |= 0x40;
+  }
+  buffer[position++] = flags;
+  buffer[position++] = mqtt_keep_alive_ >> 8;
+  buffer[position++] = mqtt_keep_alive_ & 0xFF;
+
+  // Payload
+  position = writeMqttString(buffer, position, mqtt_client_name_);
+  if (mqtt_last_will_topic_)
+  {
+    position = writeMqttString(buffer, position, mqtt_last_will_topic_);
+    position = writeMqttString(buffer, position, mqtt_last_will_message_);
+  }
+  if (mqtt_username_)
+  {
+    position = writeMqttString(buffer, position, mqtt_username_);
+    if (mqtt_password_)
+      position = writeMqttString(buffer, position, mqtt_password_);
+  }
+
+  return position;
+}
+
+void EspHomeClient::onWiFiConnectionEstablished()
+{
+  ESPHOMECLIENT_STAT(stats_.wifi_connections++);
+
+  wifi_connection_stats_.last_connection_millis = millis() - last_wifi_connection_attempt_millis_;
+  wifi_connection_stats_.last_connection_fast = wifi_fast_connecting_;
+  if (wifi_fast_connecting_)
+    wifi_connection_stats_.fast_connections++;
+  else
+    wifi_connection_stats_.full_connections++;
+
+  if (wifi_fast_connect_)
+    wifi_cache_.save(wifi_ssid_);
+
+  ESPHOMECLIENT_LOG_INFO("WiFi: Connected (%lums), ip : %s \n", millis(), WiFi.localIP().toString().c_str());
+}
+
+void EspHomeClient::onWiFiConnectionLost()
+{
+  ESPHOMECLIENT_LOG_ERROR("WiFi! Lost connection (%lums). \n", millis());
+
+  // If we handle wifi, we force disconnection to clear the last connection
+  if (handle_wifi_)
+  {
+    WiFi.disconnect(true);
+  }
+}
+
+void EspHomeClient::onMQTTConnectionEstablished()
+{
+  connection_established_count_++;
+  ESPHOMECLIENT_STAT(stats_.mqtt_connections++);
+
+  // A resumed persistent session kept the subscriptions of the previous connections, only the newer ones are sent
+  if (!mqtt_clean_session_ && mqtt_transport_.sessionPresent())
+    ESPHOMECLIENT_LOG_INFO("MQTT: Session resumed by the broker\n");
+  else
+  {
+    for (uint16_t i = 0; i < subscription_count_; i++)
+      subscriptions_[i].pending = true;
+  }
+  sendPendingSubscriptions();
+
+  for (EspHomeClientDevice *device = devices_; device != NULL; device = device->next_)
+  {
+    if (device->online_topic_ != NULL)
+      device->publish(TELE, device->online_topic_, device->online_message_, true);
+  }
+
+  // QoS 1 messages not acknowledged on the previous connection are sent again
+  inflight_resend_ = true;
+
+  connection_established_callback_();
+}
+
+/**
+ * PubSubClient does not see the streamed payloads and would take a long one for a silent broker: no ping answered
+ * within the keepalive, the connection is dropped. While the payload keeps arriving, its keepalive is set aside and
+ * the pings are sent from here. It comes back once PubSubClient has read a packet again, or when the stream stalls.
+ */
+void EspHomeClient::keepStreamAlive()
+{
+  unsigned long keep_alive_millis = mqtt_keep_alive_ * 1000UL;
+  bool stream_active = mqtt_transport_.streaming() && millis() - mqtt_transport_.streamActivityMillis() < keep_alive_millis;
+
+  if (!mqtt_stream_keep_alive_)
+  {
+    if (!stream_active || keep_alive_millis == 0)
+      return;
+
+    mqtt_stream_keep_alive_ = true;
+    mqtt_stream_packet_count_ = mqtt_transport_.incomingPacketCount();
+    mqtt_stream_ping_millis_ = millis();
+    mqtt_client_.setKeepAlive(0xFFFF);
+    return;
+  }
+
+  if (!stream_active && (millis() - mqtt_transport_.streamActivityMillis() >= keep_alive_millis || mqtt_transport_.incomingPacketCount() != mqtt_stream_packet_count_))
+  {
+    restoreKeepAlive();
+    return;
+  }
+
+  // Every half keepalive, as PubSubClient may have been silent for up to a keepalive when the stream began
+  if (millis() - mqtt_stream_ping_millis_ >= keep_alive_millis / 2)
+  {
+    static const uint8_t pingreq[2] = {0xC0, 0};
+    mqtt_transport_.writeDirect(pingreq, sizeof(pingreq));
+    mqtt_stream_ping_millis_ = millis();
+  }
+}
+
+void EspHomeClient::restoreKeepAlive()
+{
+  if (!mqtt_stream_keep_alive_)
+    return;
+
+  mqtt_stream_keep_alive_ = false;
+  mqtt_client_.setKeepAlive(mqtt_keep_alive_);
+}
+
+void EspHomeClient::onMQTTConnectionLost()
+{
+  ESPHOMECLIENT_LOG_ERROR("MQTT! Lost connection (%lums). \n", millis());
+}
+
+/**
+ * Matching MQTT topics according to the MQTT 3.1.1 wildcard rules. Both topics are walked in place, level by level.
+ * Several '+' are allowed, a trailing '#' also matches its parent level and topics beginning with '$' are not
+ * matched by filters beginning with a wildcard.
+ *
+ * @param filter is the topic filter, it may contain wildcards and must be valid (see mqttTopicFilterValid())
+ * @param topic is the topic name of a message and must not contain wildcards
+ * @return true on MQTT topic match, false otherwise
+ */
+bool EspHomeClient::mqttTopicMatch(const char *filter, const char *topic)
+{
+  if (*topic == '$' && (*filter == '+' || *filter == '#'))
+    return false;
+
+  while (true)
+  {
+    if (*filter == '#')
+      return true;
+
+    // Consume one level on both sides
+    if (*filter == '+')
+    {
+      filter++;
+      while (*topic != '\0' && *topic != '/')
+        topic++;
+    }
+    else
+    {
+      while (*filter != '\0' && *filter != '/')
+      {
+        if (*filter != *topic)
+          return false;
+        filter++;
+        topic++;
+      }
+
+      if (*topic != '\0' && *topic != '/')
+        return false;
+    }
+
+    if (*filter == '\0')
+      return *topic == '\0';
+
+    // The topic ends one level before the filter, only "/#" can match that
+    if (*topic == '\0')
+      return filter[1] == '#' && filter[2] == '\0';
+
+    filter++;
+    topic++;
+  }
+}
+
+/**
+ * Check that wildcards occupy a whole level and that '#' is the last level of the filter
+ */
+bool EspHomeClient::mqttTopicFilterValid(const char *filter)
+{
+  if (*filter == '\0')
+    return false;
+
+  for (const char *c = filter; *c != '\0'; c++)
+  {
+    if (*c != '+' && *c != '#')
+      continue;
+
+    if (c != filter && c[-1] != '/')
+      return false;
+    if (*c == '#' && c[1] != '\0')
+      return false;
+    if (*c == '+' && c[1] != '\0' && c[1] != '/')
+      return false;
+  }
+
+  return true;
+}
+
+bool EspHomeClient::addSubscription(const char *topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos)
+{
+  // Build full topic
+  const char *full_topic = buildFullTopic(CMND, topic);
+  if (full_topic == NULL)
+    return false;
+
+  if (!mqttTopicFilterValid(full_topic))
+  {
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Invalid topic filter [%s], wildcards must occupy a whole level.\n", full_topic);
+
+    return false;
+  }
+
+  // Like PubSubClient, the QoS 2 flow is not handled
+  if (qos > 1)
+  {
+    ESPHOMECLIENT_LOG_ERROR("MQTT! QoS %u rejected for [%s], 0 and 1 are supported.\n", qos, full_topic);
+
+    return false;
+  }
+
+  // The callback running may be the one replaced, or live in the storage growing
+  if (topic_trie_dispatching_)
+  {
+    deferSubscription(full_topic, message_received_callback, message_received_callback_ref, message_stream_callback, qos);
+    ESPHOMECLIENT_LOG_DEBUG("MQTT: Registering [%s] once the message is dispatched\n", full_topic);
+
+    return true;
+  }
+
+  return registerSubscription(full_topic, message_received_callback, message_received_callback_ref, message_stream_callback, qos);
+}
+
+bool EspHomeClient::registerSubscription(const char *full_topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos)
+{
+  // Subscribing again to a topic replaces its callback
+  int record = findSubscription(full_topic);
+  if (record < 0)
+  {
+    if (!hasSubscriptionCapacity(full_topic))
+    {
+      ESPHOMECLIENT_LOG_ERROR("MQTT! No room left for the subscription to [%s].\n", full_topic);
+
+      return false;
+    }
+
+    record = subscription_count_;
+    EspHomeClientSubscriptionRecord &new_record = subscriptions_[record];
+    if (subscription_storage_fixed_)
+      new_record.topic = subscription_topics_ + record * subscription_topic_size_;
+    else
+      new_record.topic = new char[strlen(full_topic) + 1];
+    strcpy(new_record.topic, full_topic);
+    new_record.qos = qos;
+    new_record.pending = true;
+    new_record.removed = false;
+    new_record.coalesce = false;
+    subscription_count_++;
+    insertTopicTrie(record);
+  }
+  else if (subscriptions_[record].qos != qos)
+  {
+    subscriptions_[record].qos = qos;
+    subscriptions_[record].pending = true;
+  }
+
+  EspHomeClientSubscriptionRecord &subscription = subscriptions_[record];
+  subscription.callback = message_received_callback;
+  subscription.callback_ref = message_received_callback_ref;
+  subscription.stream_callback = message_stream_callback;
+
+  // Already subscribed on the current connection
+  if (!subscription.pending)
+    return true;
+
+  // Sent with the other subscriptions once connected
+  if (!isConnected())
+  {
+    ESPHOMECLIENT_LOG_DEBUG("MQTT: Registered [%s], subscribing once connected\n", full_topic);
+
+    return true;
+  }
+
+  // Sent alone, the other subscriptions are made already
+  sendPendingSubscriptions();
+  if (subscription.pending)
+    return false;
+
+  ESPHOMECLIENT_LOG_INFO("MQTT: Subscribed to [%s]\n", subscription.topic);
+
+  return true;
+}
+
+void EspHomeClient::deferSubscription(const char *full_topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos)
+{
+  // The last subscription to a topic wins, like when registered right away
+  cancelDeferredSubscription(full_topic);
+
+  EspHomeClientDeferredSubscription *deferred = new EspHomeClientDeferredSubscription();
+  deferred->record.topic = new char[strlen(full_topic) + 1];
+  strcpy(deferred->record.topic, full_topic);
+  deferred->record.callback = message_received_callback;
+  deferred->record.callback_ref = message_received_callback_ref;
+  deferred->record.stream_callback = message_stream_callback;
+  deferred->record.qos = qos;
+  deferred->next = NULL;
+
+  EspHomeClientDeferredSubscription **last = &deferred_subscriptions_;
+  while (*last != NULL)
+    last = &(*last)->next;
+  *last = deferred;
+}
+
+// Forget the deferred subscriptions to full_topic, all of them when NULL
+void EspHomeClient::cancelDeferredSubscription(const char *full_topic)
+{
+  EspHomeClientDeferredSubscription **link = &deferred_subscriptions_;
+  while (*link != NULL)
+  {
+    EspHomeClientDeferredSubscription *deferred = *link;
+    if (full_topic != NULL && strcmp(deferred->record.topic, full_topic) != 0)
+    {
+      link = &deferred->next;
+      continue;
+    }
+
+    *link = deferred->next;
+    delete[] deferred->record.topic;
+    delete deferred;
+  }
+}
+
+/**
+ * Make sure there is room for one more subscription, growing the heap storage if needed
+ *
+ * @return false when the fixed capacity storage is full
+ */
+bool EspHomeClient::hasSubscriptionCapacity(const char *full_topic)
+{
+  // Worst case, every level of the topic needs a new trie node
+  uint16_t levels = 1;
+  for (const char *c = full_topic; *c != '\0'; c++)
+    if (*c == '/')
+      levels++;
+
+  if (subscription_storage_fixed_)
+    return subscription_count_ < subscription_capacity_ &&
+           strlen(full_topic) < subscription_topic_size_ &&
+           topic_trie_size_ + levels <= topic_trie_capacity_;
+
+  if (subscription_count_ == subscription_capacity_)
+  {
+    uint16_t capacity = max(4, subscription_capacity_ * 2);
+    EspHomeClientSubscriptionRecord *subscriptions = new EspHomeClientSubscriptionRecord[capacity];
+    for (uint16_t i = 0; i < subscription_count_; i++)
+      subscriptions[i] = std::move(subscriptions_[i]);
+
+    delete[] subscriptions_;
+    subscriptions_ = subscriptions;
+    subscription_capacity_ = capacity;
+  }
+
+  return true;
+}
+
+int EspHomeClient::findSubscription(const char *full_topic)
+{
+  for (uint16_t i = 0; i < subscription_count_; i++)
+  {
+    if (!subscriptions_[i].removed && strcmp(subscriptions_[i].topic, full_topic) == 0)
+      return i;
   }
 
-  // It's time to  connect to the MQTT broker
-  else if (isWifiConnected() && next_mqtt_connection_attempt_millis_ > 0 && millis() >= next_mqtt_connection_attempt_millis_)
+  return -1;
+}
+
+// A queued message is replaced by the next one on its topic when every subscription it matches allows it
+bool EspHomeClient::coalescesCommands(const char *topic)
+{
+  bool matched = false;
+  for (uint16_t i = 0; i < subscription_count_; i++)
   {
-    // Connect to MQTT broker
-    if (connectToMqttBroker())
+    const EspHomeClientSubscriptionRecord &record = subscriptions_[i];
+    if (record.removed || !mqttTopicMatch(record.topic, topic))
+      continue;
+    if (!record.coalesce)
+      return false;
+    matched = true;
+  }
+
+  return matched;
+}
+
+void EspHomeClient::removeSubscription(uint16_t record)
+{
+  // During a dispatch, the record indexes used by the trie must stay valid and the callback running may be
+  // the one removed. The record is dropped once the dispatch is over.
+  subscriptions_[record].removed = true;
+
+  if (topic_trie_dispatching_)
+    topic_trie_dirty_ = true;
+  else
+  {
+    compactSubscriptions();
+    rebuildTopicTrie();
+  }
+}
+
+// Drop the removed records, the last records take their place
+void EspHomeClient::compactSubscriptions()
+{
+  uint16_t i = 0;
+  while (i < subscription_count_)
+  {
+    if (!subscriptions_[i].removed)
     {
-      failed_mqtt_connection_attempt_count_ = 0;
-      next_mqtt_connection_attempt_millis_ = 0;
+      i++;
+      continue;
     }
+
+    EspHomeClientSubscriptionRecord &last = subscriptions_[subscription_count_ - 1];
+    if (subscription_storage_fixed_)
+      strcpy(subscriptions_[i].topic, last.topic);
     else
     {
-      // Connection failed, plan another connection attempt
-      next_mqtt_connection_attempt_millis_ = millis() + mqtt_reconnection_attempt_delay_;
-      mqtt_client_.disconnect();
-      failed_mqtt_connection_attempt_count_++;
-
-      if (enable_serial_logs_)
-        Serial.printf("MQTT!: Failed MQTT connection count: %i \n", failed_mqtt_connection_attempt_count_);
-
-      // When there is too many failed attempt, sometimes it help to reset the WiFi connection or to restart the board.
-      if (failed_mqtt_connection_attempt_count_ == 8)
-      {
-        if (enable_serial_logs_)
-          Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting WiFi ...");
+      delete[] subscriptions_[i].topic;
+      subscriptions_[i].topic = last.topic;
+      last.topic = NULL;
+    }
+    subscriptions_[i].callback = std::move(last.callback);
+    subscriptions_[i].callback_ref = last.callback_ref;
+    subscriptions_[i].stream_callback = std::move(last.stream_callback);
+    subscriptions_[i].qos = last.qos;
+    subscriptions_[i].pending = last.pending;
+    subscriptions_[i].removed = last.removed;
+    subscriptions_[i].coalesce = last.coalesce;
+
+    last.callback = NULL;
+    last.callback_ref = MessageReceivedViewCallbackRef();
+    last.stream_callback = NULL;
+    subscription_count_--;
+  }
+}
 
-        WiFi.disconnect(true);
-        next_wifi_connection_attempt_millis_ = millis() + 500;
+/**
+ * Send the subscriptions not made on the current connection yet, packing as many topic filters
+ * as the packet size allows in each SUBSCRIBE packet
+ */
+void EspHomeClient::sendPendingSubscriptions()
+{
+  uint8_t *packet = (uint8_t *)topic_buffer_;
+  // Room for the largest fixed header and the packet identifier, the fixed header is written once the length is known
+  const size_t entries_position = MQTT_MAX_HEADER_SIZE + 2;
+  size_t position = entries_position;
+  unsigned int topic_count = 0;
+  unsigned int packet_count = 0;
+
+  for (uint16_t i = 0; i < subscription_count_; i++)
+  {
+    EspHomeClientSubscriptionRecord &subscription = subscriptions_[i];
+    if (subscription.removed || !subscription.pending)
+      continue;
 
-        if (!drastic_reset_on_connection_failures_)
-          failed_mqtt_connection_attempt_count_ = 0;
-      }
-      else if (drastic_reset_on_connection_failures_ && failed_mqtt_connection_attempt_count_ == 12) // Will reset after 12 failed attempt (3 minutes of retry)
-      {
-        if (enable_serial_logs_)
-          Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting board ...");
+    size_t entry_length = 2 + strlen(subscription.topic) + 1;
+    if (entries_position + entry_length > topic_buffer_size_)
+    {
+      ESPHOMECLIENT_LOG_ERROR("MQTT! Topic filter [%s] too long for a SUBSCRIBE packet, see setMaxPacketSize()\n", subscription.topic);
+      continue;
+    }
 
-#ifdef ESP8266
-        ESP.reset();
-#else
-        ESP.restart();
-#endif
-      }
+    if (position + entry_length > topic_buffer_size_)
+    {
+      if (!sendSubscribePacket(packet, position))
+        return;
+      packet_count++;
+      position = entries_position;
     }
+
+    position = writeMqttString(packet, position, subscription.topic);
+    packet[position++] = subscription.qos;
+    subscription.pending = false;
+    topic_count++;
   }
 
-  /**** Detect and return if there was a change in the MQTT state ****/
-  if (mqtt_connected_ != is_mqtt_connected)
+  if (position > entries_position)
   {
-    mqtt_connected_ = is_mqtt_connected;
-    return true;
+    if (!sendSubscribePacket(packet, position))
+      return;
+    packet_count++;
   }
-  else
+
+  if (topic_count > 0)
+    ESPHOMECLIENT_LOG_INFO("MQTT: Subscribed to %u topics in %u packets\n", topic_count, packet_count);
+}
+
+// Complete the fixed header and packet identifier of a SUBSCRIBE packet built by sendPendingSubscriptions() and send it
+bool EspHomeClient::sendSubscribePacket(uint8_t *packet, size_t length)
+{
+  if (writeIdentifiedPacket(MQTTSUBSCRIBE | MQTTQOS1, packet, length))
+    return true;
+
+  // The connection is broken, everything is sent again on the next one
+  ESPHOMECLIENT_LOG_ERROR("MQTT! subscribe failed\n");
+  for (uint16_t i = 0; i < subscription_count_; i++)
+    subscriptions_[i].pending = true;
+
+  return false;
+}
+
+// Send an UNSUBSCRIBE packet for a single topic filter, built in the scratch buffer
+bool EspHomeClient::sendUnsubscribePacket(const char *topic)
+{
+  uint8_t *packet = (uint8_t *)topic_buffer_;
+  size_t position = MQTT_MAX_HEADER_SIZE + 2;
+  if (position + 2 + strlen(topic) > topic_buffer_size_)
     return false;
+
+  position = writeMqttString(packet, position, topic);
+  return writeIdentifiedPacket(MQTTUNSUBSCRIBE | MQTTQOS1, packet, position);
 }
 
-// Initiate a Wifi connection (non-blocking)
-void EspHomeClient::connectToWifi()
+// Write the fixed header and a new packet identifier in front of the variable part of a packet, which starts at
+// MQTT_MAX_HEADER_SIZE + 2, and send it
+bool EspHomeClient::writeIdentifiedPacket(uint8_t type, uint8_t *packet, size_t length)
 {
-  WiFi.mode(WIFI_STA);
-#ifdef ESP32
-  WiFi.setHostname(mqtt_client_name_);
-#else
-  WiFi.hostname(mqtt_client_name_);
-#endif
-  WiFi.begin(wifi_ssid_, wifi_password_);
+  uint16_t packet_id = nextPacketId();
+  packet[MQTT_MAX_HEADER_SIZE] = packet_id >> 8;
+  packet[MQTT_MAX_HEADER_SIZE + 1] = packet_id & 0xFF;
+
+  uint8_t header[MQTT_MAX_HEADER_SIZE];
+  size_t header_length = 0;
+  header[header_length++] = type;
+  size_t remaining_length = length - MQTT_MAX_HEADER_SIZE;
+  do
+  {
+    uint8_t digit = remaining_length % 128;
+    remaining_length /= 128;
+    if (remaining_length > 0)
+      digit |= 0x80;
+    header[header_length++] = digit;
+  } while (remaining_length > 0);
 
-  if (enable_serial_logs_)
-    Serial.printf("\nWiFi: Connecting to %s ... (%fs) \n", wifi_ssid_, millis() / 1000.0);
+  size_t start = MQTT_MAX_HEADER_SIZE - header_length;
+  memcpy(packet + start, header, header_length);
+
+  return mqtt_transport_.writeDirect(packet + start, length - start) == length - start;
 }
 
-// Try to connect to the MQTT broker and return True if the connection is successfull (blocking)
-bool EspHomeClient::connectToMqttBroker()
+// Streamed subscription matching the topic, the first one when several do
+int EspHomeClient::findStreamSubscription(const char *topic)
 {
-  if (enable_serial_logs_)
-    Serial.printf("MQTT: Connecting to broker \"%s\" with client name \"%s\" ... (%fs)", mqtt_broker_, mqtt_client_name_, millis() / 1000.0);
+  for (uint16_t i = 0; i < subscription_count_; i++)
+  {
+    if (!subscriptions_[i].removed && subscriptions_[i].stream_callback != NULL && mqttTopicMatch(subscriptions_[i].topic, topic))
+      return i;
+  }
+
+  return -1;
+}
+
+// Called by the transport with the header of each incoming PUBLISH, the streamed ones never reach PubSubClient
+bool EspHomeClient::onStreamBegin(const char *topic, size_t length)
+{
+  if (findStreamSubscription(topic) < 0)
+    return false;
+
+  ESPHOMECLIENT_LOG_DEBUG("MQTT >> [%s] %u bytes streamed\n", topic, (unsigned int)length);
+  ESPHOMECLIENT_STAT(stats_.messages_in++; stats_.bytes_in += strlen(topic) + length);
 
-  bool success = mqtt_client_.connect(mqtt_client_name_, mqtt_username_, mqtt_password_, mqtt_last_will_topic_, 0, mqtt_last_will_retain_, mqtt_last_will_message_, mqtt_clean_session_);
+  stream_offset_ = 0;
+  stream_length_ = length;
+  return true;
+}
 
-  if (enable_serial_logs_)
+void EspHomeClient::onStreamData(const uint8_t *data, size_t length)
+{
+  // Looked up again for each piece, the callback may unsubscribe
+  const char *topic = mqtt_transport_.streamTopic();
+  int record = findStreamSubscription(topic);
+  if (record >= 0)
   {
-    if (success)
-      Serial.printf(" - ok. (%fs) \n", millis() / 1000.0);
-    else
-    {
-      Serial.printf("unable to connect (%fs), reason: ", millis() / 1000.0);
+    topic_trie_dispatching_ = true;
+    subscriptions_[record].stream_callback(expandTopic(topic), data, length, stream_offset_, stream_length_);
+    finishDispatch();
+  }
 
-      switch (mqtt_client_.state())
-      {
-      case -4:
-        Serial.println("MQTT_CONNECTION_TIMEOUT");
-        break;
-      case -3:
-        Serial.println("MQTT_CONNECTION_LOST");
-        break;
-      case -2:
-        Serial.println("MQTT_CONNECT_FAILED");
-        break;
-      case -1:
-        Serial.println("MQTT_DISCONNECTED");
-        break;
-      case 1:
-        Serial.println("MQTT_CONNECT_BAD_PROTOCOL");
-        break;
-      case 2:
-        Serial.println("MQTT_CONNECT_BAD_CLIENT_ID");
-        break;
-      case 3:
-        Serial.println("MQTT_CONNECT_UNAVAILABLE");
-        break;
-      case 4:
-        Serial.println("MQTT_CONNECT_BAD_CREDENTIALS");
-        break;
-      case 5:
-        Serial.println("MQTT_CONNECT_UNAUTHORIZED");
-        break;
-      }
+  stream_offset_ += length;
+}
 
-      Serial.printf("MQTT: Retrying to connect in %i seconds.\n", mqtt_reconnection_attempt_delay_ / 1000);
-    }
+void EspHomeClient::onStreamEnd(bool complete)
+{
+  // An empty payload is handed out as a single empty piece
+  if (complete && stream_length_ == 0)
+    onStreamData(NULL, 0);
+
+  if (!complete)
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Streamed message cut after %u of %u bytes\n", (unsigned int)stream_offset_, (unsigned int)stream_length_);
+}
+
+void EspHomeClient::mqttMessageReceivedCallback(char *topic, byte *payload, unsigned int length)
+{
+  // The payload is handed to the subscribers as a view on the PubSubClient buffer, or on the command queue slot,
+  // it is neither copied nor terminated
+
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+  stats_.messages_in++;
+  stats_.bytes_in += strlen(topic) + length;
+  if (strlen(topic) + length + 9 >= mqtt_client_.getBufferSize())
+    stats_.messages_at_buffer_limit++;
+#endif
+
+  // Logging
+  ESPHOMECLIENT_LOG_DEBUG("MQTT >> [%s] %.*s\n", topic, (int)length, (const char *)payload);
+
+  // The oversized messages are dispatched right away rather than dropped
+  if (command_queue_.isEnabled() && command_queue_.fits(strlen(topic), length))
+  {
+    if (!command_queue_.push(topic, payload, length, coalescesCommands(topic)))
+      ESPHOMECLIENT_LOG_ERROR("MQTT! Command queue full, [%s] dropped\n", topic);
+    return;
   }
 
-  return success;
+  dispatchMessage(topic, payload, length);
 }
 
-void EspHomeClient::onWiFiConnectionEstablished()
+// Send the message to subscribers
+void EspHomeClient::dispatchMessage(const char *topic, const uint8_t *payload, size_t length)
 {
-  if (enable_serial_logs_)
-    Serial.printf("WiFi: Connected (%fs), ip : %s \n", millis() / 1000.0, WiFi.localIP().toString().c_str());
+  topic_trie_dispatching_ = true;
+  dispatchTopicTrie(0, topic, expandTopic(topic), payload, length);
+  finishDispatch();
 }
 
-void EspHomeClient::onWiFiConnectionLost()
+// Apply the changes the subscriber callbacks made during the dispatch
+void EspHomeClient::finishDispatch()
 {
-  if (enable_serial_logs_)
-    Serial.printf("WiFi! Lost connection (%fs). \n", millis() / 1000.0);
+  topic_trie_dispatching_ = false;
 
-  // If we handle wifi, we force disconnection to clear the last connection
-  if (handle_wifi_)
+  if (topic_trie_dirty_)
   {
-    WiFi.disconnect(true);
+    compactSubscriptions();
+    rebuildTopicTrie();
+  }
+
+  while (deferred_subscriptions_ != NULL)
+  {
+    EspHomeClientDeferredSubscription *deferred = deferred_subscriptions_;
+    deferred_subscriptions_ = deferred->next;
+    EspHomeClientSubscriptionRecord &record = deferred->record;
+    if (!registerSubscription(record.topic, record.callback, record.callback_ref, record.stream_callback, record.qos))
+      ESPHOMECLIENT_LOG_ERROR("MQTT! Subscription to [%s] made by a callback failed\n", record.topic);
+    else if (record.coalesce)
+      subscriptions_[findSubscription(record.topic)].coalesce = true;
+
+    delete[] record.topic;
+    delete deferred;
   }
 }
 
-void EspHomeClient::onMQTTConnectionEstablished()
+void EspHomeClient::processCommandQueue()
 {
-  connection_established_count_++;
-  connection_established_callback_();
+  unsigned long start_micros = micros();
+
+  do
+  {
+    // The slot is released once dispatched, PubSubClient does not receive anything meanwhile
+    const char *topic;
+    const uint8_t *payload;
+    size_t length;
+    command_queue_.front(topic, payload, length);
+    dispatchMessage(topic, payload, length);
+    command_queue_.pop();
+  } while (!command_queue_.isEmpty() && micros() - start_micros < command_queue_budget_micros_);
 }
 
-void EspHomeClient::onMQTTConnectionLost()
+// Reset the dispatch index to its root node and insert every subscription again
+void EspHomeClient::rebuildTopicTrie()
+{
+  topic_trie_dirty_ = false;
+  topic_trie_size_ = 0;
+  addTopicTrieNode(TOPIC_TRIE_NONE, 0, 0);
+
+  for (uint16_t i = 0; i < subscription_count_; i++)
+    insertTopicTrie(i);
+}
+
+// Return false when a fixed capacity trie is full
+bool EspHomeClient::insertTopicTrie(uint16_t record)
+{
+  const char *topic = subscriptions_[record].topic;
+  uint16_t node = 0;
+  uint16_t level_offset = 0;
+
+  while (true)
+  {
+    const char *level = topic + level_offset;
+    const char *level_end = strchr(level, '/');
+    uint16_t level_length = level_end ? level_end - level : strlen(level);
+
+    uint16_t child;
+    if (level_length == 1 && level[0] == '#')
+    {
+      child = topic_trie_[node].hash_child;
+      if (child == TOPIC_TRIE_NONE)
+      {
+        child = addTopicTrieNode(record, level_offset, level_length);
+        if (child == TOPIC_TRIE_NONE)
+          return false;
+        topic_trie_[node].hash_child = child;
+      }
+    }
+    else if (level_length == 1 && level[0] == '+')
+    {
+      child = topic_trie_[node].plus_child;
+      if (child == TOPIC_TRIE_NONE)
+      {
+        child = addTopicTrieNode(record, level_offset, level_length);
+        if (child == TOPIC_TRIE_NONE)
+          return false;
+        topic_trie_[node].plus_child = child;
+      }
+    }
+    else
+    {
+      child = topic_trie_[node].first_child;
+      while (child != TOPIC_TRIE_NONE)
+      {
+        const EspHomeClientTopicTrieNode &candidate = topic_trie_[child];
+        if (candidate.level_length == level_length &&
+            memcmp(subscriptions_[candidate.record].topic + candidate.level_offset, level, level_length) == 0)
+          break;
+        child = candidate.next_sibling;
+      }
+
+      if (child == TOPIC_TRIE_NONE)
+      {
+        child = addTopicTrieNode(record, level_offset, level_length);
+        if (child == TOPIC_TRIE_NONE)
+          return false;
+        topic_trie_[child].next_sibling = topic_trie_[node].first_child;
+        topic_trie_[node].first_child = child;
+      }
+    }
+
+    node = child;
+    if (level_end == NULL)
+      break;
+    level_offset += level_length + 1;
+  }
+
+  topic_trie_[node].subscription = record;
+  return true;
+}
+
+// Return the index of the new node, or TOPIC_TRIE_NONE when a fixed capacity trie is full
+uint16_t EspHomeClient::addTopicTrieNode(uint16_t record, uint16_t level_offset, uint16_t level_length)
 {
-  if (enable_serial_logs_)
+  if (topic_trie_size_ == topic_trie_capacity_)
   {
-    Serial.printf("MQTT! Lost connection (%fs). \n", millis() / 1000.0);
-    Serial.printf("MQTT: Retrying to connect in %i seconds. \n", mqtt_reconnection_attempt_delay_ / 1000);
+    if (subscription_storage_fixed_ || topic_trie_capacity_ == TOPIC_TRIE_NONE)
+      return TOPIC_TRIE_NONE;
+
+    uint16_t capacity = min(max(8, topic_trie_capacity_ * 2), (int)TOPIC_TRIE_NONE);
+    EspHomeClientTopicTrieNode *nodes = new EspHomeClientTopicTrieNode[capacity];
+    memcpy(nodes, topic_trie_, topic_trie_size_ * sizeof(EspHomeClientTopicTrieNode));
+
+    delete[] topic_trie_;
+    topic_trie_ = nodes;
+    topic_trie_capacity_ = capacity;
   }
+
+  topic_trie_[topic_trie_size_] = {record, level_offset, level_length, TOPIC_TRIE_NONE, TOPIC_TRIE_NONE, TOPIC_TRIE_NONE, TOPIC_TRIE_NONE, TOPIC_TRIE_NONE};
+  return topic_trie_size_++;
 }
 
 /**
- * Matching MQTT topics, handling the eventual presence of a single wildcard character
+ * Walk the dispatch index along the levels of a received topic and deliver the message to every matching subscription.
+ * The topic is read in place, no memory is allocated.
  *
- * @param topic1 is the topic may contain a wildcard
- * @param topic2 must not contain wildcards
- * @return true on MQTT topic match, false otherwise
+ * @param node is the index of the trie node matching the levels before level
+ * @param level points to the next level of the received topic, NULL when all levels have been consumed
  */
-bool EspHomeClient::mqttTopicMatch(const String &topic1, const String &topic2)
+void EspHomeClient::dispatchTopicTrie(uint16_t node, const char *level, const char *topic, const uint8_t *payload, size_t length)
 {
-  int i = 0;
+  // Topics beginning with '$' are not matched by a leading wildcard
+  bool wildcards_allowed = (node != 0 || level[0] != '$');
+
+  // A '#' matches the remaining levels, including none of them ("a/#" also matches "a")
+  uint16_t hash_child = topic_trie_[node].hash_child;
+  if (hash_child != TOPIC_TRIE_NONE && wildcards_allowed)
+    deliverToSubscription(topic_trie_[hash_child].subscription, topic, payload, length);
 
-  if ((i = topic1.indexOf('#')) >= 0)
+  if (level == NULL)
   {
-    String t1a = topic1.substring(0, i);
-    String t1b = topic1.substring(i + 1);
-    if ((t1a.length() == 0 || topic2.startsWith(t1a)) &&
-        (t1b.length() == 0 || topic2.endsWith(t1b)))
-      return true;
+    deliverToSubscription(topic_trie_[node].subscription, topic, payload, length);
+    return;
+  }
+
+  const char *level_end = strchr(level, '/');
+  size_t level_length = level_end ? level_end - level : strlen(level);
+  const char *next_level = level_end ? level_end + 1 : NULL;
+
+  for (uint16_t child = topic_trie_[node].first_child; child != TOPIC_TRIE_NONE; child = topic_trie_[child].next_sibling)
+  {
+    const EspHomeClientTopicTrieNode &candidate = topic_trie_[child];
+    if (candidate.level_length == level_length &&
+        memcmp(subscriptions_[candidate.record].topic + candidate.level_offset, level, level_length) == 0)
+      dispatchTopicTrie(child, next_level, topic, payload, length);
   }
-  else if ((i = topic1.indexOf('+')) >= 0)
+
+  if (topic_trie_[node].plus_child != TOPIC_TRIE_NONE && wildcards_allowed)
+    dispatchTopicTrie(topic_trie_[node].plus_child, next_level, topic, payload, length);
+}
+
+void EspHomeClient::deliverToSubscription(uint16_t record, const char *topic, const uint8_t *payload, size_t length)
+{
+  // Records unsubscribed by a callback of the same message are skipped
+  if (record >= subscription_count_ || subscriptions_[record].removed)
+    return;
+
+  EspHomeClientSubscriptionRecord &subscription = subscriptions_[record];
+  if (subscription.callback != NULL || subscription.callback_ref)
   {
-    String t1a = topic1.substring(0, i);
-    String t1b = topic1.substring(i + 1);
+    ESPHOMECLIENT_STAT(unsigned long callback_start_micros = micros());
+    if (subscription.callback_ref)
+      subscription.callback_ref(topic, payload, length);
+    else
+      subscription.callback(topic, payload, length);
 
-    if ((t1a.length() == 0 || topic2.startsWith(t1a)) &&
-        (t1b.length() == 0 || topic2.endsWith(t1b)))
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+    unsigned long callback_duration = micros() - callback_start_micros;
+    stats_.callback_micros += callback_duration;
+    if (callback_duration > stats_.slowest_callback_micros)
     {
-      if (topic2.substring(t1a.length(), topic2.length() - t1b.length()).indexOf('/') == -1)
-        return true;
+      stats_.slowest_callback_micros = callback_duration;
+      strncpy(stats_.slowest_callback_topic, topic, sizeof(stats_.slowest_callback_topic) - 1);
     }
+#endif
   }
-  else
-  {
-    return topic1.equals(topic2);
-  }
+}
 
-  return false;
+// Copy a payload view into a String for the String based callbacks, binary content is kept as is
+String EspHomeClient::payloadToString(const uint8_t *payload, size_t length)
+{
+  String str;
+  str.reserve(length);
+  for (size_t i = 0; i < length; i++)
+    str += (char)payload[i];
+
+  return str;
 }
 
-void EspHomeClient::mqttMessageReceivedCallback(char *topic, byte *payload, unsigned int length)
+/**
+ * Assemble "<prefix>/<client name>/<topic>" in the topic scratch buffer
+ *
+ * @return the full topic, valid until the next call, or NULL when it does not fit in the buffer
+ */
+const char *EspHomeClient::buildFullTopic(TopicType type, const char *topic)
 {
-  // Convert the payload into a String
-  // First, We ensure that we dont bypass the maximum size of the PubSubClient library buffer that originated the payload
-  // This buffer has a maximum length of _mqttClient.getBufferSize() and the payload begin at "headerSize + topicLength + 1"
-  unsigned int str_termination_pos;
-  if (strlen(topic) + length + 9 >= mqtt_client_.getBufferSize())
+  if (topic_aliases_.count() > 0)
+    topic = topic_aliases_.shorten(topic);
+
+  const char *prefix = (topic_device_ != NULL ? topic_device_->topic_prefixes_[type] : topic_prefixes_[type]);
+  size_t prefix_length = strlen(prefix);
+  size_t topic_length = strlen(topic);
+
+  if (prefix_length + topic_length >= topic_buffer_size_)
   {
-    str_termination_pos = length - 1;
+    ESPHOMECLIENT_LOG_ERROR("MQTT! Topic [%s%s] is too long, see setMaxPacketSize().\n", prefix, topic);
 
-    if (enable_serial_logs_)
-      Serial.print("MQTT! Your message may be truncated, please set setMaxPacketSize() to a higher value.\n");
+    return NULL;
   }
-  else
-    str_termination_pos = length;
 
-  // Second, we add the string termination code at the end of the payload and we convert it to a String object
-  payload[str_termination_pos] = '\0';
-  String payloadStr((char *)payload);
-  String topicStr(topic);
+  memcpy(topic_buffer_, prefix, prefix_length);
+  memcpy(topic_buffer_ + prefix_length, topic, topic_length + 1);
+  return topic_buffer_;
+}
+
+void EspHomeClient::buildTopicPrefixes(char prefixes[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH], const char *name)
+{
+  for (byte i = 0; i < 3; i++)
+    snprintf(prefixes[i], ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH, "%s/%s/", compact_topics_ ? short_topic_type_names[i] : topic_type_names[i], name);
+}
 
-  // Logging
-  if (enable_serial_logs_)
-    Serial.printf("MQTT >> [%s] %s\n", topic, payloadStr.c_str());
+// Received topic as it would be without the compact topics and the aliases, returned as is when there is nothing to expand
+const char *EspHomeClient::expandTopic(const char *topic)
+{
+  if (!compact_topics_ && topic_aliases_.count() == 0)
+    return topic;
+
+  const char *expanded = expandTopic(topic, topic_prefixes_, mqtt_client_name_);
+  for (EspHomeClientDevice *device = devices_; device != NULL && expanded == NULL; device = device->next_)
+    expanded = expandTopic(topic, device->topic_prefixes_, device->name_);
+
+  return expanded != NULL ? expanded : topic;
+}
 
-  // Send the message to subscribers
-  for (byte i = 0; i < topic_subscription_list_.size(); i++)
+// Expand a topic of the namespace of name, NULL when it is not one or when there is nothing to expand
+const char *EspHomeClient::expandTopic(const char *topic, const char prefixes[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH], const char *name)
+{
+  for (byte i = 0; i < 3; i++)
   {
-    if (mqttTopicMatch(topic_subscription_list_[i].topic, String(topic)))
+    size_t prefix_length = strlen(prefixes[i]);
+    if (strncmp(topic, prefixes[i], prefix_length) != 0)
+      continue;
+
+    const char *suffix = topic_aliases_.expand(topic + prefix_length);
+    if (suffix == NULL)
+    {
+      if (!compact_topics_)
+        return NULL;
+      suffix = topic + prefix_length;
+    }
+
+    size_t size = strlen(topic_type_names[i]) + strlen(name) + strlen(suffix) + 3;
+    if (size > expanded_topic_size_)
     {
-      if (topic_subscription_list_[i].callback != NULL)
-        topic_subscription_list_[i].callback(payloadStr); // Call the callback
-      if (topic_subscription_list_[i].callback_with_topic != NULL)
-        topic_subscription_list_[i].callback_with_topic(topicStr, payloadStr); // Call the callback
+      delete[] expanded_topic_;
+      expanded_topic_size_ = size;
+      expanded_topic_ = new char[expanded_topic_size_];
     }
+
+    snprintf(expanded_topic_, expanded_topic_size_, "%s/%s/%s", topic_type_names[i], name, suffix);
+    return expanded_topic_;
   }
+
+  return NULL;
+}
+
+// ##### Devices ####
+
+EspHomeClientDevice::EspHomeClientDevice(EspHomeClient &client, const char *name) : client_(client)
+{
+  size_t name_size = strlen(name) + 1;
+  name_ = new char[name_size];
+  memcpy(name_, name, name_size);
+  topic_prefixes_[0][0] = topic_prefixes_[1][0] = topic_prefixes_[2][0] = '\0';
+  online_topic_ = NULL;
+  online_message_ = NULL;
+  next_ = NULL;
 }
 
-String EspHomeClient::buildFullTopic(TopicType type, const String &topic)
+EspHomeClientDevice::~EspHomeClientDevice()
 {
-  String prefix;
-  switch (type)
-  {
-  case TopicType::CMND:
-    prefix = "cmnd/";
-    break;
-  case TopicType::STAT:
-    prefix = "stat/";
-    break;
-  case TopicType::TELE:
-    prefix = "tele/";
-    break;
-  }
+  delete[] name_;
+}
+
+bool EspHomeClientDevice::publish(TopicType type, const char *topic, const char *payload, bool retain)
+{
+  return publish(type, topic, (const uint8_t *)payload, strlen(payload), retain);
+}
+
+// The calls below go through the client, the topics it builds meanwhile use the prefixes of the device
+bool EspHomeClientDevice::publish(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain, unsigned long ttl_millis)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.publish(type, topic, payload, length, retain, ttl_millis);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribe(const String &topic, MessageReceivedCallback message_received_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribe(topic, message_received_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribe(const String &topic, MessageReceivedViewCallback message_received_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribe(topic, message_received_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribeRef(const char *topic, MessageReceivedViewCallbackRef message_received_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribeRef(topic, message_received_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribeStream(const String &topic, MessageStreamCallback message_stream_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribeStream(topic, message_stream_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribeFrame(const String &topic, EspHomeClientFrameDecoder &frame_decoder, FrameReceivedCallback frame_received_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribeFrame(topic, frame_decoder, frame_received_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::subscribeCommand(const String &topic, EspHomeClientCommandFields &fields, CommandReceivedCallback command_received_callback, uint8_t qos)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.subscribeCommand(topic, fields, command_received_callback, qos);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::coalesceCommands(const String &topic, bool coalesce)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.coalesceCommands(topic, coalesce);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+bool EspHomeClientDevice::unsubscribe(const String &topic)
+{
+  EspHomeClientDevice *previous = client_.topic_device_;
+  client_.topic_device_ = this;
+  bool success = client_.unsubscribe(topic);
+  client_.topic_device_ = previous;
+  return success;
+}
+
+void EspHomeClientDevice::setOnlineMessage(const char *topic, const char *message)
+{
+  online_topic_ = topic;
+  online_message_ = message;
 
-  String full_topic = prefix + String(mqtt_client_name_) + String("/") + topic;
-  return full_topic;
-}
\ No newline at end of file
+  if (client_.isConnected())
+    publish(TELE, online_topic_, online_message_, true);
+}
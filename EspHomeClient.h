@@ -2,7 +2,21 @@
 #define EspHomeClient_h
 
 #include <PubSubClient.h>
-#include <vector>
+#include "EspHomeClientFunctionRef.h"
+#include "EspHomeClientTransport.h"
+#include "EspHomeClientPublishQueue.h"
+#include "EspHomeClientLog.h"
+#include "EspHomeClientWifiCache.h"
+#include "EspHomeClientDutyCycle.h"
+#include "EspHomeClientReconnectPolicy.h"
+#include "EspHomeClientInflightWindow.h"
+#include "EspHomeClientFrameDecoder.h"
+#include "EspHomeClientTopicAliases.h"
+#include "EspHomeClientTelemetry.h"
+#include "EspHomeClientScheduler.h"
+#include "EspHomeClientCommandQueue.h"
+#include "EspHomeClientBrokerList.h"
+#include "EspHomeClientCommandFields.h"
 
 #ifdef ESP8266
 
@@ -14,11 +28,41 @@
 
 #endif
 
+// Maximum length of the "cmnd/<client name>/" prefixes, including the string termination
+#ifndef ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH
+#define ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH 64
+#endif
+
+// Define ESPHOMECLIENT_ENABLE_STATS to collect the statistics returned by getStats(), they are compiled out otherwise
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+#define ESPHOMECLIENT_STAT(statement) statement
+#else
+#define ESPHOMECLIENT_STAT(statement)
+#endif
+
+#ifndef ESPHOMECLIENT_STATS_HISTORY_LENGTH
+#define ESPHOMECLIENT_STATS_HISTORY_LENGTH 8
+#endif
+
 void onConnectionEstablished();
 
 typedef std::function<void()> ConnectionEstablishedCallback;
+typedef std::function<void()> BeforeSleepCallback;
 typedef std::function<void(const String &message)> MessageReceivedCallback;
 typedef std::function<void(const String &topicStr, const String &message)> MessageReceivedCallbackWithTopic;
+// Zero-copy view on the received message, topic and payload are only valid for the duration of the callback.
+// The payload is not NUL terminated and can hold binary data.
+typedef std::function<void(const char *topic, const uint8_t *payload, size_t length)> MessageReceivedViewCallback;
+// Non-allocating reference to a view callback, the referenced callable must outlive the subscription
+typedef EspHomeClientFunctionRef<void(const char *topic, const uint8_t *payload, size_t length)> MessageReceivedViewCallbackRef;
+// Payload streamed in pieces as it is received, offset + length == total_length on the last piece
+typedef std::function<void(const char *topic, const uint8_t *data, size_t length, size_t offset, size_t total_length)> MessageStreamCallback;
+// A complete binary LED frame has been decoded into the pixel buffer
+typedef std::function<void()> FrameReceivedCallback;
+// A command has been parsed into the bound fields, bit i of fields_present is set for the i-th registered field it carried
+typedef std::function<void(uint32_t fields_present)> CommandReceivedCallback;
+// End of a QoS 1 publish, delivered is false when it was dropped after too many retransmissions
+typedef std::function<void(uint16_t packet_id, bool delivered)> PublishCompletedCallback;
 
 enum TopicType
 {
@@ -27,7 +71,109 @@ enum TopicType
     TELE
 };
 
-class EspHomeClient
+struct EspHomeClientStats
+{
+    // loop() duration
+    unsigned long loop_count;
+    unsigned long loop_min_micros;
+    unsigned long loop_max_micros;
+    unsigned long long loop_total_micros;
+    unsigned long long handle_wifi_micros;
+    unsigned long long handle_mqtt_micros;
+
+    // Traffic
+    unsigned long messages_in;
+    unsigned long messages_out;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long messages_at_buffer_limit; // Received messages that filled the PubSubClient buffer, bigger ones are dropped by PubSubClient
+
+    // Connections
+    unsigned int wifi_connections;
+    unsigned int mqtt_connections;
+    uint8_t failed_mqtt_connection_attempts[ESPHOMECLIENT_STATS_HISTORY_LENGTH]; // Failed attempts before each of the last MQTT connections, most recent first
+
+    // Subscriber callbacks
+    unsigned long long callback_micros;
+    unsigned long slowest_callback_micros;
+    char slowest_callback_topic[64];
+
+    uint32_t min_free_heap;
+};
+
+// Subscription storage, see EspHomeClientT for the fixed capacity variant
+struct EspHomeClientSubscriptionRecord
+{
+    char *topic;
+    MessageReceivedViewCallback callback;
+    MessageReceivedViewCallbackRef callback_ref; // Set instead of callback by subscribeRef(), kept as is rather than wrapped
+    MessageStreamCallback stream_callback; // Set instead of callback for the streamed subscriptions
+    uint8_t qos;
+    bool pending; // SUBSCRIBE not sent yet on the current connection
+    bool removed; // Unsubscribed during a dispatch, removed once the dispatch is over
+    bool coalesce; // Queued messages replaced by the newer ones, see coalesceCommands()
+};
+
+// Subscription made by a callback during a dispatch, registered once the dispatch is over
+struct EspHomeClientDeferredSubscription
+{
+    EspHomeClientSubscriptionRecord record; // Full topic on the heap
+    EspHomeClientDeferredSubscription *next;
+};
+
+// Subscription dispatch index, one node per topic level. Nodes live in a flat array and reference each
+// other by index, the level text is not copied but points into the topic of the record that created it.
+struct EspHomeClientTopicTrieNode
+{
+    uint16_t record;       // Subscription record whose topic holds the text of this level
+    uint16_t level_offset; // Start of this level inside the record topic
+    uint16_t level_length;
+    uint16_t subscription; // Subscription record ending at this node, or TOPIC_TRIE_NONE
+    uint16_t first_child;  // Literal children
+    uint16_t next_sibling;
+    uint16_t plus_child;   // '+' edge
+    uint16_t hash_child;   // '#' edge
+};
+
+class EspHomeClient;
+
+// Logical device sharing the connection of an EspHomeClient, with its own "cmnd/<name>/", "stat/<name>/" and
+// "tele/<name>/" topics. Its subscriptions go to the dispatch index of the client. Created by EspHomeClient::device(),
+// it lives as long as the client.
+class EspHomeClientDevice
+{
+private:
+    EspHomeClient &client_;
+    char *name_;
+    char topic_prefixes_[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH];
+    const char *online_topic_;
+    const char *online_message_;
+    EspHomeClientDevice *next_;
+
+    friend class EspHomeClient;
+
+public:
+    EspHomeClientDevice(EspHomeClient &client, const char *name);
+    ~EspHomeClientDevice();
+
+    inline const char *getName() const { return name_; };
+
+    bool publish(TopicType type, const char *topic, const char *payload, bool retain = false);
+    bool publish(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain = false, unsigned long ttl_millis = 0);
+    bool subscribe(const String &topic, MessageReceivedCallback message_received_callback, uint8_t qos = 0);
+    bool subscribe(const String &topic, MessageReceivedViewCallback message_received_callback, uint8_t qos = 0);
+    bool subscribeRef(const char *topic, MessageReceivedViewCallbackRef message_received_callback, uint8_t qos = 0);
+    bool subscribeStream(const String &topic, MessageStreamCallback message_stream_callback, uint8_t qos = 0);
+    bool subscribeFrame(const String &topic, EspHomeClientFrameDecoder &frame_decoder, FrameReceivedCallback frame_received_callback, uint8_t qos = 0);
+    bool subscribeCommand(const String &topic, EspHomeClientCommandFields &fields, CommandReceivedCallback command_received_callback, uint8_t qos = 0);
+    bool coalesceCommands(const String &topic, bool coalesce = true);
+    bool unsubscribe(const String &topic);
+    // Published retained to "tele/<name>/<topic>" at each connection. MQTT allows one last will per connection,
+    // the one of the client (see enableLastWillMessage()) stands for all its devices
+    void setOnlineMessage(const char *topic, const char *message);
+};
+
+class EspHomeClient : private EspHomeClientStreamListener
 {
 private:
     // Wifi
@@ -36,17 +182,35 @@ private:
     bool connecting_to_wifi_;
     unsigned long last_wifi_connection_attempt_millis_;
     unsigned long next_wifi_connection_attempt_millis_;
-    unsigned int wifi_reconnection_attempt_delay_;
+    unsigned int wifi_reconnection_attempt_delay_; // Time given to a connection attempt
+    unsigned int failed_wifi_connection_attempt_count_;
+    ReconnectPolicy wifi_reconnect_policy_;
     const char *wifi_ssid_;
     const char *wifi_password_;
     WiFiClient wifi_client_;
+    bool wifi_fast_connect_;
+    bool wifi_fast_connecting_; // The connection in progress reuses the cached access point and IP configuration
+    bool wifi_static_ip_configured_;
+    unsigned int wifi_fast_connect_timeout_;
+    EspHomeClientWifiCache wifi_cache_;
+    WifiConnectionStats wifi_connection_stats_;
+
+    // Network client the MQTT connection goes through, wifi_client_ unless another one is set
+    Client *network_client_;
+#ifdef ESP8266
+    BearSSL::WiFiClientSecure *tls_client_;
+    BearSSL::Session *tls_session_; // Kept across reconnections so that the handshake resumes it
+#endif
+    TransportStats transport_stats_;
 
     // MQTT
     bool mqtt_connected_;
     unsigned long next_mqtt_connection_attempt_millis_;
-    unsigned int mqtt_reconnection_attempt_delay_;
-    const char *mqtt_broker_;
-    const short mqtt_port_;
+    ReconnectPolicy mqtt_reconnect_policy_;
+    const char *mqtt_broker_; // Active broker
+    short mqtt_port_;
+    EspHomeClientBrokerList broker_list_;
+    bool broker_failback_; // The next connection attempt tries the preferred broker again
     const char *mqtt_username_;
     const char *mqtt_password_;
     const char *mqtt_client_name_;
@@ -55,22 +219,118 @@ private:
     char *mqtt_last_will_message_;
     bool mqtt_last_will_retain_;
     unsigned int failed_mqtt_connection_attempt_count_;
+    uint16_t mqtt_keep_alive_;
+    bool mqtt_stream_keep_alive_; // Keepalive of PubSubClient set aside during a streamed payload, see keepStreamAlive()
+    uint32_t mqtt_stream_packet_count_;
+    unsigned long mqtt_stream_ping_millis_;
+    EspHomeClientTransport mqtt_transport_;
     PubSubClient mqtt_client_;
 
-    struct TopicSubscriptionRecord
+    // Connection setup, advanced by handleMQTT() one phase per loop() call
+    enum MqttConnectionPhase
     {
-        String topic;
-        MessageReceivedCallback callback;
-        MessageReceivedCallbackWithTopic callback_with_topic;
+        MQTT_PHASE_IDLE,
+        MQTT_PHASE_RESOLVING,       // DNS lookup of the broker
+        MQTT_PHASE_TCP_CONNECTING,  // TCP connection to the broker
+        MQTT_PHASE_SENDING_CONNECT, // TCP connection established, CONNECT packet to be sent
+        MQTT_PHASE_AWAITING_CONNACK // CONNECT packet sent, waiting for the CONNACK packet
     };
-    std::vector<TopicSubscriptionRecord> topic_subscription_list_;
+    MqttConnectionPhase mqtt_connection_phase_;
+    unsigned long mqtt_connection_attempt_millis_;
+    unsigned long mqtt_connect_packet_millis_;
+    unsigned long mqtt_connection_timeout_;
+    unsigned int mqtt_connection_time_budget_;
+    unsigned int mqtt_step_timeout_; // Of the next DNS lookup or TCP connection try, doubled after each one failing
+    unsigned int mqtt_blocking_connect_timeout_; // Steps that cannot be split: TLS handshake, connection of another Client
+    size_t mqtt_connect_packet_length_;
+    bool mqtt_connect_ahead_; // CONNECT sent before PubSubClient's, cleared when PubSubClient does not write the same packet
+    IPAddress mqtt_broker_ip_;
+    bool mqtt_broker_ip_resolved_;
+
+    // Topic prefixes indexed by TopicType, built once at construction, or by enableCompactTopics()
+    char topic_prefixes_[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH];
+    bool compact_topics_;
+    EspHomeClientTopicAliases topic_aliases_;
+    // Logical devices sharing the connection, and the one whose prefixes buildFullTopic() uses (NULL for the client)
+    EspHomeClientDevice *devices_;
+    EspHomeClientDevice *topic_device_;
+    friend class EspHomeClientDevice;
+    // Received topics handed to the subscribers in their long form, grown when a longer one is received
+    char *expanded_topic_;
+    uint16_t expanded_topic_size_;
+    // Scratch buffer the full topics are assembled in, sized like the PubSubClient buffer since no topic can be longer.
+    // Also used to encode the CONNECT packet.
+    char *topic_buffer_;
+    uint16_t topic_buffer_size_;
+
+    // Messages published while disconnected, or behind them
+    EspHomeClientPublishQueue publish_queue_;
+    size_t publish_queue_drain_budget_;
+    unsigned long publish_queue_default_ttl_;
+
+    // QoS 1 messages waiting for their PUBACK
+    EspHomeClientInflightWindow inflight_window_;
+    unsigned long inflight_retry_timeout_;
+    bool inflight_resend_; // Send the whole window again, with the DUP flag, after a reconnection
+    bool inflight_processing_; // A completion callback publishing again must not walk the window meanwhile
+    PublishCompletedCallback publish_completed_callback_;
+
+    // Telemetry channels, created by telemetry() and never removed
+    EspHomeClientTelemetry *telemetry_channels_;
+
+    EspHomeClientScheduler scheduler_;
+
+    // Received messages dispatched from loop() rather than from PubSubClient
+    EspHomeClientCommandQueue command_queue_;
+    unsigned long command_queue_budget_micros_;
+
+    // Subscriptions and dispatch index live in flat arrays. They grow on the heap, unless the storage is
+    // provided by EspHomeClientT in which case their capacity is fixed.
+    EspHomeClientSubscriptionRecord *subscriptions_;
+    uint16_t subscription_count_;
+    uint16_t subscription_capacity_;
+    char *subscription_topics_; // Fixed size topic slots, one per record, NULL when topics are allocated on the heap
+    uint16_t subscription_topic_size_;
+    EspHomeClientTopicTrieNode *topic_trie_;
+    uint16_t topic_trie_size_;
+    uint16_t topic_trie_capacity_;
+    bool subscription_storage_fixed_;
+    static const uint16_t TOPIC_TRIE_NONE = 0xFFFF;
+    bool topic_trie_dispatching_; // Changes made by subscriber callbacks are applied once the dispatch is over
+    bool topic_trie_dirty_;
+    EspHomeClientDeferredSubscription *deferred_subscriptions_; // In order of subscription
+    uint16_t mqtt_packet_id_; // Last identifier given to a QoS 1 PUBLISH, SUBSCRIBE or UNSUBSCRIBE packet
+
+    // Deep sleep duty cycle
+    EspHomeClientDutyCycle duty_cycle_;
+    BeforeSleepCallback before_sleep_callback_;
+
+    // Incoming message being streamed
+    size_t stream_offset_;
+    size_t stream_length_;
 
     // Other
     ConnectionEstablishedCallback connection_established_callback_;
     bool enable_serial_logs_;
+#if ESPHOMECLIENT_LOG_LEVEL > ESPHOMECLIENT_LOG_LEVEL_NONE
+    EspHomeClientLogSink log_sink_;
+#endif
     bool drastic_reset_on_connection_failures_;
     unsigned int connection_established_count_;
 
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+    EspHomeClientStats stats_;
+
+    // Record the duration of a loop() call whatever the return point
+    struct LoopStatsRecorder
+    {
+        EspHomeClient *client;
+        unsigned long start_micros;
+        LoopStatsRecorder(EspHomeClient *client) : client(client), start_micros(micros()) {}
+        ~LoopStatsRecorder() { client->recordLoopDuration(micros() - start_micros); }
+    };
+#endif
+
 public:
     EspHomeClient(
         const char *wifi_ssid,
@@ -88,45 +348,258 @@ public:
         const char *mqtt_client_name = "ESP8266",
         const short mqtt_port = 1883);
 
+    ~EspHomeClient();
+
+protected:
+    // Used by EspHomeClientT to provide fixed capacity storage
+    EspHomeClient(
+        const char *wifi_ssid,
+        const char *wifi_password,
+        const char *mqtt_broker,
+        const char *mqtt_username,
+        const char *mqtt_password,
+        const char *mqtt_client_name,
+        const short mqtt_port,
+        EspHomeClientSubscriptionRecord *subscriptions,
+        uint16_t subscription_capacity,
+        char *subscription_topics,
+        uint16_t subscription_topic_size,
+        EspHomeClientTopicTrieNode *topic_trie_nodes,
+        uint16_t topic_trie_capacity);
+
+public:
+
     // Configuration
-    void enableDebuggingMessages(const bool enabled = true); // Allow to display useful debugging messages. Can be set to false to disable them during program execution
+    void enableDebuggingMessages(const bool enabled = true); // Allow to display useful debugging messages up to ESPHOMECLIENT_LOG_LEVEL. Can be set to false to disable them during program execution
     void enableMQTTPersistence(); // Tell the broker to establish a persistent connection. Disabled by default. Must be called before the first loop() execution
     void enableLastWillMessage(const char* topic, const char* message, const bool retain = false); // Must be set before the first loop() call.
+    void setConnectionTimeBudget(const unsigned int budget_millis) {mqtt_connection_time_budget_ = budget_millis;} // Maximum time a blocking step of the MQTT connection setup may take in one loop() call (100ms by default). A DNS lookup or a TCP connection not completed in time is tried again with twice the time, up to setBlockingConnectTimeout()
+    void setBlockingConnectTimeout(const unsigned int timeout_millis) {mqtt_blocking_connect_timeout_ = timeout_millis;} // Maximum time loop() may block in the connection of a TLS or custom Client, which cannot be split across loop() calls, or in a DNS lookup or TCP connection tried again (5000ms by default)
+    void enableWifiFastConnect(const unsigned int timeout_millis = 5000); // Reconnect to the last access point with the last IP configuration, without scan nor DHCP. Falls back to a full connection after timeout_millis. Must be called before the first loop() execution
+    void enableDeepSleepCycle(const uint64_t sleep_micros, const unsigned long command_wait_millis = 500, const unsigned long max_awake_millis = 15000); // Deep sleep once connected, the publish queue flushed and the retained commands awaited for command_wait_millis, or after max_awake_millis since boot. Enables the WiFi fast connect. On ESP8266 the sleep is capped to ESP.deepSleepMax()
+    void setWifiReconnectPolicy(const ReconnectPolicy &policy) {wifi_reconnect_policy_ = policy;} // Delays between the WiFi connection attempts, see ReconnectPolicy::wifiDefault()
+    void setMqttReconnectPolicy(const ReconnectPolicy &policy) {mqtt_reconnect_policy_ = policy;} // Delays between the MQTT connection attempts and failure thresholds, see ReconnectPolicy::mqttDefault()
+    inline const ReconnectPolicy &getWifiReconnectPolicy() const { return wifi_reconnect_policy_; };
+    inline const ReconnectPolicy &getMqttReconnectPolicy() const { return mqtt_reconnect_policy_; };
+    void setNetworkClient(Client &client); // Any Client in place of the plain WiFiClient, e.g. a WiFiClientSecure on ESP32. Must be called before the first loop() execution
+#ifdef ESP8266
+    // TLS with BearSSL, the session is kept to resume the handshake on reconnection. The broker port is usually 8883.
+    // The handshake blocks loop() until done, up to setBlockingConnectTimeout(). Must be called before the first loop() execution
+    void enableTLS(const uint8_t fingerprint[20]); // Server certificate pinned by its SHA-1 fingerprint
+    void enableTLS(const BearSSL::X509List *trust_anchors); // Certificate chain verified against trust_anchors, which must outlive the client
+#endif
+    // Fallback brokers, tried in order once the earlier ones are down. A later broker is also preferred when its CONNACK round trip is
+    // faster by more than margin_millis (50ms by default). Connected through a fallback, the earlier brokers are tried again every failback_interval_millis
+    bool addBroker(const char *mqtt_broker, const short mqtt_port = 1883); // False when ESPHOMECLIENT_MAX_BROKERS are known
+    void setBrokerSelection(const unsigned long margin_millis, const unsigned long failback_interval_millis = 5 * 60 * 1000);
     void enableDrasticResetOnConnectionFailures() {drastic_reset_on_connection_failures_ = true;} // Can be usefull in special cases where the ESP board hang and need resetting (#59)
 
+    // Keep the messages published while disconnected in a queue of capacity_bytes, allocated once, and send them once connected. Must be called before the first loop() call
+    bool enablePublishQueue(const size_t capacity_bytes, const PublishQueueOverflowPolicy overflow_policy = DROP_OLDEST, const unsigned long default_ttl_millis = 0);
+    void setPublishQueueDrainBudget(const size_t bytes_per_loop) {publish_queue_drain_budget_ = bytes_per_loop;} // Bytes of queued messages sent per loop() call (1024 by default), at least one message is sent
+    inline const PublishQueueStats &getPublishQueueStats() const { return publish_queue_.getStats(); };
+
+    // Allow QoS 1 publishes, up to window_size of them pipelined, kept in capacity_bytes for retransmission. Allocated once
+    bool enableQoS1Publish(const uint8_t window_size = 4, const size_t capacity_bytes = 1024, const unsigned long retry_timeout_millis = 5000);
+    inline void setOnPublishCompletedCallback(PublishCompletedCallback callback) { publish_completed_callback_ = callback; };
+    inline const InflightStats &getInflightStats() const { return inflight_window_.getStats(); };
+
+    // Shorter topics on the wire, both must be set before subscribing or publishing. The subscribers still receive the long topics
+    void enableCompactTopics(const char *short_name = NULL); // "c/<short_name>/", "s/<short_name>/" and "t/<short_name>/" prefixes, short_name is the client name by default
+    bool addTopicAlias(const char *topic, const char *alias); // Send alias in place of topic, e.g. "p" for "present". False when ESPHOMECLIENT_MAX_TOPIC_ALIASES are registered
+    inline const TopicAliasStats &getTopicAliasStats() const { return topic_aliases_.getStats(); };
+
+    // Logical device with its own topics, multiplexed over this connection. Created on the first call for a name
+    EspHomeClientDevice &device(const char *name);
+
+    // Channel publishing the changes of a telemetry value from loop(), created on the first call for a topic.
+    // e.g. client.telemetry("temperature").setMinInterval(1000).setDeadband(0.2).update(21.4);
+    EspHomeClientTelemetry &telemetry(const char *topic, TopicType type = TELE);
+    TelemetryStats getTelemetryStats() const; // Sum of all the channels
+
+    // Copy the received messages into slot_count slots of slot_size bytes, allocated once, and dispatch them from loop() rather than
+    // on reception. Streamed subscriptions are not queued
+    bool enableCommandQueue(const uint16_t slot_count = 8, const uint16_t slot_size = 128, const PublishQueueOverflowPolicy overflow_policy = DROP_OLDEST);
+    // Let a queued message of the subscription to topic be replaced by the next one on its topic, for state commands like
+    // "power" where only the last value matters. Off by default. False when there is no such subscription
+    bool coalesceCommands(const String &topic, bool coalesce = true);
+    void setCommandQueueBudget(const unsigned long budget_micros) {command_queue_budget_micros_ = budget_micros;} // Time the queued messages may take in one loop() call (10ms by default), at least one is dispatched
+    inline const CommandQueueStats &getCommandQueueStats() const { return command_queue_.getStats(); };
+
+    // Tasks run from loop(), in place of delay() in the sketch. Return the task identifier
+    inline uint16_t every(unsigned long interval_millis, ScheduledTaskCallback callback) { return scheduler_.schedule(millis(), interval_millis, interval_millis ? interval_millis : 1, callback); };
+    inline uint16_t after(unsigned long delay_millis, ScheduledTaskCallback callback) { return scheduler_.schedule(millis(), delay_millis, 0, callback); };
+    inline bool cancelTask(uint16_t task_id) { return scheduler_.cancel(task_id); };
+    inline void setTaskTickBudget(unsigned long budget_micros) { scheduler_.setTickBudget(budget_micros); }; // Time the tasks may take in one loop() call (10ms by default), at least one due task runs
+    inline const ScheduledTaskStats *getTaskStats(uint16_t task_id) const { return scheduler_.getTaskStats(task_id); };
+    inline const SchedulerStats &getSchedulerStats() const { return scheduler_.getStats(); };
+
     // Main loop, to call at each sketch loop()
     void loop();
 
     // MQTT
     bool setMaxPacketSize(const uint16_t size); // Pubsubclient >= 2.8; override the default value of MQTT_MAX_PACKET_SIZE
     bool publish(TopicType type, const String &topic, const String &payload, bool retain = false);
+    bool publish(TopicType type, const char *topic, const char *payload, bool retain = false);
+    bool publish(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain = false, unsigned long ttl_millis = 0); // Does not allocate any memory. ttl_millis limits the time spent in the publish queue
+    // Subscriptions can be registered at any time, they are sent again in batches after each (re)connection
+    // QoS 1, return the packet identifier passed to the completion callback, or 0 when the window is full.
+    // Accepted while disconnected, the window is sent once connected.
+    uint16_t publishQoS1(TopicType type, const char *topic, const char *payload, bool retain = false);
+    uint16_t publishQoS1(TopicType type, const char *topic, const uint8_t *payload, size_t length, bool retain = false);
+    // Publish a payload of known length written in pieces, without buffering it whole
+    bool beginPublish(TopicType type, const char *topic, size_t length, bool retain = false);
+    size_t write(const uint8_t *data, size_t length);
+    size_t write(uint8_t data);
+    bool endPublish();
+    // Subscriptions made by a callback are registered once the message is dispatched, unsubscriptions apply right away.
+    // qos is 0 or 1, QoS 2 is rejected
     bool subscribe(const String &topic, MessageReceivedCallback message_received_callback, uint8_t qos = 0);
     bool subscribe(const String &topic, MessageReceivedCallbackWithTopic message_received_callback, uint8_t qos = 0);
+    bool subscribe(const String &topic, MessageReceivedViewCallback message_received_callback, uint8_t qos = 0);
+    bool subscribeRef(const char *topic, MessageReceivedViewCallbackRef message_received_callback, uint8_t qos = 0); // Does not allocate any memory with EspHomeClientT. False for an empty reference
+    bool subscribeStream(const String &topic, MessageStreamCallback message_stream_callback, uint8_t qos = 0); // Payload handed out in ESPHOMECLIENT_STREAM_CHUNK_SIZE pieces, whatever its size
+    bool subscribeFrame(const String &topic, EspHomeClientFrameDecoder &frame_decoder, FrameReceivedCallback frame_received_callback, uint8_t qos = 0); // Binary LED frames decoded while they are received, see EspHomeClientFrameDecoder.h. The decoder must outlive the subscription
+    bool subscribeCommand(const String &topic, EspHomeClientCommandFields &fields, CommandReceivedCallback command_received_callback, uint8_t qos = 0); // JSON payload parsed into the fields, without allocation. The fields must outlive the subscription
     bool unsubscribe(const String &topic);
     void setKeepAlive(uint16_t keep_alive_seconds); // Change the keepalive interval (15 seconds by default)
 
     // Other
     inline bool isConnected() const { return isWifiConnected() && isMqttConnected(); };
     inline bool isWifiConnected() const { return wifi_connected_; };
+    inline const WifiConnectionStats &getWifiConnectionStats() const { return wifi_connection_stats_; };
+    inline const TransportStats &getTransportStats() const { return transport_stats_; };
+    inline const BrokerStatus &getActiveBroker() const { return broker_list_.active(); };
+    inline BrokerSelectionReason getBrokerSelectionReason() const { return broker_list_.reason(); };
+    inline uint8_t getBrokerCount() const { return broker_list_.count(); };
+    inline const BrokerStatus &getBrokerStatus(uint8_t index) const { return broker_list_.broker(index); };
     inline bool isMqttConnected() const { return mqtt_connected_; };
 
+    // MQTT 3.1.1 topic filter matching, usable from callbacks receiving the topic. No memory is allocated
+    static bool mqttTopicMatch(const char *filter, const char *topic);
+    static bool mqttTopicFilterValid(const char *filter);
+
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+    inline const EspHomeClientStats &getStats() const { return stats_; };
+    void resetStats();
+    bool publishStats(); // Publish the statistics as compact JSON on "tele/<client name>/stats"
+#endif
+
     // Default to onConnectionEstablished, you might want to override this for special cases like two MQTT connections in the same sketch
     inline void setOnConnectionEstablishedCallback(ConnectionEstablishedCallback callback) { connection_established_callback_ = callback; };
+    inline void setOnBeforeSleepCallback(BeforeSleepCallback callback) { before_sleep_callback_ = callback; }; // Called right before the deep sleep of a duty cycle
+    inline const DutyCycleStats &getDutyCycleStats() const { return duty_cycle_.getStats(); };
 
 private:
+#if ESPHOMECLIENT_LOG_LEVEL > ESPHOMECLIENT_LOG_LEVEL_NONE
+    void writeLog(const char *format, ...) __attribute__((format(printf, 2, 3)));
+#endif
+
     bool handleWifi();
     bool handleMQTT();
+    void keepStreamAlive();
+    void restoreKeepAlive();
     void onWiFiConnectionEstablished();
     void onWiFiConnectionLost();
     void onMQTTConnectionEstablished();
     void onMQTTConnectionLost();
 
     void connectToWifi();
+    void scheduleWifiConnectionAttempt();
     bool connectToMqttBroker();
-    bool mqttTopicMatch(const String &topic1, const String &topic2);
+    void extendStepTimeout();
+    void scheduleMqttConnectionAttempt();
+    bool abortMqttConnection(const char *reason);
+    bool connectNetworkClient();
+#ifdef ESP8266
+    void createTLSClient();
+#endif
+    size_t buildConnectPacket(uint8_t *buffer, size_t size);
+    static const char *mqttStateName(int state);
     void mqttMessageReceivedCallback(char *topic, byte *payload, unsigned int length);
+    void dispatchMessage(const char *topic, const uint8_t *payload, size_t length);
+    void processCommandQueue();
+
+    bool addSubscription(const char *topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos);
+    bool registerSubscription(const char *full_topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos);
+    void deferSubscription(const char *full_topic, MessageReceivedViewCallback message_received_callback, MessageReceivedViewCallbackRef message_received_callback_ref, MessageStreamCallback message_stream_callback, uint8_t qos);
+    void cancelDeferredSubscription(const char *full_topic);
+    void finishDispatch();
+    int findStreamSubscription(const char *topic);
+    bool onStreamBegin(const char *topic, size_t length) override;
+    void onStreamData(const uint8_t *data, size_t length) override;
+    void onStreamEnd(bool complete) override;
+    bool hasSubscriptionCapacity(const char *full_topic);
+    int findSubscription(const char *full_topic);
+    bool coalescesCommands(const char *topic);
+    void removeSubscription(uint16_t record);
+    void compactSubscriptions();
+    void sendPendingSubscriptions();
+    bool sendSubscribePacket(uint8_t *packet, size_t length);
+    bool sendUnsubscribePacket(const char *topic);
+    bool writeIdentifiedPacket(uint8_t type, uint8_t *packet, size_t length);
+
+    void rebuildTopicTrie();
+    bool insertTopicTrie(uint16_t record);
+    uint16_t addTopicTrieNode(uint16_t record, uint16_t level_offset, uint16_t level_length);
+    void dispatchTopicTrie(uint16_t node, const char *level, const char *topic, const uint8_t *payload, size_t length);
+    void deliverToSubscription(uint16_t record, const char *topic, const uint8_t *payload, size_t length);
+    static String payloadToString(const uint8_t *payload, size_t length);
 
-    String buildFullTopic(TopicType type, const String &topic);
+    const char *buildFullTopic(TopicType type, const char *topic);
+    void buildTopicPrefixes(char prefixes[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH], const char *name);
+    const char *expandTopic(const char *topic);
+    const char *expandTopic(const char *topic, const char prefixes[3][ESPHOMECLIENT_MAX_TOPIC_PREFIX_LENGTH], const char *name);
+    void processPublishQueue();
+    void processInflightWindow();
+    void processTelemetry();
+    bool hasPendingTelemetry() const;
+    uint16_t nextPacketId();
+    void enterDeepSleep();
+
+#ifdef ESPHOMECLIENT_ENABLE_STATS
+    void recordLoopDuration(unsigned long duration_micros);
+#endif
 };
 
-#endif
\ No newline at end of file
+// Storage of EspHomeClientT, inherited before EspHomeClient so that it is constructed first
+template <uint16_t MaxSubscriptions, uint16_t MaxTopicLength, uint16_t MaxTrieNodes>
+struct EspHomeClientStaticStorage
+{
+    EspHomeClientSubscriptionRecord subscriptions[MaxSubscriptions];
+    char subscription_topics[MaxSubscriptions][MaxTopicLength];
+    EspHomeClientTopicTrieNode topic_trie_nodes[MaxTrieNodes];
+};
+
+/**
+ * EspHomeClient with subscriptions stored inline in fixed capacity arrays, so that the memory used by the
+ * subscriptions is known at link time and never allocated. Combine it with subscribeRef() for callbacks.
+ *
+ * @tparam MaxSubscriptions is the maximum number of subscriptions
+ * @tparam MaxTopicLength is the maximum length of a full topic ("cmnd/<client name>/<topic>"), string termination included
+ * @tparam MaxTrieNodes is the size of the dispatch index, one node per distinct topic level
+ */
+template <uint16_t MaxSubscriptions, uint16_t MaxTopicLength = 64, uint16_t MaxTrieNodes = 3 * MaxSubscriptions + 3>
+class EspHomeClientT : private EspHomeClientStaticStorage<MaxSubscriptions, MaxTopicLength, MaxTrieNodes>, public EspHomeClient
+{
+public:
+    EspHomeClientT(
+        const char *wifi_ssid,
+        const char *wifi_password,
+        const char *mqtt_broker,
+        const char *mqtt_client_name = "ESP8266",
+        const short mqtt_port = 1883) : EspHomeClientT(wifi_ssid, wifi_password, mqtt_broker, NULL, NULL, mqtt_client_name, mqtt_port) {}
+
+    EspHomeClientT(
+        const char *wifi_ssid,
+        const char *wifi_password,
+        const char *mqtt_broker,
+        const char *mqtt_username,
+        const char *mqtt_password,
+        const char *mqtt_client_name = "ESP8266",
+        const short mqtt_port = 1883) : EspHomeClient(wifi_ssid, wifi_password, mqtt_broker, mqtt_username, mqtt_password, mqtt_client_name, mqtt_port,
+                                                      this->subscriptions, MaxSubscriptions, this->subscription_topics[0], MaxTopicLength,
+                                                      this->topic_trie_nodes, MaxTrieNodes) {}
+};
+
+#endif
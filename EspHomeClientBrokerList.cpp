@@ -0,0 +1,115 @@
+#include "EspHomeClientBrokerList.h"
+
+EspHomeClientBrokerList::EspHomeClientBrokerList()
+{
+  memset(brokers_, 0, sizeof(brokers_));
+  count_ = 0;
+  active_ = 0;
+  reason_ = BROKER_PREFERRED;
+  active_since_millis_ = 0;
+  active_connected_ = false;
+  preference_margin_millis_ = 50;
+  failback_interval_millis_ = 5 * 60 * 1000;
+
+  // Delays a down broker is skipped for
+  down_policy_ = ReconnectPolicy::mqttDefault();
+  down_policy_.initial_backoff_millis = 30 * 1000;
+  down_policy_.max_backoff_millis = 10 * 60 * 1000;
+  down_policy_.jitter_percent = 20;
+}
+
+bool EspHomeClientBrokerList::add(const char *host, short port)
+{
+  if (count_ == ESPHOMECLIENT_MAX_BROKERS)
+    return false;
+
+  brokers_[count_].host = host;
+  brokers_[count_].port = port;
+  count_++;
+  return true;
+}
+
+bool EspHomeClientBrokerList::isHealthy(uint8_t index, unsigned long now_millis) const
+{
+  const BrokerStatus &broker = brokers_[index];
+  return broker.consecutive_failures < ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES || (long)(now_millis - broker.down_until_millis) >= 0;
+}
+
+const BrokerStatus &EspHomeClientBrokerList::select(unsigned long now_millis, bool failback)
+{
+  // Failing back, the earliest broker is tried whatever its health
+  if (failback && active_ > 0)
+  {
+    active_ = 0;
+    reason_ = BROKER_FAILBACK;
+    return brokers_[active_];
+  }
+
+  int selected = -1;
+  bool earlier_down = false;
+  for (uint8_t i = 0; i < count_; i++)
+  {
+    if (!isHealthy(i, now_millis))
+    {
+      if (selected < 0)
+        earlier_down = true;
+      continue;
+    }
+
+    if (selected < 0)
+    {
+      selected = i;
+      reason_ = earlier_down ? BROKER_FAILOVER : BROKER_PREFERRED;
+      continue;
+    }
+
+    // A later broker has to be measurably faster to be preferred
+    unsigned long selected_rtt = brokers_[selected].connack_rtt_millis;
+    unsigned long rtt = brokers_[i].connack_rtt_millis;
+    if (rtt > 0 && selected_rtt > 0 && rtt + preference_margin_millis_ < selected_rtt)
+    {
+      selected = i;
+      reason_ = BROKER_FASTEST;
+    }
+  }
+
+  // All down, the one coming back first
+  if (selected < 0)
+  {
+    selected = 0;
+    for (uint8_t i = 1; i < count_; i++)
+    {
+      if ((long)(brokers_[i].down_until_millis - brokers_[selected].down_until_millis) < 0)
+        selected = i;
+    }
+    reason_ = BROKER_FAILOVER;
+  }
+
+  active_ = selected;
+  return brokers_[active_];
+}
+
+void EspHomeClientBrokerList::connected(unsigned long now_millis, unsigned long connack_rtt_millis)
+{
+  BrokerStatus &broker = brokers_[active_];
+  broker.connack_rtt_millis = broker.connack_rtt_millis == 0 ? connack_rtt_millis : (broker.connack_rtt_millis * 3 + connack_rtt_millis) / 4;
+  broker.consecutive_failures = 0;
+  broker.connections++;
+  active_since_millis_ = now_millis;
+  active_connected_ = true;
+}
+
+void EspHomeClientBrokerList::failed(unsigned long now_millis)
+{
+  BrokerStatus &broker = brokers_[active_];
+  broker.consecutive_failures++;
+  broker.failures++;
+  if (broker.consecutive_failures >= ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES)
+    broker.down_until_millis = now_millis + down_policy_.delayMillis(broker.consecutive_failures - ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES + 1);
+  active_connected_ = false;
+}
+
+bool EspHomeClientBrokerList::failbackDue(unsigned long now_millis) const
+{
+  return active_connected_ && active_ > 0 && reason_ == BROKER_FAILOVER && now_millis - active_since_millis_ >= failback_interval_millis_;
+}
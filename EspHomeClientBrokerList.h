@@ -0,0 +1,76 @@
+#ifndef EspHomeClientBrokerList_h
+#define EspHomeClientBrokerList_h
+
+#include <Arduino.h>
+#include "EspHomeClientReconnectPolicy.h"
+
+#ifndef ESPHOMECLIENT_MAX_BROKERS
+#define ESPHOMECLIENT_MAX_BROKERS 4
+#endif
+
+// Consecutive failed connections after which a broker is considered down and skipped for a while
+#ifndef ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES
+#define ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES 2
+#endif
+
+// Why the active broker was selected
+enum BrokerSelectionReason
+{
+    BROKER_PREFERRED, // First healthy broker of the list
+    BROKER_FASTEST,   // Healthy like an earlier broker, with a CONNACK round trip faster by more than the preference margin
+    BROKER_FAILOVER,  // The earlier brokers are down
+    BROKER_FAILBACK   // Trying an earlier broker again while connected to a later one
+};
+
+struct BrokerStatus
+{
+    const char *host;
+    short port;
+    unsigned long connack_rtt_millis; // Smoothed CONNECT to CONNACK round trip, 0 until measured
+    unsigned int consecutive_failures;
+    unsigned long down_until_millis;  // Skipped until then, once down
+    unsigned long connections;
+    unsigned long failures;
+};
+
+// Brokers in order of preference, the first one is the one given to the constructor. Each connection attempt
+// updates the health of the broker it went to. A broker failing ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES times
+// in a row is down, it is skipped for a delay growing with its failures. While connected through a failover,
+// the earlier brokers are tried again from time to time.
+class EspHomeClientBrokerList
+{
+private:
+    BrokerStatus brokers_[ESPHOMECLIENT_MAX_BROKERS];
+    uint8_t count_;
+    uint8_t active_;
+    BrokerSelectionReason reason_;
+    unsigned long active_since_millis_; // Connection to the active broker
+    bool active_connected_;
+    unsigned long preference_margin_millis_;
+    unsigned long failback_interval_millis_;
+    ReconnectPolicy down_policy_;
+
+    bool isHealthy(uint8_t index, unsigned long now_millis) const;
+
+public:
+    EspHomeClientBrokerList();
+
+    bool add(const char *host, short port); // False when ESPHOMECLIENT_MAX_BROKERS are known
+    inline uint8_t count() const { return count_; };
+    inline const BrokerStatus &broker(uint8_t index) const { return brokers_[index]; };
+    inline const BrokerStatus &active() const { return brokers_[active_]; };
+    inline uint8_t activeIndex() const { return active_; };
+    inline BrokerSelectionReason reason() const { return reason_; };
+
+    inline void setPreferenceMargin(unsigned long margin_millis) { preference_margin_millis_ = margin_millis; };
+    inline void setFailbackInterval(unsigned long interval_millis) { failback_interval_millis_ = interval_millis; };
+
+    // Pick the broker of the next connection attempt, an earlier one than the active one when failing back
+    const BrokerStatus &select(unsigned long now_millis, bool failback);
+    void connected(unsigned long now_millis, unsigned long connack_rtt_millis);
+    void failed(unsigned long now_millis);
+    void disconnected() { active_connected_ = false; };
+    bool failbackDue(unsigned long now_millis) const; // Connected through a failover for the failback interval
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include "EspHomeClientCommandFields.h"
+#include <ctype.h>
+#include <limits.h>
+
+// Nesting of the skipped values
+#define ESPHOMECLIENT_COMMAND_MAX_DEPTH 8
+
+EspHomeClientCommandFields::EspHomeClientCommandFields()
+{
+  count_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+  position_ = NULL;
+  end_ = NULL;
+}
+
+bool EspHomeClientCommandFields::add(const char *name, FieldType type, void *target, size_t size)
+{
+  if (count_ == ESPHOMECLIENT_MAX_COMMAND_FIELDS)
+    return false;
+
+  fields_[count_++] = {name, type, target, size};
+  return true;
+}
+
+bool EspHomeClientCommandFields::addBool(const char *name, bool *target)
+{
+  return add(name, FIELD_BOOL, target, 0);
+}
+
+bool EspHomeClientCommandFields::addInt(const char *name, long *target)
+{
+  return add(name, FIELD_INT, target, 0);
+}
+
+bool EspHomeClientCommandFields::addFloat(const char *name, float *target)
+{
+  return add(name, FIELD_FLOAT, target, 0);
+}
+
+bool EspHomeClientCommandFields::addString(const char *name, char *target, size_t size)
+{
+  return size > 0 && add(name, FIELD_STRING, target, size);
+}
+
+bool EspHomeClientCommandFields::addColor(const char *name, uint8_t *target)
+{
+  return add(name, FIELD_COLOR, target, 0);
+}
+
+bool EspHomeClientCommandFields::parse(const uint8_t *payload, size_t length, uint32_t &present)
+{
+  position_ = (const char *)payload;
+  end_ = position_ + length;
+  present = 0;
+
+  bool success = true;
+  skipSpaces();
+  if (position_ < end_ && *position_ == '{')
+  {
+    position_++;
+    skipSpaces();
+    if (!expect('}'))
+    {
+      while (success)
+      {
+        // Keys longer than every field name are unknown, they are only skipped
+        char key[32];
+        size_t key_length;
+        skipSpaces();
+        success = parseString(key, sizeof(key), key_length);
+        skipSpaces();
+        success = success && expect(':');
+        skipSpaces();
+        if (!success)
+          break;
+
+        int index = -1;
+        for (uint8_t i = 0; i < count_ && key_length < sizeof(key); i++)
+        {
+          if (strcmp(fields_[i].name, key) == 0)
+          {
+            index = i;
+            break;
+          }
+        }
+
+        if (index >= 0)
+        {
+          success = parseValue(fields_[index], values_[index]);
+          present |= (1ul << index);
+        }
+        else
+          success = skipValue(0);
+
+        skipSpaces();
+        if (!success || expect('}'))
+          break;
+        success = expect(',');
+      }
+    }
+  }
+  else if (count_ > 0 && fields_[0].type == FIELD_STRING && (position_ == end_ || *position_ != '"'))
+  {
+    // Plain text, taken whole
+    size_t text_length = end_ - position_;
+    while (text_length > 0 && isspace((unsigned char)position_[text_length - 1]))
+      text_length--;
+
+    // Checked before anything is copied
+    success = (text_length < fields_[0].size);
+    if (success)
+    {
+      memcpy(fields_[0].target, position_, text_length);
+      ((char *)fields_[0].target)[text_length] = '\0';
+      position_ = end_;
+      present = 1;
+      return parsed(true);
+    }
+  }
+  else if (count_ > 0)
+  {
+    success = parseValue(fields_[0], values_[0]);
+    present = 1;
+  }
+  else
+    success = false;
+
+  skipSpaces();
+  success = success && position_ == end_;
+  if (!success)
+    return parsed(false);
+
+  for (uint8_t i = 0; i < count_; i++)
+  {
+    if (present & (1ul << i))
+      store(fields_[i], values_[i]);
+  }
+  return parsed(true);
+}
+
+bool EspHomeClientCommandFields::parsed(bool success)
+{
+  if (success)
+    stats_.parsed++;
+  else
+    stats_.errors++;
+  return success;
+}
+
+void EspHomeClientCommandFields::skipSpaces()
+{
+  while (position_ < end_ && isspace((unsigned char)*position_))
+    position_++;
+}
+
+bool EspHomeClientCommandFields::expect(char c)
+{
+  if (position_ == end_ || *position_ != c)
+    return false;
+
+  position_++;
+  return true;
+}
+
+bool EspHomeClientCommandFields::parseValue(const Field &field, Value &value)
+{
+  double number;
+  bool integral;
+  size_t length;
+
+  switch (field.type)
+  {
+  case FIELD_BOOL:
+  {
+    bool *target = &value.b;
+    if (position_ < end_ && *position_ == '"')
+    {
+      char text[8];
+      if (!parseString(text, sizeof(text), length) || length >= sizeof(text))
+        return false;
+
+      if (strcasecmp(text, "on") == 0 || strcasecmp(text, "true") == 0 || strcmp(text, "1") == 0)
+        *target = true;
+      else if (strcasecmp(text, "off") == 0 || strcasecmp(text, "false") == 0 || strcmp(text, "0") == 0)
+        *target = false;
+      else
+        return false;
+      return true;
+    }
+
+    if (parseWord("true") || parseWord("ON") || parseWord("on"))
+      *target = true;
+    else if (parseWord("false") || parseWord("OFF") || parseWord("off"))
+      *target = false;
+    else if (parseNumber(number, integral) && integral && (number == 0 || number == 1))
+      *target = (number == 1);
+    else
+      return false;
+    return true;
+  }
+
+  case FIELD_INT:
+    if (!parseNumber(number, integral) || !integral || number < LONG_MIN || number > LONG_MAX)
+      return false;
+    value.i = (long)number;
+    return true;
+
+  case FIELD_FLOAT:
+    if (!parseNumber(number, integral))
+      return false;
+    value.f = (float)number;
+    return true;
+
+  case FIELD_STRING:
+    // Only checked here, decoded into the target by store()
+    value.string = position_;
+    return parseString(NULL, 0, length) && length < field.size;
+
+  case FIELD_COLOR:
+    return parseColor(value.color);
+  }
+
+  return false;
+}
+
+// Copy a value of a payload parsed whole into the bound member
+void EspHomeClientCommandFields::store(const Field &field, const Value &value)
+{
+  size_t length;
+
+  switch (field.type)
+  {
+  case FIELD_BOOL:
+    *(bool *)field.target = value.b;
+    break;
+  case FIELD_INT:
+    *(long *)field.target = value.i;
+    break;
+  case FIELD_FLOAT:
+    *(float *)field.target = value.f;
+    break;
+  case FIELD_STRING:
+    position_ = value.string;
+    parseString((char *)field.target, field.size, length);
+    break;
+  case FIELD_COLOR:
+    memcpy(field.target, value.color, 3);
+    break;
+  }
+}
+
+bool EspHomeClientCommandFields::parseString(char *buffer, size_t size, size_t &length)
+{
+  length = 0;
+  if (!expect('"'))
+    return false;
+
+  while (position_ < end_)
+  {
+    char c = *position_++;
+    if (c == '"')
+    {
+      if (buffer != NULL)
+        buffer[min(length, size - 1)] = '\0';
+      return true;
+    }
+
+    if ((unsigned char)c < 0x20)
+      return false;
+
+    if (c == '\\')
+    {
+      if (position_ == end_)
+        return false;
+
+      c = *position_++;
+      switch (c)
+      {
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case '"':
+      case '\\':
+      case '/':
+        break;
+      case 'u':
+      {
+        // Only ASCII is kept, the other code points become '?'
+        if (end_ - position_ < 4)
+          return false;
+        unsigned int code = 0;
+        for (byte i = 0; i < 4; i++)
+        {
+          char digit = *position_++;
+          if (!isxdigit((unsigned char)digit))
+            return false;
+          code = code * 16 + (isdigit((unsigned char)digit) ? digit - '0' : (tolower(digit) - 'a' + 10));
+        }
+        c = (code < 0x80) ? (char)code : '?';
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+
+    if (buffer != NULL && length < size - 1)
+      buffer[length] = c;
+    length++;
+  }
+
+  return false;
+}
+
+bool EspHomeClientCommandFields::parseNumber(double &value, bool &integral)
+{
+  const char *start = position_;
+  bool negative = expect('-');
+
+  value = 0;
+  integral = true;
+  if (position_ == end_ || !isdigit((unsigned char)*position_))
+  {
+    position_ = start;
+    return false;
+  }
+  while (position_ < end_ && isdigit((unsigned char)*position_))
+    value = value * 10 + (*position_++ - '0');
+
+  if (expect('.'))
+  {
+    integral = false;
+    double scale = 0.1;
+    if (position_ == end_ || !isdigit((unsigned char)*position_))
+      return false;
+    while (position_ < end_ && isdigit((unsigned char)*position_))
+    {
+      value += (*position_++ - '0') * scale;
+      scale /= 10;
+    }
+  }
+
+  if (position_ < end_ && (*position_ == 'e' || *position_ == 'E'))
+  {
+    position_++;
+    integral = false;
+    bool negative_exponent = expect('-');
+    if (!negative_exponent)
+      expect('+');
+    if (position_ == end_ || !isdigit((unsigned char)*position_))
+      return false;
+
+    int exponent = 0;
+    while (position_ < end_ && isdigit((unsigned char)*position_))
+      exponent = min(exponent * 10 + (*position_++ - '0'), 400);
+    for (int i = 0; i < exponent; i++)
+      value = negative_exponent ? value / 10 : value * 10;
+  }
+
+  if (negative)
+    value = -value;
+  return true;
+}
+
+// A bare word, not followed by other letters
+bool EspHomeClientCommandFields::parseWord(const char *word)
+{
+  size_t length = strlen(word);
+  if ((size_t)(end_ - position_) < length || memcmp(position_, word, length) != 0)
+    return false;
+  if (position_ + length < end_ && isalnum((unsigned char)position_[length]))
+    return false;
+
+  position_ += length;
+  return true;
+}
+
+bool EspHomeClientCommandFields::parseColor(uint8_t *color)
+{
+  if (position_ < end_ && *position_ == '"')
+  {
+    char text[8];
+    size_t length;
+    if (!parseString(text, sizeof(text), length) || length != 7 || text[0] != '#')
+      return false;
+
+    for (byte i = 0; i < 6; i++)
+    {
+      if (!isxdigit((unsigned char)text[1 + i]))
+        return false;
+    }
+    for (byte i = 0; i < 3; i++)
+    {
+      char pair[3] = {text[1 + 2 * i], text[2 + 2 * i], '\0'};
+      color[i] = (uint8_t)strtoul(pair, NULL, 16);
+    }
+    return true;
+  }
+
+  if (!expect('['))
+    return false;
+
+  for (byte i = 0; i < 3; i++)
+  {
+    double number;
+    bool integral;
+    skipSpaces();
+    if (!parseNumber(number, integral) || !integral || number < 0 || number > 255)
+      return false;
+    color[i] = (uint8_t)number;
+    skipSpaces();
+    if (!expect(i < 2 ? ',' : ']'))
+      return false;
+  }
+
+  return true;
+}
+
+bool EspHomeClientCommandFields::skipValue(uint8_t depth)
+{
+  if (position_ == end_ || depth > ESPHOMECLIENT_COMMAND_MAX_DEPTH)
+    return false;
+
+  size_t length;
+  double number;
+  bool integral;
+
+  switch (*position_)
+  {
+  case '"':
+    return parseString(NULL, 0, length);
+
+  case '{':
+  case '[':
+  {
+    bool object = (*position_++ == '{');
+    char close = object ? '}' : ']';
+    skipSpaces();
+    if (expect(close))
+      return true;
+
+    while (true)
+    {
+      skipSpaces();
+      if (object)
+      {
+        if (!parseString(NULL, 0, length))
+          return false;
+        skipSpaces();
+        if (!expect(':'))
+          return false;
+        skipSpaces();
+      }
+      if (!skipValue(depth + 1))
+        return false;
+      skipSpaces();
+      if (expect(close))
+        return true;
+      if (!expect(','))
+        return false;
+    }
+  }
+
+  default:
+    return parseWord("true") || parseWord("false") || parseWord("null") || parseNumber(number, integral);
+  }
+}
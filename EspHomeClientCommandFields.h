@@ -0,0 +1,89 @@
+#ifndef EspHomeClientCommandFields_h
+#define EspHomeClientCommandFields_h
+
+#include <Arduino.h>
+
+#ifndef ESPHOMECLIENT_MAX_COMMAND_FIELDS
+#define ESPHOMECLIENT_MAX_COMMAND_FIELDS 8
+#endif
+
+struct CommandFieldsStats
+{
+    unsigned long parsed;
+    unsigned long errors; // Malformed payloads, or values not matching their field
+};
+
+// Fields of a JSON command, each one bound to a member of a struct owned by the caller. The payload is parsed in a
+// single pass, nothing is allocated. The values are held aside and only copied into the bound members once the whole
+// payload is parsed, the strings are decoded again from the payload then. Unknown keys are skipped, whatever their value.
+// A payload which is not a JSON object, e.g. "ON", is parsed as the value of the first field.
+// The field names must outlive the fields, string literals usually.
+class EspHomeClientCommandFields
+{
+private:
+    enum FieldType
+    {
+        FIELD_BOOL,  // true/false, 1/0 or "ON"/"OFF"
+        FIELD_INT,
+        FIELD_FLOAT,
+        FIELD_STRING,
+        FIELD_COLOR  // "#RRGGBB" or [r, g, b]
+    };
+
+    struct Field
+    {
+        const char *name;
+        FieldType type;
+        void *target;
+        size_t size; // Strings only, including the termination
+    };
+
+    // Value of a field parsed from the current payload
+    union Value
+    {
+        bool b;
+        long i;
+        float f;
+        uint8_t color[3];
+        const char *string; // Opening quote in the payload
+    };
+
+    Field fields_[ESPHOMECLIENT_MAX_COMMAND_FIELDS];
+    Value values_[ESPHOMECLIENT_MAX_COMMAND_FIELDS];
+    uint8_t count_;
+    CommandFieldsStats stats_;
+
+    // Parsing state, the payload is not terminated
+    const char *position_;
+    const char *end_;
+
+    bool add(const char *name, FieldType type, void *target, size_t size);
+    void skipSpaces();
+    bool expect(char c);
+    bool parseValue(const Field &field, Value &value);
+    void store(const Field &field, const Value &value);
+    bool parsed(bool success);
+    bool parseString(char *buffer, size_t size, size_t &length); // buffer may be NULL to skip the string
+    bool parseNumber(double &value, bool &integral);
+    bool parseWord(const char *word);
+    bool parseColor(uint8_t *color);
+    bool skipValue(uint8_t depth);
+
+public:
+    EspHomeClientCommandFields();
+
+    // False when ESPHOMECLIENT_MAX_COMMAND_FIELDS are registered
+    bool addBool(const char *name, bool *target);
+    bool addInt(const char *name, long *target);
+    bool addFloat(const char *name, float *target);
+    bool addString(const char *name, char *target, size_t size); // Longer strings are an error
+    bool addColor(const char *name, uint8_t *target);            // 3 bytes, red first
+
+    inline const CommandFieldsStats &getStats() const { return stats_; };
+
+    // Return false on malformed payloads, the bound members are then left unchanged.
+    // Bit i of present is set when field i, in order of registration, was in the payload.
+    bool parse(const uint8_t *payload, size_t length, uint32_t &present);
+};
+
+#endif
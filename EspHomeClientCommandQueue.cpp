@@ -0,0 +1,100 @@
+#include "EspHomeClientCommandQueue.h"
+
+EspHomeClientCommandQueue::EspHomeClientCommandQueue()
+{
+  buffer_ = NULL;
+  slots_ = NULL;
+  slot_count_ = 0;
+  slot_size_ = 0;
+  head_ = 0;
+  overflow_policy_ = DROP_OLDEST;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientCommandQueue::~EspHomeClientCommandQueue()
+{
+  delete[] buffer_;
+  delete[] slots_;
+}
+
+bool EspHomeClientCommandQueue::begin(uint16_t slot_count, uint16_t slot_size, PublishQueueOverflowPolicy overflow_policy)
+{
+  if (buffer_ != NULL || slot_count == 0 || slot_size < 2)
+    return false;
+
+  buffer_ = new uint8_t[(size_t)slot_count * slot_size];
+  slots_ = new Slot[slot_count];
+  slot_count_ = slot_count;
+  slot_size_ = slot_size;
+  overflow_policy_ = overflow_policy;
+  return true;
+}
+
+bool EspHomeClientCommandQueue::fits(size_t topic_length, size_t length)
+{
+  if (topic_length + 1 + length <= slot_size_)
+    return true;
+
+  stats_.oversized++;
+  return false;
+}
+
+void EspHomeClientCommandQueue::store(uint16_t slot, const char *topic, size_t topic_length, const uint8_t *payload, size_t length)
+{
+  char *data = slotTopic(slot);
+  memcpy(data, topic, topic_length + 1);
+  memcpy(data + topic_length + 1, payload, length);
+  slots_[slot].topic_length = topic_length;
+  slots_[slot].payload_length = length;
+}
+
+bool EspHomeClientCommandQueue::push(const char *topic, const uint8_t *payload, size_t length, bool coalesce)
+{
+  size_t topic_length = strlen(topic);
+
+  // Last value wins, the message keeps the place of the one it replaces
+  if (coalesce)
+  {
+    for (uint16_t i = 0; i < stats_.pending; i++)
+    {
+      uint16_t slot = (head_ + i) % slot_count_;
+      if (slots_[slot].topic_length == topic_length && memcmp(slotTopic(slot), topic, topic_length) == 0)
+      {
+        store(slot, topic, topic_length, payload, length);
+        stats_.coalesced++;
+        return true;
+      }
+    }
+  }
+
+  if (stats_.pending == slot_count_)
+  {
+    stats_.dropped++;
+    if (overflow_policy_ == DROP_NEWEST)
+      return false;
+
+    head_ = (head_ + 1) % slot_count_;
+    stats_.pending--;
+  }
+
+  store((head_ + stats_.pending) % slot_count_, topic, topic_length, payload, length);
+  stats_.pending++;
+  stats_.queued++;
+  if (stats_.pending > stats_.max_pending)
+    stats_.max_pending = stats_.pending;
+  return true;
+}
+
+void EspHomeClientCommandQueue::front(const char *&topic, const uint8_t *&payload, size_t &length) const
+{
+  topic = slotTopic(head_);
+  payload = (const uint8_t *)topic + slots_[head_].topic_length + 1;
+  length = slots_[head_].payload_length;
+}
+
+void EspHomeClientCommandQueue::pop()
+{
+  head_ = (head_ + 1) % slot_count_;
+  stats_.pending--;
+  stats_.dispatched++;
+}
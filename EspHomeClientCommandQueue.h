@@ -0,0 +1,59 @@
+#ifndef EspHomeClientCommandQueue_h
+#define EspHomeClientCommandQueue_h
+
+#include <Arduino.h>
+#include "EspHomeClientPublishQueue.h"
+
+struct CommandQueueStats
+{
+    unsigned long queued;
+    unsigned long coalesced;  // Replaced by a newer message on the same topic before being dispatched
+    unsigned long dropped;    // Lost to the overflow policy
+    unsigned long oversized;  // Too big for a slot, dispatched on reception
+    unsigned long dispatched;
+    uint16_t pending;
+    uint16_t max_pending;
+};
+
+// Received messages waiting to be dispatched, in a pool of fixed size slots allocated once. Each slot holds the
+// NUL terminated topic followed by the payload. A coalesced message replaces the pending one on the same topic, in place.
+class EspHomeClientCommandQueue
+{
+private:
+    struct Slot
+    {
+        uint16_t topic_length;
+        uint16_t payload_length;
+    };
+
+    uint8_t *buffer_;
+    Slot *slots_;
+    uint16_t slot_count_;
+    uint16_t slot_size_;
+    uint16_t head_; // Oldest message
+    PublishQueueOverflowPolicy overflow_policy_;
+    CommandQueueStats stats_;
+
+    inline char *slotTopic(uint16_t slot) const { return (char *)buffer_ + (size_t)slot * slot_size_; };
+    void store(uint16_t slot, const char *topic, size_t topic_length, const uint8_t *payload, size_t length);
+
+public:
+    EspHomeClientCommandQueue();
+    ~EspHomeClientCommandQueue();
+
+    bool begin(uint16_t slot_count, uint16_t slot_size, PublishQueueOverflowPolicy overflow_policy); // Allocate the pool, once
+    inline bool isEnabled() const { return buffer_ != NULL; };
+    inline bool isEmpty() const { return stats_.pending == 0; };
+    inline bool isFull() const { return stats_.pending == slot_count_; };
+    inline uint16_t slotCount() const { return slot_count_; };
+    inline const CommandQueueStats &getStats() const { return stats_; };
+
+    bool fits(size_t topic_length, size_t length); // Count the oversized messages
+    bool push(const char *topic, const uint8_t *payload, size_t length, bool coalesce); // False when dropped
+
+    // Oldest message, valid until pop()
+    void front(const char *&topic, const uint8_t *&payload, size_t &length) const;
+    void pop();
+};
+
+#endif
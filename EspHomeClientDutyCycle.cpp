@@ -0,0 +1,101 @@
+#include "EspHomeClientDutyCycle.h"
+
+#ifdef ESP32
+// Kept through deep sleep, not through a power loss
+RTC_DATA_ATTR static DutyCycleStats rtc_duty_cycle_stats;
+RTC_DATA_ATTR static uint32_t rtc_duty_cycle_stats_checksum;
+#endif
+
+static uint32_t statsChecksum(const DutyCycleStats &stats)
+{
+  return 0x44435943 ^ stats.cycles ^ (stats.last_awake_millis << 7) ^ (stats.timeouts << 13);
+}
+
+EspHomeClientDutyCycle::EspHomeClientDutyCycle()
+{
+  enabled_ = false;
+  sleep_micros_ = 0;
+  command_wait_millis_ = 0;
+  max_awake_millis_ = 0;
+  phase_ = DUTY_CYCLE_CONNECTING;
+  connected_millis_ = 0;
+  timed_out_ = false;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void EspHomeClientDutyCycle::begin(uint64_t sleep_micros, unsigned long command_wait_millis, unsigned long max_awake_millis)
+{
+  enabled_ = true;
+  sleep_micros_ = sleep_micros;
+  command_wait_millis_ = command_wait_millis;
+  max_awake_millis_ = max_awake_millis;
+  phase_ = DUTY_CYCLE_CONNECTING;
+  timed_out_ = false;
+}
+
+bool EspHomeClientDutyCycle::update(unsigned long now_millis, bool connected, bool publish_pending)
+{
+  if (phase_ == DUTY_CYCLE_DONE)
+    return true;
+
+  // The device wakes up at boot, millis() is the time spent awake
+  if (now_millis >= max_awake_millis_)
+  {
+    timed_out_ = true;
+    phase_ = DUTY_CYCLE_DONE;
+    return true;
+  }
+
+  if (!connected)
+  {
+    phase_ = DUTY_CYCLE_CONNECTING;
+    return false;
+  }
+
+  if (phase_ == DUTY_CYCLE_CONNECTING)
+    connected_millis_ = now_millis;
+
+  if (publish_pending)
+    phase_ = DUTY_CYCLE_FLUSHING;
+  else if (now_millis - connected_millis_ < command_wait_millis_)
+    phase_ = DUTY_CYCLE_AWAITING_COMMANDS;
+  else
+    phase_ = DUTY_CYCLE_DONE;
+
+  return phase_ == DUTY_CYCLE_DONE;
+}
+
+void EspHomeClientDutyCycle::loadStats()
+{
+  bool valid;
+#ifdef ESP8266
+  uint32_t data[4];
+  valid = ESP.rtcUserMemoryRead(ESPHOMECLIENT_RTC_DUTY_CYCLE_OFFSET, data, sizeof(data));
+  memcpy(&stats_, data, sizeof(stats_));
+  valid = valid && data[3] == statsChecksum(stats_);
+#else
+  stats_ = rtc_duty_cycle_stats;
+  valid = (rtc_duty_cycle_stats_checksum == statsChecksum(stats_));
+#endif
+
+  if (!valid)
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+void EspHomeClientDutyCycle::saveStats(unsigned long awake_millis)
+{
+  stats_.cycles++;
+  stats_.last_awake_millis = awake_millis;
+  if (timed_out_)
+    stats_.timeouts++;
+
+#ifdef ESP8266
+  uint32_t data[4];
+  memcpy(data, &stats_, sizeof(stats_));
+  data[3] = statsChecksum(stats_);
+  ESP.rtcUserMemoryWrite(ESPHOMECLIENT_RTC_DUTY_CYCLE_OFFSET, data, sizeof(data));
+#else
+  rtc_duty_cycle_stats = stats_;
+  rtc_duty_cycle_stats_checksum = statsChecksum(stats_);
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef EspHomeClientDutyCycle_h
+#define EspHomeClientDutyCycle_h
+
+#include <Arduino.h>
+#include "EspHomeClientWifiCache.h"
+
+// Position of the duty cycle statistics in the ESP8266 RTC user memory, right after the WiFi cache
+#ifndef ESPHOMECLIENT_RTC_DUTY_CYCLE_OFFSET
+#define ESPHOMECLIENT_RTC_DUTY_CYCLE_OFFSET (ESPHOMECLIENT_RTC_MEMORY_OFFSET + 8)
+#endif
+
+struct DutyCycleStats
+{
+    uint32_t cycles;            // Completed cycles since the last power loss
+    uint32_t last_awake_millis; // Awake time of the previous cycle
+    uint32_t timeouts;          // Cycles which ran out of awake time before completing
+};
+
+enum DutyCyclePhase
+{
+    DUTY_CYCLE_CONNECTING,        // Waiting for the WiFi and MQTT connections
+    DUTY_CYCLE_FLUSHING,          // Sending the queued messages
+    DUTY_CYCLE_AWAITING_COMMANDS, // Waiting for the retained commands
+    DUTY_CYCLE_DONE               // Ready to sleep
+};
+
+// Decides when a duty cycle is over: once connected, the publish queue is flushed and the retained commands
+// are awaited for a bounded time. The current time is passed in, the decisions do not depend on the hardware.
+class EspHomeClientDutyCycle
+{
+private:
+    bool enabled_;
+    uint64_t sleep_micros_;
+    unsigned long command_wait_millis_;
+    unsigned long max_awake_millis_;
+    DutyCyclePhase phase_;
+    unsigned long connected_millis_;
+    bool timed_out_;
+    DutyCycleStats stats_;
+
+public:
+    EspHomeClientDutyCycle();
+
+    void begin(uint64_t sleep_micros, unsigned long command_wait_millis, unsigned long max_awake_millis);
+    inline bool isEnabled() const { return enabled_; };
+
+    // Advance the cycle, return true once it is time to sleep
+    bool update(unsigned long now_millis, bool connected, bool publish_pending);
+
+    inline DutyCyclePhase phase() const { return phase_; };
+    inline bool timedOut() const { return timed_out_; };
+    inline uint64_t sleepMicros() const { return sleep_micros_; };
+    inline unsigned long awakeMillisLeft(unsigned long now_millis) const { return now_millis < max_awake_millis_ ? max_awake_millis_ - now_millis : 0; };
+    inline const DutyCycleStats &getStats() const { return stats_; };
+
+    // Statistics kept in RTC memory through deep sleep
+    void loadStats();
+    void saveStats(unsigned long awake_millis);
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "EspHomeClientFrameDecoder.h"
+
+EspHomeClientFrameDecoder::EspHomeClientFrameDecoder(uint8_t *pixels, uint16_t pixel_count)
+{
+  pixels_ = pixels;
+  pixel_count_ = pixel_count;
+  memset(&stats_, 0, sizeof(stats_));
+  reset();
+}
+
+void EspHomeClientFrameDecoder::reset()
+{
+  state_ = FRAME_HEADER;
+  pending_length_ = 0;
+  position_ = 0;
+  segment_end_ = 0;
+}
+
+void EspHomeClientFrameDecoder::decode(const uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    switch (state_)
+    {
+    case FRAME_HEADER:
+      if (!fillPending(data, length, 4))
+        return;
+      if (pending_[0] != 'L' || pending_[1] != 'F' || pending_[2] != 1)
+      {
+        state_ = FRAME_ERROR;
+        return;
+      }
+      state_ = SEGMENT_HEADER;
+      break;
+
+    case SEGMENT_HEADER:
+      if (!fillPending(data, length, 5))
+        return;
+      startSegment();
+      break;
+
+    case SEGMENT_DATA:
+    {
+      // Written straight from the received piece into the pixel buffer
+      size_t count = min(length, segment_end_ - position_);
+      if (segment_type_ == FRAME_SEGMENT_RAW)
+        memcpy(pixels_ + position_, data, count);
+      else
+      {
+        for (size_t i = 0; i < count; i++)
+        {
+          int value = pixels_[position_ + i] + (int8_t)data[i];
+          pixels_[position_ + i] = (value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+      }
+
+      position_ += count;
+      data += count;
+      length -= count;
+      if (position_ == segment_end_)
+        state_ = SEGMENT_HEADER;
+      break;
+    }
+
+    case RLE_RUN:
+    {
+      if (!fillPending(data, length, 4))
+        return;
+
+      size_t run_end = position_ + pending_[0] * 3;
+      if (pending_[0] == 0 || run_end > segment_end_)
+      {
+        state_ = FRAME_ERROR;
+        return;
+      }
+
+      for (; position_ < run_end; position_ += 3)
+        memcpy(pixels_ + position_, pending_ + 1, 3);
+
+      if (position_ == segment_end_)
+        state_ = SEGMENT_HEADER;
+      break;
+    }
+
+    case FRAME_ERROR:
+      return;
+    }
+  }
+}
+
+bool EspHomeClientFrameDecoder::finish()
+{
+  // A frame ends between two segments
+  bool complete = (state_ == SEGMENT_HEADER && pending_length_ == 0);
+  if (complete)
+    stats_.frames++;
+  else
+    stats_.errors++;
+
+  reset();
+  return complete;
+}
+
+// Gather a header of needed bytes which may be split over several pieces, return false when more are needed
+bool EspHomeClientFrameDecoder::fillPending(const uint8_t *&data, size_t &length, uint8_t needed)
+{
+  size_t count = min(length, (size_t)(needed - pending_length_));
+  memcpy(pending_ + pending_length_, data, count);
+  pending_length_ += count;
+  data += count;
+  length -= count;
+
+  if (pending_length_ < needed)
+    return false;
+
+  pending_length_ = 0;
+  return true;
+}
+
+void EspHomeClientFrameDecoder::startSegment()
+{
+  segment_type_ = pending_[0];
+  size_t offset = (pending_[1] << 8) | pending_[2];
+  size_t count = (pending_[3] << 8) | pending_[4];
+
+  if (segment_type_ > FRAME_SEGMENT_DELTA || offset + count > pixel_count_)
+  {
+    state_ = FRAME_ERROR;
+    return;
+  }
+
+  stats_.pixels += count;
+  position_ = offset * 3;
+  segment_end_ = (offset + count) * 3;
+  if (count == 0)
+    state_ = SEGMENT_HEADER;
+  else
+    state_ = (segment_type_ == FRAME_SEGMENT_RLE ? RLE_RUN : SEGMENT_DATA);
+}
@@ -0,0 +1,64 @@
+#ifndef EspHomeClientFrameDecoder_h
+#define EspHomeClientFrameDecoder_h
+
+#include <Arduino.h>
+
+// Binary LED frame, decoded as it is received into a buffer of 3 bytes per pixel (e.g. FastLED CRGB):
+//
+//   header   'L' 'F' version(1) flags(0)
+//   segment  type(1 byte) offset(uint16) count(uint16), in pixels, big endian, then its data:
+//            FRAME_SEGMENT_RAW    count x RGB
+//            FRAME_SEGMENT_RLE    runs of length(1 byte, 1-255) RGB, covering count pixels
+//            FRAME_SEGMENT_DELTA  count x signed RGB differences, added to the current pixels with saturation
+//
+// Segments follow each other until the end of the payload, pixels out of any segment keep their value.
+enum FrameSegmentType
+{
+    FRAME_SEGMENT_RAW = 0,
+    FRAME_SEGMENT_RLE = 1,
+    FRAME_SEGMENT_DELTA = 2
+};
+
+struct FrameDecoderStats
+{
+    unsigned long frames;  // Complete frames
+    unsigned long errors;  // Frames dropped for a bad header or a segment out of the buffer
+    unsigned long pixels;  // Pixels covered by the segments decoded
+};
+
+class EspHomeClientFrameDecoder
+{
+private:
+    enum State
+    {
+        FRAME_HEADER,
+        SEGMENT_HEADER,
+        SEGMENT_DATA,
+        RLE_RUN, // Run header of a RLE segment
+        FRAME_ERROR
+    };
+
+    uint8_t *pixels_;
+    uint16_t pixel_count_;
+    State state_;
+    uint8_t pending_[5]; // Header or run split over two pieces of the payload
+    uint8_t pending_length_;
+    uint8_t segment_type_;
+    size_t position_;    // Next byte of the pixel buffer
+    size_t segment_end_;
+    FrameDecoderStats stats_;
+
+    bool fillPending(const uint8_t *&data, size_t &length, uint8_t needed);
+    void startSegment();
+
+public:
+    EspHomeClientFrameDecoder(uint8_t *pixels, uint16_t pixel_count);
+
+    void reset(); // Start a new frame
+    void decode(const uint8_t *data, size_t length); // Decode the next piece of the payload
+    bool finish(); // End of the payload, return true when the frame was complete and valid
+
+    inline const FrameDecoderStats &getStats() const { return stats_; };
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef EspHomeClientFunctionRef_h
+#define EspHomeClientFunctionRef_h
+
+#include <stddef.h>
+#include <type_traits>
+
+template <typename Signature>
+class EspHomeClientFunctionRef;
+
+// Non-owning reference to a function or a callable object, two pointers wide and never allocating.
+// A referenced callable object must outlive the reference, temporaries are rejected at compile time.
+template <typename R, typename... Args>
+class EspHomeClientFunctionRef<R(Args...)>
+{
+private:
+    void *object_;
+    R (*invoke_)(void *object, Args... args);
+
+    static R invokeFunction(void *object, Args... args) { return ((R(*)(Args...))object)(args...); }
+
+    template <typename Callable>
+    static R invokeCallable(void *object, Args... args) { return (*(Callable *)object)(args...); }
+
+public:
+    EspHomeClientFunctionRef() : object_(NULL), invoke_(NULL) {}
+    EspHomeClientFunctionRef(R (*function)(Args...)) : object_((void *)function), invoke_(function ? invokeFunction : NULL) {}
+
+    template <typename Callable, typename = typename std::enable_if<!std::is_same<typename std::remove_cv<Callable>::type, EspHomeClientFunctionRef>::value>::type>
+    EspHomeClientFunctionRef(Callable &callable) : object_((void *)&callable), invoke_(invokeCallable<Callable>) {}
+
+    inline R operator()(Args... args) const { return invoke_(object_, args...); }
+    inline explicit operator bool() const { return invoke_ != NULL; }
+};
+
+#endif
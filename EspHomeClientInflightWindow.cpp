@@ -0,0 +1,157 @@
+#include "EspHomeClientInflightWindow.h"
+
+EspHomeClientInflightWindow::EspHomeClientInflightWindow()
+{
+  buffer_ = NULL;
+  capacity_ = 0;
+  head_ = 0;
+  used_ = 0;
+  slots_ = NULL;
+  window_size_ = 0;
+  first_slot_ = 0;
+  slot_count_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientInflightWindow::~EspHomeClientInflightWindow()
+{
+  delete[] buffer_;
+  delete[] slots_;
+}
+
+bool EspHomeClientInflightWindow::begin(uint8_t window_size, size_t capacity)
+{
+  if (buffer_ != NULL || window_size == 0)
+    return false;
+
+  buffer_ = new uint8_t[capacity];
+  capacity_ = capacity;
+  slots_ = new Slot[window_size];
+  window_size_ = window_size;
+  return true;
+}
+
+bool EspHomeClientInflightWindow::push(uint16_t packet_id, const char *topic, const uint8_t *payload, size_t length, bool retain)
+{
+  size_t topic_length = strlen(topic);
+  size_t remaining_length = 2 + topic_length + 2 + length;
+
+  // Fixed header
+  uint8_t header[5];
+  size_t header_length = 0;
+  header[header_length++] = 0x32 | (retain ? 0x01 : 0); // PUBLISH, QoS 1
+  size_t remaining = remaining_length;
+  do
+  {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    if (remaining > 0)
+      digit |= 0x80;
+    header[header_length++] = digit;
+  } while (remaining > 0 && header_length < sizeof(header));
+
+  size_t packet_length = header_length + remaining_length;
+  if (slot_count_ == window_size_ || topic_length > 0xFFFF || capacity_ - used_ < packet_length)
+    return false;
+
+  size_t position = (head_ + used_) % capacity_;
+  uint8_t topic_length_bytes[2] = {(uint8_t)(topic_length >> 8), (uint8_t)(topic_length & 0xFF)};
+  uint8_t packet_id_bytes[2] = {(uint8_t)(packet_id >> 8), (uint8_t)(packet_id & 0xFF)};
+  copyIn(position, header, header_length);
+  copyIn(position + header_length, topic_length_bytes, 2);
+  copyIn(position + header_length + 2, topic, topic_length);
+  copyIn(position + header_length + 2 + topic_length, packet_id_bytes, 2);
+  copyIn(position + header_length + 4 + topic_length, payload, length);
+  used_ += packet_length;
+
+  Slot &new_slot = slots_[(first_slot_ + slot_count_) % window_size_];
+  new_slot.packet_id = packet_id;
+  new_slot.position = position;
+  new_slot.length = packet_length;
+  new_slot.sent_millis = 0;
+  new_slot.send_count = 0;
+  new_slot.retransmissions = 0;
+  new_slot.done = false;
+  slot_count_++;
+
+  stats_.published++;
+  stats_.in_flight = slot_count_;
+  return true;
+}
+
+void EspHomeClientInflightWindow::packet(const Slot &slot, const uint8_t *&first, size_t &first_length, const uint8_t *&second, size_t &second_length) const
+{
+  first = buffer_ + slot.position;
+  first_length = min(slot.length, capacity_ - slot.position);
+  second = buffer_;
+  second_length = slot.length - first_length;
+}
+
+void EspHomeClientInflightWindow::markSent(Slot &slot, unsigned long now_millis)
+{
+  if (slot.send_count > 0)
+    stats_.retransmitted++;
+
+  slot.sent_millis = now_millis;
+  if (slot.send_count < 0xFF)
+    slot.send_count++;
+  buffer_[slot.position] |= 0x08;
+}
+
+bool EspHomeClientInflightWindow::acknowledge(uint16_t packet_id)
+{
+  for (uint8_t i = 0; i < slot_count_; i++)
+  {
+    Slot &candidate = slot(i);
+    if (!candidate.done && candidate.send_count > 0 && candidate.packet_id == packet_id)
+    {
+      candidate.done = true;
+      stats_.acknowledged++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// The slots done but not released yet count too, a dropped packet may still be acknowledged
+bool EspHomeClientInflightWindow::contains(uint16_t packet_id) const
+{
+  for (uint8_t i = 0; i < slot_count_; i++)
+  {
+    if (slots_[(first_slot_ + i) % window_size_].packet_id == packet_id)
+      return true;
+  }
+
+  return false;
+}
+
+void EspHomeClientInflightWindow::drop(Slot &slot)
+{
+  slot.done = true;
+  stats_.dropped++;
+}
+
+void EspHomeClientInflightWindow::release()
+{
+  while (slot_count_ > 0 && slots_[first_slot_].done)
+  {
+    Slot &oldest = slots_[first_slot_];
+    head_ = (oldest.position + oldest.length) % capacity_;
+    used_ -= oldest.length;
+    first_slot_ = (first_slot_ + 1) % window_size_;
+    slot_count_--;
+  }
+
+  if (slot_count_ == 0)
+    head_ = 0;
+  stats_.in_flight = slot_count_;
+}
+
+void EspHomeClientInflightWindow::copyIn(size_t position, const void *data, size_t length)
+{
+  position %= capacity_;
+  size_t first_length = min(length, capacity_ - position);
+  memcpy(buffer_ + position, data, first_length);
+  memcpy(buffer_, (const uint8_t *)data + first_length, length - first_length);
+}
@@ -0,0 +1,75 @@
+#ifndef EspHomeClientInflightWindow_h
+#define EspHomeClientInflightWindow_h
+
+#include <Arduino.h>
+
+// Retransmissions after a timeout before a message is dropped, the ones after a reconnection are not counted
+#ifndef ESPHOMECLIENT_QOS1_MAX_RETRANSMISSIONS
+#define ESPHOMECLIENT_QOS1_MAX_RETRANSMISSIONS 5
+#endif
+
+struct InflightStats
+{
+    unsigned long published;     // Accepted by publishQoS1()
+    unsigned long acknowledged;
+    unsigned long retransmitted; // Sent again with the DUP flag, after a timeout or a reconnection
+    unsigned long dropped;       // Given up after too many retransmissions
+    uint8_t in_flight;
+};
+
+// QoS 1 PUBLISH packets waiting for their PUBACK. The encoded packets are kept in a ring buffer with a fixed
+// memory budget so that they can be sent again, the window bounds how many are pipelined at once.
+// Brokers acknowledge in order, a packet acknowledged out of order only frees its room once the older ones are done.
+class EspHomeClientInflightWindow
+{
+public:
+    struct Slot
+    {
+        uint16_t packet_id;
+        size_t position; // Start of the packet in the ring buffer
+        size_t length;
+        unsigned long sent_millis;
+        uint8_t send_count; // 0 until the packet is sent for the first time
+        uint8_t retransmissions;
+        bool done;          // Acknowledged or dropped, released once the older slots are done too
+    };
+
+private:
+    uint8_t *buffer_;
+    size_t capacity_;
+    size_t head_; // Position of the oldest packet
+    size_t used_;
+    Slot *slots_;
+    uint8_t window_size_;
+    uint8_t first_slot_;
+    uint8_t slot_count_;
+    InflightStats stats_;
+
+    void copyIn(size_t position, const void *data, size_t length);
+
+public:
+    EspHomeClientInflightWindow();
+    ~EspHomeClientInflightWindow();
+
+    bool begin(uint8_t window_size, size_t capacity); // Allocate the buffers, once
+    inline bool isEnabled() const { return buffer_ != NULL; };
+    inline bool isEmpty() const { return slot_count_ == 0; };
+    inline uint8_t count() const { return slot_count_; };
+    inline const InflightStats &getStats() const { return stats_; };
+
+    // Encode a QoS 1 PUBLISH packet, false when the window or the buffer is full
+    bool push(uint16_t packet_id, const char *topic, const uint8_t *payload, size_t length, bool retain);
+
+    // Slots from the oldest one
+    inline Slot &slot(uint8_t index) { return slots_[(first_slot_ + index) % window_size_]; };
+    // The packet is returned as up to two spans, second_length is 0 when it does not wrap
+    void packet(const Slot &slot, const uint8_t *&first, size_t &first_length, const uint8_t *&second, size_t &second_length) const;
+    void markSent(Slot &slot, unsigned long now_millis); // Set the DUP flag of the next sends
+
+    bool acknowledge(uint16_t packet_id);
+    bool contains(uint16_t packet_id) const; // The identifier is held by a packet of the window
+    void drop(Slot &slot);
+    void release(); // Free the room of the oldest slots which are done
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include "EspHomeClientLog.h"
+
+EspHomeClientLogSink::EspHomeClientLogSink()
+{
+  head_ = 0;
+  used_ = 0;
+  dropped_lines_ = 0;
+}
+
+void EspHomeClientLogSink::vprintf(const char *format, va_list args)
+{
+  char line[ESPHOMECLIENT_LOG_LINE_LENGTH];
+  int length = vsnprintf(line, sizeof(line), format, args);
+  if (length < 0)
+    return;
+
+  // Truncated lines keep their line feed
+  if ((size_t)length >= sizeof(line))
+  {
+    length = sizeof(line) - 1;
+    line[length - 1] = '\n';
+  }
+
+  if (!push(line, length))
+    dropped_lines_++;
+}
+
+void EspHomeClientLogSink::drain(Print &output)
+{
+  // Report the dropped lines once there is room again
+  if (dropped_lines_ > 0)
+  {
+    char line[48];
+    int length = snprintf(line, sizeof(line), "Log! %lu lines dropped\n", dropped_lines_);
+    if (push(line, length))
+      dropped_lines_ = 0;
+  }
+
+  while (used_ > 0)
+  {
+    int writable = output.availableForWrite();
+    if (writable <= 0)
+      return;
+
+    size_t length = min(min((size_t)writable, used_), ESPHOMECLIENT_LOG_BUFFER_SIZE - head_);
+    size_t written = output.write((const uint8_t *)buffer_ + head_, length);
+    head_ = (head_ + written) % ESPHOMECLIENT_LOG_BUFFER_SIZE;
+    used_ -= written;
+
+    if (written < length)
+      return;
+  }
+}
+
+bool EspHomeClientLogSink::push(const char *line, size_t length)
+{
+  if (ESPHOMECLIENT_LOG_BUFFER_SIZE - used_ < length)
+    return false;
+
+  size_t position = (head_ + used_) % ESPHOMECLIENT_LOG_BUFFER_SIZE;
+  size_t first_length = min(length, ESPHOMECLIENT_LOG_BUFFER_SIZE - position);
+  memcpy(buffer_ + position, line, first_length);
+  memcpy(buffer_, line + first_length, length - first_length);
+  used_ += length;
+  return true;
+}
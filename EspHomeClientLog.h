@@ -0,0 +1,48 @@
+#ifndef EspHomeClientLog_h
+#define EspHomeClientLog_h
+
+#include <Arduino.h>
+
+// Log statements above ESPHOMECLIENT_LOG_LEVEL are removed at compile time, format strings included.
+// Define it in the build flags, e.g. -DESPHOMECLIENT_LOG_LEVEL=ESPHOMECLIENT_LOG_LEVEL_DEBUG to log every message.
+#define ESPHOMECLIENT_LOG_LEVEL_NONE 0
+#define ESPHOMECLIENT_LOG_LEVEL_ERROR 1 // Failures
+#define ESPHOMECLIENT_LOG_LEVEL_INFO 2  // Connection events
+#define ESPHOMECLIENT_LOG_LEVEL_DEBUG 3 // Every message sent and received
+
+#ifndef ESPHOMECLIENT_LOG_LEVEL
+#define ESPHOMECLIENT_LOG_LEVEL ESPHOMECLIENT_LOG_LEVEL_INFO
+#endif
+
+// Size of the buffer log lines wait in before being written to Serial
+#ifndef ESPHOMECLIENT_LOG_BUFFER_SIZE
+#define ESPHOMECLIENT_LOG_BUFFER_SIZE 512
+#endif
+
+#ifndef ESPHOMECLIENT_LOG_LINE_LENGTH
+#define ESPHOMECLIENT_LOG_LINE_LENGTH 128
+#endif
+
+// Asynchronous log output. Lines are formatted into a ring buffer and written to the output from loop(), only as
+// much as it accepts without blocking. Lines that do not fit in the buffer are dropped and counted.
+class EspHomeClientLogSink
+{
+private:
+    char buffer_[ESPHOMECLIENT_LOG_BUFFER_SIZE];
+    size_t head_;
+    size_t used_;
+    unsigned long dropped_lines_;
+
+public:
+    EspHomeClientLogSink();
+
+    void vprintf(const char *format, va_list args);
+    void drain(Print &output);
+    inline unsigned long getDroppedLines() const { return dropped_lines_; };
+    inline bool isEmpty() const { return used_ == 0; };
+
+private:
+    bool push(const char *line, size_t length);
+};
+
+#endif
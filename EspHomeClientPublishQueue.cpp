@@ -0,0 +1,136 @@
+#include "EspHomeClientPublishQueue.h"
+
+EspHomeClientPublishQueue::EspHomeClientPublishQueue()
+{
+  buffer_ = NULL;
+  capacity_ = 0;
+  head_ = 0;
+  used_ = 0;
+  overflow_policy_ = DROP_OLDEST;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientPublishQueue::~EspHomeClientPublishQueue()
+{
+  delete[] buffer_;
+}
+
+bool EspHomeClientPublishQueue::begin(size_t capacity, PublishQueueOverflowPolicy overflow_policy)
+{
+  if (buffer_ != NULL)
+    return false;
+
+  buffer_ = new uint8_t[capacity];
+  capacity_ = capacity;
+  overflow_policy_ = overflow_policy;
+  return true;
+}
+
+bool EspHomeClientPublishQueue::push(const char *topic, const uint8_t *payload, size_t length, bool retain, unsigned long ttl_millis)
+{
+  EntryHeader header;
+  header.enqueued_millis = millis();
+  header.ttl_millis = ttl_millis;
+  header.topic_length = strlen(topic);
+  header.payload_length = length;
+  header.retain = retain;
+
+  size_t size = entrySize(header);
+  if (length > 0xFFFF || size > capacity_)
+  {
+    stats_.dropped_overflow++;
+    return false;
+  }
+
+  // Make room
+  while (capacity_ - used_ < size)
+  {
+    if (overflow_policy_ == DROP_NEWEST)
+    {
+      stats_.dropped_overflow++;
+      return false;
+    }
+
+    pop(false);
+    stats_.dropped_overflow++;
+  }
+
+  size_t position = (head_ + used_) % capacity_;
+  copyIn(position, &header, sizeof(header));
+  copyIn((position + sizeof(header)) % capacity_, topic, header.topic_length);
+  copyIn((position + sizeof(header) + header.topic_length) % capacity_, payload, length);
+
+  used_ += size;
+  stats_.enqueued++;
+  stats_.pending_messages++;
+  stats_.pending_bytes = used_;
+  return true;
+}
+
+void EspHomeClientPublishQueue::front(EntryHeader &header) const
+{
+  copyOut(head_, &header, sizeof(header));
+}
+
+void EspHomeClientPublishQueue::frontTopic(char *topic) const
+{
+  EntryHeader header;
+  front(header);
+  copyOut((head_ + sizeof(header)) % capacity_, topic, header.topic_length);
+  topic[header.topic_length] = '\0';
+}
+
+void EspHomeClientPublishQueue::frontPayload(const uint8_t *&first, size_t &first_length, const uint8_t *&second, size_t &second_length) const
+{
+  EntryHeader header;
+  front(header);
+
+  size_t position = (head_ + sizeof(header) + header.topic_length) % capacity_;
+  first = buffer_ + position;
+  first_length = min((size_t)header.payload_length, capacity_ - position);
+  second = buffer_;
+  second_length = header.payload_length - first_length;
+}
+
+void EspHomeClientPublishQueue::pop(bool sent)
+{
+  if (isEmpty())
+    return;
+
+  EntryHeader header;
+  front(header);
+
+  size_t size = entrySize(header);
+  head_ = (head_ + size) % capacity_;
+  used_ -= size;
+
+  if (sent)
+    stats_.sent++;
+  stats_.pending_messages--;
+  stats_.pending_bytes = used_;
+}
+
+void EspHomeClientPublishQueue::dropFront()
+{
+  pop(false);
+  stats_.dropped_expired++;
+}
+
+size_t EspHomeClientPublishQueue::entrySize(const EntryHeader &header) const
+{
+  return sizeof(header) + header.topic_length + header.payload_length;
+}
+
+void EspHomeClientPublishQueue::copyIn(size_t position, const void *data, size_t length)
+{
+  size_t first_length = min(length, capacity_ - position);
+  memcpy(buffer_ + position, data, first_length);
+  memcpy(buffer_, (const uint8_t *)data + first_length, length - first_length);
+}
+
+void EspHomeClientPublishQueue::copyOut(size_t position, void *data, size_t length) const
+{
+  size_t first_length = min(length, capacity_ - position);
+  memcpy(data, buffer_ + position, first_length);
+  memcpy((uint8_t *)data + first_length, buffer_, length - first_length);
+}
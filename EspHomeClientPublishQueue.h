@@ -0,0 +1,71 @@
+#ifndef EspHomeClientPublishQueue_h
+#define EspHomeClientPublishQueue_h
+
+#include <Arduino.h>
+
+// What to do with a message that does not fit in the publish queue
+enum PublishQueueOverflowPolicy
+{
+    DROP_OLDEST, // Drop the oldest pending messages until the new one fits
+    DROP_NEWEST  // Reject the new message
+};
+
+struct PublishQueueStats
+{
+    unsigned long enqueued;
+    unsigned long sent;
+    unsigned long dropped_overflow;
+    unsigned long dropped_expired;
+    unsigned int pending_messages;
+    size_t pending_bytes;
+};
+
+// Ring buffer of pending publishes with a fixed memory budget. Each message is stored as a header followed by
+// its full topic and its payload, both of which may wrap around the end of the buffer.
+class EspHomeClientPublishQueue
+{
+public:
+    struct EntryHeader
+    {
+        unsigned long enqueued_millis;
+        unsigned long ttl_millis; // 0 means the message never expires
+        uint16_t topic_length;
+        uint16_t payload_length;
+        bool retain;
+    };
+
+private:
+    uint8_t *buffer_;
+    size_t capacity_;
+    size_t head_; // Position of the oldest message
+    size_t used_;
+    PublishQueueOverflowPolicy overflow_policy_;
+    PublishQueueStats stats_;
+
+public:
+    EspHomeClientPublishQueue();
+    ~EspHomeClientPublishQueue();
+
+    bool begin(size_t capacity, PublishQueueOverflowPolicy overflow_policy); // Allocate the buffer, once
+    inline bool isEnabled() const { return buffer_ != NULL; };
+    inline bool isEmpty() const { return stats_.pending_messages == 0; };
+    inline const PublishQueueStats &getStats() const { return stats_; };
+
+    bool push(const char *topic, const uint8_t *payload, size_t length, bool retain, unsigned long ttl_millis);
+
+    // Access to the oldest message
+    void front(EntryHeader &header) const;
+    void frontTopic(char *topic) const; // topic must hold header.topic_length + 1 bytes
+    // The payload is returned as up to two spans, second_length is 0 when it does not wrap
+    void frontPayload(const uint8_t *&first, size_t &first_length, const uint8_t *&second, size_t &second_length) const;
+    void pop(bool sent);
+    static inline bool isExpired(const EntryHeader &header, unsigned long now) { return header.ttl_millis > 0 && now - header.enqueued_millis >= header.ttl_millis; };
+    void dropFront(); // Counted as expired
+
+private:
+    size_t entrySize(const EntryHeader &header) const;
+    void copyIn(size_t position, const void *data, size_t length);
+    void copyOut(size_t position, void *data, size_t length) const;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "EspHomeClientReconnectPolicy.h"
+
+unsigned long ReconnectPolicy::delayMillis(unsigned int failed_attempts) const
+{
+  unsigned long delay_millis = first_retry_millis;
+  if (failed_attempts > 0)
+  {
+    delay_millis = initial_backoff_millis;
+    for (unsigned int i = 1; i < failed_attempts && delay_millis < max_backoff_millis; i++)
+      delay_millis *= 2;
+    delay_millis = min(delay_millis, max_backoff_millis);
+  }
+
+  // Above 100% the delay could go negative
+  long jitter = delay_millis * min(jitter_percent, (uint8_t)100) / 100;
+  if (jitter > 0)
+    delay_millis += random(-jitter, jitter + 1);
+
+  // 0 would not schedule any attempt
+  return max(delay_millis, 1ul);
+}
+
+ReconnectPolicy ReconnectPolicy::wifiDefault()
+{
+  ReconnectPolicy policy;
+  policy.first_retry_millis = 500;
+  policy.initial_backoff_millis = 1000;
+  policy.max_backoff_millis = 30 * 1000;
+  policy.jitter_percent = 20;
+  policy.reset_wifi_after_failures = 0;
+  policy.reset_board_after_failures = 0;
+  return policy;
+}
+
+ReconnectPolicy ReconnectPolicy::mqttDefault()
+{
+  ReconnectPolicy policy;
+  policy.first_retry_millis = 1000;
+  policy.initial_backoff_millis = 2000;
+  policy.max_backoff_millis = 2 * 60 * 1000;
+  policy.jitter_percent = 50;
+  policy.reset_wifi_after_failures = 8;
+  policy.reset_board_after_failures = 12;
+  return policy;
+}
@@ -0,0 +1,27 @@
+#ifndef EspHomeClientReconnectPolicy_h
+#define EspHomeClientReconnectPolicy_h
+
+#include <Arduino.h>
+
+// Delays between connection attempts. After a connection loss the first attempt comes quickly, then the delay
+// doubles with each failed attempt up to a cap. The jitter spreads devices that lost their connection at the
+// same time, e.g. when the broker restarts, so that they do not reconnect in lock-step.
+struct ReconnectPolicy
+{
+    unsigned long first_retry_millis;     // Delay after a connection loss
+    unsigned long initial_backoff_millis; // Delay after the first failed attempt, doubled after each following one
+    unsigned long max_backoff_millis;
+    uint8_t jitter_percent;               // Each delay is randomised by up to +/- this percentage, 100 at most
+    unsigned int reset_wifi_after_failures;  // MQTT only, reset the WiFi connection after this many failed attempts, 0 to disable
+    // MQTT only, restart the board after this many failed attempts when enableDrasticResetOnConnectionFailures() is set, 0 to disable.
+    // Counted in attempts, the time it takes follows the backoff: about 12 minutes with the default MQTT policy
+    unsigned int reset_board_after_failures;
+
+    // Delay before the next attempt, failed_attempts is 0 after a connection loss
+    unsigned long delayMillis(unsigned int failed_attempts) const;
+
+    static ReconnectPolicy wifiDefault();
+    static ReconnectPolicy mqttDefault();
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "EspHomeClientScheduler.h"
+
+EspHomeClientScheduler::EspHomeClientScheduler()
+{
+  heap_ = NULL;
+  size_ = 0;
+  capacity_ = 0;
+  last_id_ = 0;
+  free_id_limit_ = 0x10000;
+  running_id_ = 0;
+  running_cancelled_ = false;
+  tick_budget_micros_ = 10000;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientScheduler::~EspHomeClientScheduler()
+{
+  delete[] heap_;
+}
+
+// Due times are compared through their difference, to cope with millis() wrapping around
+bool EspHomeClientScheduler::runsBefore(const Task &a, const Task &b)
+{
+  return (long)(a.due_millis - b.due_millis) < 0;
+}
+
+uint16_t EspHomeClientScheduler::schedule(unsigned long now_millis, unsigned long delay_millis, unsigned long interval_millis, ScheduledTaskCallback callback)
+{
+  // Identifiers are handed out in order. Once they wrap around, the ones still in use are skipped: the tasks are only
+  // searched when the range of free identifiers found last time is exhausted
+  if ((uint32_t)last_id_ + 1 >= free_id_limit_ && !findFreeIds())
+    return 0;
+  uint16_t id = ++last_id_;
+
+  Task task;
+  task.id = id;
+  task.due_millis = now_millis + delay_millis;
+  task.interval_millis = interval_millis;
+  task.callback = callback;
+  memset(&task.stats, 0, sizeof(task.stats));
+  push(task);
+
+  stats_.tasks = size_;
+  return id;
+}
+
+bool EspHomeClientScheduler::cancel(uint16_t id)
+{
+  if (id != 0 && id == running_id_)
+  {
+    running_cancelled_ = true;
+    return true;
+  }
+
+  int index = find(id);
+  if (index < 0)
+    return false;
+
+  Task task;
+  removeAt(index, task);
+  stats_.tasks = size_;
+  return true;
+}
+
+const ScheduledTaskStats *EspHomeClientScheduler::getTaskStats(uint16_t id) const
+{
+  int index = find(id);
+  return index < 0 ? NULL : &heap_[index].stats;
+}
+
+void EspHomeClientScheduler::tick(unsigned long now_millis)
+{
+  unsigned long start_micros = micros();
+
+  while (size_ > 0 && (long)(now_millis - heap_[0].due_millis) >= 0)
+  {
+    // The task leaves the heap while it runs, it may schedule or cancel tasks meanwhile
+    Task task;
+    removeAt(0, task);
+    running_id_ = task.id;
+    running_cancelled_ = false;
+
+    unsigned long run_start_micros = micros();
+    task.callback();
+    unsigned long run_micros = micros() - run_start_micros;
+
+    running_id_ = 0;
+    stats_.runs++;
+    task.stats.runs++;
+    if (run_micros > task.stats.max_micros)
+      task.stats.max_micros = run_micros;
+
+    if (task.interval_millis > 0 && !running_cancelled_)
+    {
+      // Fixed rate, unless a whole interval was missed
+      task.due_millis += task.interval_millis;
+      if ((long)(now_millis - task.due_millis) >= 0)
+      {
+        task.stats.overruns++;
+        task.due_millis = now_millis + task.interval_millis;
+      }
+      push(task);
+    }
+    stats_.tasks = size_;
+
+    if (micros() - start_micros >= tick_budget_micros_)
+    {
+      if (size_ > 0 && (long)(now_millis - heap_[0].due_millis) >= 0)
+        stats_.cut_ticks++;
+      break;
+    }
+  }
+}
+
+void EspHomeClientScheduler::push(Task &task)
+{
+  if (size_ == capacity_)
+  {
+    uint16_t capacity = capacity_ == 0 ? 4 : (capacity_ > 0x7FFF ? 0xFFFF : capacity_ * 2);
+    Task *heap = new Task[capacity];
+    for (uint16_t i = 0; i < size_; i++)
+      heap[i] = std::move(heap_[i]);
+
+    delete[] heap_;
+    heap_ = heap;
+    capacity_ = capacity;
+  }
+
+  heap_[size_] = std::move(task);
+  siftUp(size_++);
+}
+
+void EspHomeClientScheduler::removeAt(uint16_t index, Task &task)
+{
+  task = std::move(heap_[index]);
+  size_--;
+  if (index == size_)
+    return;
+
+  heap_[index] = std::move(heap_[size_]);
+  siftUp(index);
+  siftDown(index);
+}
+
+void EspHomeClientScheduler::siftUp(uint16_t index)
+{
+  while (index > 0)
+  {
+    uint16_t parent = (index - 1) / 2;
+    if (!runsBefore(heap_[index], heap_[parent]))
+      break;
+    std::swap(heap_[index], heap_[parent]);
+    index = parent;
+  }
+}
+
+void EspHomeClientScheduler::siftDown(uint16_t index)
+{
+  while (true)
+  {
+    uint32_t smallest = index;
+    uint32_t left = 2 * (uint32_t)index + 1;
+    uint32_t right = left + 1;
+    if (left < size_ && runsBefore(heap_[left], heap_[smallest]))
+      smallest = left;
+    if (right < size_ && runsBefore(heap_[right], heap_[smallest]))
+      smallest = right;
+    if (smallest == index)
+      break;
+    std::swap(heap_[index], heap_[smallest]);
+    index = smallest;
+  }
+}
+
+/**
+ * Look for the next identifier not in use after last_id_, wrapping around, and for the first one in use after it
+ *
+ * @return false when all the identifiers are in use
+ */
+bool EspHomeClientScheduler::findFreeIds()
+{
+  if ((uint32_t)size_ + (running_id_ != 0 ? 1 : 0) >= 0xFFFF)
+    return false;
+
+  uint32_t candidate = (uint32_t)last_id_ + 1;
+  while (true)
+  {
+    if (candidate > 0xFFFF)
+      candidate = 1;
+
+    bool used = candidate == running_id_;
+    uint32_t limit = running_id_ > candidate ? running_id_ : 0x10000;
+    for (uint16_t i = 0; i < size_ && !used; i++)
+    {
+      if (heap_[i].id == candidate)
+        used = true;
+      else if (heap_[i].id > candidate && heap_[i].id < limit)
+        limit = heap_[i].id;
+    }
+
+    if (!used)
+    {
+      last_id_ = candidate - 1;
+      free_id_limit_ = limit;
+      return true;
+    }
+    candidate++;
+  }
+}
+
+// Linear, only used to cancel a task or read its statistics
+int EspHomeClientScheduler::find(uint16_t id) const
+{
+  for (uint16_t i = 0; i < size_; i++)
+  {
+    if (heap_[i].id == id)
+      return i;
+  }
+
+  return -1;
+}
@@ -0,0 +1,71 @@
+#ifndef EspHomeClientScheduler_h
+#define EspHomeClientScheduler_h
+
+#include <Arduino.h>
+#include <functional>
+
+typedef std::function<void()> ScheduledTaskCallback;
+
+struct ScheduledTaskStats
+{
+    unsigned long runs;
+    unsigned long overruns; // Runs that started a whole interval late, the missed ones are skipped
+    unsigned long max_micros;
+};
+
+struct SchedulerStats
+{
+    unsigned long runs;
+    unsigned long cut_ticks; // Ticks that left due tasks to the next one, the time budget being spent
+    uint16_t tasks;
+};
+
+// Timers run from EspHomeClient::loop(). The tasks are kept in a min-heap ordered by due time, a tick only looks at
+// its top. A tick stops once its time budget is spent, the remaining due tasks run in the next one.
+class EspHomeClientScheduler
+{
+public:
+    struct Task
+    {
+        uint16_t id;
+        unsigned long due_millis;
+        unsigned long interval_millis; // 0 for a one shot task
+        ScheduledTaskCallback callback;
+        ScheduledTaskStats stats;
+    };
+
+private:
+    Task *heap_;
+    uint16_t size_;
+    uint16_t capacity_;
+    uint16_t last_id_;
+    uint32_t free_id_limit_;   // The identifiers after last_id_ and below this one are not in use
+    uint16_t running_id_;      // Task out of the heap while it runs, 0 when none
+    bool running_cancelled_;
+    unsigned long tick_budget_micros_;
+    SchedulerStats stats_;
+
+    static bool runsBefore(const Task &a, const Task &b);
+    void push(Task &task);
+    void removeAt(uint16_t index, Task &task);
+    void siftUp(uint16_t index);
+    void siftDown(uint16_t index);
+    int find(uint16_t id) const;
+    bool findFreeIds();
+
+public:
+    EspHomeClientScheduler();
+    ~EspHomeClientScheduler();
+
+    // Return the task identifier, 0 when out of identifiers
+    uint16_t schedule(unsigned long now_millis, unsigned long delay_millis, unsigned long interval_millis, ScheduledTaskCallback callback);
+    bool cancel(uint16_t id); // Can be called from any task, including the cancelled one
+    const ScheduledTaskStats *getTaskStats(uint16_t id) const; // NULL when unknown, or running
+    inline const SchedulerStats &getStats() const { return stats_; };
+    inline bool isEmpty() const { return size_ == 0; };
+
+    inline void setTickBudget(unsigned long budget_micros) { tick_budget_micros_ = budget_micros; };
+    void tick(unsigned long now_millis); // Run the due tasks, at least one when any is due
+};
+
+#endif
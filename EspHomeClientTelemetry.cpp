@@ -0,0 +1,101 @@
+#include "EspHomeClientTelemetry.h"
+#include <math.h>
+
+EspHomeClientTelemetry::EspHomeClientTelemetry(const char *topic, uint8_t type)
+{
+  size_t topic_size = strlen(topic) + 1;
+  topic_ = new char[topic_size];
+  memcpy(topic_, topic, topic_size);
+  type_ = type;
+  next_ = NULL;
+
+  min_interval_millis_ = 0;
+  max_interval_millis_ = 0;
+  deadband_ = 0;
+  decimals_ = 2;
+  retain_ = false;
+
+  numeric_ = false;
+  sent_number_ = 0;
+  pending_number_ = 0;
+  sent_value_[0] = '\0';
+  pending_value_[0] = '\0';
+  pending_ = false;
+  sent_once_ = false;
+  sent_millis_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientTelemetry::~EspHomeClientTelemetry()
+{
+  delete[] topic_;
+}
+
+// The value in pending_value_ replaces the pending one, if any
+void EspHomeClientTelemetry::setPending(bool changed)
+{
+  stats_.updates++;
+  if (pending_)
+    stats_.suppressed++;
+
+  pending_ = changed || !sent_once_;
+  if (!pending_)
+    stats_.suppressed++;
+}
+
+void EspHomeClientTelemetry::update(double value)
+{
+  numeric_ = true;
+  bool changed = fabs(value - sent_number_) > deadband_;
+
+  // Formatted once, trailing zeros dropped so that 1.00 is sent as 1
+  int length = snprintf(pending_value_, sizeof(pending_value_), "%.*f", (int)decimals_, value);
+  if (length > 0 && length < (int)sizeof(pending_value_) && strchr(pending_value_, '.') != NULL)
+  {
+    while (pending_value_[length - 1] == '0')
+      pending_value_[--length] = '\0';
+    if (pending_value_[length - 1] == '.')
+      pending_value_[--length] = '\0';
+  }
+
+  // A change within the deadband may still be visible once formatted, it is not published either
+  setPending(changed && strcmp(pending_value_, sent_value_) != 0);
+  pending_number_ = value;
+}
+
+void EspHomeClientTelemetry::updateText(const char *value)
+{
+  numeric_ = false;
+  strncpy(pending_value_, value, sizeof(pending_value_) - 1);
+  pending_value_[sizeof(pending_value_) - 1] = '\0';
+
+  setPending(strcmp(pending_value_, sent_value_) != 0);
+}
+
+const char *EspHomeClientTelemetry::due(unsigned long now_millis)
+{
+  if (pending_)
+    return (!sent_once_ || now_millis - sent_millis_ >= min_interval_millis_) ? pending_value_ : NULL;
+
+  if (sent_once_ && max_interval_millis_ > 0 && now_millis - sent_millis_ >= max_interval_millis_)
+    return sent_value_;
+
+  return NULL;
+}
+
+void EspHomeClientTelemetry::markSent(unsigned long now_millis)
+{
+  if (pending_)
+  {
+    memcpy(sent_value_, pending_value_, sizeof(sent_value_));
+    if (numeric_)
+      sent_number_ = pending_number_;
+    pending_ = false;
+    stats_.sent++;
+  }
+  else
+    stats_.heartbeats++;
+
+  sent_once_ = true;
+  sent_millis_ = now_millis;
+}
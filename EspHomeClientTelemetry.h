@@ -0,0 +1,72 @@
+#ifndef EspHomeClientTelemetry_h
+#define EspHomeClientTelemetry_h
+
+#include <Arduino.h>
+
+// Longest payload of a telemetry channel, including the string termination
+#ifndef ESPHOMECLIENT_TELEMETRY_VALUE_LENGTH
+#define ESPHOMECLIENT_TELEMETRY_VALUE_LENGTH 24
+#endif
+
+struct TelemetryStats
+{
+    unsigned long updates;    // Values passed to update()
+    unsigned long sent;       // Changes published
+    unsigned long suppressed; // Values within the deadband, or replaced by a newer one before being published
+    unsigned long heartbeats; // Unchanged values published again after the max interval
+};
+
+// Last value of a telemetry topic. Values are only published when they change, at most once per min interval,
+// and at least once per max interval when it is set. Pending values are coalesced, only the latest one is sent.
+// Channels are created by EspHomeClient::telemetry() and published from its loop() while connected.
+class EspHomeClientTelemetry
+{
+private:
+    char *topic_;
+    uint8_t type_;
+    EspHomeClientTelemetry *next_;
+
+    unsigned long min_interval_millis_;
+    unsigned long max_interval_millis_;
+    double deadband_;
+    uint8_t decimals_;
+    bool retain_;
+
+    bool numeric_;
+    double sent_number_;
+    double pending_number_;
+    char sent_value_[ESPHOMECLIENT_TELEMETRY_VALUE_LENGTH];
+    char pending_value_[ESPHOMECLIENT_TELEMETRY_VALUE_LENGTH];
+    bool pending_;
+    bool sent_once_;
+    unsigned long sent_millis_;
+    TelemetryStats stats_;
+
+    void setPending(bool changed);
+
+    friend class EspHomeClient;
+
+public:
+    EspHomeClientTelemetry(const char *topic, uint8_t type);
+    ~EspHomeClientTelemetry();
+
+    // Settings, can be chained
+    EspHomeClientTelemetry &setMinInterval(unsigned long millis) { min_interval_millis_ = millis; return *this; }; // 0 by default
+    EspHomeClientTelemetry &setMaxInterval(unsigned long millis) { max_interval_millis_ = millis; return *this; }; // Heartbeat, 0 (none) by default
+    EspHomeClientTelemetry &setDeadband(double deadband) { deadband_ = deadband; return *this; }; // Numeric changes up to deadband are not published
+    EspHomeClientTelemetry &setDecimals(uint8_t decimals) { decimals_ = decimals; return *this; }; // 2 by default, trailing zeros are not sent
+    EspHomeClientTelemetry &setRetain(bool retain = true) { retain_ = retain; return *this; };
+
+    void update(double value);
+    void updateText(const char *value); // Longer values are cut to ESPHOMECLIENT_TELEMETRY_VALUE_LENGTH - 1 characters
+
+    inline const char *getTopic() const { return topic_; };
+    inline bool isPending() const { return pending_; };
+    inline const TelemetryStats &getStats() const { return stats_; };
+
+    // Value to publish at now_millis, NULL when there is none
+    const char *due(unsigned long now_millis);
+    void markSent(unsigned long now_millis);
+};
+
+#endif
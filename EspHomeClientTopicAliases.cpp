@@ -0,0 +1,75 @@
+#include "EspHomeClientTopicAliases.h"
+
+EspHomeClientTopicAliases::EspHomeClientTopicAliases()
+{
+  memset(entries_, 0, sizeof(entries_));
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+EspHomeClientTopicAliases::~EspHomeClientTopicAliases()
+{
+  for (uint8_t i = 0; i < stats_.aliases; i++)
+  {
+    delete[] entries_[i].topic;
+    delete[] entries_[i].alias;
+  }
+}
+
+char *EspHomeClientTopicAliases::copyString(const char *string)
+{
+  size_t length = strlen(string) + 1;
+  char *copy = new char[length];
+  memcpy(copy, string, length);
+  return copy;
+}
+
+bool EspHomeClientTopicAliases::add(const char *topic, const char *alias)
+{
+  if (stats_.aliases == ESPHOMECLIENT_MAX_TOPIC_ALIASES)
+    return false;
+
+  size_t alias_length = strlen(alias);
+  if (alias_length == 0 || alias_length >= strlen(topic) || strpbrk(alias, "/+#") != NULL)
+    return false;
+
+  for (uint8_t i = 0; i < stats_.aliases; i++)
+  {
+    // An alias equal to another topic would be ambiguous once received
+    if (strcmp(entries_[i].topic, topic) == 0 || strcmp(entries_[i].alias, alias) == 0 ||
+        strcmp(entries_[i].topic, alias) == 0 || strcmp(entries_[i].alias, topic) == 0)
+      return false;
+  }
+
+  entries_[stats_.aliases].topic = copyString(topic);
+  entries_[stats_.aliases].alias = copyString(alias);
+  stats_.aliases++;
+  return true;
+}
+
+const char *EspHomeClientTopicAliases::shorten(const char *topic)
+{
+  for (uint8_t i = 0; i < stats_.aliases; i++)
+  {
+    if (strcmp(entries_[i].topic, topic) == 0)
+    {
+      stats_.shortened++;
+      return entries_[i].alias;
+    }
+  }
+
+  return topic;
+}
+
+const char *EspHomeClientTopicAliases::expand(const char *alias)
+{
+  for (uint8_t i = 0; i < stats_.aliases; i++)
+  {
+    if (strcmp(entries_[i].alias, alias) == 0)
+    {
+      stats_.expanded++;
+      return entries_[i].topic;
+    }
+  }
+
+  return NULL;
+}
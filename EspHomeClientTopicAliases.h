@@ -0,0 +1,47 @@
+#ifndef EspHomeClientTopicAliases_h
+#define EspHomeClientTopicAliases_h
+
+#include <Arduino.h>
+
+#ifndef ESPHOMECLIENT_MAX_TOPIC_ALIASES
+#define ESPHOMECLIENT_MAX_TOPIC_ALIASES 16
+#endif
+
+struct TopicAliasStats
+{
+    unsigned long shortened; // Topics replaced by their alias when building a full topic
+    unsigned long expanded;  // Received aliases resolved back to their topic
+    uint8_t aliases;
+};
+
+// Short aliases of frequent topics, sent on the wire in place of the topic. Both sides of the connection must
+// know the same aliases. The table is small and searched linearly, the strings are copied once when added.
+class EspHomeClientTopicAliases
+{
+private:
+    struct Entry
+    {
+        char *topic;
+        char *alias;
+    };
+
+    Entry entries_[ESPHOMECLIENT_MAX_TOPIC_ALIASES];
+    TopicAliasStats stats_;
+
+    static char *copyString(const char *string);
+
+public:
+    EspHomeClientTopicAliases();
+    ~EspHomeClientTopicAliases();
+
+    // False when the table is full, when the topic or the alias is already known, or when the alias is not a
+    // single topic level shorter than the topic
+    bool add(const char *topic, const char *alias);
+    inline uint8_t count() const { return stats_.aliases; };
+    inline const TopicAliasStats &getStats() const { return stats_; };
+
+    const char *shorten(const char *topic); // Alias of the topic, or the topic itself
+    const char *expand(const char *alias);  // Topic of the alias, NULL when unknown
+};
+
+#endif
@@ -0,0 +1,353 @@
+#include "EspHomeClientTransport.h"
+
+EspHomeClientTransport::EspHomeClientTransport(Client &client) : client_(&client)
+{
+  skipped_packet_ = NULL;
+  skipped_packet_length_ = 0;
+  skipped_packet_position_ = 0;
+  skipped_packet_mismatch_ = false;
+  stream_listener_ = NULL;
+  lookahead_ = NULL;
+  lookahead_size_ = 0;
+  stream_topic_ = NULL;
+  stream_chunk_ = NULL;
+  lookahead_state_ = LOOKAHEAD_NONE;
+  stream_activity_millis_ = 0;
+  incoming_packet_count_ = 0;
+  expectConnack();
+}
+
+EspHomeClientTransport::~EspHomeClientTransport()
+{
+  delete[] lookahead_;
+}
+
+void EspHomeClientTransport::expectConnack()
+{
+  session_present_ = false;
+  incoming_type_ = 0;
+  incoming_header_read_ = false;
+  incoming_length_shift_ = 0;
+  incoming_remaining_length_ = 0;
+  incoming_position_ = 0;
+  acknowledged_head_ = 0;
+  acknowledged_count_ = 0;
+  resetLookahead();
+}
+
+bool EspHomeClientTransport::takeAcknowledgement(uint16_t &packet_id)
+{
+  if (acknowledged_count_ == 0)
+    return false;
+
+  packet_id = acknowledged_packet_ids_[acknowledged_head_];
+  acknowledged_head_ = (acknowledged_head_ + 1) % ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH;
+  acknowledged_count_--;
+  return true;
+}
+
+size_t EspHomeClientTransport::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t EspHomeClientTransport::write(const uint8_t *buf, size_t size)
+{
+  if (skipped_packet_ == NULL)
+    return client_->write(buf, size);
+
+  // Whatever PubSubClient writes is dropped, the connection already carries a CONNECT packet. Sending anything
+  // else before the CONNACK is read would break the protocol.
+  if (!skipped_packet_mismatch_)
+  {
+    if (size <= skipped_packet_length_ - skipped_packet_position_ && memcmp(buf, skipped_packet_ + skipped_packet_position_, size) == 0)
+      skipped_packet_position_ += size;
+    else
+      skipped_packet_mismatch_ = true;
+  }
+
+  return size;
+}
+
+void EspHomeClientTransport::skipOutgoingPacket(const uint8_t *packet, size_t length)
+{
+  skipped_packet_ = packet;
+  skipped_packet_length_ = length;
+  skipped_packet_position_ = 0;
+  skipped_packet_mismatch_ = false;
+}
+
+bool EspHomeClientTransport::stopSkippingOutgoingPacket()
+{
+  bool skipped = (skipped_packet_ != NULL && !skipped_packet_mismatch_ && skipped_packet_position_ == skipped_packet_length_);
+  skipped_packet_ = NULL;
+  return skipped;
+}
+
+void EspHomeClientTransport::stop()
+{
+  skipped_packet_ = NULL;
+  resetLookahead();
+  client_->stop();
+}
+
+int EspHomeClientTransport::available()
+{
+  // Between two packets, an incoming PUBLISH is read ahead before PubSubClient gets to see it
+  if (stream_listener_ != NULL && incoming_type_ == 0 && lookaheadIncomingPublish())
+    return 0;
+
+  int available = client_->available();
+  if (lookahead_state_ == LOOKAHEAD_PASSING)
+    available += lookahead_length_ - lookahead_position_;
+
+  return available;
+}
+
+int EspHomeClientTransport::read()
+{
+  int b;
+  if (lookahead_state_ == LOOKAHEAD_PASSING)
+  {
+    b = lookahead_[lookahead_position_++];
+    if (lookahead_position_ == lookahead_length_)
+      resetLookahead();
+  }
+  else
+    b = client_->read();
+
+  if (b >= 0)
+    inspectIncomingByte(b);
+
+  return b;
+}
+
+int EspHomeClientTransport::read(uint8_t *buf, size_t size)
+{
+  int count;
+  if (lookahead_state_ == LOOKAHEAD_PASSING)
+  {
+    count = min(size, lookahead_length_ - lookahead_position_);
+    memcpy(buf, lookahead_ + lookahead_position_, count);
+    lookahead_position_ += count;
+    if (lookahead_position_ == lookahead_length_)
+      resetLookahead();
+  }
+  else
+    count = client_->read(buf, size);
+
+  for (int i = 0; i < count; i++)
+    inspectIncomingByte(buf[i]);
+
+  return count;
+}
+
+int EspHomeClientTransport::peek()
+{
+  if (lookahead_state_ == LOOKAHEAD_PASSING)
+    return lookahead_[lookahead_position_];
+
+  return client_->peek();
+}
+
+void EspHomeClientTransport::inspectIncomingByte(uint8_t b)
+{
+  // Fixed header: packet type, then the remaining length on up to 4 bytes
+  if (incoming_type_ == 0)
+  {
+    incoming_type_ = b & 0xF0;
+    incoming_length_shift_ = 0;
+    incoming_remaining_length_ = 0;
+    return;
+  }
+
+  if (!incoming_header_read_)
+  {
+    incoming_remaining_length_ |= (uint32_t)(b & 0x7F) << incoming_length_shift_;
+    incoming_length_shift_ += 7;
+    if ((b & 0x80) == 0)
+    {
+      incoming_header_read_ = true;
+      incoming_position_ = 0;
+      incoming_packet_id_ = 0;
+      if (incoming_remaining_length_ == 0)
+        incomingPacketEnd();
+    }
+    return;
+  }
+
+  switch (incoming_type_)
+  {
+  case 0x20: // CONNACK: acknowledge flags, return code
+    if (incoming_position_ == 0)
+      session_present_ = (b & 0x01);
+    break;
+  case 0x40: // PUBACK: packet identifier
+    if (incoming_position_ < 2)
+      incoming_packet_id_ = (incoming_packet_id_ << 8) | b;
+    break;
+  }
+
+  if (++incoming_position_ == incoming_remaining_length_)
+    incomingPacketEnd();
+}
+
+void EspHomeClientTransport::incomingPacketEnd()
+{
+  if (incoming_type_ == 0x40 && acknowledged_count_ < ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH)
+  {
+    acknowledged_packet_ids_[(acknowledged_head_ + acknowledged_count_) % ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH] = incoming_packet_id_;
+    acknowledged_count_++;
+  }
+
+  incoming_packet_count_++;
+  incoming_type_ = 0;
+  incoming_header_read_ = false;
+}
+
+bool EspHomeClientTransport::enableStreaming(EspHomeClientStreamListener *listener, size_t max_topic_length)
+{
+  if (lookahead_ != NULL)
+    return false;
+
+  // Fixed header, topic length, topic and packet identifier, then the terminated topic and the chunk buffer
+  lookahead_size_ = 5 + 2 + max_topic_length + 2;
+  lookahead_ = new uint8_t[lookahead_size_ + max_topic_length + 1 + ESPHOMECLIENT_STREAM_CHUNK_SIZE];
+  stream_topic_ = (char *)lookahead_ + lookahead_size_;
+  stream_chunk_ = lookahead_ + lookahead_size_ + max_topic_length + 1;
+  stream_listener_ = listener;
+  return true;
+}
+
+/**
+ * Read the header of the next incoming PUBLISH, as much as has arrived, and let the listener decide to stream it
+ *
+ * @return true while PubSubClient must not read: header incomplete or payload being streamed
+ */
+bool EspHomeClientTransport::lookaheadIncomingPublish()
+{
+  if (lookahead_state_ == LOOKAHEAD_STREAMING)
+    return true;
+  if (lookahead_state_ == LOOKAHEAD_PASSING)
+    return false;
+
+  if (lookahead_state_ == LOOKAHEAD_NONE)
+  {
+    if (client_->available() == 0 || (client_->peek() & 0xF0) != 0x30)
+      return false;
+    lookahead_state_ = LOOKAHEAD_READING;
+  }
+
+  // Read byte by byte, never past the header
+  size_t header_length = 0, topic_length = 0, needed = 0;
+  uint32_t remaining_length = 0;
+  while ((needed = lookaheadHeaderLength(header_length, remaining_length, topic_length)) == 0 || lookahead_length_ < needed)
+  {
+    // Malformed or too long to be streamed, PubSubClient gets the packet
+    if (needed > lookahead_size_)
+    {
+      lookahead_state_ = LOOKAHEAD_PASSING;
+      return false;
+    }
+
+    if (client_->available() == 0)
+      return true;
+    lookahead_[lookahead_length_++] = client_->read();
+  }
+
+  if (remaining_length < needed - header_length)
+  {
+    lookahead_state_ = LOOKAHEAD_PASSING;
+    return false;
+  }
+
+  // The topic is copied and terminated behind the header, which stays intact for PubSubClient
+  memcpy(stream_topic_, lookahead_ + header_length + 2, topic_length);
+  stream_topic_[topic_length] = '\0';
+
+  if (!stream_listener_->onStreamBegin(stream_topic_, remaining_length - (needed - header_length)))
+  {
+    lookahead_state_ = LOOKAHEAD_PASSING;
+    return false;
+  }
+
+  stream_remaining_ = remaining_length - (needed - header_length);
+  stream_packet_id_ = 0;
+  if (needed > header_length + 2 + topic_length)
+    stream_packet_id_ = (lookahead_[needed - 2] << 8) | lookahead_[needed - 1];
+  stream_activity_millis_ = millis();
+  lookahead_state_ = LOOKAHEAD_STREAMING;
+  return true;
+}
+
+/**
+ * Length of the header held by the lookahead buffer: fixed header, topic and packet identifier
+ *
+ * @return 0 while more bytes are needed to know it, SIZE_MAX for a malformed remaining length
+ */
+size_t EspHomeClientTransport::lookaheadHeaderLength(size_t &header_length, uint32_t &remaining_length, size_t &topic_length) const
+{
+  remaining_length = 0;
+  size_t position = 1;
+  while (true)
+  {
+    if (position == 5)
+      return SIZE_MAX;
+    if (position >= lookahead_length_)
+      return 0;
+
+    uint8_t digit = lookahead_[position];
+    remaining_length |= (uint32_t)(digit & 0x7F) << (7 * (position - 1));
+    position++;
+    if ((digit & 0x80) == 0)
+      break;
+  }
+
+  header_length = position;
+  if (lookahead_length_ < header_length + 2)
+    return 0;
+
+  uint8_t qos = (lookahead_[0] >> 1) & 0x03;
+  topic_length = (lookahead_[header_length] << 8) | lookahead_[header_length + 1];
+  return header_length + 2 + topic_length + (qos > 0 ? 2 : 0);
+}
+
+void EspHomeClientTransport::processIncomingStream()
+{
+  if (lookahead_state_ != LOOKAHEAD_STREAMING)
+    return;
+
+  while (stream_remaining_ > 0 && client_->available() > 0)
+  {
+    int count = client_->read(stream_chunk_, min((size_t)ESPHOMECLIENT_STREAM_CHUNK_SIZE, stream_remaining_));
+    if (count <= 0)
+      break;
+
+    stream_remaining_ -= count;
+    stream_activity_millis_ = millis();
+    stream_listener_->onStreamData(stream_chunk_, count);
+  }
+
+  if (stream_remaining_ > 0)
+    return;
+
+  if (stream_packet_id_ != 0)
+  {
+    uint8_t puback[4] = {0x40, 2, (uint8_t)(stream_packet_id_ >> 8), (uint8_t)(stream_packet_id_ & 0xFF)};
+    client_->write(puback, sizeof(puback));
+  }
+
+  lookahead_state_ = LOOKAHEAD_NONE;
+  lookahead_length_ = 0;
+  stream_listener_->onStreamEnd(true);
+}
+
+void EspHomeClientTransport::resetLookahead()
+{
+  if (lookahead_state_ == LOOKAHEAD_STREAMING)
+    stream_listener_->onStreamEnd(false);
+
+  lookahead_state_ = LOOKAHEAD_NONE;
+  lookahead_length_ = 0;
+  lookahead_position_ = 0;
+}
@@ -0,0 +1,137 @@
+#ifndef EspHomeClientTransport_h
+#define EspHomeClientTransport_h
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Acknowledgements waiting for EspHomeClient, PubSubClient reads at most one packet per loop() call
+#ifndef ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH
+#define ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH 8
+#endif
+
+// Pieces streamed payloads are handed out in
+#ifndef ESPHOMECLIENT_STREAM_CHUNK_SIZE
+#define ESPHOMECLIENT_STREAM_CHUNK_SIZE 128
+#endif
+
+struct TransportStats
+{
+    unsigned long connections;
+    unsigned long failed_connections;
+    unsigned long first_connect_millis; // Time to open the first connection, TLS handshake included. The later ones may resume its TLS session
+    unsigned long last_connect_millis;
+    unsigned long min_connect_millis;
+    unsigned long max_connect_millis;
+};
+
+// Receives the PUBLISH packets taken away from PubSubClient, payload piece by piece
+class EspHomeClientStreamListener
+{
+public:
+    virtual bool onStreamBegin(const char *topic, size_t length) = 0; // Return true to stream the payload, false to leave the packet to PubSubClient
+    virtual void onStreamData(const uint8_t *data, size_t length) = 0;
+    virtual void onStreamEnd(bool complete) = 0; // complete is false when the connection closed before the end of the payload
+};
+
+// Client handed to PubSubClient, it forwards everything to the network client.
+// Sitting between both lets EspHomeClient write to the connection itself and hide bytes from PubSubClient.
+// The packets read by PubSubClient are followed to pick what it ignores: the CONNACK flags and the PUBACKs.
+// With a stream listener, the header of each incoming PUBLISH is read ahead. The listener may then take the packet,
+// whose payload is never buffered whole, otherwise the header is handed to PubSubClient as if nothing happened.
+class EspHomeClientTransport : public Client
+{
+private:
+    Client *client_;
+    const uint8_t *skipped_packet_; // Packet expected from PubSubClient, dropped instead of being sent
+    size_t skipped_packet_length_;
+    size_t skipped_packet_position_;
+    bool skipped_packet_mismatch_;
+    bool session_present_;
+
+    // Incoming packet being read by PubSubClient
+    uint8_t incoming_type_;
+    bool incoming_header_read_; // Type and remaining length read
+    uint8_t incoming_length_shift_;
+    uint32_t incoming_remaining_length_;
+    uint32_t incoming_position_; // Position after the fixed header
+    uint16_t incoming_packet_id_;
+    uint32_t incoming_packet_count_;
+
+    uint16_t acknowledged_packet_ids_[ESPHOMECLIENT_TRANSPORT_ACK_QUEUE_LENGTH];
+    uint8_t acknowledged_head_;
+    uint8_t acknowledged_count_;
+
+    // Incoming PUBLISH read ahead of PubSubClient
+    enum LookaheadState
+    {
+        LOOKAHEAD_NONE,
+        LOOKAHEAD_READING, // Header being read, PubSubClient sees no data meanwhile
+        LOOKAHEAD_PASSING, // Header left to PubSubClient, read from the lookahead buffer first
+        LOOKAHEAD_STREAMING // Payload handed to the stream listener
+    };
+    EspHomeClientStreamListener *stream_listener_;
+    LookaheadState lookahead_state_;
+    uint8_t *lookahead_; // Header, followed in the same allocation by the stream topic and chunk buffers
+    size_t lookahead_size_;
+    size_t lookahead_length_;
+    size_t lookahead_position_;
+    size_t stream_remaining_;
+    uint16_t stream_packet_id_; // 0 for QoS 0
+    char *stream_topic_;
+    uint8_t *stream_chunk_;
+    unsigned long stream_activity_millis_; // Last time a part of the streamed payload arrived
+
+    void inspectIncomingByte(uint8_t b);
+    void incomingPacketEnd();
+    bool lookaheadIncomingPublish();
+    size_t lookaheadHeaderLength(size_t &header_length, uint32_t &remaining_length, size_t &topic_length) const;
+    void resetLookahead();
+
+public:
+    EspHomeClientTransport(Client &client);
+    ~EspHomeClientTransport();
+
+    // Drop the next bytes written by PubSubClient as long as they are those of packet, which must stay valid until
+    // stopSkippingOutgoingPacket(). Used for the CONNECT packet EspHomeClient already sent. Anything else written
+    // meanwhile is dropped too, without being compared.
+    void skipOutgoingPacket(const uint8_t *packet, size_t length);
+    // Return true when PubSubClient wrote exactly the expected packet
+    bool stopSkippingOutgoingPacket();
+    // Write directly to the network client, bypassing the skipped bytes
+    inline size_t writeDirect(const uint8_t *buf, size_t size) { return client_->write(buf, size); };
+
+    inline Client &client() { return *client_; };
+    inline void setClient(Client &client) { client_ = &client; }; // Only while disconnected
+
+    // A new connection starts, the next packet read by PubSubClient is a CONNACK
+    void expectConnack();
+    inline bool sessionPresent() const { return session_present_; };
+    // Identifier of the next PUBACK received, false when there is none
+    bool takeAcknowledgement(uint16_t &packet_id);
+
+    // Let the listener take incoming PUBLISH packets whose topic is up to max_topic_length long. Allocated once
+    bool enableStreaming(EspHomeClientStreamListener *listener, size_t max_topic_length);
+    // Hand the streamed payload received so far to the listener
+    void processIncomingStream();
+    inline const char *streamTopic() const { return stream_topic_; };
+    inline bool streaming() const { return lookahead_state_ == LOOKAHEAD_STREAMING; };
+    inline unsigned long streamActivityMillis() const { return stream_activity_millis_; };
+    // Packets read by PubSubClient, the streamed ones are not
+    inline uint32_t incomingPacketCount() const { return incoming_packet_count_; };
+
+    // Client
+    inline int connect(IPAddress ip, uint16_t port) override { return client_->connect(ip, port); };
+    inline int connect(const char *host, uint16_t port) override { return client_->connect(host, port); };
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    inline void flush() override { client_->flush(); };
+    void stop() override;
+    inline uint8_t connected() override { return client_->connected(); };
+    inline operator bool() override { return (bool)*client_; };
+};
+
+#endif
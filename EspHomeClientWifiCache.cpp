@@ -0,0 +1,81 @@
+#include "EspHomeClientWifiCache.h"
+
+#ifdef ESP8266
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+
+// Kept through deep sleep, not through a power loss
+RTC_DATA_ATTR static EspHomeClientWifiCache::Data rtc_wifi_cache;
+#endif
+
+EspHomeClientWifiCache::EspHomeClientWifiCache()
+{
+  memset(&data_, 0, sizeof(data_));
+  valid_ = false;
+}
+
+bool EspHomeClientWifiCache::load(const char *ssid)
+{
+#ifdef ESP8266
+  valid_ = ESP.rtcUserMemoryRead(ESPHOMECLIENT_RTC_MEMORY_OFFSET, (uint32_t *)&data_, sizeof(data_));
+#else
+  data_ = rtc_wifi_cache;
+  valid_ = true;
+#endif
+
+  valid_ = valid_ && data_.checksum == checksum(data_, ssid) && data_.local_ip != 0;
+  return valid_;
+}
+
+void EspHomeClientWifiCache::save(const char *ssid)
+{
+  Data data;
+  memset(&data, 0, sizeof(data));
+  memcpy(data.bssid, WiFi.BSSID(), sizeof(data.bssid));
+  data.channel = WiFi.channel();
+  data.local_ip = WiFi.localIP();
+  data.gateway_ip = WiFi.gatewayIP();
+  data.subnet_mask = WiFi.subnetMask();
+  data.dns_ip = WiFi.dnsIP();
+  data.checksum = checksum(data, ssid);
+
+  // Nothing to write when reconnecting to the same access point with the same lease
+  if (valid_ && memcmp(&data, &data_, sizeof(data)) == 0)
+    return;
+
+  data_ = data;
+  valid_ = true;
+#ifdef ESP8266
+  ESP.rtcUserMemoryWrite(ESPHOMECLIENT_RTC_MEMORY_OFFSET, (uint32_t *)&data_, sizeof(data_));
+#else
+  rtc_wifi_cache = data_;
+#endif
+}
+
+void EspHomeClientWifiCache::invalidate()
+{
+  if (!valid_)
+    return;
+
+  data_.checksum = ~data_.checksum;
+  valid_ = false;
+#ifdef ESP8266
+  ESP.rtcUserMemoryWrite(ESPHOMECLIENT_RTC_MEMORY_OFFSET, (uint32_t *)&data_, sizeof(data_));
+#else
+  rtc_wifi_cache = data_;
+#endif
+}
+
+// FNV-1a
+uint32_t EspHomeClientWifiCache::checksum(const Data &data, const char *ssid)
+{
+  uint32_t hash = 2166136261u;
+  const uint8_t *bytes = (const uint8_t *)&data + sizeof(data.checksum);
+  for (size_t i = 0; i < sizeof(data) - sizeof(data.checksum); i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  for (const char *c = ssid; *c != '\0'; c++)
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+
+  return hash;
+}
@@ -0,0 +1,55 @@
+#ifndef EspHomeClientWifiCache_h
+#define EspHomeClientWifiCache_h
+
+#include <Arduino.h>
+
+// Position of the cache in the ESP8266 RTC user memory, in 4 bytes blocks.
+// The first 128 bytes are skipped, they are overwritten by OTA updates.
+#ifndef ESPHOMECLIENT_RTC_MEMORY_OFFSET
+#define ESPHOMECLIENT_RTC_MEMORY_OFFSET 32
+#endif
+
+struct WifiConnectionStats
+{
+    unsigned long last_connection_millis; // Time from WiFi.begin() to the connection of the last attempt
+    bool last_connection_fast;
+    unsigned long fast_connections;
+    unsigned long full_connections; // Connections with a scan and a DHCP request
+    unsigned long fast_connection_failures;
+};
+
+// Access point and DHCP lease of the last connection, kept in RTC memory so that it survives resets and deep sleep.
+// Reusing them skips the scan and the DHCP request of the next connection.
+class EspHomeClientWifiCache
+{
+public:
+    struct Data
+    {
+        uint32_t checksum; // Covers the fields below and the SSID, a change of network invalidates the cache
+        uint8_t bssid[6];
+        uint8_t reserved[2];
+        int32_t channel;
+        uint32_t local_ip;
+        uint32_t gateway_ip;
+        uint32_t subnet_mask;
+        uint32_t dns_ip;
+    };
+
+private:
+    Data data_;
+    bool valid_;
+
+    static uint32_t checksum(const Data &data, const char *ssid);
+
+public:
+    EspHomeClientWifiCache();
+
+    bool load(const char *ssid); // Read the cache from RTC memory, return whether it is valid for this network
+    void save(const char *ssid); // Store the current connection
+    void invalidate();
+
+    inline bool isValid() const { return valid_; };
+    inline const Data &data() const { return data_; };
+};
+
+#endif
@@ -20,26 +20,25 @@ void setup() {
 
   client.enableDebuggingMessages();
 
-  // Radar
+  // Only the changes are published, and at least once a minute
+  client.telemetry("present").setMaxInterval(60000);
+
+  // Radar, read every 2 seconds without blocking the client
   pinMode (RADAR_SENSOR_PIN, INPUT);
+  client.every(2000, checkMovement);
 }
 
 void loop() {
   client.loop();
-  
-  checkMovement();
-
-  delay(2000);
 }
 
 void onConnectionEstablished(){}
 
 void checkMovement() {
   int sensorValue = digitalRead(RADAR_SENSOR_PIN);
-  
-  if (sensorValue == 1) {
-    char value[2];
-    sprintf(value, "%02i", sensorValue);
-    client.publish(TELE, "present", value);
-  }
+
+  // Same payload as before the telemetry channel, "01" when present. The absence is published too, as "00"
+  char value[3];
+  sprintf(value, "%02i", sensorValue);
+  client.telemetry("present").updateText(value);
 }
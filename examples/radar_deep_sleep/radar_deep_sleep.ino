@@ -0,0 +1,48 @@
+#include <EspHomeClient.h>
+
+// WiFi & MQTT Server
+const char* ssid = "";
+const char* password = "";
+const char* mqtt_broker = "";
+const char* mqtt_username = "";
+const char* mqtt_password = "";
+const char* mqtt_client_name = "garden_radar_1";
+
+// Sensor
+const int RADAR_SENSOR_PIN = 5;
+
+// Wake up every 5 minutes
+const uint64_t SLEEP_MICROS = 5 * 60 * 1000000ULL;
+
+EspHomeClient client(
+  ssid, password, mqtt_broker, mqtt_username, mqtt_password, mqtt_client_name
+);
+
+void setup() {
+  Serial.begin(115200);
+
+  client.enableDebuggingMessages();
+
+  // The reading is queued until the connection is established
+  client.enablePublishQueue(256);
+  // Sleep once the reading is sent and the retained commands had 300ms to arrive
+  client.enableDeepSleepCycle(SLEEP_MICROS, 300);
+
+  // Radar
+  pinMode (RADAR_SENSOR_PIN, INPUT);
+
+  char value[3];
+  sprintf(value, "%02i", digitalRead(RADAR_SENSOR_PIN));
+  client.publish(TELE, "present", value);
+}
+
+void loop() {
+  client.loop();
+}
+
+void onConnectionEstablished() {
+  // Awake time of the previous cycle
+  char value[12];
+  sprintf(value, "%lu", (unsigned long)client.getDutyCycleStats().last_awake_millis);
+  client.publish(TELE, "awake", value);
+}
@@ -20,6 +20,15 @@ const char* mqtt_client_name = "office_led_1";
 #define CLOCK_PIN 2
 
 CRGB leds[NUM_LEDS];
+EspHomeClientFrameDecoder frame_decoder((uint8_t *)leds, NUM_LEDS);
+
+// "ON", "OFF" or {"state": "ON", "brightness": 128, "color": "#0000FF"}
+struct PowerCommand {
+  bool state;
+  long brightness;
+  uint8_t color[3];
+} power_command = {false, 255, {0, 0, 255}};
+EspHomeClientCommandFields power_fields;
 
 EspHomeClient client(
   ssid, password, mqtt_broker, mqtt_username, mqtt_password, mqtt_client_name
@@ -29,6 +38,11 @@ void setup() {
   Serial.begin(115200);
 
   client.enableDebuggingMessages();
+  power_fields.addBool("state", &power_command.state);
+  power_fields.addInt("brightness", &power_command.brightness);
+  power_fields.addColor("color", power_command.color);
+  // FastLED.show() is slow, the power commands are handled from loop() and only the last one of a burst is applied
+  client.enableCommandQueue();
 
   // LEDs
   delay(2000);
@@ -40,21 +54,28 @@ void loop() {
 }
 
 void onConnectionEstablished(){
-  client.subscribe("power", onPowerCommand);
+  client.subscribeCommand("power", power_fields, onPowerCommand);
+  client.coalesceCommands("power");
+
+  // Binary frames are decoded straight into leds, shown once complete
+  client.subscribeFrame("frame", frame_decoder, [] () {
+    FastLED.show();
+  });
 }
 
-void onPowerCommand(const String &message) {
-  if (message == "ON") {
+void onPowerCommand(uint32_t fields_present) {
+  if (power_command.state) {
     turn_on();
-  } else if (message == "OFF") {
+  } else {
     turn_off();
   }
 }
 
 void turn_on() {
   for(int i = 0; i < NUM_LEDS; i++) {
-    leds[i] = CRGB::Blue; 
+    leds[i] = CRGB(power_command.color[0], power_command.color[1], power_command.color[2]);
   }
+  FastLED.setBrightness(constrain(power_command.brightness, 0, 255));
   FastLED.show();
 }
 
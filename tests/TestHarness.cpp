@@ -0,0 +1,167 @@
+#include "TestHarness.h"
+#include <chrono>
+#include <vector>
+
+struct RegisteredTest
+{
+  const char *name;
+  TestFunction function;
+};
+
+struct Metric
+{
+  std::string benchmark;
+  std::string metric;
+  double value;
+  std::string unit;
+};
+
+static std::vector<RegisteredTest> &registeredTests()
+{
+  static std::vector<RegisteredTest> tests;
+  return tests;
+}
+
+static std::vector<Metric> metrics;
+static unsigned int failure_count = 0;
+static const char *current_test = "";
+static bool quick_run = false;
+static unsigned int connection_established_calls = 0;
+
+// ##### Runner ####
+
+TestRegistration::TestRegistration(const char *name, TestFunction function)
+{
+  RegisteredTest test = {name, function};
+  registeredTests().push_back(test);
+}
+
+void reportFailure(const std::string &message, const char *file, int line)
+{
+  failure_count++;
+  fprintf(stderr, "%s:%d: %s: %s\n", file, line, current_test, message.c_str());
+}
+
+void checkCondition(bool condition, const char *expression, const char *file, int line)
+{
+  if (!condition)
+    reportFailure(std::string("CHECK(") + expression + ") failed", file, line);
+}
+
+bool runUntil(EspHomeClient &client, std::function<bool()> condition, unsigned long timeout_millis)
+{
+  unsigned long start = millis();
+  while (!condition())
+  {
+    if (millis() - start >= timeout_millis)
+      return false;
+    client.loop();
+    host::advanceMillis(1);
+  }
+
+  return true;
+}
+
+void runFor(EspHomeClient &client, unsigned long duration_millis)
+{
+  EspHomeClient *clients[] = {&client};
+  runFor(clients, 1, duration_millis);
+}
+
+void runFor(EspHomeClient **clients, size_t count, unsigned long duration_millis)
+{
+  unsigned long start = millis();
+  while (millis() - start < duration_millis)
+  {
+    for (size_t i = 0; i < count; i++)
+      clients[i]->loop();
+    host::advanceMillis(1);
+  }
+}
+
+unsigned long worstLoopMillis(EspHomeClient &client, unsigned long duration_millis)
+{
+  unsigned long start = millis();
+  uint64_t worst_micros = 0;
+  while (millis() - start < duration_millis)
+  {
+    uint64_t loop_start = host::nowMicros();
+    client.loop();
+    worst_micros = max(worst_micros, host::nowMicros() - loop_start);
+    host::advanceMillis(1);
+  }
+
+  return worst_micros / 1000;
+}
+
+void onConnectionEstablished()
+{
+  connection_established_calls++;
+}
+
+unsigned int connectionEstablishedCalls()
+{
+  return connection_established_calls;
+}
+
+uint64_t wallNanos()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool quickRun()
+{
+  return quick_run;
+}
+
+void reportMetric(const char *benchmark, const char *metric, double value, const char *unit)
+{
+  Metric result = {benchmark, metric, value, unit};
+  metrics.push_back(result);
+}
+
+static void printMetrics(const char *program)
+{
+  const char *name = strrchr(program, '/');
+  printf("{\"program\":\"%s\",\"quick\":%s,\"results\":[", name != NULL ? name + 1 : program, quick_run ? "true" : "false");
+  for (size_t i = 0; i < metrics.size(); i++)
+  {
+    printf("%s\n  {\"benchmark\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}", i == 0 ? "" : ",",
+           metrics[i].benchmark.c_str(), metrics[i].metric.c_str(), metrics[i].value, metrics[i].unit.c_str());
+  }
+  printf("\n]}\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *filter = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--quick") == 0)
+      quick_run = true;
+    else
+      filter = argv[i];
+  }
+
+  unsigned int run_count = 0;
+  for (size_t i = 0; i < registeredTests().size(); i++)
+  {
+    const RegisteredTest &test = registeredTests()[i];
+    if (filter != NULL && strstr(test.name, filter) == NULL)
+      continue;
+
+    current_test = test.name;
+    host::reset();
+    connection_established_calls = 0;
+    unsigned int failures_before = failure_count;
+    test.function();
+    run_count++;
+    fprintf(stderr, "%s %s\n", failure_count == failures_before ? "PASS" : "FAIL", test.name);
+  }
+
+  if (!metrics.empty())
+    printMetrics(argv[0]);
+
+  fprintf(stderr, "%u tests, %u failed checks\n", run_count, failure_count);
+  return failure_count == 0 && run_count > 0 ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+#ifndef TestHarness_h
+#define TestHarness_h
+
+// Minimal test runner of the host tests and benchmarks. Each TEST starts from host::reset(), the FakeBrokers it
+// needs are local to it. A failed CHECK is reported and the test goes on, the executable then exits with 1.
+
+#include <EspHomeClient.h>
+#include <sstream>
+#include "FakeBroker.h"
+#include "HostSimulation.h"
+
+typedef void (*TestFunction)();
+
+struct TestRegistration
+{
+    TestRegistration(const char *name, TestFunction function);
+};
+
+#define TEST(name)                                                  \
+    static void name();                                             \
+    static TestRegistration name##_registration(#name, name);       \
+    static void name()
+
+#define CHECK(condition) checkCondition((condition), #condition, __FILE__, __LINE__)
+#define CHECK_EQUAL(expected, actual) checkEqual((expected), (actual), #actual, __FILE__, __LINE__)
+
+void checkCondition(bool condition, const char *expression, const char *file, int line);
+void reportFailure(const std::string &message, const char *file, int line);
+
+template <typename Expected, typename Actual>
+void checkEqual(const Expected &expected, const Actual &actual, const char *expression, const char *file, int line)
+{
+    if (expected == actual)
+        return;
+
+    std::ostringstream message;
+    message << expression << " is " << actual << ", expected " << expected;
+    reportFailure(message.str(), file, line);
+}
+
+// Call client.loop() until condition holds, for at most timeout_millis of simulated time. The clock advances by
+// one millisecond between the calls, on top of what loop() blocked for. Return whether condition was met.
+bool runUntil(EspHomeClient &client, std::function<bool()> condition, unsigned long timeout_millis);
+void runFor(EspHomeClient &client, unsigned long duration_millis);
+// Same over several clients, each one's loop() called in turn like separate boards
+void runFor(EspHomeClient **clients, size_t count, unsigned long duration_millis);
+// runFor(), returning the longest simulated time a single loop() call took
+unsigned long worstLoopMillis(EspHomeClient &client, unsigned long duration_millis);
+
+// Calls of onConnectionEstablished(), the default connection callback
+unsigned int connectionEstablishedCalls();
+
+// Wall clock, for the benchmarks measuring the host CPU time rather than the simulated time
+uint64_t wallNanos();
+
+// The benchmarks run with small sizes when --quick is given, as ctest does
+bool quickRun();
+
+// Benchmark result, printed in the JSON document written on stdout once all the tests ran
+void reportMetric(const char *benchmark, const char *metric, double value, const char *unit);
+
+#endif
@@ -0,0 +1,94 @@
+// Overall cost of EspHomeClient on the host: loop() latency, publish throughput, dispatch cost and heap allocations.
+// Wall clock figures measure the library code only, the stand-ins answer instantly. Prints JSON on stdout.
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+static void connect(EspHomeClient &client)
+{
+  if (!runUntil(client, [&]() { return client.isConnected(); }, 10000))
+    reportFailure("client did not connect", __FILE__, __LINE__);
+}
+
+TEST(loopLatency)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  for (int i = 0; i < 20; i++)
+    client.subscribe(String("topic/") + String(i), [](const String &) {});
+  connect(client);
+  runFor(client, 100);
+
+  // Connected and idle
+  const unsigned long calls = quickRun() ? 10000 : 1000000;
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  for (unsigned long i = 0; i < calls; i++)
+    client.loop();
+  uint64_t elapsed = wallNanos() - start;
+  reportMetric("loop_idle", "mean_latency", (double)elapsed / calls, "ns");
+  reportMetric("loop_idle", "allocations_per_call", (double)(host::allocations() - allocations) / calls, "allocations");
+
+  // Worst case seen by the loop() statistics, in simulated time, over a reconnection
+  client.resetStats();
+  broker.dropConnections();
+  runFor(client, 10000);
+  CHECK(client.isConnected());
+  reportMetric("loop_reconnecting", "max_latency", client.getStats().loop_max_micros / 1000.0, "simulated ms");
+}
+
+TEST(publishThroughput)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  connect(client);
+
+  const unsigned long messages = quickRun() ? 10000 : 200000;
+  const uint8_t payload[] = "{\"temperature\":21.5,\"humidity\":40}";
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  for (unsigned long i = 0; i < messages; i++)
+    client.publish(TELE, "sensor", payload, sizeof(payload) - 1);
+  uint64_t elapsed = wallNanos() - start;
+  unsigned long long publish_allocations = host::allocations() - allocations;
+  runFor(client, 10);
+
+  CHECK_EQUAL(messages, (unsigned long)broker.receivedOn("tele/node/sensor").size());
+  reportMetric("publish", "throughput", messages * 1e9 / elapsed, "messages/s");
+  reportMetric("publish", "allocations_per_message", (double)publish_allocations / messages, "allocations");
+}
+
+TEST(dispatchCost)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  unsigned long received = 0;
+  for (int i = 0; i < 50; i++)
+    client.subscribe(String("room/") + String(i) + "/light", [&](const char *, const uint8_t *, size_t) { received++; });
+  client.subscribe("room/+/temperature", [&](const char *, const uint8_t *, size_t) { received++; });
+  connect(client);
+  runFor(client, 100);
+
+  // Messages queued in the socket by the broker, then read and dispatched by loop() one per call
+  const unsigned long messages = quickRun() ? 5000 : 100000;
+  for (unsigned long i = 0; i < messages; i++)
+    broker.publish(i % 2 ? "cmnd/node/room/17/light" : "cmnd/node/room/3/temperature", "on");
+  host::advanceMillis(10);
+
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  while (received < messages)
+  {
+    unsigned long before = received;
+    client.loop();
+    if (received == before)
+      break;
+  }
+  uint64_t elapsed = wallNanos() - start;
+
+  CHECK_EQUAL(messages, received);
+  reportMetric("dispatch", "cost_per_message", (double)elapsed / messages, "ns");
+  reportMetric("dispatch", "allocations_per_message", (double)(host::allocations() - allocations) / messages, "allocations");
+}
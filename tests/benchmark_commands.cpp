@@ -0,0 +1,123 @@
+// JSON light commands: parsing into EspHomeClientCommandFields against the String handling of a sketch, the payload
+// copied into a String and each field cut out with indexOf() and substring(). ArduinoJson is not part of the host
+// build, it is not measured. The host String keeps up to 15 characters inline, the allocations it reports are fewer
+// than on the boards.
+
+#include "TestHarness.h"
+
+struct LightCommand
+{
+  bool state;
+  long brightness;
+  uint8_t color[3];
+};
+
+static const char *PAYLOADS[] = {
+    "{\"state\":\"ON\",\"brightness\":128,\"color\":\"#FF6400\"}",
+    "{\"state\":\"OFF\"}",
+    "{\"brightness\":40,\"transition\":2,\"color\":\"#0080FF\"}",
+    "ON",
+};
+static const size_t PAYLOAD_COUNT = sizeof(PAYLOADS) / sizeof(PAYLOADS[0]);
+
+// Raw text of the value of key, quotes removed, empty when missing
+static String stringValue(const String &message, const char *key)
+{
+  int position = message.indexOf(String("\"") + key + "\"");
+  if (position < 0)
+    return String();
+
+  int start = message.indexOf(':', position) + 1;
+  int end = message.indexOf(',', start);
+  if (end < 0)
+    end = message.indexOf('}', start);
+
+  String value = message.substring(start, end);
+  value.trim();
+  if (value.startsWith("\""))
+    value = value.substring(1, value.length() - 1);
+  return value;
+}
+
+static void parseWithStrings(const uint8_t *payload, size_t length, LightCommand &command)
+{
+  String message;
+  message.reserve(length);
+  for (size_t i = 0; i < length; i++)
+    message += (char)payload[i];
+
+  if (!message.startsWith("{"))
+  {
+    command.state = (message == "ON");
+    return;
+  }
+
+  String state = stringValue(message, "state");
+  if (!state.isEmpty())
+    command.state = (state == "ON");
+
+  String brightness = stringValue(message, "brightness");
+  if (!brightness.isEmpty())
+    command.brightness = brightness.toInt();
+
+  String color = stringValue(message, "color");
+  if (color.length() == 7)
+  {
+    long rgb = strtol(color.c_str() + 1, NULL, 16);
+    command.color[0] = rgb >> 16;
+    command.color[1] = (rgb >> 8) & 0xFF;
+    command.color[2] = rgb & 0xFF;
+  }
+}
+
+TEST(lightCommands)
+{
+  const unsigned long rounds = quickRun() ? 1000 : 100000;
+  LightCommand fields_command = {false, 0, {0, 0, 0}};
+  LightCommand strings_command = fields_command;
+  EspHomeClientCommandFields fields;
+  fields.addBool("state", &fields_command.state);
+  fields.addInt("brightness", &fields_command.brightness);
+  fields.addColor("color", fields_command.color);
+
+  // Both ways read the same commands
+  for (size_t i = 0; i < PAYLOAD_COUNT; i++)
+  {
+    uint32_t present;
+    CHECK(fields.parse((const uint8_t *)PAYLOADS[i], strlen(PAYLOADS[i]), present));
+    parseWithStrings((const uint8_t *)PAYLOADS[i], strlen(PAYLOADS[i]), strings_command);
+    CHECK(fields_command.state == strings_command.state);
+    CHECK_EQUAL(fields_command.brightness, strings_command.brightness);
+    CHECK(memcmp(fields_command.color, strings_command.color, 3) == 0);
+  }
+  CHECK_EQUAL(40l, fields_command.brightness);
+  CHECK(fields_command.color[2] == 0xFF);
+
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  for (unsigned long r = 0; r < rounds; r++)
+  {
+    for (size_t i = 0; i < PAYLOAD_COUNT; i++)
+    {
+      uint32_t present;
+      fields.parse((const uint8_t *)PAYLOADS[i], strlen(PAYLOADS[i]), present);
+    }
+  }
+  uint64_t elapsed = wallNanos() - start;
+  allocations = host::allocations() - allocations;
+  CHECK_EQUAL(0ull, allocations);
+  reportMetric("command_fields", "cost_per_command", (double)elapsed / (rounds * PAYLOAD_COUNT), "ns");
+  reportMetric("command_fields", "allocations_per_command", (double)allocations / (rounds * PAYLOAD_COUNT), "allocations");
+
+  allocations = host::allocations();
+  start = wallNanos();
+  for (unsigned long r = 0; r < rounds; r++)
+  {
+    for (size_t i = 0; i < PAYLOAD_COUNT; i++)
+      parseWithStrings((const uint8_t *)PAYLOADS[i], strlen(PAYLOADS[i]), strings_command);
+  }
+  elapsed = wallNanos() - start;
+  allocations = host::allocations() - allocations;
+  reportMetric("strings", "cost_per_command", (double)elapsed / (rounds * PAYLOAD_COUNT), "ns");
+  reportMetric("strings", "allocations_per_command", (double)allocations / (rounds * PAYLOAD_COUNT), "allocations");
+}
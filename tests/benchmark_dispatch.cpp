@@ -0,0 +1,216 @@
+// Dispatch of the received messages: the topic trie against the vector scan of the original EspHomeClient, at 10, 100
+// and 1000 subscriptions. Both read the same packets through PubSubClient, so the difference is the dispatch itself.
+// Also mqttTopicMatch() against the original String matcher, on the specification examples.
+
+#include "TestHarness.h"
+#include <vector>
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+// ##### Original dispatch ####
+
+// mqttTopicMatch() and the subscription records as they were before the trie
+static bool legacyTopicMatch(const String &topic1, const String &topic2)
+{
+  int i = 0;
+  if ((i = topic1.indexOf('#')) >= 0)
+  {
+    String t1a = topic1.substring(0, i);
+    String t1b = topic1.substring(i + 1);
+    if ((t1a.length() == 0 || topic2.startsWith(t1a)) && (t1b.length() == 0 || topic2.endsWith(t1b)))
+      return true;
+  }
+  else if ((i = topic1.indexOf('+')) >= 0)
+  {
+    String t1a = topic1.substring(0, i);
+    String t1b = topic1.substring(i + 1);
+    if ((t1a.length() == 0 || topic2.startsWith(t1a)) && (t1b.length() == 0 || topic2.endsWith(t1b)))
+    {
+      if (topic2.substring(t1a.length(), topic2.length() - t1b.length()).indexOf('/') == -1)
+        return true;
+    }
+  }
+  else
+  {
+    return topic1.equals(topic2);
+  }
+
+  return false;
+}
+
+struct LegacySubscriptionRecord
+{
+  String topic;
+  MessageReceivedCallback callback;
+};
+
+// The original callback, minus the logging. Its byte index could not go past 255 subscriptions, it is widened here.
+static void legacyDispatch(std::vector<LegacySubscriptionRecord> &subscriptions, char *topic, uint8_t *payload, unsigned int length)
+{
+  payload[length] = '\0';
+  String payload_str((char *)payload);
+  String topic_str(topic);
+
+  for (size_t i = 0; i < subscriptions.size(); i++)
+  {
+    if (legacyTopicMatch(subscriptions[i].topic, String(topic)))
+      subscriptions[i].callback(payload_str);
+  }
+}
+
+// ##### Benchmark ####
+
+// One in ten subscriptions is a '+' filter, the messages alternate between a literal and a wildcard match
+static String subscriptionTopic(int index)
+{
+  return (index % 10 == 9) ? String("room/+/sensor") + String(index) : String("room/") + String(index) + "/light";
+}
+
+static void publishMessages(FakeBroker &broker, const char *prefix, int subscription_count, unsigned long messages)
+{
+  String literal = String(prefix) + "room/" + String(subscription_count / 2) + "/light";
+  String wildcard = String(prefix) + "room/kitchen/sensor" + String(subscription_count - 1);
+  for (unsigned long i = 0; i < messages; i++)
+    broker.publish(i % 2 ? literal.c_str() : wildcard.c_str(), "on");
+  host::advanceMillis(10);
+}
+
+static void report(const char *benchmark, int subscription_count, const char *metric, double value, const char *unit)
+{
+  String name = String(benchmark) + "_" + String(subscription_count);
+  reportMetric(name.c_str(), metric, value, unit);
+}
+
+static void benchmarkTrie(int subscription_count, unsigned long messages)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  unsigned long received = 0;
+  client.setMaxPacketSize(1024);
+  for (int i = 0; i < subscription_count; i++)
+    client.subscribe(subscriptionTopic(i), [&](const String &) { received++; });
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  runFor(client, 2000);
+
+  publishMessages(broker, "cmnd/node/", subscription_count, messages);
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  while (received < messages)
+  {
+    unsigned long before = received;
+    client.loop();
+    if (received == before)
+      break;
+  }
+  uint64_t elapsed = wallNanos() - start;
+
+  CHECK_EQUAL(messages, received);
+  report("trie", subscription_count, "cost_per_message", (double)elapsed / messages, "ns");
+  report("trie", subscription_count, "allocations_per_message", (double)(host::allocations() - allocations) / messages, "allocations");
+}
+
+static void benchmarkLegacy(int subscription_count, unsigned long messages)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  WiFi.begin(SSID, PASSWORD);
+  host::advanceMillis(10000);
+
+  unsigned long received = 0;
+  std::vector<LegacySubscriptionRecord> subscriptions;
+  for (int i = 0; i < subscription_count; i++)
+  {
+    LegacySubscriptionRecord record = {String("cmnd/legacy/") + subscriptionTopic(i), [&](const String &) { received++; }};
+    subscriptions.push_back(record);
+  }
+
+  WiFiClient wifi_client;
+  PubSubClient mqtt_client("broker.test", 1883, wifi_client);
+  mqtt_client.setBufferSize(1024);
+  mqtt_client.setCallback([&](char *topic, uint8_t *payload, unsigned int length) { legacyDispatch(subscriptions, topic, payload, length); });
+  CHECK(mqtt_client.connect("legacy"));
+  mqtt_client.subscribe("cmnd/legacy/#");
+  host::advanceMillis(10);
+  while (wifi_client.available() > 0)
+    mqtt_client.loop(); // SUBACK
+
+  publishMessages(broker, "cmnd/legacy/", subscription_count, messages);
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  while (received < messages)
+  {
+    unsigned long before = received;
+    mqtt_client.loop();
+    if (received == before)
+      break;
+  }
+  uint64_t elapsed = wallNanos() - start;
+
+  CHECK_EQUAL(messages, received);
+  report("vector_scan", subscription_count, "cost_per_message", (double)elapsed / messages, "ns");
+  report("vector_scan", subscription_count, "allocations_per_message", (double)(host::allocations() - allocations) / messages, "allocations");
+}
+
+TEST(dispatch10)
+{
+  unsigned long messages = quickRun() ? 2000 : 100000;
+  benchmarkTrie(10, messages);
+  host::reset();
+  benchmarkLegacy(10, messages);
+}
+
+TEST(dispatch100)
+{
+  unsigned long messages = quickRun() ? 2000 : 50000;
+  benchmarkTrie(100, messages);
+  host::reset();
+  benchmarkLegacy(100, messages);
+}
+
+TEST(dispatch1000)
+{
+  unsigned long messages = quickRun() ? 500 : 10000;
+  benchmarkTrie(1000, messages);
+  host::reset();
+  benchmarkLegacy(1000, messages);
+}
+
+// Specification examples, matching or not
+static const char *match_cases[][2] = {
+    {"sport/tennis/player1/#", "sport/tennis/player1/score/wimbledon"},
+    {"sport/#", "sport"},
+    {"sport/tennis/+", "sport/tennis/player1"},
+    {"sport/tennis/+", "sport/tennis/player1/ranking"},
+    {"+/+", "/finance"},
+    {"+/b/+/d", "a/b/c/d"},
+    {"$SYS/monitor/+", "$SYS/monitor/Clients"},
+    {"home/livingroom/light", "home/livingroom/light"},
+    {"home/livingroom/light", "home/kitchen/light"},
+};
+
+TEST(topicMatch)
+{
+  const size_t case_count = sizeof(match_cases) / sizeof(match_cases[0]);
+  const unsigned long rounds = quickRun() ? 10000 : 1000000;
+  volatile unsigned long matches = 0;
+
+  unsigned long long allocations = host::allocations();
+  uint64_t start = wallNanos();
+  for (unsigned long r = 0; r < rounds; r++)
+    for (size_t i = 0; i < case_count; i++)
+      matches += EspHomeClient::mqttTopicMatch(match_cases[i][0], match_cases[i][1]);
+  uint64_t elapsed = wallNanos() - start;
+  reportMetric("topic_match", "cost_per_match", (double)elapsed / (rounds * case_count), "ns");
+  reportMetric("topic_match", "allocations_per_match", (double)(host::allocations() - allocations) / (rounds * case_count), "allocations");
+
+  // The original matcher took Strings, building them is part of its cost as the dispatch did it for each record
+  allocations = host::allocations();
+  start = wallNanos();
+  for (unsigned long r = 0; r < rounds; r++)
+    for (size_t i = 0; i < case_count; i++)
+      matches += legacyTopicMatch(String(match_cases[i][0]), String(match_cases[i][1]));
+  elapsed = wallNanos() - start;
+  reportMetric("legacy_topic_match", "cost_per_match", (double)elapsed / (rounds * case_count), "ns");
+  reportMetric("legacy_topic_match", "allocations_per_match", (double)(host::allocations() - allocations) / (rounds * case_count), "allocations");
+  CHECK(matches > 0);
+}
@@ -0,0 +1,146 @@
+// LED frames: decode cost per pixel of each segment type, and frames per second through subscribeFrame() against a
+// String subscription copying the same raw payload into the pixels. Wall clock on the host, 300 pixels.
+
+#include "TestHarness.h"
+#include <vector>
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+static const uint16_t PIXEL_COUNT = 300;
+
+static void appendSegmentHeader(std::vector<uint8_t> &frame, FrameSegmentType type, uint16_t offset, uint16_t count)
+{
+  frame.push_back(type);
+  frame.push_back(offset >> 8);
+  frame.push_back(offset & 0xFF);
+  frame.push_back(count >> 8);
+  frame.push_back(count & 0xFF);
+}
+
+static std::vector<uint8_t> buildFrame(FrameSegmentType type)
+{
+  std::vector<uint8_t> frame = {'L', 'F', 1, 0};
+  appendSegmentHeader(frame, type, 0, PIXEL_COUNT);
+  if (type == FRAME_SEGMENT_RLE)
+  {
+    // Runs of 10 pixels
+    for (uint16_t i = 0; i < PIXEL_COUNT; i += 10)
+    {
+      frame.push_back(10);
+      frame.push_back(i & 0xFF);
+      frame.push_back(0x40);
+      frame.push_back(0x80);
+    }
+  }
+  else
+  {
+    for (uint16_t i = 0; i < PIXEL_COUNT * 3; i++)
+      frame.push_back(type == FRAME_SEGMENT_DELTA ? (uint8_t)((i % 5) - 2) : (uint8_t)i);
+  }
+  return frame;
+}
+
+static void measureDecode(const char *benchmark, FrameSegmentType type)
+{
+  uint8_t pixels[PIXEL_COUNT * 3];
+  EspHomeClientFrameDecoder decoder(pixels, PIXEL_COUNT);
+  std::vector<uint8_t> frame = buildFrame(type);
+  const unsigned long frames = quickRun() ? 1000 : 100000;
+
+  // Pieces of the size the stream hands out
+  uint64_t start = wallNanos();
+  for (unsigned long f = 0; f < frames; f++)
+  {
+    decoder.reset();
+    for (size_t position = 0; position < frame.size(); position += ESPHOMECLIENT_STREAM_CHUNK_SIZE)
+      decoder.decode(frame.data() + position, min(frame.size() - position, (size_t)ESPHOMECLIENT_STREAM_CHUNK_SIZE));
+    if (!decoder.finish())
+      reportFailure("frame not decoded", __FILE__, __LINE__);
+  }
+  uint64_t elapsed = wallNanos() - start;
+
+  CHECK_EQUAL(frames, decoder.getStats().frames);
+  reportMetric(benchmark, "cost_per_pixel", (double)elapsed / frames / PIXEL_COUNT, "ns");
+  reportMetric(benchmark, "payload", frame.size(), "bytes");
+}
+
+TEST(decodeRaw)
+{
+  measureDecode("decode_raw", FRAME_SEGMENT_RAW);
+}
+
+TEST(decodeRle)
+{
+  measureDecode("decode_rle", FRAME_SEGMENT_RLE);
+}
+
+TEST(decodeDelta)
+{
+  measureDecode("decode_delta", FRAME_SEGMENT_DELTA);
+}
+
+// Receive frames until count of them reached the callback, return the wall time taken
+static uint64_t receiveFrames(EspHomeClient &client, FakeBroker &broker, const std::string &payload, unsigned long count, unsigned long &received)
+{
+  for (unsigned long i = 0; i < count; i++)
+    broker.publish("cmnd/node/frame", payload);
+  host::advanceMillis(10);
+
+  uint64_t start = wallNanos();
+  while (received < count)
+  {
+    unsigned long before = received;
+    for (int i = 0; i < 10 && received == before; i++)
+      client.loop();
+    if (received == before)
+      break;
+  }
+  return wallNanos() - start;
+}
+
+TEST(framesPerSecond)
+{
+  const unsigned long frames = quickRun() ? 200 : 10000;
+  std::vector<uint8_t> raw = buildFrame(FRAME_SEGMENT_RAW);
+  std::string payload(raw.begin(), raw.end());
+
+  {
+    FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+    uint8_t pixels[PIXEL_COUNT * 3];
+    EspHomeClientFrameDecoder decoder(pixels, PIXEL_COUNT);
+    EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+    unsigned long received = 0;
+    client.subscribeFrame("frame", decoder, [&]() { received++; });
+    CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/frame"); }, 10000));
+
+    unsigned long long allocations = host::allocations();
+    uint64_t elapsed = receiveFrames(client, broker, payload, frames, received);
+    CHECK_EQUAL(frames, received);
+    CHECK(pixels[3 * 3] == 9);
+    reportMetric("subscribe_frame", "frames_per_second", frames * 1e9 / elapsed, "frames/s");
+    reportMetric("subscribe_frame", "allocations_per_frame", (double)(host::allocations() - allocations) / frames, "allocations");
+  }
+
+  host::reset();
+
+  {
+    // The whole payload in the PubSubClient buffer, then in a String, then copied
+    FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+    uint8_t pixels[PIXEL_COUNT * 3];
+    EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+    client.setMaxPacketSize(1024);
+    unsigned long received = 0;
+    client.subscribe("frame", [&](const String &message) {
+      if (message.length() == raw.size())
+        memcpy(pixels, message.c_str() + 9, sizeof(pixels));
+      received++;
+    });
+    CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/frame"); }, 10000));
+
+    unsigned long long allocations = host::allocations();
+    uint64_t elapsed = receiveFrames(client, broker, payload, frames, received);
+    CHECK_EQUAL(frames, received);
+    reportMetric("subscribe_string", "frames_per_second", frames * 1e9 / elapsed, "frames/s");
+    reportMetric("subscribe_string", "allocations_per_frame", (double)(host::allocations() - allocations) / frames, "allocations");
+  }
+}
@@ -0,0 +1,197 @@
+// Memory taken by the subscriptions: the std::vector of String records of the original EspHomeClient, the arrays
+// EspHomeClient grows on the heap, and the inline arrays of EspHomeClientT. Sizes are the host ones, pointers and
+// std::function are twice as large as on ESP8266, the proportions are what matters.
+// Also a board driving 4 LED strips, with a client each or with a device each on a single client.
+
+#include "TestHarness.h"
+#include <vector>
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+static String subscriptionTopic(int index)
+{
+  return String("room/") + String(index) + "/light";
+}
+
+static void report(const char *storage, int subscription_count, const char *metric, double value, const char *unit)
+{
+  String name = String("subscriptions_") + storage + "_" + String(subscription_count);
+  reportMetric(name.c_str(), metric, value, unit);
+}
+
+// Subscription record of the original EspHomeClient, kept in a std::vector
+struct LegacySubscriptionRecord
+{
+  String topic;
+  MessageReceivedCallback callback;
+};
+
+static void measureLegacy(int subscription_count)
+{
+  unsigned long received = 0;
+  size_t heap = host::heapInUse();
+  unsigned long long allocations = host::allocations();
+  {
+    std::vector<LegacySubscriptionRecord> subscriptions;
+    for (int i = 0; i < subscription_count; i++)
+    {
+      LegacySubscriptionRecord record = {String("cmnd/node/") + subscriptionTopic(i), [&received](const String &) { received++; }};
+      subscriptions.push_back(record);
+    }
+
+    heap = host::heapInUse() - heap;
+    allocations = host::allocations() - allocations;
+    report("vector", subscription_count, "heap", heap, "bytes");
+    report("vector", subscription_count, "allocations", allocations, "allocations");
+  }
+}
+
+static void measureHeap(int subscription_count)
+{
+  unsigned long received = 0;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  size_t heap = host::heapInUse();
+  unsigned long long allocations = host::allocations();
+  for (int i = 0; i < subscription_count; i++)
+    CHECK(client.subscribe(subscriptionTopic(i), [&received](const char *, const uint8_t *, size_t) { received++; }));
+
+  heap = host::heapInUse() - heap;
+  allocations = host::allocations() - allocations;
+  report("heap", subscription_count, "heap", heap, "bytes");
+  report("heap", subscription_count, "allocations", allocations, "allocations");
+}
+
+template <uint16_t SubscriptionCount>
+static void measureFixed()
+{
+  unsigned long received = 0;
+  auto on_message = [&received](const char *, const uint8_t *, size_t) { received++; };
+  EspHomeClientT<SubscriptionCount> client(SSID, PASSWORD, "broker.test", "node");
+  size_t heap = host::heapInUse();
+  unsigned long long allocations = host::allocations();
+  for (int i = 0; i < SubscriptionCount; i++)
+  {
+    // Built in a stack buffer, a String would allocate
+    char topic[32];
+    snprintf(topic, sizeof(topic), "room/%d/light", i);
+    CHECK(client.subscribeRef(topic, on_message));
+  }
+
+  // Full, the next subscription is rejected rather than allocated
+  CHECK(!client.subscribeRef("room/full", on_message));
+
+  heap = host::heapInUse() - heap;
+  allocations = host::allocations() - allocations;
+  CHECK_EQUAL((size_t)0, heap);
+  CHECK_EQUAL(0ull, allocations);
+  report("fixed", SubscriptionCount, "heap", heap, "bytes");
+  report("fixed", SubscriptionCount, "allocations", allocations, "allocations");
+  report("fixed", SubscriptionCount, "static", sizeof(EspHomeClientT<SubscriptionCount>) - sizeof(EspHomeClient), "bytes");
+}
+
+// Received messages reach the fixed capacity subscriptions like the other ones
+TEST(fixedCapacityDispatch)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  unsigned long received = 0;
+  auto on_message = [&received](const char *, const uint8_t *, size_t) { received++; };
+  EspHomeClientT<4> client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.subscribeRef("room/+/light", on_message));
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/room/+/light"); }, 10000));
+
+  broker.publish("cmnd/node/room/kitchen/light", "on");
+  runFor(client, 10);
+  CHECK_EQUAL(1ul, received);
+}
+
+// An empty reference has nothing to call, it is rejected rather than dispatched to
+TEST(emptyReferenceRejected)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClientT<4> client(SSID, PASSWORD, "broker.test", "node");
+  void (*no_function)(const char *, const uint8_t *, size_t) = NULL;
+  CHECK(!client.subscribeRef("light", MessageReceivedViewCallbackRef()));
+  CHECK(!client.subscribeRef("light", no_function));
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  runFor(client, 10);
+  CHECK(!broker.hasSubscription("node", "cmnd/node/light"));
+
+  broker.publish("cmnd/node/light", "on");
+  runFor(client, 10);
+  CHECK(client.isConnected());
+}
+
+TEST(subscriptions8)
+{
+  measureLegacy(8);
+  measureHeap(8);
+  measureFixed<8>();
+}
+
+TEST(subscriptions32)
+{
+  measureLegacy(32);
+  measureHeap(32);
+  measureFixed<32>();
+}
+
+TEST(subscriptions128)
+{
+  measureLegacy(128);
+  measureHeap(128);
+  measureFixed<128>();
+}
+
+// Heap taken once connected and subscribed, the clients included, and the connections the broker holds
+static void measureStrips(bool with_devices)
+{
+  const int strip_count = 4;
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  unsigned long received = 0;
+  auto on_message = [&received](const char *, const uint8_t *, size_t) { received++; };
+  String names[strip_count];
+  for (int i = 0; i < strip_count; i++)
+    names[i] = String("strip_") + String(i);
+
+  size_t heap = host::heapInUse();
+  std::vector<EspHomeClient *> clients;
+  if (with_devices)
+  {
+    clients.push_back(new EspHomeClient(SSID, PASSWORD, "broker.test", "board"));
+    for (int i = 0; i < strip_count; i++)
+      CHECK(clients[0]->device(names[i].c_str()).subscribe("power", on_message));
+  }
+  else
+  {
+    for (int i = 0; i < strip_count; i++)
+    {
+      clients.push_back(new EspHomeClient(SSID, PASSWORD, "broker.test", names[i].c_str()));
+      CHECK(clients[i]->subscribe("power", on_message));
+    }
+  }
+
+  runFor(clients.data(), clients.size(), 10000);
+  for (size_t i = 0; i < clients.size(); i++)
+    CHECK(clients[i]->isConnected());
+  for (int i = 0; i < strip_count; i++)
+    broker.publish((String("cmnd/") + names[i] + "/power").c_str(), "ON");
+  runFor(clients.data(), clients.size(), 10);
+  CHECK_EQUAL((unsigned long)strip_count, received);
+
+  heap = host::heapInUse() - heap;
+  unsigned int connections = broker.openConnections();
+  for (size_t i = 0; i < clients.size(); i++)
+    delete clients[i];
+
+  const char *name = with_devices ? "strips_4_devices" : "strips_4_clients";
+  reportMetric(name, "heap", heap, "bytes");
+  reportMetric(name, "connections", connections, "connections");
+}
+
+TEST(stripsSharingOneConnection)
+{
+  measureStrips(false);
+  host::reset();
+  measureStrips(true);
+}
@@ -0,0 +1,105 @@
+// QoS 1 publishing: the packet identifiers stay unique among the packets in use, and the throughput of the window at
+// sizes 1, 4 and 16 over a 40ms round trip, in simulated time
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+// A message left unacknowledged holds its identifier while the SUBSCRIBE and UNSUBSCRIBE packets go through the
+// whole identifier range. The FakeBroker counts any reuse as a protocol violation.
+TEST(packetIdentifiersSkipTheOnesInUse)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.acknowledge_publishes = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableQoS1Publish(4, 1024, 10 * 60 * 1000);
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  uint16_t held = client.publishQoS1(TELE, "alarm", "1");
+  CHECK(held != 0);
+  runFor(client, 10);
+
+  // PubSubClient reads one packet per loop() call, the SUBACK and UNSUBACK of each round are read right away
+  for (unsigned long i = 0; i < 0x8000 + 10; i++)
+  {
+    client.subscribe("light", [](const String &) {});
+    client.unsubscribe("light");
+    runFor(client, 2);
+  }
+  runFor(client, 10);
+  CHECK(client.isConnected());
+  CHECK(broker.subscribe_packets > 0x8000);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+
+  // The message holding the identifier completes normally
+  bool delivered = false;
+  client.setOnPublishCompletedCallback([&](uint16_t packet_id, bool success) { delivered = (packet_id == held && success); });
+  broker.acknowledge_publishes = true;
+  broker.dropConnections();
+  CHECK(runUntil(client, [&]() { return delivered; }, 30000));
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+// Subscriptions made while connected use the identifiers of EspHomeClient too, not those of PubSubClient
+TEST(subscriptionsShareTheIdentifiers)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.acknowledge_publishes = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableQoS1Publish(16, 4096, 10 * 60 * 1000);
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  for (int i = 0; i < 16; i++)
+    CHECK(client.publishQoS1(TELE, "reading", "1") != 0);
+  for (int i = 0; i < 16; i++)
+    CHECK(client.subscribe(String("light") + String(i), [](const String &) {}));
+  CHECK(client.unsubscribe("light0"));
+  runFor(client, 10);
+
+  CHECK(broker.hasSubscription("node", "cmnd/node/light15"));
+  CHECK(!broker.hasSubscription("node", "cmnd/node/light0"));
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+static void measureWindow(uint8_t window_size, unsigned long messages)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.latency_millis = 20;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableQoS1Publish(window_size, 4096);
+  unsigned long completed = 0;
+  client.setOnPublishCompletedCallback([&](uint16_t, bool success) { completed += success; });
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  runFor(client, 100);
+
+  const uint8_t payload[] = "{\"temperature\":21.5}";
+  unsigned long published = 0;
+  unsigned long start = millis();
+  uint64_t wall_start = wallNanos();
+  while (completed < messages && millis() - start < 600000)
+  {
+    while (published < messages && client.publishQoS1(TELE, "sensor", payload, sizeof(payload) - 1) != 0)
+      published++;
+    client.loop();
+    host::advanceMillis(1);
+  }
+  unsigned long elapsed = millis() - start;
+  uint64_t wall_elapsed = wallNanos() - wall_start;
+
+  CHECK_EQUAL(messages, completed);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+  String name = String("qos1_window_") + String((int)window_size);
+  reportMetric(name.c_str(), "throughput", messages * 1000.0 / elapsed, "messages/simulated s");
+  reportMetric(name.c_str(), "cost_per_message", (double)wall_elapsed / messages, "ns");
+}
+
+TEST(windowSizes)
+{
+  unsigned long messages = quickRun() ? 200 : 2000;
+  measureWindow(1, messages);
+  host::reset();
+  measureWindow(4, messages);
+  host::reset();
+  measureWindow(16, messages);
+}
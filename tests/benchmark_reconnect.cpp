@@ -0,0 +1,114 @@
+// Reconnection storm: many clients lose the broker at the same time and reconnect. Reports the peak of CONNECT packets
+// the broker receives per second, with the default jittered backoff and with the same policy in lock-step (no jitter).
+// Also the time an unreachable broker takes to trigger the board reset with the default policy.
+
+#include "TestHarness.h"
+#include <algorithm>
+#include <vector>
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+// Most CONNECT packets received within window_millis, from the given one on
+static unsigned int peakConnects(const FakeBroker &broker, size_t first, unsigned long window_millis)
+{
+  std::vector<unsigned long> times(broker.connect_millis.begin() + first, broker.connect_millis.end());
+  std::sort(times.begin(), times.end());
+
+  unsigned int peak = 0;
+  for (size_t start = 0, end = 0; start < times.size(); start++)
+  {
+    while (end < times.size() && times[end] - times[start] < window_millis)
+      end++;
+    peak = max(peak, (unsigned int)(end - start));
+  }
+  return peak;
+}
+
+static size_t connectedClients(std::vector<EspHomeClient *> &clients)
+{
+  size_t connected = 0;
+  for (size_t i = 0; i < clients.size(); i++)
+    connected += clients[i]->isMqttConnected();
+  return connected;
+}
+
+// The broker goes down for outage_millis, then client_count clients reconnect. The clock is shared: a loop() call
+// blocking delays all the simulated boards, so the broker refuses the connections meanwhile rather than leaving them
+// unanswered, as a host whose broker process restarts does.
+static void storm(const char *benchmark, size_t client_count, uint8_t jitter_percent, unsigned long outage_millis)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  ReconnectPolicy policy = ReconnectPolicy::mqttDefault();
+  policy.jitter_percent = jitter_percent;
+
+  std::vector<String> names;
+  std::vector<EspHomeClient *> clients;
+  for (size_t i = 0; i < client_count; i++)
+    names.push_back(String("node") + String((int)i));
+  for (size_t i = 0; i < client_count; i++)
+  {
+    clients.push_back(new EspHomeClient(SSID, PASSWORD, "broker.test", names[i].c_str()));
+    clients[i]->setMqttReconnectPolicy(policy);
+  }
+
+  runFor(clients.data(), client_count, 10000);
+  CHECK_EQUAL(client_count, connectedClients(clients));
+
+  broker.refusing = true;
+  broker.dropConnections();
+  runFor(clients.data(), client_count, outage_millis);
+  broker.refusing = false;
+
+  size_t first = broker.connect_millis.size();
+  unsigned long recovery_start = millis();
+  unsigned long all_connected_millis = 0;
+  while (millis() - recovery_start < 10 * 60 * 1000)
+  {
+    runFor(clients.data(), client_count, 10);
+    if (connectedClients(clients) == client_count)
+    {
+      all_connected_millis = millis() - recovery_start;
+      break;
+    }
+  }
+
+  CHECK(all_connected_millis > 0);
+  CHECK_EQUAL(client_count, broker.connect_millis.size() - first);
+  reportMetric(benchmark, "peak_connects_per_second", peakConnects(broker, first, 1000), "connects/s");
+  reportMetric(benchmark, "peak_connects_per_100ms", peakConnects(broker, first, 100), "connects");
+  reportMetric(benchmark, "all_connected", all_connected_millis, "simulated ms");
+
+  for (size_t i = 0; i < client_count; i++)
+    delete clients[i];
+}
+
+TEST(brokerRestart)
+{
+  size_t client_count = quickRun() ? 20 : 100;
+  storm("restart_jitter", client_count, 50, 100);
+  host::reset();
+  storm("restart_lockstep", client_count, 0, 100);
+}
+
+TEST(brokerOutage)
+{
+  size_t client_count = quickRun() ? 20 : 100;
+  storm("outage_60s_jitter", client_count, 50, 60000);
+  host::reset();
+  storm("outage_60s_lockstep", client_count, 0, 60000);
+}
+
+// With the backoff, the 12 failed attempts before the board reset take about 12 minutes
+TEST(boardResetDelay)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableDrasticResetOnConnectionFailures();
+
+  CHECK(runUntil(client, []() { return host::esp().resets + host::esp().restarts > 0; }, 30 * 60 * 1000));
+  reportMetric("board_reset", "unreachable_broker_to_reset", millis() / 60000.0, "simulated min");
+  CHECK(millis() > 8 * 60 * 1000);
+  CHECK(millis() < 16 * 60 * 1000);
+}
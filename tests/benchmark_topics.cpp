@@ -0,0 +1,77 @@
+// Compact topics: bytes the broker receives for small telemetry values, with the full topics, the compact prefixes,
+// and the compact prefixes with an alias. The example of the readme, "tele/radar_kitchen/present" with a 2 bytes payload.
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+enum TopicMode
+{
+  FULL_TOPICS,
+  COMPACT_TOPICS,
+  COMPACT_TOPICS_AND_ALIAS
+};
+
+static void setTopicMode(EspHomeClient &client, TopicMode mode)
+{
+  if (mode != FULL_TOPICS)
+    client.enableCompactTopics("rk");
+  if (mode == COMPACT_TOPICS_AND_ALIAS)
+  {
+    client.addTopicAlias("present", "p");
+    client.addTopicAlias("light", "l");
+  }
+}
+
+// Bytes on the wire per message, the MQTT header included
+static double measureBytes(const char *benchmark, TopicMode mode, const char *expected_topic)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "radar_kitchen");
+  setTopicMode(client, mode);
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  runFor(client, 100);
+
+  const unsigned long messages = quickRun() ? 100 : 1000;
+  uint64_t bytes = broker.bytes_received;
+  for (unsigned long i = 0; i < messages; i++)
+  {
+    CHECK(client.publish(TELE, "present", i % 2 ? "01" : "00"));
+    runFor(client, 1);
+  }
+  bytes = broker.bytes_received - bytes;
+
+  CHECK_EQUAL(messages, broker.receivedOn(expected_topic).size());
+  double per_message = (double)bytes / messages;
+  reportMetric(benchmark, "bytes_per_message", per_message, "bytes");
+  return per_message;
+}
+
+TEST(bytesOnWire)
+{
+  double full = measureBytes("full_topics", FULL_TOPICS, "tele/radar_kitchen/present");
+  host::reset();
+  double compact = measureBytes("compact_topics", COMPACT_TOPICS, "t/rk/present");
+  host::reset();
+  double aliased = measureBytes("compact_topics_and_alias", COMPACT_TOPICS_AND_ALIAS, "t/rk/p");
+
+  CHECK(compact < full);
+  CHECK(aliased < compact);
+  reportMetric("compact_topics", "reduction", 100.0 * (full - compact) / full, "%");
+  reportMetric("compact_topics_and_alias", "reduction", 100.0 * (full - aliased) / full, "%");
+}
+
+// The subscribers see the full topic whatever was sent on the wire
+TEST(aliasedCommandsAreDispatched)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "radar_kitchen");
+  setTopicMode(client, COMPACT_TOPICS_AND_ALIAS);
+  String received;
+  client.subscribe("light", [&](const String &message) { received = message; });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("radar_kitchen", "c/rk/l"); }, 10000));
+
+  broker.publish("c/rk/l", "on");
+  CHECK(runUntil(client, [&]() { return received == "on"; }, 1000));
+}
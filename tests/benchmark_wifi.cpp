@@ -0,0 +1,101 @@
+// WiFi connection time after a reboot, with and without the fast connect cache, in simulated time. The stand-in takes
+// 2200ms to scan, 250ms to join and 1100ms for DHCP, the fast connection skips the scan and DHCP.
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+// A reset leaves the station disconnected, the RTC memory is kept
+static void reboot()
+{
+  WiFi.disconnect();
+}
+
+// Time from the construction of a new client, as after a reset, to the WiFi connection
+static unsigned long bootToWifi(bool fast_connect)
+{
+  reboot();
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  if (fast_connect)
+    client.enableWifiFastConnect();
+
+  unsigned long start = millis();
+  if (!runUntil(client, [&]() { return client.isWifiConnected(); }, 30000))
+    reportFailure("WiFi did not connect", __FILE__, __LINE__);
+  return millis() - start;
+}
+
+TEST(fullConnection)
+{
+  unsigned long duration = bootToWifi(false);
+  reportMetric("wifi_full", "boot_to_connected", duration, "simulated ms");
+  CHECK(duration >= 2200 + 250 + 1100);
+}
+
+TEST(fastConnectionAfterReboot)
+{
+  // The first boot finds no cache, it connects fully and fills it
+  unsigned long first = bootToWifi(true);
+  CHECK(first >= 2200 + 250 + 1100);
+  unsigned int begin_calls = host::wifi().begin_calls;
+
+  unsigned long second;
+  {
+    reboot();
+    EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+    client.enableWifiFastConnect();
+    unsigned long start = millis();
+    CHECK(runUntil(client, [&]() { return client.isWifiConnected(); }, 30000));
+    second = millis() - start;
+
+    const WifiConnectionStats &stats = client.getWifiConnectionStats();
+    CHECK(stats.last_connection_fast);
+    CHECK_EQUAL(1ul, stats.fast_connections);
+    CHECK_EQUAL(0ul, stats.full_connections);
+    CHECK_EQUAL(250ul, stats.last_connection_millis);
+    CHECK(WiFi.localIP() == host::wifi().local_ip);
+  }
+  CHECK_EQUAL(begin_calls + 1, host::wifi().begin_calls);
+  CHECK(second < 250 + 20);
+
+  reportMetric("wifi_fast", "first_boot_to_connected", first, "simulated ms");
+  reportMetric("wifi_fast", "boot_to_connected", second, "simulated ms");
+  reportMetric("wifi_fast", "saved", (double)first - second, "simulated ms");
+}
+
+// The access point moved to another channel: the fast attempt fails after its timeout and the full connection that
+// follows refills the cache
+TEST(movedAccessPointFallsBack)
+{
+  bootToWifi(true);
+  host::wifi().channel = 11;
+
+  unsigned long duration;
+  {
+    reboot();
+    EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+    client.enableWifiFastConnect(2000);
+    unsigned long start = millis();
+    CHECK(runUntil(client, [&]() { return client.isWifiConnected(); }, 30000));
+    duration = millis() - start;
+
+    const WifiConnectionStats &stats = client.getWifiConnectionStats();
+    CHECK(!stats.last_connection_fast);
+    CHECK_EQUAL(1ul, stats.fast_connection_failures);
+    CHECK_EQUAL(1ul, stats.full_connections);
+  }
+  CHECK(duration >= 2000 + 2200 + 250 + 1100);
+  reportMetric("wifi_fast_moved", "boot_to_connected", duration, "simulated ms");
+
+  // Cache refilled with the new channel
+  CHECK(bootToWifi(true) < 250 + 20);
+}
+
+// A power loss clears the RTC memory, the cache is found invalid and the connection is a full one
+TEST(powerLossInvalidatesCache)
+{
+  bootToWifi(true);
+  host::clearRtcMemory();
+  CHECK(bootToWifi(true) >= 2200 + 250 + 1100);
+}
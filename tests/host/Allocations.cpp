@@ -0,0 +1,81 @@
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include "HostSimulation.h"
+
+static unsigned long long allocation_count = 0;
+static size_t heap_in_use = 0;
+static unsigned int uncounted_scopes = 0;
+
+// Each block starts with its size, 0 for the uncounted ones, keeping the alignment malloc gives
+union BlockHeader
+{
+  size_t counted_size;
+  max_align_t alignment;
+};
+
+unsigned long long host::allocations()
+{
+  return allocation_count;
+}
+
+size_t host::heapInUse()
+{
+  return heap_in_use;
+}
+
+host::UncountedAllocations::UncountedAllocations()
+{
+  uncounted_scopes++;
+}
+
+host::UncountedAllocations::~UncountedAllocations()
+{
+  uncounted_scopes--;
+}
+
+void *operator new(size_t size)
+{
+  BlockHeader *header = (BlockHeader *)malloc(sizeof(BlockHeader) + size);
+  if (header == NULL)
+    throw std::bad_alloc();
+
+  header->counted_size = 0;
+  if (uncounted_scopes == 0)
+  {
+    allocation_count++;
+    header->counted_size = size;
+    heap_in_use += size;
+  }
+  return header + 1;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+  if (pointer == NULL)
+    return;
+
+  BlockHeader *header = (BlockHeader *)pointer - 1;
+  heap_in_use -= header->counted_size;
+  free(header);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+  operator delete(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  operator delete(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+  operator delete(pointer);
+}
@@ -0,0 +1,602 @@
+#include <Arduino.h>
+#include "HostSimulation.h"
+
+static uint64_t now_micros = 0;
+
+uint64_t host::nowMicros()
+{
+  return now_micros;
+}
+
+void host::setMillis(unsigned long now_millis)
+{
+  now_micros = (uint64_t)now_millis * 1000;
+}
+
+void host::advanceMillis(unsigned long millis)
+{
+  now_micros += (uint64_t)millis * 1000;
+}
+
+void host::advanceMicros(uint64_t micros)
+{
+  now_micros += micros;
+}
+
+// The board counters are 32 bits wide
+unsigned long millis()
+{
+  return (uint32_t)(now_micros / 1000);
+}
+
+unsigned long micros()
+{
+  return (uint32_t)now_micros;
+}
+
+void delay(unsigned long ms)
+{
+  host::advanceMillis(ms);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  host::advanceMicros(us);
+}
+
+void yield()
+{
+  host::advanceMillis(1);
+}
+
+// ##### Random ####
+
+static uint32_t random_state = 1;
+
+void randomSeed(unsigned long seed)
+{
+  random_state = seed != 0 ? seed : 1;
+}
+
+static uint32_t nextRandom()
+{
+  // xorshift32
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+long random(long max)
+{
+  if (max <= 0)
+    return 0;
+  return nextRandom() % max;
+}
+
+long random(long min, long max)
+{
+  if (min >= max)
+    return min;
+  return min + random(max - min);
+}
+
+// ##### String ####
+
+static std::string formatNumber(unsigned long long value, bool negative, unsigned char base)
+{
+  if (base < 2 || base > 36)
+    base = 10;
+
+  std::string digits;
+  do
+  {
+    unsigned int digit = value % base;
+    digits.insert(digits.begin(), digit < 10 ? '0' + digit : 'a' + digit - 10);
+    value /= base;
+  } while (value > 0);
+
+  if (negative)
+    digits.insert(digits.begin(), '-');
+  return digits;
+}
+
+String::String(const char *str) : value_(str != NULL ? str : "") {}
+String::String(char c) : value_(1, c) {}
+String::String(int value, unsigned char base) : value_(formatNumber(value < 0 && base == 10 ? -(long long)value : (unsigned int)value, value < 0 && base == 10, base)) {}
+String::String(unsigned int value, unsigned char base) : value_(formatNumber(value, false, base)) {}
+String::String(long value, unsigned char base) : value_(formatNumber(value < 0 && base == 10 ? -(long long)value : (unsigned long)value, value < 0 && base == 10, base)) {}
+String::String(unsigned long value, unsigned char base) : value_(formatNumber(value, false, base)) {}
+String::String(float value, unsigned char decimals) : String((double)value, decimals) {}
+
+String::String(double value, unsigned char decimals)
+{
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+  value_ = buffer;
+}
+
+String &String::operator=(const char *str)
+{
+  value_ = (str != NULL ? str : "");
+  return *this;
+}
+
+bool String::reserve(unsigned int size)
+{
+  value_.reserve(size);
+  return true;
+}
+
+bool String::concat(const String &str)
+{
+  value_ += str.value_;
+  return true;
+}
+
+bool String::concat(const char *str)
+{
+  if (str == NULL)
+    return false;
+  value_ += str;
+  return true;
+}
+
+bool String::concat(char c)
+{
+  value_ += c;
+  return true;
+}
+
+bool String::concat(int value)
+{
+  return concat(String(value));
+}
+
+bool String::concat(unsigned long value)
+{
+  return concat(String(value));
+}
+
+String &String::operator+=(const String &str)
+{
+  concat(str);
+  return *this;
+}
+
+String &String::operator+=(const char *str)
+{
+  concat(str);
+  return *this;
+}
+
+String &String::operator+=(char c)
+{
+  concat(c);
+  return *this;
+}
+
+String &String::operator+=(int value)
+{
+  concat(value);
+  return *this;
+}
+
+String &String::operator+=(unsigned long value)
+{
+  concat(value);
+  return *this;
+}
+
+bool String::equals(const String &str) const
+{
+  return value_ == str.value_;
+}
+
+bool String::equals(const char *str) const
+{
+  return value_ == (str != NULL ? str : "");
+}
+
+bool String::startsWith(const String &prefix) const
+{
+  return value_.compare(0, prefix.value_.size(), prefix.value_) == 0 && prefix.value_.size() <= value_.size();
+}
+
+bool String::endsWith(const String &suffix) const
+{
+  return suffix.value_.size() <= value_.size() &&
+         value_.compare(value_.size() - suffix.value_.size(), suffix.value_.size(), suffix.value_) == 0;
+}
+
+char String::charAt(unsigned int index) const
+{
+  return index < value_.size() ? value_[index] : '\0';
+}
+
+char String::operator[](unsigned int index) const
+{
+  return charAt(index);
+}
+
+char &String::operator[](unsigned int index)
+{
+  static char dummy;
+  if (index >= value_.size())
+  {
+    dummy = '\0';
+    return dummy;
+  }
+  return value_[index];
+}
+
+int String::indexOf(char c, unsigned int from) const
+{
+  size_t position = value_.find(c, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+int String::indexOf(const String &str, unsigned int from) const
+{
+  size_t position = value_.find(str.value_, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+int String::lastIndexOf(char c) const
+{
+  size_t position = value_.rfind(c);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+String String::substring(unsigned int from) const
+{
+  return substring(from, value_.size());
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+  if (from > to)
+    std::swap(from, to);
+  if (from >= value_.size())
+    return String();
+  to = min((size_t)to, value_.size());
+  return String(value_.substr(from, to - from).c_str());
+}
+
+void String::replace(const String &find, const String &replacement)
+{
+  if (find.value_.empty())
+    return;
+
+  size_t position = 0;
+  while ((position = value_.find(find.value_, position)) != std::string::npos)
+  {
+    value_.replace(position, find.value_.size(), replacement.value_);
+    position += replacement.value_.size();
+  }
+}
+
+void String::trim()
+{
+  size_t begin = value_.find_first_not_of(" \t\r\n");
+  size_t end = value_.find_last_not_of(" \t\r\n");
+  value_ = (begin == std::string::npos ? "" : value_.substr(begin, end - begin + 1));
+}
+
+void String::toLowerCase()
+{
+  for (char &c : value_)
+    c = tolower(c);
+}
+
+void String::toUpperCase()
+{
+  for (char &c : value_)
+    c = toupper(c);
+}
+
+long String::toInt() const
+{
+  return atol(value_.c_str());
+}
+
+float String::toFloat() const
+{
+  return atof(value_.c_str());
+}
+
+String operator+(const String &lhs, const String &rhs)
+{
+  String result(lhs);
+  result += rhs;
+  return result;
+}
+
+String operator+(const String &lhs, const char *rhs)
+{
+  String result(lhs);
+  result += rhs;
+  return result;
+}
+
+String operator+(const char *lhs, const String &rhs)
+{
+  String result(lhs);
+  result += rhs;
+  return result;
+}
+
+String operator+(const String &lhs, char rhs)
+{
+  String result(lhs);
+  result += rhs;
+  return result;
+}
+
+// ##### Print ####
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (written < size && write(buffer[written]) == 1)
+    written++;
+  return written;
+}
+
+size_t Print::print(const char *str)
+{
+  return write(str);
+}
+
+size_t Print::print(const String &str)
+{
+  return write(str.c_str());
+}
+
+size_t Print::print(char c)
+{
+  return write((uint8_t)c);
+}
+
+size_t Print::print(int value)
+{
+  return print(String(value));
+}
+
+size_t Print::print(unsigned int value)
+{
+  return print(String(value));
+}
+
+size_t Print::print(long value)
+{
+  return print(String(value));
+}
+
+size_t Print::print(unsigned long value)
+{
+  return print(String(value));
+}
+
+size_t Print::print(double value, int decimals)
+{
+  return print(String(value, decimals));
+}
+
+size_t Print::println()
+{
+  return write("\r\n");
+}
+
+size_t Print::println(const char *str)
+{
+  return print(str) + println();
+}
+
+size_t Print::println(const String &str)
+{
+  return print(str) + println();
+}
+
+size_t Print::println(int value)
+{
+  return print(value) + println();
+}
+
+size_t Print::println(unsigned long value)
+{
+  return print(value) + println();
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (length < 0)
+    return 0;
+  return write((const uint8_t *)buffer, min((size_t)length, sizeof(buffer) - 1));
+}
+
+// ##### Serial ####
+
+HardwareSerial Serial;
+
+static bool serial_muted = true;
+static std::string serial_output;
+
+void host::muteSerial(bool muted)
+{
+  serial_muted = muted;
+}
+
+const std::string &host::serialOutput()
+{
+  return serial_output;
+}
+
+void host::clearSerialOutput()
+{
+  serial_output.clear();
+}
+
+void HardwareSerial::begin(unsigned long) {}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  serial_output.append((const char *)buffer, size);
+  if (!serial_muted)
+    fwrite(buffer, 1, size, stdout);
+  return size;
+}
+
+// Size of the ESP8266 UART transmit FIFO
+int HardwareSerial::availableForWrite()
+{
+  return 128;
+}
+
+void HardwareSerial::flush()
+{
+  if (!serial_muted)
+    fflush(stdout);
+}
+
+// ##### IPAddress ####
+
+IPAddress::IPAddress()
+{
+  memset(bytes_, 0, sizeof(bytes_));
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+  bytes_[0] = a;
+  bytes_[1] = b;
+  bytes_[2] = c;
+  bytes_[3] = d;
+}
+
+// Network order in memory, like lwIP
+IPAddress::IPAddress(uint32_t address)
+{
+  memcpy(bytes_, &address, sizeof(bytes_));
+}
+
+IPAddress::operator uint32_t() const
+{
+  uint32_t address;
+  memcpy(&address, bytes_, sizeof(address));
+  return address;
+}
+
+bool IPAddress::operator==(const IPAddress &other) const
+{
+  return memcmp(bytes_, other.bytes_, sizeof(bytes_)) == 0;
+}
+
+bool IPAddress::fromString(const char *address)
+{
+  unsigned int parts[4];
+  char trailing;
+  if (sscanf(address, "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &trailing) != 4)
+    return false;
+
+  for (int i = 0; i < 4; i++)
+  {
+    if (parts[i] > 255)
+      return false;
+    bytes_[i] = parts[i];
+  }
+  return true;
+}
+
+String IPAddress::toString() const
+{
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", bytes_[0], bytes_[1], bytes_[2], bytes_[3]);
+  return String(buffer);
+}
+
+bool IPAddress::isSet() const
+{
+  return (uint32_t)*this != 0;
+}
+
+// ##### ESP ####
+
+EspClass ESP;
+
+static host::EspState esp_state;
+static uint8_t rtc_user_memory[512];
+
+host::EspState &host::esp()
+{
+  return esp_state;
+}
+
+void host::clearRtcMemory()
+{
+  // Random content after a power loss
+  for (size_t i = 0; i < sizeof(rtc_user_memory); i++)
+    rtc_user_memory[i] = (uint8_t)(i * 37 + 11);
+}
+
+void EspClass::reset()
+{
+  esp_state.resets++;
+}
+
+void EspClass::restart()
+{
+  esp_state.restarts++;
+}
+
+void EspClass::deepSleep(uint64_t time_us)
+{
+  esp_state.deep_sleeps++;
+  esp_state.deep_sleep_micros = time_us;
+}
+
+// Varies with the RTC clock calibration of each chip
+uint64_t EspClass::deepSleepMax()
+{
+  return 12600000000ULL;
+}
+
+uint32_t EspClass::getChipId()
+{
+  return 0x00C0FFEE;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+  return 40000;
+}
+
+// Offsets are in 4 bytes blocks, the user part of the RTC memory is 512 bytes long
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (size == 0 || offset * 4 + size > sizeof(rtc_user_memory))
+    return false;
+
+  memcpy(data, rtc_user_memory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (size == 0 || offset * 4 + size > sizeof(rtc_user_memory))
+    return false;
+
+  memcpy(rtc_user_memory + offset * 4, data, size);
+  return true;
+}
@@ -0,0 +1,199 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Host stand-in of the Arduino core, enough of it to build EspHomeClient on Linux.
+// Time is simulated, see HostSimulation.h: it only moves when a test advances it or when a stand-in blocks.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <math.h>
+#include <functional>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class String
+{
+private:
+    std::string value_;
+
+public:
+    String(const char *str = "");
+    String(const String &str) = default;
+    String(String &&str) = default;
+    explicit String(char c);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(float value, unsigned char decimals = 2);
+    explicit String(double value, unsigned char decimals = 2);
+
+    String &operator=(const String &str) = default;
+    String &operator=(String &&str) = default;
+    String &operator=(const char *str);
+
+    inline const char *c_str() const { return value_.c_str(); };
+    inline unsigned int length() const { return value_.length(); };
+    inline bool isEmpty() const { return value_.empty(); };
+    bool reserve(unsigned int size);
+
+    bool concat(const String &str);
+    bool concat(const char *str);
+    bool concat(char c);
+    bool concat(int value);
+    bool concat(unsigned long value);
+    String &operator+=(const String &str);
+    String &operator+=(const char *str);
+    String &operator+=(char c);
+    String &operator+=(int value);
+    String &operator+=(unsigned long value);
+
+    bool equals(const String &str) const;
+    bool equals(const char *str) const;
+    inline bool operator==(const String &str) const { return equals(str); };
+    inline bool operator==(const char *str) const { return equals(str); };
+    inline bool operator!=(const String &str) const { return !equals(str); };
+    inline bool operator!=(const char *str) const { return !equals(str); };
+    inline bool operator<(const String &str) const { return value_ < str.value_; };
+    bool startsWith(const String &prefix) const;
+    bool endsWith(const String &suffix) const;
+
+    char charAt(unsigned int index) const;
+    char operator[](unsigned int index) const;
+    char &operator[](unsigned int index);
+    int indexOf(char c, unsigned int from = 0) const;
+    int indexOf(const String &str, unsigned int from = 0) const;
+    int lastIndexOf(char c) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+
+    void replace(const String &find, const String &replacement);
+    void trim();
+    void toLowerCase();
+    void toUpperCase();
+    long toInt() const;
+    float toFloat() const;
+};
+
+String operator+(const String &lhs, const String &rhs);
+String operator+(const String &lhs, const char *rhs);
+String operator+(const char *lhs, const String &rhs);
+String operator+(const String &lhs, char rhs);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    inline size_t write(const char *str) { return str == NULL ? 0 : write((const uint8_t *)str, strlen(str)); };
+    inline size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); };
+    virtual int availableForWrite() { return 0; };
+    virtual void flush() {}
+
+    size_t print(const char *str);
+    size_t print(const String &str);
+    size_t print(char c);
+    size_t print(int value);
+    size_t print(unsigned int value);
+    size_t print(long value);
+    size_t print(unsigned long value);
+    size_t print(double value, int decimals = 2);
+    size_t println();
+    size_t println(const char *str);
+    size_t println(const String &str);
+    size_t println(int value);
+    size_t println(unsigned long value);
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+protected:
+    unsigned long _timeout;
+
+public:
+    Stream() : _timeout(1000) {}
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    inline void setTimeout(unsigned long timeout) { _timeout = timeout; };
+    inline unsigned long getTimeout() const { return _timeout; };
+};
+
+// Serial output goes to stdout, unless muted by the tests
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long baud);
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int availableForWrite() override;
+    void flush() override;
+    int available() override { return 0; };
+    int read() override { return -1; };
+    int peek() override { return -1; };
+};
+
+extern HardwareSerial Serial;
+
+class IPAddress
+{
+private:
+    uint8_t bytes_[4];
+
+public:
+    IPAddress();
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+    IPAddress(uint32_t address);
+
+    operator uint32_t() const;
+    bool operator==(const IPAddress &other) const;
+    bool operator!=(const IPAddress &other) const { return !(*this == other); };
+    inline uint8_t operator[](int index) const { return bytes_[index]; };
+    inline uint8_t &operator[](int index) { return bytes_[index]; };
+
+    bool fromString(const char *address);
+    String toString() const;
+    bool isSet() const;
+};
+
+#include "Client.h"
+
+class EspClass
+{
+public:
+    void reset();
+    void restart();
+    void deepSleep(uint64_t time_us);
+    uint64_t deepSleepMax();
+    uint32_t getChipId();
+    uint32_t getFreeHeap();
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+};
+
+extern EspClass ESP;
+
+#endif
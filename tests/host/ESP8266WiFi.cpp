@@ -0,0 +1,266 @@
+#include <ESP8266WiFi.h>
+#include "FakeBroker.h"
+#include "HostSimulation.h"
+
+ESP8266WiFiClass WiFi;
+
+static host::WiFiNetwork network;
+static host::TlsTimings tls_timings;
+static std::map<std::string, IPAddress> dns_entries;
+static unsigned int wifi_generation = 0;
+
+// Station state
+static wl_status_t station_status = WL_DISCONNECTED;
+static bool joining = false;
+static bool join_succeeds = false;
+static uint64_t join_done_micros = 0;
+static bool static_configuration = false;
+static IPAddress static_ip, static_gateway, static_subnet, static_dns;
+
+host::WiFiNetwork &host::wifi()
+{
+  return network;
+}
+
+host::TlsTimings &host::tls()
+{
+  return tls_timings;
+}
+
+unsigned int host::wifiGeneration()
+{
+  return wifi_generation;
+}
+
+void host::dropWiFi()
+{
+  if (station_status == WL_CONNECTED)
+    wifi_generation++;
+  station_status = WL_CONNECTION_LOST;
+  joining = false;
+}
+
+void host::addDnsEntry(const char *name, IPAddress ip)
+{
+  dns_entries[name] = ip;
+}
+
+void host::reset()
+{
+  setMillis(0);
+  memset(&esp(), 0, sizeof(EspState));
+  clearRtcMemory();
+  clearSerialOutput();
+  randomSeed(1);
+
+  network.ssid = "test-network";
+  network.password = "test-password";
+  network.in_range = true;
+  const uint8_t bssid[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  memcpy(network.bssid, bssid, sizeof(bssid));
+  network.channel = 6;
+  network.local_ip = IPAddress(192, 168, 1, 50);
+  network.gateway_ip = IPAddress(192, 168, 1, 1);
+  network.subnet_mask = IPAddress(255, 255, 255, 0);
+  network.dns_ip = IPAddress(192, 168, 1, 1);
+  // Orders of magnitude measured on ESP8266 boards: all-channel scan, association, DHCP on a home router
+  network.scan_millis = 2200;
+  network.join_millis = 250;
+  network.dhcp_millis = 1100;
+  network.dns_millis = 30;
+  network.begin_calls = 0;
+
+  // BearSSL on an ESP8266 at 80MHz, RSA 2048 key exchange against an abbreviated handshake
+  tls_timings.full_handshake_millis = 1600;
+  tls_timings.resumed_handshake_millis = 180;
+  tls_timings.resumption_accepted = true;
+  tls_timings.full_handshakes = 0;
+  tls_timings.resumed_handshakes = 0;
+
+  dns_entries.clear();
+  memset(&pubSubClientVariant(), 0, sizeof(PubSubClientVariant));
+  if (station_status == WL_CONNECTED)
+    wifi_generation++;
+  station_status = WL_DISCONNECTED;
+  joining = false;
+  static_configuration = false;
+}
+
+// ##### Station ####
+
+wl_status_t ESP8266WiFiClass::begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid, bool connect)
+{
+  network.begin_calls++;
+  if (station_status == WL_CONNECTED)
+    wifi_generation++;
+  station_status = WL_DISCONNECTED;
+
+  if (!connect)
+    return station_status;
+
+  // Given the channel and BSSID, the station skips the scan, and fails when the access point moved
+  bool targeted = (channel != 0 && bssid != NULL);
+  bool found = network.in_range && network.ssid == ssid &&
+               (!targeted || (channel == network.channel && memcmp(bssid, network.bssid, 6) == 0));
+
+  unsigned long duration = (targeted ? 0 : network.scan_millis) + network.join_millis + (static_configuration ? 0 : network.dhcp_millis);
+  joining = true;
+  join_succeeds = found && network.password == (passphrase != NULL ? passphrase : "");
+  join_done_micros = host::nowMicros() + (uint64_t)duration * 1000;
+  return station_status;
+}
+
+bool ESP8266WiFiClass::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress)
+{
+  static_configuration = local_ip.isSet();
+  static_ip = local_ip;
+  static_gateway = gateway;
+  static_subnet = subnet;
+  static_dns = dns1;
+  return true;
+}
+
+bool ESP8266WiFiClass::disconnect(bool)
+{
+  if (station_status == WL_CONNECTED)
+    wifi_generation++;
+  station_status = WL_DISCONNECTED;
+  joining = false;
+  return true;
+}
+
+wl_status_t ESP8266WiFiClass::status()
+{
+  if (joining && host::nowMicros() >= join_done_micros)
+  {
+    joining = false;
+    station_status = (join_succeeds ? WL_CONNECTED : WL_NO_SSID_AVAIL);
+  }
+
+  return station_status;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t)
+{
+  return true;
+}
+
+bool ESP8266WiFiClass::hostname(const char *)
+{
+  return true;
+}
+
+IPAddress ESP8266WiFiClass::localIP()
+{
+  if (status() != WL_CONNECTED)
+    return IPAddress();
+  return static_configuration ? static_ip : network.local_ip;
+}
+
+IPAddress ESP8266WiFiClass::gatewayIP()
+{
+  if (status() != WL_CONNECTED)
+    return IPAddress();
+  return static_configuration ? static_gateway : network.gateway_ip;
+}
+
+IPAddress ESP8266WiFiClass::subnetMask()
+{
+  if (status() != WL_CONNECTED)
+    return IPAddress();
+  return static_configuration ? static_subnet : network.subnet_mask;
+}
+
+IPAddress ESP8266WiFiClass::dnsIP(uint8_t)
+{
+  if (status() != WL_CONNECTED)
+    return IPAddress();
+  return static_configuration ? static_dns : network.dns_ip;
+}
+
+uint8_t *ESP8266WiFiClass::BSSID()
+{
+  return network.bssid;
+}
+
+int32_t ESP8266WiFiClass::channel()
+{
+  return network.channel;
+}
+
+// Without a timeout the lookup blocks until it is answered, like on ESP32
+int ESP8266WiFiClass::hostByName(const char *name, IPAddress &result)
+{
+  return hostByName(name, result, 0xFFFFFFFF);
+}
+
+int ESP8266WiFiClass::hostByName(const char *name, IPAddress &result, uint32_t timeout_ms)
+{
+  if (result.fromString(name))
+    return 1;
+  if (status() != WL_CONNECTED)
+    return 0;
+
+  if (network.dns_millis > timeout_ms)
+  {
+    host::advanceMillis(timeout_ms);
+    return 0;
+  }
+  host::advanceMillis(network.dns_millis);
+
+  std::map<std::string, IPAddress>::iterator entry = dns_entries.find(name);
+  if (entry != dns_entries.end())
+  {
+    result = entry->second;
+    return 1;
+  }
+
+  FakeBroker *broker = FakeBroker::find(name);
+  if (broker != NULL)
+  {
+    result = broker->ip();
+    return 1;
+  }
+
+  return 0;
+}
+
+// ##### TLS ####
+
+int BearSSL::WiFiClientSecure::connect(IPAddress ip, uint16_t port)
+{
+  if (!WiFiClient::connect(ip, port))
+    return 0;
+
+  return handshake(ip.toString().c_str());
+}
+
+int BearSSL::WiFiClientSecure::connect(const char *host, uint16_t port)
+{
+  if (!WiFiClient::connect(host, port))
+    return 0;
+
+  return handshake(host);
+}
+
+int BearSSL::WiFiClientSecure::handshake(const char *host)
+{
+  bool resumed = (session_ != NULL && session_->host == host && tls_timings.resumption_accepted);
+  unsigned long duration = (resumed ? tls_timings.resumed_handshake_millis : tls_timings.full_handshake_millis);
+  if (duration > _timeout)
+  {
+    host::advanceMillis(_timeout);
+    stop();
+    return 0;
+  }
+
+  host::advanceMillis(duration);
+  if (resumed)
+    tls_timings.resumed_handshakes++;
+  else
+    tls_timings.full_handshakes++;
+
+  if (session_ != NULL)
+    session_->host = host;
+  return 1;
+}
@@ -0,0 +1,91 @@
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include <Arduino.h>
+#include "WiFiClient.h"
+
+enum wl_status_t
+{
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_SCAN_COMPLETED = 2,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_CONNECTION_LOST = 5,
+    WL_WRONG_PASSWORD = 6,
+    WL_DISCONNECTED = 7
+};
+
+enum WiFiMode_t
+{
+    WIFI_OFF,
+    WIFI_STA,
+    WIFI_AP,
+    WIFI_AP_STA
+};
+
+// Station of the simulated network described by host::wifi()
+class ESP8266WiFiClass
+{
+public:
+    wl_status_t begin(const char *ssid, const char *passphrase = NULL, int32_t channel = 0, const uint8_t *bssid = NULL, bool connect = true);
+    bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0, IPAddress dns2 = (uint32_t)0);
+    bool disconnect(bool wifioff = false);
+    wl_status_t status();
+
+    bool mode(WiFiMode_t mode);
+    bool hostname(const char *name);
+    bool setHostname(const char *name) { return hostname(name); };
+    bool persistent(bool) { return true; };
+    bool setAutoReconnect(bool) { return true; };
+
+    IPAddress localIP();
+    IPAddress gatewayIP();
+    IPAddress subnetMask();
+    IPAddress dnsIP(uint8_t index = 0);
+    uint8_t *BSSID();
+    int32_t channel();
+
+    int hostByName(const char *name, IPAddress &result);
+    int hostByName(const char *name, IPAddress &result, uint32_t timeout_ms);
+};
+
+extern ESP8266WiFiClass WiFi;
+
+namespace BearSSL
+{
+    // Only remembers the host it was negotiated with, see host::tls()
+    class Session
+    {
+    public:
+        std::string host;
+    };
+
+    class X509List
+    {
+    public:
+        X509List(const char *) {}
+    };
+
+    // WiFiClient followed by a handshake of simulated duration, bounded by the Stream timeout
+    class WiFiClientSecure : public WiFiClient
+    {
+    private:
+        Session *session_;
+
+        int handshake(const char *host);
+
+    public:
+        WiFiClientSecure() : session_(NULL) {}
+        void setSession(Session *session) { session_ = session; };
+        bool setFingerprint(const uint8_t[20]) { return true; };
+        bool setFingerprint(const char *) { return true; };
+        void setInsecure() {}
+        void setTrustAnchors(const X509List *) {}
+
+        int connect(IPAddress ip, uint16_t port) override;
+        int connect(const char *host, uint16_t port) override;
+    };
+}
+
+#endif
@@ -0,0 +1,618 @@
+#include "FakeBroker.h"
+#include "HostSimulation.h"
+
+static std::vector<FakeBroker *> &brokers()
+{
+  static std::vector<FakeBroker *> list;
+  return list;
+}
+
+FakeBroker::FakeBroker(const char *host, IPAddress ip, uint16_t port) : host_(host), ip_(ip), port_(port)
+{
+  reachable = true;
+  refusing = false;
+  answering = true;
+  latency_millis = 1;
+  bandwidth_bytes_per_second = 0;
+  connack_code = 0;
+  acknowledge_publishes = true;
+  clearObservations();
+
+  brokers().push_back(this);
+}
+
+FakeBroker::~FakeBroker()
+{
+  for (size_t i = 0; i < connections_.size(); i++)
+  {
+    std::shared_ptr<FakeConnection> connection = connections_[i].lock();
+    if (connection)
+    {
+      connection->open = false;
+      connection->broker = NULL;
+    }
+  }
+
+  std::vector<FakeBroker *> &list = brokers();
+  list.erase(std::remove(list.begin(), list.end(), this), list.end());
+}
+
+FakeBroker *FakeBroker::find(IPAddress ip, uint16_t port)
+{
+  std::vector<FakeBroker *> &list = brokers();
+  for (size_t i = 0; i < list.size(); i++)
+  {
+    if (list[i]->ip_ == ip && list[i]->port_ == port)
+      return list[i];
+  }
+
+  return NULL;
+}
+
+FakeBroker *FakeBroker::find(const char *host)
+{
+  std::vector<FakeBroker *> &list = brokers();
+  for (size_t i = 0; i < list.size(); i++)
+  {
+    if (list[i]->host_ == host)
+      return list[i];
+  }
+
+  return NULL;
+}
+
+void FakeBroker::clearObservations()
+{
+  tcp_connections = 0;
+  protocol_violations = 0;
+  connect_millis.clear();
+  received.clear();
+  bytes_received = 0;
+  subscribe_packets = 0;
+}
+
+std::shared_ptr<FakeConnection> FakeBroker::accept()
+{
+  host::UncountedAllocations uncounted;
+  std::shared_ptr<FakeConnection> connection = std::make_shared<FakeConnection>();
+  connection->broker = this;
+  connection->open = true;
+  connection->last_delivery_micros = 0;
+  connection->due_bytes = 0;
+  connection->bytes_from_client = 0;
+  connection->wifi_generation = 0;
+  connection->mqtt_connected = false;
+  connection->has_will = false;
+  connection->will_retain = false;
+
+  // Forget the connections closed on both sides
+  for (size_t i = 0; i < connections_.size();)
+  {
+    if (connections_[i].expired())
+      connections_.erase(connections_.begin() + i);
+    else
+      i++;
+  }
+
+  connections_.push_back(connection);
+  tcp_connections++;
+  return connection;
+}
+
+unsigned int FakeBroker::openConnections() const
+{
+  unsigned int count = 0;
+  for (size_t i = 0; i < connections_.size(); i++)
+  {
+    std::shared_ptr<FakeConnection> connection = connections_[i].lock();
+    if (connection && connection->open)
+      count++;
+  }
+
+  return count;
+}
+
+void FakeBroker::dropConnections()
+{
+  host::UncountedAllocations uncounted;
+  for (size_t i = 0; i < connections_.size(); i++)
+  {
+    std::shared_ptr<FakeConnection> connection = connections_[i].lock();
+    if (connection)
+      close(*connection, true);
+  }
+}
+
+bool FakeBroker::hasSubscription(const char *client_id, const char *filter) const
+{
+  std::map<std::string, Session>::const_iterator session = sessions_.find(client_id);
+  if (session == sessions_.end())
+    return false;
+
+  for (size_t i = 0; i < session->second.subscriptions.size(); i++)
+  {
+    if (session->second.subscriptions[i].first == filter)
+      return true;
+  }
+
+  return false;
+}
+
+std::vector<FakeBroker::Message> FakeBroker::receivedOn(const char *topic) const
+{
+  std::vector<Message> messages;
+  for (size_t i = 0; i < received.size(); i++)
+  {
+    if (received[i].topic == topic)
+      messages.push_back(received[i]);
+  }
+
+  return messages;
+}
+
+void FakeBroker::publish(const char *topic, const std::string &payload, bool retain, uint8_t qos)
+{
+  host::UncountedAllocations uncounted;
+  if (retain)
+  {
+    if (payload.empty())
+      retained_.erase(topic);
+    else
+      retained_[topic] = payload;
+  }
+
+  deliver(topic, payload, qos, false);
+}
+
+// ##### Connection ####
+
+void FakeBroker::receive(FakeConnection &connection, const uint8_t *data, size_t length)
+{
+  host::UncountedAllocations uncounted;
+  bytes_received += length;
+  connection.bytes_from_client += length;
+  connection.from_client.insert(connection.from_client.end(), data, data + length);
+
+  // Handle every complete packet
+  while (connection.open && connection.from_client.size() >= 2)
+  {
+    std::vector<uint8_t> &buffer = connection.from_client;
+    size_t remaining_length = 0;
+    size_t position = 1;
+    bool complete_length = false;
+    for (int shift = 0; position < buffer.size() && position < 5; shift += 7)
+    {
+      uint8_t digit = buffer[position++];
+      remaining_length |= (size_t)(digit & 0x7F) << shift;
+      if ((digit & 0x80) == 0)
+      {
+        complete_length = true;
+        break;
+      }
+    }
+
+    if (!complete_length)
+    {
+      if (position == 5)
+      {
+        protocol_violations++;
+        close(connection, true);
+      }
+      return;
+    }
+
+    if (buffer.size() < position + remaining_length)
+      return;
+
+    std::vector<uint8_t> packet(buffer.begin(), buffer.begin() + position + remaining_length);
+    buffer.erase(buffer.begin(), buffer.begin() + position + remaining_length);
+    handlePacket(connection, packet[0], packet.data() + position, remaining_length);
+  }
+}
+
+void FakeBroker::closed(FakeConnection &connection)
+{
+  host::UncountedAllocations uncounted;
+  close(connection, true);
+}
+
+static std::string readString(const uint8_t *body, size_t length, size_t &position)
+{
+  if (position + 2 > length)
+  {
+    position = length + 1;
+    return std::string();
+  }
+
+  size_t string_length = (body[position] << 8) | body[position + 1];
+  position += 2;
+  if (position + string_length > length)
+  {
+    position = length + 1;
+    return std::string();
+  }
+
+  std::string str((const char *)body + position, string_length);
+  position += string_length;
+  return str;
+}
+
+void FakeBroker::handlePacket(FakeConnection &connection, uint8_t header, const uint8_t *body, size_t length)
+{
+  if (!answering)
+    return;
+
+  uint8_t type = header & 0xF0;
+
+  if ((type == 0x10) == connection.mqtt_connected)
+  {
+    // Second CONNECT, or anything before the first one
+    protocol_violations++;
+    close(connection, true);
+    return;
+  }
+
+  size_t position = 0;
+  switch (type)
+  {
+  case 0x10: // CONNECT
+  {
+    std::string protocol = readString(body, length, position);
+    if (position + 4 > length || (protocol != "MQTT" && protocol != "MQIsdp"))
+    {
+      protocol_violations++;
+      close(connection, false);
+      return;
+    }
+
+    uint8_t flags = body[position + 1];
+    position += 4; // Level, flags and keepalive
+    connection.client_id = readString(body, length, position);
+    connection.has_will = (flags & 0x04) != 0;
+    if (connection.has_will)
+    {
+      connection.will_topic = readString(body, length, position);
+      connection.will_message = readString(body, length, position);
+      connection.will_retain = (flags & 0x20) != 0;
+    }
+    if (flags & 0x80)
+      readString(body, length, position);
+    if (flags & 0x40)
+      readString(body, length, position);
+
+    if (position != length)
+    {
+      protocol_violations++;
+      close(connection, false);
+      return;
+    }
+
+    connect_millis.push_back(millis());
+
+    if (connack_code != 0)
+    {
+      send(connection, std::vector<uint8_t>{0x20, 2, 0, connack_code}, 2 * latency_millis);
+      connection.has_will = false;
+      close(connection, false);
+      return;
+    }
+
+    // Session takeover, the older connection is closed
+    std::map<std::string, Session>::iterator existing = sessions_.find(connection.client_id);
+    if (existing != sessions_.end())
+    {
+      std::shared_ptr<FakeConnection> previous = existing->second.connection.lock();
+      if (previous && previous.get() != &connection && previous->open)
+        close(*previous, true);
+    }
+
+    bool clean_session = (flags & 0x02) != 0;
+    bool session_present = (!clean_session && existing != sessions_.end());
+    if (!session_present)
+    {
+      Session session;
+      session.next_packet_id = 1;
+      sessions_[connection.client_id] = session;
+    }
+
+    for (size_t i = 0; i < connections_.size(); i++)
+    {
+      std::shared_ptr<FakeConnection> candidate = connections_[i].lock();
+      if (candidate.get() == &connection)
+        sessions_[connection.client_id].connection = candidate;
+    }
+
+    connection.mqtt_connected = true;
+    send(connection, std::vector<uint8_t>{0x20, 2, (uint8_t)(session_present ? 1 : 0), 0}, 2 * latency_millis);
+    return;
+  }
+
+  case 0x30: // PUBLISH
+  {
+    Message message;
+    message.client_id = connection.client_id;
+    message.qos = (header >> 1) & 0x03;
+    message.retain = (header & 0x01) != 0;
+    message.dup = (header & 0x08) != 0;
+    message.topic = readString(body, length, position);
+    message.packet_id = 0;
+    if (message.qos > 0 && position + 2 <= length)
+    {
+      message.packet_id = (body[position] << 8) | body[position + 1];
+      position += 2;
+    }
+    if (position > length || message.qos > 1)
+    {
+      protocol_violations++;
+      close(connection, true);
+      return;
+    }
+    message.payload.assign((const char *)body + position, length - position);
+    message.received_millis = millis();
+    received.push_back(message);
+
+    if (message.qos == 1)
+    {
+      if (!message.dup && connection.unacknowledged_ids.count(message.packet_id) > 0)
+        protocol_violations++;
+
+      if (acknowledge_publishes)
+      {
+        connection.unacknowledged_ids.erase(message.packet_id);
+        send(connection, std::vector<uint8_t>{0x40, 2, (uint8_t)(message.packet_id >> 8), (uint8_t)(message.packet_id & 0xFF)}, 2 * latency_millis);
+      }
+      else
+        connection.unacknowledged_ids.insert(message.packet_id);
+    }
+
+    if (message.retain)
+    {
+      if (message.payload.empty())
+        retained_.erase(message.topic);
+      else
+        retained_[message.topic] = message.payload;
+    }
+    deliver(message.topic, message.payload, message.qos, false);
+    return;
+  }
+
+  case 0x40: // PUBACK of a message sent to the client
+    return;
+
+  case 0x80: // SUBSCRIBE
+  {
+    if (header != 0x82 || length < 2)
+    {
+      protocol_violations++;
+      close(connection, true);
+      return;
+    }
+
+    subscribe_packets++;
+    Session &session = sessions_[connection.client_id];
+    uint16_t packet_id = (body[0] << 8) | body[1];
+    if (connection.unacknowledged_ids.count(packet_id) > 0)
+      protocol_violations++;
+    position = 2;
+    std::vector<uint8_t> suback{(uint8_t)(packet_id >> 8), (uint8_t)(packet_id & 0xFF)};
+    std::vector<std::string> filters;
+    while (position < length)
+    {
+      std::string filter = readString(body, length, position);
+      if (position >= length)
+      {
+        protocol_violations++;
+        close(connection, true);
+        return;
+      }
+      uint8_t qos = min(body[position++], (uint8_t)1);
+
+      bool replaced = false;
+      for (size_t i = 0; i < session.subscriptions.size(); i++)
+      {
+        if (session.subscriptions[i].first == filter)
+        {
+          session.subscriptions[i].second = qos;
+          replaced = true;
+        }
+      }
+      if (!replaced)
+        session.subscriptions.push_back(std::make_pair(filter, qos));
+
+      suback.push_back(qos);
+      filters.push_back(filter);
+    }
+
+    send(connection, encode(0x90, suback), 2 * latency_millis);
+
+    // Retained messages of the new subscriptions
+    for (std::map<std::string, std::string>::iterator retained = retained_.begin(); retained != retained_.end(); ++retained)
+    {
+      for (size_t i = 0; i < filters.size(); i++)
+      {
+        if (topicMatch(filters[i].c_str(), retained->first.c_str()))
+        {
+          deliverTo(session, connection, retained->first, retained->second, 0, true);
+          break;
+        }
+      }
+    }
+    return;
+  }
+
+  case 0xA0: // UNSUBSCRIBE
+  {
+    Session &session = sessions_[connection.client_id];
+    uint16_t packet_id = (body[0] << 8) | body[1];
+    if (connection.unacknowledged_ids.count(packet_id) > 0)
+      protocol_violations++;
+    position = 2;
+    while (position < length)
+    {
+      std::string filter = readString(body, length, position);
+      for (size_t i = 0; i < session.subscriptions.size(); i++)
+      {
+        if (session.subscriptions[i].first == filter)
+        {
+          session.subscriptions.erase(session.subscriptions.begin() + i);
+          break;
+        }
+      }
+    }
+
+    send(connection, std::vector<uint8_t>{0xB0, 2, (uint8_t)(packet_id >> 8), (uint8_t)(packet_id & 0xFF)}, 2 * latency_millis);
+    return;
+  }
+
+  case 0xC0: // PINGREQ
+    send(connection, std::vector<uint8_t>{0xD0, 0}, 2 * latency_millis);
+    return;
+
+  case 0xE0: // DISCONNECT, no last will
+    close(connection, false);
+    return;
+
+  default:
+    protocol_violations++;
+    close(connection, true);
+    return;
+  }
+}
+
+void FakeBroker::send(FakeConnection &connection, const std::vector<uint8_t> &packet, unsigned long delay_millis)
+{
+  if (!connection.open)
+    return;
+
+  // Bytes arrive in order, never before the ones sent earlier, and one after the other with a limited bandwidth
+  uint64_t delivery_micros = max(host::nowMicros() + (uint64_t)delay_millis * 1000, connection.last_delivery_micros);
+  uint64_t byte_micros = bandwidth_bytes_per_second > 0 ? 1000000 / bandwidth_bytes_per_second : 0;
+  for (size_t i = 0; i < packet.size(); i++)
+  {
+    connection.to_client.push_back(std::make_pair(delivery_micros, packet[i]));
+    if (i + 1 < packet.size())
+      delivery_micros += byte_micros;
+  }
+  connection.last_delivery_micros = delivery_micros;
+}
+
+void FakeBroker::deliver(const std::string &topic, const std::string &payload, uint8_t qos, bool retain)
+{
+  for (std::map<std::string, Session>::iterator session = sessions_.begin(); session != sessions_.end(); ++session)
+  {
+    std::shared_ptr<FakeConnection> connection = session->second.connection.lock();
+    if (!connection || !connection->open || !connection->mqtt_connected)
+      continue;
+
+    // The highest QoS among the matching subscriptions, one copy per client
+    int granted = -1;
+    for (size_t i = 0; i < session->second.subscriptions.size(); i++)
+    {
+      if (topicMatch(session->second.subscriptions[i].first.c_str(), topic.c_str()))
+        granted = max(granted, (int)session->second.subscriptions[i].second);
+    }
+
+    if (granted >= 0)
+      deliverTo(session->second, *connection, topic, payload, min((int)qos, granted), retain);
+  }
+}
+
+void FakeBroker::deliverTo(Session &session, FakeConnection &connection, const std::string &topic, const std::string &payload, uint8_t qos, bool retain)
+{
+  std::vector<uint8_t> body;
+  body.push_back(topic.size() >> 8);
+  body.push_back(topic.size() & 0xFF);
+  body.insert(body.end(), topic.begin(), topic.end());
+  if (qos > 0)
+  {
+    uint16_t packet_id = session.next_packet_id++;
+    if (session.next_packet_id == 0)
+      session.next_packet_id = 1;
+    body.push_back(packet_id >> 8);
+    body.push_back(packet_id & 0xFF);
+  }
+  body.insert(body.end(), payload.begin(), payload.end());
+
+  send(connection, encode(0x30 | (qos << 1) | (retain ? 1 : 0), body), latency_millis);
+}
+
+void FakeBroker::close(FakeConnection &connection, bool publish_will)
+{
+  if (!connection.open)
+    return;
+
+  connection.open = false;
+  bool was_connected = connection.mqtt_connected;
+  connection.mqtt_connected = false;
+
+  if (was_connected && publish_will && connection.has_will)
+  {
+    if (connection.will_retain)
+      retained_[connection.will_topic] = connection.will_message;
+    deliver(connection.will_topic, connection.will_message, 0, false);
+  }
+}
+
+std::vector<uint8_t> FakeBroker::encode(uint8_t header, const std::vector<uint8_t> &body)
+{
+  std::vector<uint8_t> packet;
+  packet.push_back(header);
+  size_t length = body.size();
+  do
+  {
+    uint8_t digit = length % 128;
+    length /= 128;
+    if (length > 0)
+      digit |= 0x80;
+    packet.push_back(digit);
+  } while (length > 0);
+
+  packet.insert(packet.end(), body.begin(), body.end());
+  return packet;
+}
+
+// Written apart from EspHomeClient::mqttTopicMatch(), which the tests check against it
+bool FakeBroker::topicMatch(const char *filter, const char *topic)
+{
+  if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+    return false;
+
+  std::vector<std::string> filter_levels, topic_levels;
+  std::string level;
+  for (const char *c = filter;; c++)
+  {
+    if (*c == '/' || *c == '\0')
+    {
+      filter_levels.push_back(level);
+      level.clear();
+      if (*c == '\0')
+        break;
+    }
+    else
+      level += *c;
+  }
+  for (const char *c = topic;; c++)
+  {
+    if (*c == '/' || *c == '\0')
+    {
+      topic_levels.push_back(level);
+      level.clear();
+      if (*c == '\0')
+        break;
+    }
+    else
+      level += *c;
+  }
+
+  for (size_t i = 0; i < filter_levels.size(); i++)
+  {
+    if (filter_levels[i] == "#")
+      return true;
+    if (i >= topic_levels.size())
+      return false;
+    if (filter_levels[i] != "+" && filter_levels[i] != topic_levels[i])
+      return false;
+  }
+
+  return filter_levels.size() == topic_levels.size();
+}
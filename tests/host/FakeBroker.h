@@ -0,0 +1,121 @@
+#ifndef FakeBroker_h
+#define FakeBroker_h
+
+#include <Arduino.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+class FakeBroker;
+
+// Byte pipe between a WiFiClient and a FakeBroker. What the client writes is handled by the broker right away,
+// what the broker sends is readable once its delivery time is reached.
+struct FakeConnection
+{
+    FakeBroker *broker;
+    bool open;
+    std::deque<std::pair<uint64_t, uint8_t> > to_client; // Delivery time in micros, byte
+    uint64_t last_delivery_micros; // Delivery times never go back, the due bytes are at the front
+    size_t due_bytes;              // Leading bytes of to_client known to be due
+    std::vector<uint8_t> from_client; // Incomplete packet
+    uint64_t bytes_from_client;
+    unsigned int wifi_generation; // Station connection the socket was opened on, it breaks with it
+    std::set<uint16_t> unacknowledged_ids; // QoS 1 PUBLISH packets from the client not acknowledged yet
+
+    // MQTT session state
+    bool mqtt_connected;
+    std::string client_id;
+    bool has_will;
+    std::string will_topic;
+    std::string will_message;
+    bool will_retain;
+};
+
+// MQTT 3.1.1 broker living in the test process, reached through the WiFiClient stand-in at host:port.
+// It handles CONNECT, PUBLISH (QoS 0 and 1, retained), SUBSCRIBE, UNSUBSCRIBE, PINGREQ, DISCONNECT and the last will.
+// A second CONNECT on a connection is a protocol violation: the connection is closed, like real brokers do.
+// So is a new packet reusing the identifier of a QoS 1 PUBLISH not acknowledged yet, it is only counted.
+class FakeBroker
+{
+public:
+    struct Message
+    {
+        std::string client_id; // Sender, empty for the messages published by the test
+        std::string topic;
+        std::string payload;
+        uint8_t qos;
+        bool retain;
+        bool dup;
+        uint16_t packet_id;
+        unsigned long received_millis;
+    };
+
+    // Behaviour
+    bool reachable;           // False: connection attempts go unanswered until they time out
+    bool refusing;            // Connection attempts are reset after one round trip
+    bool answering;           // False: connections are accepted, the packets received on them are ignored
+    unsigned long latency_millis; // One way, the answers arrive a round trip after the request
+    unsigned long bandwidth_bytes_per_second; // Towards the clients, 0 for no limit
+    uint8_t connack_code;
+    bool acknowledge_publishes; // Send the PUBACKs of the QoS 1 messages
+
+    // Observations
+    unsigned int tcp_connections;
+    unsigned int protocol_violations;
+    std::vector<unsigned long> connect_millis; // Time of each accepted CONNECT packet
+    std::vector<Message> received;             // PUBLISH packets from the clients, retransmissions included
+    uint64_t bytes_received;
+    unsigned int subscribe_packets;
+
+    FakeBroker(const char *host, IPAddress ip, uint16_t port = 1883);
+    ~FakeBroker();
+
+    inline const std::string &host() const { return host_; };
+    inline IPAddress ip() const { return ip_; };
+    inline uint16_t port() const { return port_; };
+
+    // Publish to the matching subscriptions, from outside of any client
+    void publish(const char *topic, const std::string &payload, bool retain = false, uint8_t qos = 0);
+    // Close every connection without DISCONNECT, e.g. a broker restart
+    void dropConnections();
+    unsigned int openConnections() const;
+    bool hasSubscription(const char *client_id, const char *filter) const;
+    std::vector<Message> receivedOn(const char *topic) const;
+    void clearObservations();
+
+    // Used by the WiFiClient stand-in
+    static FakeBroker *find(IPAddress ip, uint16_t port);
+    static FakeBroker *find(const char *host); // Brokers are resolvable by their host name
+    std::shared_ptr<FakeConnection> accept();
+    void receive(FakeConnection &connection, const uint8_t *data, size_t length);
+    void closed(FakeConnection &connection);
+
+    static bool topicMatch(const char *filter, const char *topic);
+
+private:
+    struct Session
+    {
+        std::vector<std::pair<std::string, uint8_t> > subscriptions;
+        std::weak_ptr<FakeConnection> connection;
+        uint16_t next_packet_id;
+    };
+
+    std::string host_;
+    IPAddress ip_;
+    uint16_t port_;
+    std::vector<std::weak_ptr<FakeConnection> > connections_;
+    std::map<std::string, Session> sessions_;
+    std::map<std::string, std::string> retained_;
+
+    void handlePacket(FakeConnection &connection, uint8_t header, const uint8_t *body, size_t length);
+    void send(FakeConnection &connection, const std::vector<uint8_t> &packet, unsigned long delay_millis);
+    void deliver(const std::string &topic, const std::string &payload, uint8_t qos, bool retain);
+    void deliverTo(Session &session, FakeConnection &connection, const std::string &topic, const std::string &payload, uint8_t qos, bool retain);
+    void close(FakeConnection &connection, bool publish_will);
+    static std::vector<uint8_t> encode(uint8_t header, const std::vector<uint8_t> &body);
+};
+
+#endif
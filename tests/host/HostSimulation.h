@@ -0,0 +1,90 @@
+#ifndef HostSimulation_h
+#define HostSimulation_h
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+
+// Controls of the simulated board and network the stand-ins implement. Everything is single threaded and deterministic:
+// time only moves when a test advances it, or when a stand-in blocks the way the real call would.
+namespace host
+{
+    // Clock behind millis() and micros(). delay() advances it, yield() advances it by one millisecond.
+    uint64_t nowMicros();
+    void setMillis(unsigned long now_millis);
+    void advanceMillis(unsigned long millis);
+    void advanceMicros(uint64_t micros);
+
+    // What the sketch asked the chip to do, the real calls never return
+    struct EspState
+    {
+        unsigned int resets;
+        unsigned int restarts;
+        unsigned int deep_sleeps;
+        uint64_t deep_sleep_micros; // Argument of the last ESP.deepSleep()
+    };
+    EspState &esp();
+    void clearRtcMemory(); // Power loss, deep sleep keeps the RTC memory
+
+    void muteSerial(bool muted);
+    const std::string &serialOutput(); // Everything written to Serial since the last reset()
+    void clearSerialOutput();
+
+    // Heap allocations made through operator new since the start of the process. The ones of the stand-ins playing the
+    // other end of the network, like FakeBroker, are left out with an UncountedAllocations scope.
+    unsigned long long allocations();
+    // Bytes of the counted allocations not freed yet
+    size_t heapInUse();
+    struct UncountedAllocations
+    {
+        UncountedAllocations();
+        ~UncountedAllocations();
+    };
+
+    // Access point and network timings seen by the WiFi stand-in
+    struct WiFiNetwork
+    {
+        std::string ssid;
+        std::string password;
+        bool in_range;
+        uint8_t bssid[6];
+        int32_t channel;
+        IPAddress local_ip;
+        IPAddress gateway_ip;
+        IPAddress subnet_mask;
+        IPAddress dns_ip;
+        unsigned long scan_millis; // Skipped when WiFi.begin() is given the channel and BSSID
+        unsigned long join_millis;
+        unsigned long dhcp_millis; // Skipped with a static configuration
+        unsigned long dns_millis;  // Time to resolve a name, WiFi.hostByName() gives up at its timeout
+        unsigned int begin_calls;
+    };
+    WiFiNetwork &wifi();
+    void dropWiFi(); // Access point lost, the open connections break
+    unsigned int wifiGeneration(); // Changes each time the station disconnects
+    void addDnsEntry(const char *name, IPAddress ip); // The FakeBroker host names resolve without an entry
+
+    // TLS handshake cost of the WiFiClientSecure stand-in, a session resumption skips the key exchange
+    struct TlsTimings
+    {
+        unsigned long full_handshake_millis;
+        unsigned long resumed_handshake_millis;
+        bool resumption_accepted; // False for a broker without a session cache
+        unsigned int full_handshakes;
+        unsigned int resumed_handshakes;
+    };
+    TlsTimings &tls();
+
+    // PubSubClient stand-in behaving like another version would
+    struct PubSubClientVariant
+    {
+        bool split_connect_write; // CONNECT packet written as its fixed header, then the rest
+        bool different_connect;   // CONNECT packet differing from the 2.8 one, with a keepalive one second longer
+    };
+    PubSubClientVariant &pubSubClientVariant();
+
+    // Back to power-on: clock at 0, default network, RTC memory cleared, counters reset. Brokers are left alone.
+    void reset();
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <ESP8266WiFi.h>
+#include "FakeBroker.h"
+#include "HostSimulation.h"
+
+WiFiClient::WiFiClient() {}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  return connect(ip, port, _timeout);
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip, _timeout))
+    return 0;
+
+  return connect(ip, port, _timeout);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+  stop();
+  if (WiFi.status() != WL_CONNECTED)
+    return 0;
+
+  // Nobody answers the SYN, the call blocks for the whole timeout
+  FakeBroker *broker = FakeBroker::find(ip, port);
+  if (broker == NULL || !broker->reachable || 2 * broker->latency_millis > (unsigned long)timeout)
+  {
+    host::advanceMillis(timeout);
+    return 0;
+  }
+
+  host::advanceMillis(2 * broker->latency_millis);
+  if (broker->refusing)
+    return 0;
+
+  connection_ = broker->accept();
+  connection_->wifi_generation = host::wifiGeneration();
+  return 1;
+}
+
+// The sockets opened before the station lost its connection are broken
+static void checkStation(std::shared_ptr<FakeConnection> &connection)
+{
+  if (connection && connection->open && connection->wifi_generation != host::wifiGeneration())
+  {
+    if (connection->broker != NULL)
+      connection->broker->closed(*connection);
+    connection->open = false;
+    connection->to_client.clear();
+    connection->due_bytes = 0;
+  }
+}
+
+size_t WiFiClient::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+  checkStation(connection_);
+  if (!connection_ || !connection_->open || connection_->broker == NULL)
+    return 0;
+
+  connection_->broker->receive(*connection_, buffer, size);
+  return size;
+}
+
+int WiFiClient::available()
+{
+  checkStation(connection_);
+  if (!connection_)
+    return 0;
+
+  uint64_t now = host::nowMicros();
+  std::deque<std::pair<uint64_t, uint8_t> > &bytes = connection_->to_client;
+  while (connection_->due_bytes < bytes.size() && bytes[connection_->due_bytes].first <= now)
+    connection_->due_bytes++;
+
+  return connection_->due_bytes;
+}
+
+int WiFiClient::read()
+{
+  if (available() == 0)
+    return -1;
+
+  uint8_t b = connection_->to_client.front().second;
+  connection_->to_client.pop_front();
+  connection_->due_bytes--;
+  return b;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t size)
+{
+  size_t count = min(size, (size_t)available());
+  for (size_t i = 0; i < count; i++)
+  {
+    buffer[i] = connection_->to_client.front().second;
+    connection_->to_client.pop_front();
+  }
+  connection_->due_bytes -= count;
+
+  return count;
+}
+
+int WiFiClient::peek()
+{
+  if (available() == 0)
+    return -1;
+
+  return connection_->to_client.front().second;
+}
+
+void WiFiClient::stop()
+{
+  if (!connection_)
+    return;
+
+  if (connection_->open && connection_->broker != NULL)
+    connection_->broker->closed(*connection_);
+  connection_->open = false;
+  connection_.reset();
+}
+
+// Like lwIP, a closed connection stays connected while received data is left to read. The data still in flight
+// arrives before the end of the connection.
+uint8_t WiFiClient::connected()
+{
+  checkStation(connection_);
+  return connection_ && (connection_->open || !connection_->to_client.empty());
+}
+
+int WiFiClient::availableForWrite()
+{
+  return connected() ? 1460 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef WiFiClient_h
+#define WiFiClient_h
+
+#include <Arduino.h>
+#include <memory>
+
+struct FakeConnection;
+
+// TCP client connected in-process to the FakeBroker listening at the address, see FakeBroker.h.
+// connect() blocks like lwIP does: for the round trip when the broker answers, for the whole timeout when nobody does.
+class WiFiClient : public Client
+{
+protected:
+    std::shared_ptr<FakeConnection> connection_;
+
+public:
+    WiFiClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout); // ESP32 flavour
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); };
+    int availableForWrite() override;
+    void setNoDelay(bool) {}
+};
+
+#endif
@@ -0,0 +1,358 @@
+// End to end behaviour of EspHomeClient against the simulated WiFi and a FakeBroker
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+TEST(connectsToWifiAndBroker)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  CHECK(client.isWifiConnected());
+  CHECK_EQUAL(1u, connectionEstablishedCalls());
+  CHECK_EQUAL(1u, broker.tcp_connections);
+  CHECK_EQUAL(1u, (unsigned int)broker.connect_millis.size());
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+TEST(receivesSubscribedMessages)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  String received;
+  client.subscribe("light", [&](const String &message) { received = message; });
+
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/light"); }, 10000));
+  broker.publish("cmnd/node/light", "on");
+  CHECK(runUntil(client, [&]() { return received == "on"; }, 1000));
+
+  // Wildcard subscription, with the topic handed to the callback
+  String topic;
+  client.subscribe("sensors/+/set", [&](const String &topic_str, const String &message) { topic = topic_str; received = message; });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/sensors/+/set"); }, 1000));
+  broker.publish("cmnd/node/sensors/kitchen/set", "12");
+  CHECK(runUntil(client, [&]() { return received == "12"; }, 1000));
+  CHECK(topic == "cmnd/node/sensors/kitchen/set");
+}
+
+TEST(publishesUnderTheTopicPrefixes)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  CHECK(client.publish(STAT, "power", "on"));
+  CHECK(client.publish(TELE, "temperature", "21.5", true));
+  runFor(client, 100);
+
+  std::vector<FakeBroker::Message> power = broker.receivedOn("stat/node/power");
+  std::vector<FakeBroker::Message> temperature = broker.receivedOn("tele/node/temperature");
+  CHECK_EQUAL(1u, (unsigned int)power.size());
+  CHECK_EQUAL(1u, (unsigned int)temperature.size());
+  if (!power.empty())
+    CHECK_EQUAL(std::string("on"), power[0].payload);
+  if (!temperature.empty())
+    CHECK(temperature[0].retain);
+}
+
+TEST(reconnectsAfterBrokerRestart)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  String received;
+  client.subscribe("light", [&](const String &message) { received = message; });
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  broker.dropConnections();
+  CHECK(runUntil(client, [&]() { return !client.isMqttConnected(); }, 1000));
+  CHECK(runUntil(client, [&]() { return client.isConnected() && broker.hasSubscription("node", "cmnd/node/light"); }, 30000));
+  CHECK_EQUAL(2u, connectionEstablishedCalls());
+
+  broker.publish("cmnd/node/light", "off");
+  CHECK(runUntil(client, [&]() { return received == "off"; }, 1000));
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+TEST(reconnectsAfterWifiLoss)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  host::dropWiFi();
+  CHECK(runUntil(client, [&]() { return !client.isWifiConnected(); }, 1000));
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 30000));
+  CHECK_EQUAL(2u, broker.tcp_connections);
+}
+
+// The subscriptions of a device are made under its own namespace, whatever their kind
+TEST(deviceSubscriptionsUseItsTopics)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  EspHomeClientDevice &strip = client.device("strip_2");
+
+  unsigned int received = 0;
+  auto on_message = [&](const char *, const uint8_t *, size_t) { received++; };
+  CHECK(strip.subscribeRef("power", on_message));
+  CHECK(strip.subscribeStream("data", [&](const char *, const uint8_t *, size_t, size_t, size_t) { received++; }));
+  uint8_t pixels[3];
+  EspHomeClientFrameDecoder decoder(pixels, 1);
+  CHECK(strip.subscribeFrame("frame", decoder, [&]() { received++; }));
+  long brightness = 0;
+  EspHomeClientCommandFields fields;
+  fields.addInt("brightness", &brightness);
+  CHECK(strip.subscribeCommand("set", fields, [&](uint32_t) { received++; }));
+
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/strip_2/set"); }, 10000));
+  CHECK(broker.hasSubscription("node", "cmnd/strip_2/power"));
+  CHECK(broker.hasSubscription("node", "cmnd/strip_2/data"));
+  CHECK(broker.hasSubscription("node", "cmnd/strip_2/frame"));
+  CHECK(!broker.hasSubscription("node", "cmnd/node/power"));
+
+  broker.publish("cmnd/strip_2/power", "ON");
+  broker.publish("cmnd/strip_2/data", "12345");
+  broker.publish("cmnd/strip_2/frame", std::string("LF\x01\x00\x00\x00\x00\x00\x01\x10\x20\x30", 12));
+  broker.publish("cmnd/strip_2/set", "{\"brightness\":80}");
+  CHECK(runUntil(client, [&]() { return received == 4; }, 1000));
+  CHECK_EQUAL(80l, brightness);
+  CHECK(pixels[2] == 0x30);
+}
+
+// A malformed command leaves the bound members as they were, a well formed one sets them all
+TEST(malformedCommandLeavesFieldsUnchanged)
+{
+  bool state = false;
+  long brightness = 10;
+  uint8_t color[3] = {1, 2, 3};
+  char effect[8] = "none";
+  EspHomeClientCommandFields fields;
+  fields.addBool("state", &state);
+  fields.addInt("brightness", &brightness);
+  fields.addColor("color", color);
+  fields.addString("effect", effect, sizeof(effect));
+
+  const char *malformed[] = {
+      "{\"state\":\"ON\",\"brightness\":200,\"color\":\"#FF0000\",\"effect\":\"rainbow\",}",
+      "{\"state\":true,\"effect\":\"fade\",\"brightness\":\"high\"}",
+      "{\"brightness\":200,\"effect\":\"much too long\"}",
+      "{\"color\":[255,0,0],\"state\":true",
+  };
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+  {
+    uint32_t present;
+    CHECK(!fields.parse((const uint8_t *)malformed[i], strlen(malformed[i]), present));
+    CHECK(!state);
+    CHECK_EQUAL(10l, brightness);
+    CHECK(color[0] == 1 && color[1] == 2 && color[2] == 3);
+    CHECK_EQUAL(std::string("none"), std::string(effect));
+  }
+  CHECK_EQUAL(4ul, fields.getStats().errors);
+
+  const char *command = "{\"state\":\"ON\",\"effect\":\"f\\u0061de\",\"brightness\":200,\"color\":\"#FF8000\",\"effect\":\"glow\"}";
+  uint32_t present;
+  CHECK(fields.parse((const uint8_t *)command, strlen(command), present));
+  CHECK_EQUAL(0xFu, present);
+  CHECK(state);
+  CHECK_EQUAL(200l, brightness);
+  CHECK(color[0] == 0xFF && color[1] == 0x80 && color[2] == 0);
+  CHECK_EQUAL(std::string("glow"), std::string(effect));
+
+  const char *escaped = "{\"effect\":\"f\\u0061de\"}";
+  CHECK(fields.parse((const uint8_t *)escaped, strlen(escaped), present));
+  CHECK_EQUAL(std::string("fade"), std::string(effect));
+}
+
+// ##### Publish queue ####
+
+// With a budget of 0, each loop() call still sends one queued message
+TEST(publishQueueSendsOneMessageWithoutBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.enablePublishQueue(1024));
+  client.setPublishQueueDrainBudget(0);
+  CHECK(runUntil(client, [&]() { return client.isWifiConnected(); }, 10000));
+
+  for (int i = 0; i < 4; i++)
+    CHECK(client.publish(STAT, "power", "on"));
+  CHECK_EQUAL(4u, client.getPublishQueueStats().pending_messages);
+
+  broker.reachable = true;
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 120000));
+  unsigned int most = 0;
+  for (int i = 0; i < 10 && client.getPublishQueueStats().pending_messages > 0; i++)
+  {
+    unsigned int pending = client.getPublishQueueStats().pending_messages;
+    client.loop();
+    most = max(most, pending - client.getPublishQueueStats().pending_messages);
+    host::advanceMillis(1);
+  }
+  runFor(client, 100);
+  CHECK_EQUAL(4u, (unsigned int)broker.receivedOn("stat/node/power").size());
+  CHECK_EQUAL(1u, most);
+}
+
+// A message whose time to live expired is dropped, also when it waits behind one without time to live
+TEST(publishQueueDropsExpiredMessages)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.enablePublishQueue(1024));
+  CHECK(runUntil(client, [&]() { return client.isWifiConnected(); }, 10000));
+
+  CHECK(client.publish(STAT, "power", (const uint8_t *)"on", 2));
+  CHECK(client.publish(STAT, "alert", (const uint8_t *)"smoke", 5, false, 1000));
+  CHECK(client.publish(STAT, "power", (const uint8_t *)"off", 3));
+  runFor(client, 2000);
+
+  broker.reachable = true;
+  CHECK(runUntil(client, [&]() { return broker.receivedOn("stat/node/power").size() == 2; }, 120000));
+  runFor(client, 100);
+  CHECK_EQUAL(0u, (unsigned int)broker.receivedOn("stat/node/alert").size());
+  CHECK_EQUAL(1ul, client.getPublishQueueStats().dropped_expired);
+  CHECK_EQUAL(2ul, client.getPublishQueueStats().sent);
+}
+
+// ##### Command queue ####
+
+// Without coalescing, every queued command is dispatched, in order
+TEST(commandQueueDispatchesEveryCommand)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.enableCommandQueue());
+  std::string received;
+  client.subscribe("light", [&](const String &message) { received += message.c_str(); });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/light"); }, 10000));
+
+  for (char c = '1'; c <= '5'; c++)
+    broker.publish("cmnd/node/light", std::string(1, c));
+  CHECK(runUntil(client, [&]() { return received.size() == 5; }, 1000));
+  CHECK_EQUAL(std::string("12345"), received);
+
+  CommandQueueStats stats = client.getCommandQueueStats();
+  CHECK_EQUAL(5ul, stats.queued);
+  CHECK_EQUAL(5ul, stats.dispatched);
+  CHECK_EQUAL(0ul, stats.coalesced);
+  CHECK(stats.max_pending > 1);
+}
+
+// Only the subscriptions marked with coalesceCommands() keep the last command of a burst
+TEST(commandQueueCoalescesMarkedSubscriptions)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.enableCommandQueue());
+  std::vector<std::string> power, light, all;
+  client.subscribe("power", [&](const String &message) { power.push_back(message.c_str()); });
+  client.subscribe("light", [&](const String &message) { light.push_back(message.c_str()); });
+  client.subscribe("group/+", [&](const String &message) { all.push_back(message.c_str()); });
+  client.subscribe("group/power", [&](const String &) {});
+  CHECK(client.coalesceCommands("power"));
+  CHECK(client.coalesceCommands("group/power"));
+  CHECK(!client.coalesceCommands("unknown"));
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/group/power"); }, 10000));
+
+  broker.publish("cmnd/node/power", "ON");
+  broker.publish("cmnd/node/light", "1");
+  broker.publish("cmnd/node/power", "OFF");
+  broker.publish("cmnd/node/light", "2");
+  broker.publish("cmnd/node/power", "ON");
+  // Also matched by a subscription without coalescing
+  broker.publish("cmnd/node/group/power", "ON");
+  broker.publish("cmnd/node/group/power", "OFF");
+  CHECK(runUntil(client, [&]() { return light.size() == 2 && all.size() == 2; }, 1000));
+  runFor(client, 10);
+
+  CHECK_EQUAL(1u, (unsigned int)power.size());
+  if (!power.empty())
+    CHECK_EQUAL(std::string("ON"), power[0]);
+  CHECK(light == std::vector<std::string>({"1", "2"}));
+  CHECK(all == std::vector<std::string>({"ON", "OFF"}));
+  CHECK_EQUAL(2ul, client.getCommandQueueStats().coalesced);
+}
+
+// A loop() call dispatches the queued commands within the budget, and at least one
+TEST(commandQueueFollowsDrainBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(client.enableCommandQueue());
+  client.setCommandQueueBudget(10000);
+  unsigned int received = 0;
+  // A slow handler, 4ms per command
+  client.subscribe("light", [&](const String &) { received++; host::advanceMillis(4); });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/light"); }, 10000));
+
+  for (int budget = 1; budget >= 0; budget--)
+  {
+    client.setCommandQueueBudget(budget * 10000);
+    received = 0;
+    for (int i = 0; i < 8; i++)
+      broker.publish("cmnd/node/light", "on");
+
+    unsigned long most = 0;
+    unsigned long start = millis();
+    while (received < 8 && millis() - start < 1000)
+    {
+      unsigned long dispatched = client.getCommandQueueStats().dispatched;
+      client.loop();
+      most = max(most, client.getCommandQueueStats().dispatched - dispatched);
+      host::advanceMillis(1);
+    }
+    CHECK_EQUAL(8u, received);
+    CHECK_EQUAL(budget ? 3ul : 1ul, most);
+  }
+}
+
+// A payload arriving over several keepalives: PubSubClient does not see it, the connection is kept alive meanwhile
+TEST(longStreamKeepsConnectionAlive)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.setKeepAlive(2);
+  size_t received = 0;
+  bool complete = false;
+  CHECK(client.subscribeStream("data", [&](const char *, const uint8_t *, size_t length, size_t offset, size_t total_length) {
+    received += length;
+    complete = offset + length == total_length;
+  }));
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/data"); }, 10000));
+
+  // 10 seconds at 1000 bytes per second
+  broker.bandwidth_bytes_per_second = 1000;
+  broker.publish("cmnd/node/data", std::string(10000, 'x'));
+  CHECK(runUntil(client, [&]() { return complete; }, 15000));
+  CHECK_EQUAL((size_t)10000, received);
+
+  // Back to the keepalive of PubSubClient once the stream is over
+  broker.bandwidth_bytes_per_second = 0;
+  runFor(client, 10000);
+  CHECK(client.isMqttConnected());
+  CHECK_EQUAL(1u, broker.tcp_connections);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+// The QoS 2 flow is not handled, such subscriptions are rejected rather than sent to the broker
+TEST(qos2SubscriptionRejected)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(!client.subscribe("light", [](const String &) {}, 2));
+  CHECK(!client.subscribeStream("data", [](const char *, const uint8_t *, size_t, size_t, size_t) {}, 2));
+  CHECK(client.subscribe("power", [](const String &) {}, 1));
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/power"); }, 10000));
+
+  // Connected, the packet would be sent right away
+  CHECK(!client.subscribe("light", [](const String &) {}, 2));
+  runFor(client, 10);
+  CHECK(!broker.hasSubscription("node", "cmnd/node/light"));
+  CHECK(!broker.hasSubscription("node", "cmnd/node/data"));
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
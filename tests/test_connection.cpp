@@ -0,0 +1,253 @@
+// MQTT connection setup: time a single loop() call can block while the broker is unreachable or slow, and the
+// TLS session resumption and the CONNECT packet sent ahead of PubSubClient
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+// Default budget of a blocking step, a yield() or two on top of it is fine
+static const unsigned long BUDGET_MILLIS = 100;
+static const unsigned long SLACK_MILLIS = 5;
+
+static void connectWifi(EspHomeClient &client)
+{
+  CHECK(runUntil(client, [&]() { return client.isWifiConnected(); }, 10000));
+}
+
+TEST(unreachableBrokerKeepsLoopWithinBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  // The tries timing out grow up to the blocking timeout, kept to the budget here
+  client.setBlockingConnectTimeout(BUDGET_MILLIS);
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 120000);
+  CHECK(worst <= BUDGET_MILLIS + SLACK_MILLIS);
+  CHECK(client.getTransportStats().failed_connections > 10);
+  CHECK(!client.isMqttConnected());
+
+  // Reachable again, the client connects without waiting more than the backoff
+  broker.reachable = true;
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, ReconnectPolicy::mqttDefault().max_backoff_millis * 3 / 2 + 20000));
+}
+
+TEST(slowDnsKeepsLoopWithinBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  host::wifi().dns_millis = 5000;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.setBlockingConnectTimeout(BUDGET_MILLIS);
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= BUDGET_MILLIS + SLACK_MILLIS);
+  CHECK(!client.isMqttConnected());
+}
+
+TEST(silentBrokerKeepsLoopWithinBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.answering = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= BUDGET_MILLIS + SLACK_MILLIS);
+  CHECK(broker.tcp_connections >= 2);
+  CHECK(!client.isMqttConnected());
+}
+
+TEST(refusingBrokerKeepsLoopWithinBudget)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.refusing = true;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= BUDGET_MILLIS + SLACK_MILLIS);
+  CHECK(!client.isMqttConnected());
+}
+
+TEST(budgetFollowsSetting)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.setConnectionTimeBudget(20);
+  client.setBlockingConnectTimeout(20);
+  connectWifi(client);
+
+  CHECK(worstLoopMillis(client, 60000) <= 20 + SLACK_MILLIS);
+}
+
+// With the default settings, the tries to an unreachable broker block for up to the blocking timeout
+TEST(unreachableBrokerTriesGrowUpToBlockingTimeout)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= 5000 + SLACK_MILLIS);
+  CHECK(worst >= 5000);
+  CHECK(!client.isMqttConnected());
+}
+
+// A lookup and a round trip longer than the budget, the tries grow until they complete
+TEST(distantBrokerConnectsWithDefaults)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.latency_millis = 150;
+  host::wifi().dns_millis = 250;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  connectWifi(client);
+
+  unsigned long start = millis();
+  CHECK(runUntil(client, [&]() { return client.isMqttConnected(); }, 10000));
+  CHECK(millis() - start < 2000);
+  CHECK_EQUAL(1u, broker.tcp_connections);
+}
+
+// The TLS handshake and the connection of another Client cannot be split, they are bounded as a whole. These clients
+// connect by name, a lookup of the cached address comes on top
+TEST(tlsConnectionIsBoundedByBlockingTimeout)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1), 8883);
+  broker.reachable = false;
+  const uint8_t fingerprint[20] = {0};
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node", 8883);
+  client.enableTLS(fingerprint);
+  client.setBlockingConnectTimeout(2000);
+  connectWifi(client);
+
+  const unsigned long bound = 2000 + host::wifi().dns_millis + SLACK_MILLIS;
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= bound);
+  CHECK(worst >= 2000);
+
+  // A handshake longer than the timeout fails rather than blocking
+  broker.reachable = true;
+  host::tls().full_handshake_millis = 3000;
+  worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= bound);
+  CHECK(!client.isMqttConnected());
+}
+
+// The reconnection resumes the TLS session of the first connection and skips the key exchange
+TEST(tlsSessionIsResumedOnReconnection)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1), 8883);
+  const uint8_t fingerprint[20] = {0};
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node", 8883);
+  client.enableTLS(fingerprint);
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  CHECK_EQUAL(1u, host::tls().full_handshakes);
+
+  broker.dropConnections();
+  CHECK(runUntil(client, [&]() { return !client.isMqttConnected(); }, 1000));
+  CHECK(runUntil(client, [&]() { return client.isMqttConnected(); }, 30000));
+
+  CHECK_EQUAL(1u, host::tls().full_handshakes);
+  CHECK_EQUAL(1u, host::tls().resumed_handshakes);
+  TransportStats stats = client.getTransportStats();
+  CHECK_EQUAL(2ul, stats.connections);
+  CHECK(stats.first_connect_millis >= host::tls().full_handshake_millis);
+  CHECK(stats.last_connect_millis >= host::tls().resumed_handshake_millis);
+  CHECK(stats.last_connect_millis < host::tls().full_handshake_millis);
+}
+
+// A broker without a session cache makes every reconnection take the full handshake
+TEST(tlsFullHandshakeWhenResumptionRefused)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1), 8883);
+  host::tls().resumption_accepted = false;
+  const uint8_t fingerprint[20] = {0};
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node", 8883);
+  client.enableTLS(fingerprint);
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  broker.dropConnections();
+  CHECK(runUntil(client, [&]() { return !client.isMqttConnected(); }, 1000));
+  CHECK(runUntil(client, [&]() { return client.isMqttConnected(); }, 30000));
+
+  CHECK_EQUAL(2u, host::tls().full_handshakes);
+  CHECK_EQUAL(0u, host::tls().resumed_handshakes);
+  TransportStats stats = client.getTransportStats();
+  CHECK(stats.last_connect_millis >= host::tls().full_handshake_millis);
+}
+
+TEST(customClientIsBoundedByBlockingTimeout)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  WiFiClient custom_client;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.setNetworkClient(custom_client);
+  connectWifi(client);
+
+  unsigned long worst = worstLoopMillis(client, 60000);
+  CHECK(worst <= 5000 + host::wifi().dns_millis + SLACK_MILLIS);
+
+  broker.reachable = true;
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 130000));
+}
+
+// ##### CONNECT sent ahead of PubSubClient ####
+
+TEST(pubSubClientConnectIsDropped)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableLastWillMessage("tele/node/lwt", "offline", true);
+
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  CHECK_EQUAL(1u, broker.tcp_connections);
+  CHECK_EQUAL(1u, (unsigned int)broker.connect_millis.size());
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+// Written in pieces, the packet is still recognised
+TEST(pubSubClientConnectWrittenInPiecesIsDropped)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  host::pubSubClientVariant().split_connect_write = true;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  CHECK_EQUAL(1u, broker.tcp_connections);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
+
+// A PubSubClient sending another CONNECT packet is noticed, the connection made with it ahead is dropped and the next
+// ones are left to PubSubClient, which blocks until the CONNACK
+TEST(differentPubSubClientConnectFallsBack)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.latency_millis = 20;
+  host::pubSubClientVariant().different_connect = true;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  String received;
+  client.subscribe("light", [&](const String &message) { received = message; });
+
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 30000));
+  CHECK_EQUAL(2u, broker.tcp_connections);
+  CHECK_EQUAL(2u, (unsigned int)broker.connect_millis.size());
+  CHECK_EQUAL(0u, broker.protocol_violations);
+  CHECK_EQUAL(1u, connectionEstablishedCalls());
+
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/light"); }, 1000));
+  broker.publish("cmnd/node/light", "on");
+  CHECK(runUntil(client, [&]() { return received == "on"; }, 1000));
+
+  // Reconnections go on with the fallback
+  broker.dropConnections();
+  CHECK(runUntil(client, [&]() { return !client.isMqttConnected(); }, 1000));
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 30000));
+  CHECK_EQUAL(3u, broker.tcp_connections);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}
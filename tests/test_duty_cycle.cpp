@@ -0,0 +1,99 @@
+// Deep sleep duty cycles against the simulated clock: when the cycle ends, what keeps it awake, and the sleep duration
+// handed to ESP.deepSleep()
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+static bool asleep()
+{
+  return host::esp().deep_sleeps > 0;
+}
+
+TEST(sleepsOnceQueueFlushedAndCommandsAwaited)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enablePublishQueue(256);
+  client.enableDeepSleepCycle(60 * 1000000ULL, 300, 15000);
+  client.publish(TELE, "present", "01");
+
+  unsigned long connected_millis = 0;
+  CHECK(runUntil(client, [&]() {
+    if (connected_millis == 0 && client.isConnected())
+      connected_millis = millis();
+    return asleep();
+  }, 20000));
+
+  CHECK_EQUAL(1u, (unsigned int)broker.receivedOn("tele/node/present").size());
+  CHECK_EQUAL(60 * 1000000ULL, host::esp().deep_sleep_micros);
+  CHECK(millis() - connected_millis >= 300);
+  CHECK(millis() - connected_millis < 300 + 50);
+  CHECK(!client.getDutyCycleStats().timeouts);
+}
+
+TEST(unreachableBrokerSleepsAfterMaxAwake)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableDeepSleepCycle(60 * 1000000ULL, 300, 8000);
+
+  CHECK(runUntil(client, asleep, 20000));
+  CHECK(millis() >= 8000);
+  CHECK(millis() < 8000 + 200);
+  CHECK_EQUAL(1ul, (unsigned long)client.getDutyCycleStats().timeouts);
+}
+
+// A QoS 1 message waiting for its PUBACK is not delivered yet, the cycle waits for it
+TEST(unacknowledgedQoS1KeepsCycleAwake)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  broker.acknowledge_publishes = false;
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableQoS1Publish(4, 1024, 1000);
+  client.enableDeepSleepCycle(60 * 1000000ULL, 300, 15000);
+  bool delivered = false;
+  client.setOnPublishCompletedCallback([&](uint16_t, bool success) { delivered = success; });
+
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+  CHECK(client.publishQoS1(TELE, "alarm", "1") != 0);
+
+  // Well past the command wait, the message is still in flight
+  runFor(client, 3000);
+  CHECK(!asleep());
+
+  broker.acknowledge_publishes = true;
+  CHECK(runUntil(client, asleep, 5000));
+  CHECK(delivered);
+}
+
+// ESP8266 caps the sleep to what its RTC timer can count
+TEST(longSleepIsCapped)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  client.enableDeepSleepCycle(24 * 3600 * 1000000ULL, 0, 15000);
+
+  CHECK(runUntil(client, asleep, 20000));
+  CHECK_EQUAL(ESP.deepSleepMax(), host::esp().deep_sleep_micros);
+}
+
+// Statistics carried through deep sleep in RTC memory, counted per cycle
+TEST(statisticsSurviveDeepSleep)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  for (int cycle = 0; cycle < 3; cycle++)
+  {
+    // Woken up: the clock counts from boot again, the station is off, the RTC memory is kept
+    host::setMillis(0);
+    host::esp().deep_sleeps = 0;
+    WiFi.disconnect();
+
+    EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+    client.enableDeepSleepCycle(60 * 1000000ULL, 100, 15000);
+    CHECK_EQUAL((uint32_t)cycle, client.getDutyCycleStats().cycles);
+    CHECK(runUntil(client, asleep, 20000));
+  }
+}
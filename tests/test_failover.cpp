@@ -0,0 +1,83 @@
+// Broker failover between several FakeBrokers: a primary broker down, its recovery, and the preference for a
+// measurably faster broker
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+static bool connectedTo(EspHomeClient &client, const char *host)
+{
+  return client.isConnected() && strcmp(client.getActiveBroker().host, host) == 0;
+}
+
+TEST(failoverWhenPrimaryIsDown)
+{
+  FakeBroker primary("primary.test", IPAddress(10, 0, 0, 1));
+  FakeBroker backup("backup.test", IPAddress(10, 0, 0, 2));
+  primary.reachable = false;
+  EspHomeClient client(SSID, PASSWORD, "primary.test", "node");
+  CHECK(client.addBroker("backup.test"));
+
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "backup.test"); }, 60000));
+  CHECK(client.getBrokerSelectionReason() == BROKER_FAILOVER);
+  CHECK(client.getBrokerStatus(0).consecutive_failures >= ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES);
+  CHECK_EQUAL(0u, primary.tcp_connections);
+
+  CHECK(client.publish(TELE, "reading", "1"));
+  runFor(client, 100);
+  CHECK_EQUAL(1u, backup.receivedOn("tele/node/reading").size());
+}
+
+TEST(failbackWhenPrimaryRecovers)
+{
+  FakeBroker primary("primary.test", IPAddress(10, 0, 0, 1));
+  FakeBroker backup("backup.test", IPAddress(10, 0, 0, 2));
+  EspHomeClient client(SSID, PASSWORD, "primary.test", "node");
+  client.addBroker("backup.test");
+  client.setBrokerSelection(50, 60000);
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "primary.test"); }, 10000));
+  CHECK(client.getBrokerSelectionReason() == BROKER_PREFERRED);
+
+  // Maintenance of the primary broker
+  primary.refusing = true;
+  primary.dropConnections();
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "backup.test"); }, 60000));
+
+  // Still down at the first failback, the client goes back to the backup broker
+  runFor(client, 60000);
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "backup.test"); }, 60000));
+  CHECK(client.getBrokerStatus(0).failures >= ESPHOMECLIENT_BROKER_DOWN_AFTER_FAILURES + 1);
+
+  primary.refusing = false;
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "primary.test"); }, 2 * 60000));
+  CHECK_EQUAL(0u, primary.protocol_violations + backup.protocol_violations);
+}
+
+// Once both round trips are known, a broker faster by more than the margin is preferred to an earlier one
+TEST(fasterBrokerIsPreferred)
+{
+  FakeBroker primary("primary.test", IPAddress(10, 0, 0, 1));
+  FakeBroker backup("backup.test", IPAddress(10, 0, 0, 2));
+  primary.latency_millis = 150;
+  backup.latency_millis = 10;
+  EspHomeClient client(SSID, PASSWORD, "primary.test", "node");
+  client.addBroker("backup.test");
+  client.setBrokerSelection(50, 60000);
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "primary.test"); }, 10000));
+
+  // The round trip of the backup broker is measured during an outage of the primary one
+  primary.refusing = true;
+  primary.dropConnections();
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "backup.test"); }, 60000));
+  primary.refusing = false;
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "primary.test"); }, 2 * 60000));
+
+  CHECK(client.getBrokerStatus(0).connack_rtt_millis >= 300);
+  CHECK(client.getBrokerStatus(1).connack_rtt_millis <= 30);
+
+  // The next connection goes to the faster one
+  primary.dropConnections();
+  CHECK(runUntil(client, [&]() { return connectedTo(client, "backup.test"); }, 60000));
+  CHECK(client.getBrokerSelectionReason() == BROKER_FASTEST);
+}
@@ -0,0 +1,106 @@
+// Tasks scheduled on the client: periodic runs, cancellation, tasks changing the schedule while they run and the
+// identifiers handed out
+
+#include "TestHarness.h"
+
+static const char *SSID = "test-network";
+static const char *PASSWORD = "test-password";
+
+TEST(everyRunsUntilCancelled)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  unsigned int runs = 0;
+  uint16_t id = client.every(100, [&]() { runs++; });
+  CHECK(id != 0);
+  runFor(client, 1050);
+  CHECK_EQUAL(10u, runs);
+  CHECK(client.getTaskStats(id) != NULL);
+  CHECK_EQUAL(10ul, client.getTaskStats(id)->runs);
+
+  CHECK(client.cancelTask(id));
+  CHECK(!client.cancelTask(id));
+  CHECK(client.getTaskStats(id) == NULL);
+  runFor(client, 1000);
+  CHECK_EQUAL(10u, runs);
+  CHECK_EQUAL(0u, client.getSchedulerStats().tasks);
+}
+
+// A task may cancel itself, or another task due in the same tick
+TEST(taskCancelsFromInside)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  unsigned int self_runs = 0;
+  uint16_t self_id = 0;
+  self_id = client.every(100, [&]() {
+    if (++self_runs == 3)
+      CHECK(client.cancelTask(self_id));
+  });
+
+  unsigned int other_runs = 0;
+  uint16_t other_id = 0;
+  client.after(50, [&]() { CHECK(client.cancelTask(other_id)); });
+  other_id = client.after(50, [&]() { other_runs++; });
+
+  runFor(client, 1000);
+  CHECK_EQUAL(3u, self_runs);
+  CHECK_EQUAL(0u, other_runs);
+  CHECK_EQUAL(0u, client.getSchedulerStats().tasks);
+}
+
+// A one shot task scheduling itself again, with a new identifier each time
+TEST(taskReschedulesItself)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client(SSID, PASSWORD, "broker.test", "node");
+  CHECK(runUntil(client, [&]() { return client.isConnected(); }, 10000));
+
+  std::vector<unsigned long> run_millis;
+  std::vector<uint16_t> ids;
+  std::function<void()> task = [&]() {
+    run_millis.push_back(millis());
+    if (run_millis.size() < 5)
+      ids.push_back(client.after(run_millis.size() * 100, task));
+  };
+  ids.push_back(client.after(100, task));
+
+  unsigned long start = millis();
+  runFor(client, 2000);
+  CHECK_EQUAL(5u, (unsigned int)run_millis.size());
+  CHECK_EQUAL(5u, (unsigned int)ids.size());
+  for (size_t i = 1; i < ids.size(); i++)
+    CHECK(ids[i] != ids[i - 1]);
+  // Delays of 100, 100, 200, 300 and 400ms, one after the other
+  if (run_millis.size() == 5)
+    CHECK(run_millis[4] - start >= 1100 && run_millis[4] - start < 1150);
+  CHECK_EQUAL(0u, client.getSchedulerStats().tasks);
+}
+
+// Once the identifiers wrap around, the ones of the tasks still scheduled are skipped
+TEST(identifiersSkipTheOnesInUse)
+{
+  EspHomeClientScheduler scheduler;
+  CHECK_EQUAL(1u, scheduler.schedule(0, 1000, 1000, []() {}));
+  CHECK_EQUAL(2u, scheduler.schedule(0, 1000, 1000, []() {}));
+  CHECK_EQUAL(3u, scheduler.schedule(0, 1000, 1000, []() {}));
+
+  unsigned int unexpected = 0;
+  for (uint32_t expected = 4; expected <= 0xFFFF; expected++)
+  {
+    uint16_t id = scheduler.schedule(0, 10, 0, []() {});
+    if (id != expected || !scheduler.cancel(id))
+      unexpected++;
+  }
+  CHECK_EQUAL(0u, unexpected);
+
+  // 1, 2 and 3 are still in use
+  CHECK_EQUAL(4u, scheduler.schedule(0, 10, 0, []() {}));
+  CHECK(scheduler.cancel(2));
+  CHECK_EQUAL(5u, scheduler.schedule(0, 10, 0, []() {}));
+  CHECK_EQUAL(4u, scheduler.getStats().tasks);
+}
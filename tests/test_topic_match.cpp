@@ -0,0 +1,223 @@
+// mqttTopicMatch() and mqttTopicFilterValid() on the examples of the MQTT 3.1.1 specification (section 4.7), and the
+// dispatch of received messages to overlapping subscriptions
+
+#include "TestHarness.h"
+
+static bool match(const char *filter, const char *topic)
+{
+  bool matched = EspHomeClient::mqttTopicMatch(filter, topic);
+  // The FakeBroker matcher is written independently, both must agree
+  if (matched != FakeBroker::topicMatch(filter, topic))
+    reportFailure(std::string("matchers disagree on ") + filter + " " + topic, __FILE__, __LINE__);
+  return matched;
+}
+
+TEST(multiLevelWildcard)
+{
+  CHECK(match("sport/tennis/player1/#", "sport/tennis/player1"));
+  CHECK(match("sport/tennis/player1/#", "sport/tennis/player1/ranking"));
+  CHECK(match("sport/tennis/player1/#", "sport/tennis/player1/score/wimbledon"));
+  CHECK(match("sport/#", "sport"));
+  CHECK(match("#", "sport/tennis/player1"));
+  CHECK(match("#", "/"));
+  CHECK(!match("sport/tennis/player1/#", "sport/tennis/player2"));
+  CHECK(!match("sport/tennis/player1/#", "sport/tennis/player10"));
+  CHECK(!match("sport/tennis/#", "sport"));
+}
+
+TEST(singleLevelWildcard)
+{
+  CHECK(match("sport/tennis/+", "sport/tennis/player1"));
+  CHECK(match("sport/tennis/+", "sport/tennis/player2"));
+  CHECK(!match("sport/tennis/+", "sport/tennis/player1/ranking"));
+  CHECK(!match("sport/+", "sport"));
+  CHECK(match("sport/+", "sport/"));
+  CHECK(match("+", "sport"));
+  CHECK(!match("+", "/finance"));
+  CHECK(match("+/+", "/finance"));
+  CHECK(match("/+", "/finance"));
+  CHECK(match("+/tennis/#", "sport/tennis/player1"));
+}
+
+TEST(severalWildcards)
+{
+  CHECK(match("+/+/+", "a/b/c"));
+  CHECK(!match("+/+/+", "a/b"));
+  CHECK(!match("+/+/+", "a/b/c/d"));
+  CHECK(match("+/b/+/d", "a/b/c/d"));
+  CHECK(!match("+/b/+/d", "a/x/c/d"));
+  CHECK(match("a/+/+/#", "a/b/c"));
+  CHECK(match("a/+/+/#", "a/b/c/d/e"));
+  CHECK(!match("a/+/+/#", "a/b"));
+  CHECK(match("a/+/c", "a//c"));
+  CHECK(match("+/+", "/"));
+}
+
+TEST(dollarTopics)
+{
+  CHECK(!match("#", "$SYS/monitor/Clients"));
+  CHECK(!match("+/monitor/Clients", "$SYS/monitor/Clients"));
+  CHECK(match("$SYS/#", "$SYS/monitor/Clients"));
+  CHECK(match("$SYS/monitor/+", "$SYS/monitor/Clients"));
+  CHECK(match("$SYS", "$SYS"));
+  CHECK(match("a/+", "a/$b"));
+}
+
+TEST(literalTopics)
+{
+  CHECK(match("sport/tennis", "sport/tennis"));
+  CHECK(!match("sport/tennis", "sport/tennis/"));
+  CHECK(!match("sport/tennis", "sport/tenni"));
+  CHECK(!match("sport/tennis", "Sport/tennis"));
+  CHECK(!match("sport/tennis/", "sport/tennis"));
+}
+
+TEST(filterValidity)
+{
+  CHECK(EspHomeClient::mqttTopicFilterValid("sport/tennis/#"));
+  CHECK(EspHomeClient::mqttTopicFilterValid("#"));
+  CHECK(EspHomeClient::mqttTopicFilterValid("+"));
+  CHECK(EspHomeClient::mqttTopicFilterValid("+/tennis/#"));
+  CHECK(EspHomeClient::mqttTopicFilterValid("sport/+/player1"));
+  CHECK(EspHomeClient::mqttTopicFilterValid("/+"));
+  CHECK(!EspHomeClient::mqttTopicFilterValid("sport/tennis#"));
+  CHECK(!EspHomeClient::mqttTopicFilterValid("sport/tennis/#/ranking"));
+  CHECK(!EspHomeClient::mqttTopicFilterValid("sport+"));
+  CHECK(!EspHomeClient::mqttTopicFilterValid("sport/+tennis"));
+  CHECK(!EspHomeClient::mqttTopicFilterValid(""));
+}
+
+// Every combination of the levels below, against the FakeBroker matcher
+TEST(agreesWithReferenceMatcher)
+{
+  const char *filter_levels[] = {"a", "b", "+", "#", "", "$x"};
+  const char *topic_levels[] = {"a", "b", "", "$x"};
+  unsigned int combinations = 0;
+
+  for (int filter_length = 1; filter_length <= 3; filter_length++)
+  {
+    for (int topic_length = 1; topic_length <= 3; topic_length++)
+    {
+      int filter_count = 1, topic_count = 1;
+      for (int i = 0; i < filter_length; i++)
+        filter_count *= 6;
+      for (int i = 0; i < topic_length; i++)
+        topic_count *= 4;
+
+      for (int f = 0; f < filter_count; f++)
+      {
+        std::string filter;
+        for (int i = 0, n = f; i < filter_length; i++, n /= 6)
+          filter += (i > 0 ? "/" : "") + std::string(filter_levels[n % 6]);
+        if (!EspHomeClient::mqttTopicFilterValid(filter.c_str()))
+          continue;
+
+        for (int t = 0; t < topic_count; t++)
+        {
+          std::string topic;
+          for (int i = 0, n = t; i < topic_length; i++, n /= 4)
+            topic += (i > 0 ? "/" : "") + std::string(topic_levels[n % 4]);
+          match(filter.c_str(), topic.c_str());
+          combinations++;
+        }
+      }
+    }
+  }
+
+  CHECK(combinations > 1000);
+}
+
+// Overlapping subscriptions each receive the message once, the other ones not at all
+TEST(dispatchesToEveryMatchingSubscription)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client("test-network", "test-password", "broker.test", "node");
+  int calls[6] = {0, 0, 0, 0, 0, 0};
+  client.subscribe("room/kitchen/light", [&](const String &) { calls[0]++; });
+  client.subscribe("room/+/light", [&](const String &) { calls[1]++; });
+  client.subscribe("room/#", [&](const String &) { calls[2]++; });
+  client.subscribe("#", [&](const String &) { calls[3]++; });
+  client.subscribe("room/+/+/set", [&](const String &) { calls[4]++; });
+  client.subscribe("room/kitchen", [&](const String &) { calls[5]++; });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/room/kitchen"); }, 10000));
+
+  broker.publish("cmnd/node/room/kitchen/light", "on");
+  runFor(client, 10);
+  CHECK_EQUAL(1, calls[0]);
+  CHECK_EQUAL(1, calls[1]);
+  CHECK_EQUAL(1, calls[2]);
+  CHECK_EQUAL(1, calls[3]);
+  CHECK_EQUAL(0, calls[4]);
+  CHECK_EQUAL(0, calls[5]);
+
+  // Unsubscribed from a callback, the dispatch in progress goes on and the removed subscription receives nothing more
+  client.subscribe("room/kitchen/light", [&](const String &) { calls[0]++; client.unsubscribe("room/#"); });
+  broker.publish("cmnd/node/room/kitchen/light", "off");
+  runFor(client, 10);
+  CHECK_EQUAL(2, calls[0]);
+  CHECK_EQUAL(2, calls[1]);
+  CHECK_EQUAL(2, calls[3]);
+  int removed_calls = calls[2];
+  CHECK(removed_calls == 1 || removed_calls == 2);
+
+  broker.publish("cmnd/node/room/kitchen/light", "on");
+  runFor(client, 10);
+  CHECK_EQUAL(3, calls[0]);
+  CHECK_EQUAL(3, calls[1]);
+  CHECK_EQUAL(removed_calls, calls[2]);
+  CHECK_EQUAL(3, calls[3]);
+}
+
+// The callback running is kept until the dispatch is over, its captures stay valid after the unsubscription
+TEST(callbackUnsubscribesItself)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client("test-network", "test-password", "broker.test", "node");
+  int calls = 0;
+  String last;
+  client.subscribe("light", [&](const String &message) {
+    client.unsubscribe("light");
+    calls++;
+    last = message;
+  });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/light"); }, 10000));
+
+  broker.publish("cmnd/node/light", "on");
+  runFor(client, 10);
+  CHECK_EQUAL(1, calls);
+  CHECK(last == "on");
+  CHECK(!broker.hasSubscription("node", "cmnd/node/light"));
+
+  broker.publish("cmnd/node/light", "off");
+  runFor(client, 10);
+  CHECK_EQUAL(1, calls);
+}
+
+// Subscriptions made by a callback are registered once the dispatch is over, the storage may grow meanwhile
+TEST(callbackSubscribes)
+{
+  FakeBroker broker("broker.test", IPAddress(10, 0, 0, 1));
+  EspHomeClient client("test-network", "test-password", "broker.test", "node");
+  int calls = 0;
+  int added_calls = 0;
+  client.subscribe("setup", [&](const char *, const uint8_t *, size_t) {
+    for (int i = 0; i < 8; i++)
+      CHECK(client.subscribe(String("room/") + String(i), [&](const String &) { added_calls++; }));
+    // Replaces the callback running, the new one receives the next messages
+    CHECK(client.subscribe("setup", [&](const String &) { calls += 10; }));
+    calls++;
+  });
+  CHECK(runUntil(client, [&]() { return broker.hasSubscription("node", "cmnd/node/setup"); }, 10000));
+
+  broker.publish("cmnd/node/setup", "go");
+  runFor(client, 10);
+  CHECK_EQUAL(1, calls);
+  CHECK(broker.hasSubscription("node", "cmnd/node/room/7"));
+
+  broker.publish("cmnd/node/room/3", "on");
+  broker.publish("cmnd/node/setup", "go");
+  runFor(client, 10);
+  CHECK_EQUAL(1, added_calls);
+  CHECK_EQUAL(11, calls);
+  CHECK_EQUAL(0u, broker.protocol_violations);
+}